@@ -0,0 +1,418 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <numeric>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include "ThreadPool/CorePool.h"
+#include "ThreadPool/Parallel.hpp"
+#include "ThreadPool/ThreadPool.h"
+
+#define CALL(foo)                                         \
+  do {                                                    \
+    TnStatus status_ = (foo);                             \
+    if (!TnStatusOk(status_)) {                           \
+      fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__,  \
+              #foo);                                      \
+      exit(1);                                            \
+    }                                                     \
+  } while (0)
+
+using Clock = std::chrono::steady_clock;
+
+static double SecondsSince(Clock::time_point start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+struct Benchmark {
+  const char* Name;
+  std::function<void()> Run;
+};
+
+static void Nop(void* args, void* res) {}
+
+static int Dummy;
+
+struct SubmitData {
+  ThreadPool* Pool;
+  size_t NTasks;
+};
+
+static void* SubmitLoop(void* args) {
+  SubmitData* data = (SubmitData*)args;
+
+  WorkerTask task;
+  task.Function = Nop;
+  task.Args = &Dummy;
+  task.Result = &Dummy;
+
+  for (size_t i = 0; i < data->NTasks; ++i)
+    CALL(ThreadPoolAddTask(data->Pool, task));
+
+  return NULL;
+}
+
+/* Submit throughput of N concurrent producers, plain vs sharded queues */
+static void SubmitScaling() {
+  static constexpr size_t NWorkers = 4;
+  static constexpr size_t NTasks = 200000;
+
+  for (size_t nShards : {(size_t)1, NWorkers}) {
+    for (size_t nProducers : {1, 2, 4, 8, 16}) {
+      ThreadPoolConfig config;
+      CALL(ThreadPoolConfigInit(&config, NWorkers));
+      config.NShards = nShards;
+
+      ThreadPool tp;
+      CALL(ThreadPoolInitConfig(&tp, &config));
+      CALL(ThreadPoolRun(&tp));
+
+      std::vector<pthread_t> threads(nProducers);
+      SubmitData data = {&tp, NTasks / nProducers};
+
+      auto start = Clock::now();
+      for (auto& thread : threads)
+        pthread_create(&thread, NULL, SubmitLoop, &data);
+      for (auto& thread : threads) pthread_join(thread, NULL);
+      double submit = SecondsSince(start);
+
+      CALL(ThreadPoolWaitAll(&tp));
+      double total = SecondsSince(start);
+
+      printf("  shards=%-2zu producers=%-2zu submit %6.2f Mtask/s, "
+             "total %6.2f Mtask/s\n",
+             nShards, nProducers, NTasks / submit / 1e6,
+             NTasks / total / 1e6);
+
+      CALL(ThreadPoolStop(&tp));
+      CALL(ThreadPoolDestroy(&tp));
+    }
+  }
+}
+
+/* Empty tasks, one lock and state machine cycle each vs batches */
+static void TinyTasks() {
+  static constexpr size_t NWorkers = 4;
+  static constexpr size_t NTasks = 200000;
+
+  for (size_t maxBatch : {1, 4, TP_BATCH_MAX}) {
+    ThreadPoolConfig config;
+    CALL(ThreadPoolConfigInit(&config, NWorkers));
+    config.MaxBatch = maxBatch;
+
+    ThreadPool tp;
+    CALL(ThreadPoolInitConfig(&tp, &config));
+    CALL(ThreadPoolRun(&tp));
+
+    SubmitData data = {&tp, NTasks};
+
+    auto start = Clock::now();
+    SubmitLoop(&data);
+    CALL(ThreadPoolWaitAll(&tp));
+    double total = SecondsSince(start);
+
+    printf("  batch=%-2zu %6.2f Mtask/s\n", maxBatch, NTasks / total / 1e6);
+
+    CALL(ThreadPoolStop(&tp));
+    CALL(ThreadPoolDestroy(&tp));
+  }
+}
+
+static long VoluntarySwitches() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_nvcsw;
+}
+
+/* Bursts of empty tasks with the pool going idle in between. Every
+ * voluntary context switch is a thread going to sleep, mostly on a futex,
+ * and every sleep of a worker takes a wakeup to end. */
+static void Wakeups() {
+  static constexpr size_t NWorkers = 4;
+  static constexpr size_t NTasks = 100000;
+
+  for (size_t spinRounds : {(size_t)0, (size_t)TP_SPIN_ROUNDS}) {
+    for (size_t burst : {1, 16, 256}) {
+      ThreadPoolConfig config;
+      CALL(ThreadPoolConfigInit(&config, NWorkers));
+      config.SpinRounds = spinRounds;
+
+      ThreadPool tp;
+      CALL(ThreadPoolInitConfig(&tp, &config));
+      CALL(ThreadPoolRun(&tp));
+      CALL(ThreadPoolWaitReady(&tp));
+
+      SubmitData data = {&tp, burst};
+      size_t nBursts = NTasks / burst;
+
+      long switches = VoluntarySwitches();
+      auto start = Clock::now();
+
+      for (size_t i = 0; i < nBursts; ++i) {
+        SubmitLoop(&data);
+        CALL(ThreadPoolWaitAll(&tp));
+      }
+
+      double total = SecondsSince(start);
+      switches = VoluntarySwitches() - switches;
+
+      printf("  spin=%-4zu burst=%-3zu %6.2f Mtask/s, %.3f sleeps/task\n",
+             spinRounds, burst, nBursts * burst / total / 1e6,
+             (double)switches / (nBursts * burst));
+
+      CALL(ThreadPoolStop(&tp));
+      CALL(ThreadPoolDestroy(&tp));
+    }
+  }
+}
+
+struct Token {
+  CorePool* Cores;
+  ThreadPool* Pool;
+  size_t Hops;
+  size_t* NDone; /* Atomic */
+};
+
+static void CoreHop(void* args, void* res) {
+  Token* token = (Token*)args;
+
+  if (token->Hops-- == 0) {
+    __atomic_add_fetch(token->NDone, 1, __ATOMIC_RELEASE);
+    return;
+  }
+
+  size_t self;
+  CALL(CorePoolSelf(token->Cores, &self));
+
+  WorkerTask task = {CoreHop, token, &Dummy};
+  CALL(CorePoolPost(token->Cores, (self + 1) % token->Cores->NCores, task));
+}
+
+static void PoolHop(void* args, void* res) {
+  Token* token = (Token*)args;
+
+  if (token->Hops-- == 0) {
+    __atomic_add_fetch(token->NDone, 1, __ATOMIC_RELEASE);
+    return;
+  }
+
+  WorkerTask task = {PoolHop, token, &Dummy};
+  CALL(ThreadPoolAddTask(token->Pool, task));
+}
+
+/* Tokens passed from core to core: SPSC rings vs the shared task queue */
+static void CrossCoreMessages() {
+  static constexpr size_t NCores = 4;
+  static constexpr size_t NHops = 200000;
+
+  for (size_t nTokens : {1, 4, 16, 64}) {
+    std::vector<Token> tokens(nTokens);
+    size_t nDone = 0;
+    size_t hops = NHops / nTokens;
+
+    CorePool cp;
+    CALL(CorePoolInit(&cp, NCores, CP_RING_CAPACITY));
+    CALL(CorePoolRun(&cp));
+
+    auto start = Clock::now();
+    for (size_t i = 0; i < nTokens; ++i) {
+      tokens[i] = {&cp, NULL, hops, &nDone};
+      WorkerTask task = {CoreHop, &tokens[i], &Dummy};
+      CALL(CorePoolPost(&cp, i % NCores, task));
+    }
+    while (__atomic_load_n(&nDone, __ATOMIC_ACQUIRE) != nTokens)
+      std::this_thread::yield();
+    double cores = SecondsSince(start);
+
+    CALL(CorePoolStop(&cp));
+    CALL(CorePoolDestroy(&cp));
+
+    ThreadPool tp;
+    CALL(ThreadPoolInit(&tp, NCores));
+    CALL(ThreadPoolRun(&tp));
+
+    nDone = 0;
+    start = Clock::now();
+    for (size_t i = 0; i < nTokens; ++i) {
+      tokens[i] = {NULL, &tp, hops, &nDone};
+      WorkerTask task = {PoolHop, &tokens[i], &Dummy};
+      CALL(ThreadPoolAddTask(&tp, task));
+    }
+    CALL(ThreadPoolWaitAll(&tp));
+    double pool = SecondsSince(start);
+
+    CALL(ThreadPoolStop(&tp));
+    CALL(ThreadPoolDestroy(&tp));
+
+    printf("  tokens=%-2zu core pool %6.2f Mmsg/s, thread pool %6.2f Mmsg/s\n",
+           nTokens, hops * nTokens / cores / 1e6,
+           hops * nTokens / pool / 1e6);
+  }
+}
+
+static void SetFlag(void* args, void* res) {
+  __atomic_store_n((int*)args, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Init and Run to the first task done, then to every worker running */
+static void Startup() {
+  static const char* Names[] = {"serial", "parallel", "lazy"};
+
+  for (ThreadPoolStartPolicy policy :
+       {TP_START_SERIAL, TP_START_PARALLEL, TP_START_LAZY}) {
+    for (size_t nWorkers : {8, 32, 128}) {
+      ThreadPoolConfig config;
+      CALL(ThreadPoolConfigInit(&config, nWorkers));
+      config.StartPolicy = policy;
+
+      int flag = 0;
+      WorkerTask task = {SetFlag, &flag, &flag};
+
+      auto start = Clock::now();
+
+      ThreadPool tp;
+      CALL(ThreadPoolInitConfig(&tp, &config));
+      CALL(ThreadPoolRun(&tp));
+      CALL(ThreadPoolAddTask(&tp, task));
+      while (!__atomic_load_n(&flag, __ATOMIC_SEQ_CST)) {
+      }
+      double first = SecondsSince(start);
+
+      CALL(ThreadPoolWaitReady(&tp));
+      double ready = SecondsSince(start);
+
+      printf("  %-8s workers=%-3zu first task %8.1f us, all ready %8.1f us\n",
+             Names[policy], nWorkers, first * 1e6, ready * 1e6);
+
+      CALL(ThreadPoolWaitAll(&tp));
+      CALL(ThreadPoolStop(&tp));
+      CALL(ThreadPoolDestroy(&tp));
+    }
+  }
+}
+
+/* Largest input of ParallelAlgorithms is 10^MaxExponent elements */
+static int MaxExponent = 7;
+
+/* Best of a few runs, in milliseconds */
+template <class Foo>
+static double Measure(Foo foo) {
+  double best = 0;
+
+  for (int i = 0; i < 3; ++i) {
+    auto start = Clock::now();
+    foo();
+    double time = SecondsSince(start) * 1e3;
+    if (i == 0 || time < best) best = time;
+  }
+
+  return best;
+}
+
+/* Serial standard library against the pool, 10^6 to 10^MaxExponent ints */
+static void ParallelAlgorithms() {
+  ThreadPool tp;
+  CALL(ThreadPoolInit(&tp, std::thread::hardware_concurrency()));
+  CALL(ThreadPoolRun(&tp));
+
+  std::mt19937 gen(42);
+  auto even = [](int value) { return value % 2 == 0; };
+  auto square = [](int value) { return (long)value * value; };
+
+  for (int exp = 6; exp <= MaxExponent; ++exp) {
+    size_t n = 1;
+    for (int i = 0; i < exp; ++i) n *= 10;
+
+    std::vector<int> input(n), values(n), out(n);
+    std::vector<long> wide(n);
+    for (int& value : input) value = gen();
+    size_t nOut;
+
+    printf("  n=10^%d\n", exp);
+
+    double serial = Measure([&] {
+      values = input;
+      std::sort(values.begin(), values.end());
+    });
+    double parallel = Measure([&] {
+      values = input;
+      CALL(TnParallel::Sort(&tp, values.begin(), values.end()));
+    });
+    printf("    sort        std %8.1f ms, pool %8.1f ms\n", serial,
+           parallel);
+
+    serial = Measure([&] {
+      std::partial_sum(input.begin(), input.end(), out.begin());
+    });
+    parallel = Measure([&] {
+      CALL(TnParallel::InclusiveScan(&tp, input.begin(), input.end(),
+                                     out.begin()));
+    });
+    printf("    scan        std %8.1f ms, pool %8.1f ms\n", serial,
+           parallel);
+
+    serial = Measure([&] {
+      values = input;
+      std::stable_partition(values.begin(), values.end(), even);
+    });
+    parallel = Measure([&] {
+      CALL(TnParallel::StablePartition(&tp, input.begin(), input.end(),
+                                       out.begin(), even));
+    });
+    printf("    partition   std %8.1f ms, pool %8.1f ms\n", serial,
+           parallel);
+
+    serial = Measure([&] {
+      std::transform(input.begin(), input.end(), wide.begin(), square);
+    });
+    parallel = Measure([&] {
+      CALL(TnParallel::Transform(&tp, input.begin(), input.end(),
+                                 wide.begin(), square));
+    });
+    printf("    transform   std %8.1f ms, pool %8.1f ms\n", serial,
+           parallel);
+
+    serial = Measure([&] {
+      std::copy_if(input.begin(), input.end(), out.begin(), even);
+    });
+    parallel = Measure([&] {
+      CALL(TnParallel::CopyIf(&tp, input.begin(), input.end(), out.begin(),
+                              even, &nOut));
+    });
+    printf("    copy_if     std %8.1f ms, pool %8.1f ms\n", serial,
+           parallel);
+  }
+
+  CALL(ThreadPoolStop(&tp));
+  CALL(ThreadPoolDestroy(&tp));
+}
+
+static const Benchmark Benchmarks[] = {
+    {"SubmitScaling", SubmitScaling},
+    {"TinyTasks", TinyTasks},
+    {"Wakeups", Wakeups},
+    {"CrossCoreMessages", CrossCoreMessages},
+    {"ParallelAlgorithms", ParallelAlgorithms},
+    {"Startup", Startup},
+};
+
+int main(int argc, char** argv) {
+  const char* filter = (argc > 1) ? argv[1] : "";
+  if (argc > 2) MaxExponent = atoi(argv[2]);
+
+  for (const Benchmark& bench : Benchmarks) {
+    if (!strstr(bench.Name, filter)) continue;
+
+    printf("%s\n", bench.Name);
+    bench.Run();
+  }
+
+  return 0;
+}
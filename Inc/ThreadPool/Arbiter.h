@@ -0,0 +1,89 @@
+#pragma once
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <time.h>
+
+#include "ThreadPool/CpuQuota.h"
+
+/* Rebalancing period of ArbiterGlobal(), ns */
+#define ARBITER_GLOBAL_INTERVAL 10000000
+
+/* Tells the member how many workers it may run and which cpus the first
+ * granted ones go to. Called under the arbiter's mutex. */
+typedef void (*ArbiterApplyT)(void* args, size_t granted, const int* cores);
+
+/* Workers the member could keep busy right now */
+typedef size_t (*ArbiterDemandT)(void* args);
+
+/* Filled in by the member, owned by the arbiter between Join and Leave */
+typedef struct ArbiterLeaseImpl {
+  size_t Weight;
+  size_t Max; /* Workers the member has */
+  ArbiterDemandT Demand;
+  ArbiterApplyT Apply;
+  void* Args;
+
+  /* Set by the arbiter */
+  size_t Wanted;
+  size_t Target;
+  size_t Granted;
+  int* Cores; /* Max entries, the first Granted are in use */
+  struct ArbiterLeaseImpl* Next;
+} ArbiterLease;
+
+/* Shares a budget of workers between thread pools. Every member gets at
+ * least one, the rest goes by weight to the members that have work for
+ * it, so an idle pool hands its share to busy ones. Granted workers are
+ * spread over the cpus so that members overlap only once the budget is
+ * larger than the cpus. */
+typedef struct {
+  size_t Budget;
+
+  int* Cpus;
+  size_t NCpus;
+  size_t* CpuUsers; /* Granted workers, by cpu number */
+
+  ArbiterLease* Leases;
+  size_t NLeases;
+
+  pthread_mutex_t Mutex;
+  pthread_cond_t Cond; /* CLOCK_MONOTONIC */
+
+  uint64_t Interval;
+  pthread_t Thread;
+  int Running;
+  int Stop;
+} Arbiter;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Budget 0 takes the CPU quota of the process, cpus NULL its affinity
+ * mask. A non-zero interval (ns) rebalances periodically on a thread of
+ * its own, otherwise only on Join, Leave and ArbiterRebalance. */
+TnStatus ArbiterInit(Arbiter* arb, size_t budget, const cpu_set_t* cpus,
+                     uint64_t interval);
+TnStatus ArbiterDestroy(Arbiter* arb);
+
+/* Process-wide instance, created on first use and never destroyed. NULL
+ * if that failed. */
+Arbiter* ArbiterGlobal();
+
+TnStatus ArbiterJoin(Arbiter* arb, ArbiterLease* lease);
+TnStatus ArbiterLeave(Arbiter* arb, ArbiterLease* lease);
+TnStatus ArbiterRebalance(Arbiter* arb);
+
+#ifdef __cplusplus
+}
+#endif
+
+static void ArbiterGrant(Arbiter* arb);
+static void ArbiterPlace(Arbiter* arb, ArbiterLease* lease, size_t granted);
+static int ArbiterLeastUsedCpu(Arbiter* arb);
+static void ArbiterRebalanceLocked(Arbiter* arb);
+static void* ArbiterLoop(void* args);
+static void ArbiterGlobalInit();
@@ -0,0 +1,62 @@
+#pragma once
+#include <string.h>
+
+#include "ThreadPool/Fiber.h"
+#include "malloc.h"
+
+/* FIFO of parked fibers, linked through Fiber.Next */
+typedef struct {
+  Fiber* Head;
+  Fiber* Tail;
+} ChannelWaiters;
+
+/* Bounded MPMC queue of fixed-size values. A task running in a fiber
+ * parks on a full or empty channel and is rescheduled by the pool once
+ * the other side makes progress, so it never holds its worker. Threads
+ * outside fibers block on condition variables instead. */
+typedef struct {
+  char* Buffer;
+  size_t ElemSize;
+  size_t Capacity;
+  size_t Head;
+  size_t Size;
+  int Closed;
+
+  ChannelWaiters Senders;
+  ChannelWaiters Receivers;
+
+  pthread_mutex_t Mutex;
+  pthread_cond_t NotFull;
+  pthread_cond_t NotEmpty;
+} Channel;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+TnStatus ChannelInit(Channel* ch, size_t elemSize, size_t capacity);
+TnStatus ChannelDestroy(Channel* ch);
+
+/* Wakes everyone: sends fail and receives drain what is left, then fail
+ * with TN_FSM_WRONG_STATE */
+TnStatus ChannelClose(Channel* ch);
+
+TnStatus ChannelSend(Channel* ch, const void* value);
+TnStatus ChannelReceive(Channel* ch, void* value);
+
+/* TN_OVERFLOW when full, TN_UNDERFLOW when empty */
+TnStatus ChannelTrySend(Channel* ch, const void* value);
+TnStatus ChannelTryReceive(Channel* ch, void* value);
+
+#ifdef __cplusplus
+}
+#endif
+
+static TnStatus ChannelPush(Channel* ch, const void* value);
+static TnStatus ChannelPop(Channel* ch, void* value);
+static void ChannelWaitersPush(ChannelWaiters* waiters, Fiber* fiber);
+static Fiber* ChannelWaitersPop(ChannelWaiters* waiters);
+static Fiber* ChannelWake(ChannelWaiters* waiters, pthread_cond_t* cond);
+static void ChannelSchedule(Fiber* fiber);
+static void ChannelSendHook(Fiber* fiber, void* args);
+static void ChannelReceiveHook(Fiber* fiber, void* args);
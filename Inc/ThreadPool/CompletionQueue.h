@@ -0,0 +1,104 @@
+#pragma once
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <poll.h>
+#include <string.h>
+#include <sys/eventfd.h>
+
+#include "Worker/Worker.h"
+#include "malloc.h"
+
+#define CQ_CACHE_LINE 64
+
+typedef struct {
+  uint64_t Tag;
+  void* Result;
+} Completion;
+
+typedef struct {
+  size_t Sequence; /* Atomic */
+  Completion Value;
+} CompletionCell;
+
+/* Lock-free ring that any number of workers push finished tasks into and
+ * one consumer drains. When the ring is full, completions go to a locked
+ * overflow backlog instead of stalling the worker, as io_uring does with
+ * its CQ. Order is not kept across the two: a poll returns what the ring
+ * holds first, which may be newer than what spilled. The eventfd becomes
+ * readable when a completion arrives while the consumer is armed, so the
+ * queue can sit in an epoll set next to sockets:
+ *
+ *   CompletionQueueArm(&cq, &ready);
+ *   if (!ready) epoll_wait(...);
+ *   CompletionQueuePoll(&cq, batch, N, &n);
+ */
+typedef struct CompletionQueueImpl {
+  CompletionCell* Cells;
+  size_t Mask;
+
+  size_t Head __attribute__((aligned(CQ_CACHE_LINE))); /* Atomic */
+  size_t Tail __attribute__((aligned(CQ_CACHE_LINE)));
+
+  /* Completions that did not fit into the ring, a circular buffer. Room
+   * is reserved before a push, so that the push itself never allocates. */
+  Completion* Overflow;
+  size_t OverflowCapacity; /* Atomic, power of two, only grows */
+  size_t OverflowHead;     /* Oldest */
+  size_t NOverflow;        /* Atomic */
+  size_t NPromised; /* Atomic, reserved pushes not taken yet, see Reserve */
+  pthread_mutex_t OverflowMutex;
+
+  int EventFd;
+  int Armed; /* Atomic */
+} CompletionQueue;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Capacity is rounded up to a power of two */
+TnStatus CompletionQueueInit(CompletionQueue* cq, size_t capacity);
+TnStatus CompletionQueueDestroy(CompletionQueue* cq);
+
+/* Producers */
+TnStatus CompletionQueuePush(CompletionQueue* cq, const Completion* value);
+
+/* Makes room for one push ahead of it, so that a producer that cannot
+ * handle an error at push time fails early instead. TN_BAD_ALLOC if the
+ * overflow backlog cannot grow. */
+TnStatus CompletionQueueReserve(CompletionQueue* cq);
+TnStatus CompletionQueueUnreserve(CompletionQueue* cq);
+
+/* Takes a reservation, never fails */
+TnStatus CompletionQueuePushReserved(CompletionQueue* cq,
+                                     const Completion* value);
+
+/* Consumer: takes up to max completions without blocking */
+TnStatus CompletionQueuePoll(CompletionQueue* cq, Completion* values,
+                             size_t max, size_t* n);
+
+/* Consumer: blocks until there is at least one completion */
+TnStatus CompletionQueueWait(CompletionQueue* cq, Completion* values,
+                             size_t max, size_t* n);
+
+/* Consumer: requests a wake-up on the eventfd. Ready is set when
+ * completions are already queued and waiting would not return. */
+TnStatus CompletionQueueArm(CompletionQueue* cq, int* ready);
+TnStatus CompletionQueueFd(const CompletionQueue* cq, int* fd);
+
+#ifdef __cplusplus
+}
+#endif
+
+static TnStatus CompletionQueueRingPush(CompletionQueue* cq,
+                                        const Completion* value);
+static void CompletionQueueOverflowPush(CompletionQueue* cq,
+                                        const Completion* value);
+static TnStatus CompletionQueueGrow(CompletionQueue* cq);
+static size_t CompletionQueueOverflowPop(CompletionQueue* cq,
+                                         Completion* values, size_t max);
+static void CompletionQueueNotify(CompletionQueue* cq);
+static int CompletionQueueEmpty(CompletionQueue* cq);
@@ -0,0 +1,66 @@
+#pragma once
+#include "ThreadPool/Futex.h"
+#include "ThreadPool/SpscRing.h"
+#include "ThreadPool/WorkerInbox.h"
+
+#define CP_RING_CAPACITY 1024
+#define CP_BATCH 32 /* Tasks taken from one ring per pass */
+
+struct CorePoolImpl;
+
+typedef struct {
+  struct CorePoolImpl* Pool;
+  size_t ID;
+  int Cpu; /* Atomic, pinned to, -1 if pinning failed */
+  pthread_t Thread;
+
+  WorkerInbox External; /* Posts from threads outside the pool */
+
+  /* Cores posted to since the last doorbell flush */
+  size_t* Dirty;
+  size_t NDirty;
+
+  uint32_t Doorbell __attribute__((aligned(64))); /* Atomic, futex word */
+  int Sleeping;                                   /* Atomic */
+} CorePoolCore;
+
+/* Thread-per-core executor: every core runs its own loop over the rings
+ * other cores post to, nothing is shared between cores but these rings.
+ * A sleeping core is woken by a doorbell that senders ring once per
+ * pass over their input, not once per message. */
+typedef struct CorePoolImpl {
+  size_t NCores;
+  CorePoolCore* Cores;
+  SpscRing* Rings; /* Rings[from * NCores + to] */
+  size_t RingCapacity;
+
+  int DoStop; /* Atomic */
+} CorePool;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+TnStatus CorePoolInit(CorePool* cp, size_t nCores, size_t ringCapacity);
+TnStatus CorePoolRun(CorePool* cp);
+TnStatus CorePoolStop(CorePool* cp);
+TnStatus CorePoolDestroy(CorePool* cp);
+
+/* Runs the task on core N. From a core thread this goes through the SPSC
+ * ring of the pair and fails with TN_OVERFLOW when it is full. */
+TnStatus CorePoolPost(CorePool* cp, size_t core, WorkerTask task);
+
+/* Core of the calling task */
+TnStatus CorePoolSelf(const CorePool* cp, size_t* core);
+
+#ifdef __cplusplus
+}
+#endif
+
+static int CorePoolPickCpu(const cpu_set_t* cpus, size_t n);
+static void* CorePoolLoop(void* args);
+static size_t CorePoolPoll(CorePoolCore* core);
+static int CorePoolHasWork(CorePoolCore* core);
+static void CorePoolPark(CorePoolCore* core);
+static void CorePoolRing(CorePoolCore* core);
+static void CorePoolFlush(CorePoolCore* core);
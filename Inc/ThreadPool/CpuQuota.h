@@ -0,0 +1,47 @@
+#pragma once
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <string.h>
+
+#include "ThreadPool/Topology.h"
+
+#define CPU_QUOTA_CGROUP_ROOT "/sys/fs/cgroup"
+#define CPU_QUOTA_PROC_CGROUP "/proc/self/cgroup"
+
+/* CPU budget of the process: the cgroup's CFS quota and cpuset, cut down
+ * to the affinity mask of the process */
+typedef struct {
+  double Quota; /* CPUs per period, 0 if unlimited */
+  size_t NCpus; /* Allowed by both the cpuset and the affinity mask */
+  size_t Limit; /* Workers worth running, whole CPUs of both, at least 1 */
+} CpuQuota;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Reads cgroup v2 cpu.max and cpuset.cpus.effective, or the v1 cpu and
+ * cpuset controllers, under root (NULL for CPU_QUOTA_CGROUP_ROOT). The
+ * group of the process is looked up in CPU_QUOTA_PROC_CGROUP, and root
+ * itself is read if that group is not found under it. Missing files
+ * mean no limit. */
+TnStatus CpuQuotaRead(const char* root, CpuQuota* quota);
+
+/* Parses v2 cpu.max, e.g. "150000 100000" or "max 100000" */
+TnStatus CpuQuotaParseMax(const char* line, double* quota);
+
+#ifdef __cplusplus
+}
+#endif
+
+static int CpuQuotaReadLine(const char* path, char* buf, size_t size);
+static void CpuQuotaGroupDir(const char* root, const char* controller,
+                             char* dir, size_t size);
+static void CpuQuotaMin(double* quota, double value);
+static void CpuQuotaReadV2(const char* root, CpuQuota* quota,
+                           cpu_set_t* cpus);
+static void CpuQuotaReadV1(const char* root, CpuQuota* quota,
+                           cpu_set_t* cpus);
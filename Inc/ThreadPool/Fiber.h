@@ -0,0 +1,139 @@
+#pragma once
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+
+#include "Worker/Worker.h"
+
+#define FIBER_DEFAULT_STACK_SIZE (16 * 1024)
+#define FIBER_MIN_STACK_SIZE (8 * 1024)
+#define FIBER_CACHE_SIZE 256 /* Finished fibers kept mapped for reuse */
+#define FIBER_SLAB_STACKS 64 /* Stacks per mapping without guard pages */
+
+struct FiberImpl;
+
+typedef void (*FiberHookT)(struct FiberImpl* fiber, void* args);
+
+/* A task running on its own stack, with the Fiber itself at the top of
+ * it, so a suspended fiber costs the pages its stack has touched, usually
+ * one or two. A stack is either a private mapping with a guard page below
+ * it, which takes two mappings of vm.max_map_count per fiber, or a slice
+ * of a slab of FIBER_SLAB_STACKS stacks with no guard between them. */
+typedef struct FiberImpl {
+  ucontext_t Context;
+  ucontext_t* Return; /* Thread that switched in last */
+
+  char* Map;   /* Own mapping, NULL for a slab stack */
+  size_t MapSize;
+  char* Stack; /* Lowest usable address */
+
+  WorkerTask Task;
+  int Finished;
+
+  /* Makes a suspended fiber runnable again, set by the owner */
+  FiberHookT Schedule;
+  void* ScheduleArgs;
+
+  /* Runs on the thread stack once the fiber has switched out */
+  FiberHookT OnPark;
+  void* OnParkArgs;
+
+  struct FiberImpl* Next; /* Free list, waiter lists */
+} Fiber;
+
+typedef struct FiberSlabImpl {
+  char* Map;
+  size_t NCarved; /* Stacks handed out so far */
+  struct FiberSlabImpl* Next;
+} FiberSlab;
+
+typedef struct {
+  size_t StackSize;
+  int Guard;
+
+  Fiber* Free;
+  size_t NFree;
+  size_t CacheLimit; /* FIBER_CACHE_SIZE unless reserved above it */
+  FiberSlab* Slabs;  /* Without guard pages, newest first */
+
+  size_t NLive; /* Handed out and not put back yet */
+  size_t Limit; /* Of NLive, 0 if unlimited */
+  size_t NPut;  /* Atomic, bumped by every FiberPoolPut */
+
+  pthread_mutex_t Mutex;
+} FiberPool;
+
+/* One-shot event a fiber waits on without blocking its thread. Threads
+ * outside fibers block on the condition variable. */
+typedef struct {
+  int Set;
+  Fiber* Waiters;
+
+  pthread_mutex_t Mutex;
+  pthread_cond_t Cond;
+} FiberEvent;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Without a guard, stacks come from slabs and an overflow silently
+ * corrupts the stack below. Slab stacks stay mapped until the pool is
+ * destroyed, those above the cache only give their pages back. */
+TnStatus FiberPoolInit(FiberPool* pool, size_t stackSize, int guard);
+TnStatus FiberPoolDestroy(FiberPool* pool);
+
+/* Prepares a fiber that will run the task once switched in. TN_OVERFLOW
+ * once Limit fibers are out. */
+TnStatus FiberPoolGet(FiberPool* pool, const WorkerTask* task,
+                      Fiber** fiber);
+TnStatus FiberPoolPut(FiberPool* pool, Fiber* fiber);
+
+/* Maps nFibers up front and keeps that many mapped for reuse */
+TnStatus FiberPoolReserve(FiberPool* pool, size_t nFibers);
+
+/* Caps the fibers out at once, 0 removes the cap */
+TnStatus FiberPoolSetLimit(FiberPool* pool, size_t nFibers);
+
+/* Runs the fiber on the calling thread until it finishes or parks */
+TnStatus FiberSwitchIn(Fiber* fiber, int* finished);
+
+/* Switches out of the current fiber. The hook runs after the switch and
+ * must eventually FiberSchedule() the fiber. */
+TnStatus FiberPark(FiberHookT onPark, void* args);
+TnStatus FiberSchedule(Fiber* fiber);
+
+/* NULL outside fibers */
+TnStatus FiberCurrent(Fiber** fiber);
+
+/* Lets the worker run other tasks before continuing. Outside a fiber
+ * this only yields the thread. */
+TnStatus TnYield();
+
+TnStatus FiberEventInit(FiberEvent* event);
+TnStatus FiberEventDestroy(FiberEvent* event);
+TnStatus FiberEventSet(FiberEvent* event);
+TnStatus FiberEventWait(FiberEvent* event);
+
+#ifdef __cplusplus
+}
+#endif
+
+/* Not inlined: a fiber may resume on another thread, and an inlined
+ * thread-local access could reuse the address of the previous one */
+static Fiber* FiberGetCurrent() __attribute__((noinline));
+static void FiberSetCurrent(Fiber* fiber) __attribute__((noinline));
+
+static TnStatus FiberMap(FiberPool* pool, Fiber** fiber);
+static TnStatus FiberCarve(FiberPool* pool, Fiber** fiber);
+static Fiber* FiberAt(char* stack, size_t size);
+static void FiberUnmap(Fiber* fiber);
+static void FiberRelease(FiberPool* pool, Fiber* fiber);
+static void FiberEntry();
+static void FiberYieldHook(Fiber* fiber, void* args);
+static void FiberEventHook(Fiber* fiber, void* args);
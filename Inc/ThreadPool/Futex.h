@@ -0,0 +1,23 @@
+#pragma once
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <linux/futex.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+
+#include "Worker/Worker.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Sleeps while *addr == value, spurious wakeups are possible */
+TnStatus FutexWait(uint32_t* addr, uint32_t value);
+TnStatus FutexWake(uint32_t* addr, int count);
+
+#ifdef __cplusplus
+}
+#endif
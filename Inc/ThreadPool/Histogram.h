@@ -0,0 +1,59 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "TnStatus.h"
+
+/* Values below 2 * HISTOGRAM_SUB_BUCKETS are exact, above they fall into
+ * one of HISTOGRAM_SUB_BUCKETS linear steps of their power of two, so a
+ * percentile is off by at most 1 / HISTOGRAM_SUB_BUCKETS (~3%) */
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+
+/* Values of 2^HISTOGRAM_MAX_BITS ns (~4.9 hours) and above share the last
+ * bucket */
+#define HISTOGRAM_MAX_BITS 44
+#define HISTOGRAM_BUCKETS \
+  ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+/* Log-bucketed histogram of ns with a single writer. Readers merge it
+ * with HistogramMerge at any time without locking; a snapshot may miss
+ * the values being recorded meanwhile. */
+typedef struct {
+  uint64_t Counts[HISTOGRAM_BUCKETS]; /* Atomic */
+  uint64_t Max;                       /* Atomic */
+} Histogram;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+TnStatus HistogramInit(Histogram* hist);
+
+/* Single writer */
+void HistogramRecord(Histogram* hist, uint64_t value);
+
+/* dst += src, dst must not be written concurrently */
+TnStatus HistogramMerge(Histogram* dst, const Histogram* src);
+
+TnStatus HistogramCount(const Histogram* hist, uint64_t* count);
+
+/* Upper bound of the value below which percentile % of the values lie,
+ * capped by the maximum. 0 for an empty histogram. */
+TnStatus HistogramPercentile(const Histogram* hist, double percentile,
+                             uint64_t* value);
+
+/* Cheap timestamps: the TSC where it is invariant, CLOCK_MONOTONIC_RAW
+ * otherwise. The first call calibrates the TSC for about a millisecond. */
+uint64_t HistogramNow();
+uint64_t HistogramTicksToNs(uint64_t ticks);
+
+#ifdef __cplusplus
+}
+#endif
+
+static size_t HistogramBucket(uint64_t value);
+static uint64_t HistogramBucketTop(size_t bucket);
+static uint64_t HistogramRawNs();
+static void HistogramCalibrate();
@@ -0,0 +1,95 @@
+#pragma once
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ThreadPool/ThreadPool.h"
+
+/* Bytes of input one chunk of work covers: small enough for a chunk and
+ * its output to stay in L2, large enough to amortize the chunk claim */
+#define PARALLEL_BLOCK_SIZE (64 * 1024)
+
+/* Inputs below this many elements are sorted on the calling thread */
+#define PARALLEL_SORT_CUTOFF (16 * 1024)
+
+typedef void (*ParallelBodyT)(size_t begin, size_t end, void* args);
+
+typedef int (*ParallelCompareT)(const void* a, const void* b, void* ctx);
+typedef int (*ParallelPredicateT)(const void* value, void* ctx);
+typedef void (*ParallelTransformT)(const void* in, void* out, void* ctx);
+
+/* acc = acc (+) value, must be associative */
+typedef void (*ParallelCombineT)(void* acc, const void* value, void* ctx);
+
+/* Shared by the tasks of one ParallelFor */
+typedef struct {
+  ParallelBodyT Body;
+  void* Args;
+  size_t N;
+  size_t Grain;
+  size_t Next; /* Atomic */
+} ParallelLoop;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Calls body on [begin, end) chunks of at most grain indices, 0 picks one
+ * block per chunk. The calling thread takes part, so it may be a task. */
+TnStatus ParallelFor(ThreadPool* tp, size_t n, size_t grain,
+                     ParallelBodyT body, void* args);
+
+/* Merge sort: cache-sized runs sorted in parallel, then merged pairwise
+ * with every merge split between tasks. Not stable. */
+TnStatus ParallelSort(ThreadPool* tp, void* base, size_t n, size_t size,
+                      ParallelCompareT cmp, void* ctx);
+
+/* out may be in */
+TnStatus ParallelInclusiveScan(ThreadPool* tp, const void* in, void* out,
+                               size_t n, size_t size, ParallelCombineT op,
+                               void* ctx);
+TnStatus ParallelExclusiveScan(ThreadPool* tp, const void* in, void* out,
+                               size_t n, size_t size, const void* init,
+                               ParallelCombineT op, void* ctx);
+
+/* Matching elements first, then the rest, both in input order */
+TnStatus ParallelStablePartition(ThreadPool* tp, const void* in, void* out,
+                                 size_t n, size_t size,
+                                 ParallelPredicateT pred, void* ctx,
+                                 size_t* nTrue);
+
+TnStatus ParallelTransform(ThreadPool* tp, const void* in, void* out,
+                           size_t n, size_t inSize, size_t outSize,
+                           ParallelTransformT foo, void* ctx);
+
+TnStatus ParallelCopyIf(ThreadPool* tp, const void* in, void* out, size_t n,
+                        size_t size, ParallelPredicateT pred, void* ctx,
+                        size_t* nOut);
+
+#ifdef __cplusplus
+}
+#endif
+
+static void ParallelLoopRun(void* args, void* result);
+static size_t ParallelGrain(size_t size);
+static void ParallelSortRun(size_t begin, size_t end, void* args);
+static void ParallelMergeBlock(size_t begin, size_t end, void* args);
+static void ParallelCopyBlock(size_t begin, size_t end, void* args);
+static void ParallelScanReduce(size_t begin, size_t end, void* args);
+static void ParallelScanApply(size_t begin, size_t end, void* args);
+static void ParallelSelectCount(size_t begin, size_t end, void* args);
+static void ParallelSelectScatter(size_t begin, size_t end, void* args);
+static void ParallelTransformBlock(size_t begin, size_t end, void* args);
+static size_t ParallelCoRank(const char* a, size_t na, const char* b,
+                             size_t nb, size_t k, size_t size,
+                             ParallelCompareT cmp, void* ctx);
+static TnStatus ParallelScan(ThreadPool* tp, const void* in, void* out,
+                             size_t n, size_t size, const void* init,
+                             int inclusive, ParallelCombineT op, void* ctx);
+static TnStatus ParallelSelect(ThreadPool* tp, const void* in, void* out,
+                               size_t n, size_t size, ParallelPredicateT pred,
+                               void* ctx, int keepRest, size_t* nTrue);
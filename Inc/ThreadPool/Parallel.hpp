@@ -0,0 +1,125 @@
+#pragma once
+#include <functional>
+#include <iterator>
+#include <type_traits>
+
+#include "ThreadPool/Parallel.h"
+
+/* Iterator front end of Parallel.h. Iterators must point into contiguous
+ * storage of trivially copyable values, which the C side moves with
+ * memcpy. */
+namespace TnParallel {
+
+namespace Detail {
+
+template <class It>
+using ValueT = typename std::iterator_traits<It>::value_type;
+
+template <class It>
+void* Data(It it) {
+  static_assert(std::is_trivially_copyable<ValueT<It>>::value,
+                "Values are moved with memcpy");
+  return (void*)&*it;
+}
+
+template <class T, class Less>
+int Compare(const void* a, const void* b, void* ctx) {
+  Less& comp = *(Less*)ctx;
+  if (comp(*(const T*)a, *(const T*)b)) return -1;
+  if (comp(*(const T*)b, *(const T*)a)) return 1;
+  return 0;
+}
+
+template <class T, class Predicate>
+int Test(const void* value, void* ctx) {
+  return (*(Predicate*)ctx)(*(const T*)value) ? 1 : 0;
+}
+
+template <class T, class Op>
+void Combine(void* acc, const void* value, void* ctx) {
+  *(T*)acc = (*(Op*)ctx)(*(T*)acc, *(const T*)value);
+}
+
+template <class In, class Out, class Foo>
+void Apply(const void* in, void* out, void* ctx) {
+  *(Out*)out = (*(Foo*)ctx)(*(const In*)in);
+}
+
+}  // namespace Detail
+
+template <class It, class Compare = std::less<Detail::ValueT<It>>>
+TnStatus Sort(ThreadPool* tp, It first, It last, Compare comp = Compare()) {
+  using T = Detail::ValueT<It>;
+  if (first == last) return TN_OK;
+
+  return ParallelSort(tp, Detail::Data(first), last - first, sizeof(T),
+                      Detail::Compare<T, Compare>, &comp);
+}
+
+template <class InIt, class OutIt, class Op = std::plus<Detail::ValueT<InIt>>>
+TnStatus InclusiveScan(ThreadPool* tp, InIt first, InIt last, OutIt out,
+                       Op op = Op()) {
+  using T = Detail::ValueT<InIt>;
+  if (first == last) return TN_OK;
+
+  return ParallelInclusiveScan(tp, Detail::Data(first), Detail::Data(out),
+                               last - first, sizeof(T),
+                               Detail::Combine<T, Op>, &op);
+}
+
+template <class InIt, class OutIt, class T,
+          class Op = std::plus<Detail::ValueT<InIt>>>
+TnStatus ExclusiveScan(ThreadPool* tp, InIt first, InIt last, OutIt out,
+                       T init, Op op = Op()) {
+  using V = Detail::ValueT<InIt>;
+  if (first == last) return TN_OK;
+
+  V value = init;
+  return ParallelExclusiveScan(tp, Detail::Data(first), Detail::Data(out),
+                               last - first, sizeof(V), &value,
+                               Detail::Combine<V, Op>, &op);
+}
+
+/* Out receives the matches, then the rest. nTrue may be NULL. */
+template <class InIt, class OutIt, class Predicate>
+TnStatus StablePartition(ThreadPool* tp, InIt first, InIt last, OutIt out,
+                         Predicate pred, size_t* nTrue = nullptr) {
+  using T = Detail::ValueT<InIt>;
+  size_t count = 0;
+  if (first == last) return TN_OK;
+
+  TnStatus status = ParallelStablePartition(
+      tp, Detail::Data(first), Detail::Data(out), last - first, sizeof(T),
+      Detail::Test<T, Predicate>, &pred, &count);
+
+  if (nTrue) *nTrue = count;
+  return status;
+}
+
+template <class InIt, class OutIt, class Foo>
+TnStatus Transform(ThreadPool* tp, InIt first, InIt last, OutIt out,
+                   Foo foo) {
+  using In = Detail::ValueT<InIt>;
+  using Out = typename std::remove_reference<decltype(*out)>::type;
+  if (first == last) return TN_OK;
+
+  return ParallelTransform(tp, Detail::Data(first), Detail::Data(out),
+                           last - first, sizeof(In), sizeof(Out),
+                           Detail::Apply<In, Out, Foo>, &foo);
+}
+
+template <class InIt, class OutIt, class Predicate>
+TnStatus CopyIf(ThreadPool* tp, InIt first, InIt last, OutIt out,
+                Predicate pred, size_t* nOut) {
+  using T = Detail::ValueT<InIt>;
+  if (first == last) {
+    *nOut = 0;
+    return TN_OK;
+  }
+
+  return ParallelCopyIf(tp, Detail::Data(first), Detail::Data(out),
+                        last - first, sizeof(T), Detail::Test<T, Predicate>,
+                        &pred, nOut);
+}
+
+}  // namespace TnParallel
@@ -0,0 +1,82 @@
+#pragma once
+#include "ThreadPool/ThreadPool.h"
+
+#define PIPELINE_MAX_STAGES 16
+
+typedef enum {
+  PIPELINE_SERIAL,  /* One item at a time, in input order */
+  PIPELINE_PARALLEL /* Any number of items at once */
+} PipelineStageKind;
+
+/* Returns the item passed to the next stage. The first stage gets NULL
+ * and ends the stream by returning NULL. */
+typedef void* (*PipelineStageFooT)(void* item, void* args);
+
+struct PipelineImpl;
+
+/* An item travelling through the stages. There are only NTokens of them,
+ * so at most NTokens items are in flight and a slow stage holds the
+ * input back instead of letting items pile up in front of it. */
+typedef struct {
+  struct PipelineImpl* Pipeline;
+  size_t Seq;
+  size_t Stage; /* Next to run */
+  void* Item;
+} PipelineToken;
+
+typedef struct {
+  PipelineStageKind Kind;
+  PipelineStageFooT Function;
+  void* Args;
+
+  /* Serial stages: tokens that arrived early, ring indexed by Seq */
+  PipelineToken** Waiting;
+  size_t NextSeq;
+  pthread_mutex_t Mutex;
+} PipelineStage;
+
+/* Stages run as tasks of the pool. The first stage is the input and is
+ * serial: it is read by one token at a time, whichever got free last. */
+typedef struct PipelineImpl {
+  ThreadPool* Pool;
+
+  PipelineStage Stages[PIPELINE_MAX_STAGES];
+  size_t NStages;
+
+  PipelineToken* Tokens;
+  PipelineToken** FreeTokens;
+  size_t NTokens;
+  size_t NFree;
+
+  pthread_mutex_t Mutex; /* Input and free tokens */
+  int Feeding;
+  int Done;
+  size_t NextSeq;
+
+  TaskGroup Group;
+} Pipeline;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+TnStatus PipelineInit(Pipeline* pl, ThreadPool* tp, size_t nTokens);
+TnStatus PipelineDestroy(Pipeline* pl);
+
+TnStatus PipelineAddStage(Pipeline* pl, PipelineStageKind kind,
+                          PipelineStageFooT function, void* args);
+
+/* Runs until the input ends and every item left the last stage. The
+ * calling thread runs tasks of the pool meanwhile. */
+TnStatus PipelineRun(Pipeline* pl);
+
+#ifdef __cplusplus
+}
+#endif
+
+static void PipelineTokenRun(void* args, void* result);
+static TnStatus PipelineSubmit(Pipeline* pl, PipelineToken* token);
+static void PipelineFeed(Pipeline* pl);
+static void PipelineRelease(Pipeline* pl, PipelineToken* token);
+static int PipelineEnter(PipelineStage* stage, PipelineToken* token);
+static void PipelineLeave(Pipeline* pl, PipelineStage* stage);
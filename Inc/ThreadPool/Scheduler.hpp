@@ -0,0 +1,499 @@
+#pragma once
+#include <atomic>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "ThreadPool/Parallel.h"
+
+#if __has_include(<stdexec/execution.hpp>)
+#include <stdexec/execution.hpp>
+#define TN_STDEXEC 1
+#endif
+
+/* Sender/receiver front end of the pool in the shape of P2300
+ * (std::execution): a scheduler whose schedule() sender completes on a
+ * worker, and bulk() on top of ParallelFor.
+ *
+ * A receiver provides set_value(), set_error(TnStatus) and set_stopped(),
+ * and optionally get_env() with an environment answering get_stop_token.
+ * set_value must not throw, it runs on a worker. Operation states are
+ * immovable and carry the pool task themselves, so connect() and start()
+ * never allocate.
+ *
+ * When stdexec is on the include path the senders also carry its concept
+ * tags, completion signatures and environments, completions go through
+ * its customization points and the stop token types are its inplace ones,
+ * so they compose with stdexec algorithms and receivers. */
+namespace TnExec {
+
+#ifdef TN_STDEXEC
+
+using StopSource = stdexec::inplace_stop_source;
+using StopToken = stdexec::inplace_stop_token;
+
+using stdexec::get_env;
+using stdexec::get_stop_token;
+using get_stop_token_t = stdexec::get_stop_token_t;
+
+#else
+
+/* Cancellation flag, the inplace_stop_source of P2300 without callbacks:
+ * operations check it when started and again when they run */
+class StopSource;
+
+class StopToken {
+ public:
+  StopToken() = default;
+
+  bool stop_requested() const noexcept;
+  bool stop_possible() const noexcept { return Source != nullptr; }
+
+ private:
+  friend class StopSource;
+  explicit StopToken(const StopSource* source) : Source(source) {}
+
+  const StopSource* Source = nullptr;
+};
+
+class StopSource {
+ public:
+  StopSource() = default;
+  StopSource(const StopSource&) = delete;
+  StopSource& operator=(const StopSource&) = delete;
+
+  /* Whether this call was the one to request it */
+  bool request_stop() noexcept { return !Stopped.exchange(true); }
+  bool stop_requested() const noexcept { return Stopped.load(); }
+  StopToken get_token() const noexcept { return StopToken(this); }
+
+ private:
+  std::atomic<bool> Stopped{false};
+};
+
+inline bool StopToken::stop_requested() const noexcept {
+  return Source && Source->stop_requested();
+}
+
+namespace Detail {
+
+template <class T, class = void>
+struct HasEnv : std::false_type {};
+
+template <class T>
+struct HasEnv<T, decltype((void)std::declval<const T&>().get_env())>
+    : std::true_type {};
+
+template <class Env, class Query, class = void>
+struct HasQuery : std::false_type {};
+
+template <class Env, class Query>
+struct HasQuery<Env, Query,
+                decltype((void)std::declval<const Env&>().query(
+                    std::declval<Query>()))> : std::true_type {};
+
+}  // namespace Detail
+
+struct EmptyEnv {};
+
+/* The environment of a receiver or sender, empty if it has none */
+struct get_env_t {
+  template <class T>
+  auto operator()(const T& obj) const noexcept {
+    if constexpr (Detail::HasEnv<T>::value)
+      return obj.get_env();
+    else
+      return EmptyEnv{};
+  }
+};
+
+/* An environment's stop token, one that never stops if it has none */
+struct get_stop_token_t {
+  template <class Env>
+  auto operator()(const Env& env) const noexcept {
+    if constexpr (Detail::HasQuery<Env, get_stop_token_t>::value)
+      return env.query(*this);
+    else
+      return StopToken{};
+  }
+};
+
+inline constexpr get_env_t get_env{};
+inline constexpr get_stop_token_t get_stop_token{};
+
+#endif
+
+namespace Detail {
+
+template <class Receiver>
+bool StopRequested(const Receiver& receiver) {
+  return TnExec::get_stop_token(TnExec::get_env(receiver)).stop_requested();
+}
+
+template <class Receiver, class... Values>
+void SetValue(Receiver& receiver, Values&&... values) noexcept {
+#ifdef TN_STDEXEC
+  stdexec::set_value(std::move(receiver), std::forward<Values>(values)...);
+#else
+  std::move(receiver).set_value(std::forward<Values>(values)...);
+#endif
+}
+
+template <class Receiver, class Error>
+void SetError(Receiver& receiver, Error&& error) noexcept {
+#ifdef TN_STDEXEC
+  stdexec::set_error(std::move(receiver), std::forward<Error>(error));
+#else
+  std::move(receiver).set_error(std::forward<Error>(error));
+#endif
+}
+
+template <class Receiver>
+void SetStopped(Receiver& receiver) noexcept {
+#ifdef TN_STDEXEC
+  stdexec::set_stopped(std::move(receiver));
+#else
+  std::move(receiver).set_stopped();
+#endif
+}
+
+template <class Sender, class Receiver>
+auto Connect(Sender&& sender, Receiver&& receiver) {
+#ifdef TN_STDEXEC
+  return stdexec::connect(std::forward<Sender>(sender),
+                          std::forward<Receiver>(receiver));
+#else
+  return std::forward<Sender>(sender).connect(
+      std::forward<Receiver>(receiver));
+#endif
+}
+
+template <class Sender, class Receiver>
+using ConnectResultT =
+    decltype(Connect(std::declval<Sender>(), std::declval<Receiver>()));
+
+/* Submits run(op) as a pool task, or completes the receiver with the
+ * reason it could not */
+template <class Receiver>
+void Enqueue(ThreadPool* tp, Receiver& receiver, WorkerFooT run, void* op) {
+  if (StopRequested(receiver)) {
+    SetStopped(receiver);
+    return;
+  }
+
+  WorkerTask task;
+  task.Function = run;
+  task.Args = op;
+  task.Result = op;
+
+  TnStatus status = ThreadPoolAddTask(tp, task);
+  if (!TnStatusOk(status)) SetError(receiver, status);
+}
+
+}  // namespace Detail
+
+class Scheduler;
+
+template <class ReceiverT>
+class ScheduleOperation {
+ public:
+#ifdef TN_STDEXEC
+  using operation_state_concept = stdexec::operation_state_t;
+#endif
+
+  ScheduleOperation(ThreadPool* tp, ReceiverT receiver)
+      : Pool(tp), Receiver(std::move(receiver)) {}
+
+  ScheduleOperation(const ScheduleOperation&) = delete;
+  ScheduleOperation& operator=(const ScheduleOperation&) = delete;
+
+  void start() noexcept { Detail::Enqueue(Pool, Receiver, Run, this); }
+
+ private:
+  static void Run(void* args, void* result) {
+    ScheduleOperation* self = (ScheduleOperation*)args;
+
+    if (Detail::StopRequested(self->Receiver))
+      Detail::SetStopped(self->Receiver);
+    else
+      Detail::SetValue(self->Receiver);
+  }
+
+  ThreadPool* Pool;
+  ReceiverT Receiver;
+};
+
+class ScheduleSender {
+ public:
+#ifdef TN_STDEXEC
+  using sender_concept = stdexec::sender_t;
+  using completion_signatures =
+      stdexec::completion_signatures<stdexec::set_value_t(),
+                                     stdexec::set_error_t(TnStatus),
+                                     stdexec::set_stopped_t()>;
+
+  /* Values are sent from the pool's workers */
+  struct Env {
+    ThreadPool* Pool;
+
+    Scheduler query(stdexec::get_completion_scheduler_t<
+                    stdexec::set_value_t>) const noexcept;
+  };
+
+  Env get_env() const noexcept { return {Pool}; }
+#endif
+
+  explicit ScheduleSender(ThreadPool* tp) : Pool(tp) {}
+
+  template <class Receiver>
+  ScheduleOperation<std::decay_t<Receiver>> connect(
+      Receiver&& receiver) const {
+    return {Pool, std::forward<Receiver>(receiver)};
+  }
+
+  Scheduler get_completion_scheduler() const noexcept;
+
+ private:
+  ThreadPool* Pool;
+};
+
+class Scheduler {
+ public:
+  explicit Scheduler(ThreadPool* tp) : Pool(tp) {}
+
+  ScheduleSender schedule() const noexcept { return ScheduleSender(Pool); }
+
+  bool operator==(const Scheduler& other) const noexcept {
+    return Pool == other.Pool;
+  }
+  bool operator!=(const Scheduler& other) const noexcept {
+    return Pool != other.Pool;
+  }
+
+ private:
+  template <class Pred, class Shape, class Foo>
+  friend class BulkSender;
+
+  ThreadPool* Pool;
+};
+
+inline Scheduler ScheduleSender::get_completion_scheduler() const noexcept {
+  return Scheduler(Pool);
+}
+
+#ifdef TN_STDEXEC
+inline Scheduler ScheduleSender::Env::query(
+    stdexec::get_completion_scheduler_t<stdexec::set_value_t>)
+    const noexcept {
+  return Scheduler(Pool);
+}
+#endif
+
+/* Once the predecessor sends its values, calls foo(i, values...) for every
+ * i in [0, shape) through ParallelFor on a scheduler's pool, then sends
+ * the values on. The thread the predecessor completes on takes part and
+ * sends the result, so the predecessor picks where the loop is driven. */
+template <class Pred, class Shape, class Foo>
+class BulkSender;
+
+template <class Pred, class ReceiverT, class Shape, class Foo>
+class BulkOperation {
+  /* Connected to the predecessor, runs the loop on its values */
+  class PredReceiver {
+   public:
+#ifdef TN_STDEXEC
+    using receiver_concept = stdexec::receiver_t;
+#endif
+
+    explicit PredReceiver(BulkOperation* op) : Op(op) {}
+
+    template <class... Values>
+    void set_value(Values&&... values) noexcept {
+      Op->Run(std::forward<Values>(values)...);
+    }
+
+    template <class Error>
+    void set_error(Error&& error) noexcept {
+      Detail::SetError(Op->Receiver, std::forward<Error>(error));
+    }
+
+    void set_stopped() noexcept { Detail::SetStopped(Op->Receiver); }
+
+    auto get_env() const noexcept { return TnExec::get_env(Op->Receiver); }
+
+   private:
+    BulkOperation* Op;
+  };
+
+ public:
+#ifdef TN_STDEXEC
+  using operation_state_concept = stdexec::operation_state_t;
+#endif
+
+  BulkOperation(ThreadPool* tp, Pred pred, Shape shape, Foo foo,
+                ReceiverT receiver)
+      : Pool(tp),
+        Size(shape),
+        Body(std::move(foo)),
+        Receiver(std::move(receiver)),
+        Inner(Detail::Connect(std::move(pred), PredReceiver(this))) {}
+
+  BulkOperation(const BulkOperation&) = delete;
+  BulkOperation& operator=(const BulkOperation&) = delete;
+
+  void start() noexcept {
+#ifdef TN_STDEXEC
+    stdexec::start(Inner);
+#else
+    Inner.start();
+#endif
+  }
+
+ private:
+  /* A few chunks per worker, so a slow one does not hold up the rest */
+  static constexpr size_t ChunksPerWorker = 4;
+
+  template <class Values>
+  struct Loop {
+    BulkOperation* Self;
+    Values* Args;
+  };
+
+  template <class Values>
+  static void Chunk(size_t begin, size_t end, void* args) {
+    Loop<Values>* loop = (Loop<Values>*)args;
+    BulkOperation* self = loop->Self;
+    if (Detail::StopRequested(self->Receiver)) return;
+
+    for (size_t i = begin; i < end; ++i)
+      std::apply([&](auto&... values) { self->Body((Shape)i, values...); },
+                 *loop->Args);
+  }
+
+  template <class... Values>
+  void Run(Values&&... values) noexcept {
+    if (Detail::StopRequested(Receiver)) {
+      Detail::SetStopped(Receiver);
+      return;
+    }
+
+    auto args = std::forward_as_tuple(values...);
+    Loop<decltype(args)> loop = {this, &args};
+
+    size_t n = (size_t)Size;
+    size_t nChunks = Pool->Workers.Size * ChunksPerWorker;
+    size_t grain = (n + nChunks - 1) / nChunks;
+
+    TnStatus status =
+        ParallelFor(Pool, n, grain, Chunk<decltype(args)>, &loop);
+
+    if (!TnStatusOk(status))
+      Detail::SetError(Receiver, status);
+    else if (Detail::StopRequested(Receiver))
+      Detail::SetStopped(Receiver);
+    else
+      Detail::SetValue(Receiver, std::forward<Values>(values)...);
+  }
+
+  ThreadPool* Pool;
+  Shape Size;
+  Foo Body;
+  ReceiverT Receiver;
+  Detail::ConnectResultT<Pred, PredReceiver> Inner;
+};
+
+template <class Pred, class Shape, class Foo>
+class BulkSender {
+  static_assert(std::is_integral<Shape>::value, "Shape must be integral");
+
+ public:
+#ifdef TN_STDEXEC
+  using sender_concept = stdexec::sender_t;
+
+  /* The predecessor's, plus the loop's own failures and cancellation */
+  template <class Env>
+  auto get_completion_signatures(Env&&) const
+      -> stdexec::transform_completion_signatures_of<
+          Pred, Env,
+          stdexec::completion_signatures<stdexec::set_error_t(TnStatus),
+                                         stdexec::set_stopped_t()>> {
+    return {};
+  }
+
+  /* Completes where the predecessor does */
+  auto get_env() const noexcept { return stdexec::get_env(Predecessor); }
+#endif
+
+  BulkSender(Scheduler sched, Pred pred, Shape shape, Foo foo)
+      : Pool(sched.Pool),
+        Predecessor(std::move(pred)),
+        Size(shape),
+        Body(std::move(foo)) {}
+
+  template <class Receiver>
+  BulkOperation<Pred, std::decay_t<Receiver>, Shape, Foo> connect(
+      Receiver&& receiver) && {
+    return {Pool, std::move(Predecessor), Size, std::move(Body),
+            std::forward<Receiver>(receiver)};
+  }
+
+  template <class Receiver>
+  BulkOperation<Pred, std::decay_t<Receiver>, Shape, Foo> connect(
+      Receiver&& receiver) const& {
+    return {Pool, Predecessor, Size, Body, std::forward<Receiver>(receiver)};
+  }
+
+ private:
+  ThreadPool* Pool;
+  Pred Predecessor;
+  Shape Size;
+  Foo Body;
+};
+
+namespace Detail {
+
+/* The pool a sender sends its values from */
+template <class Sender>
+Scheduler CompletionScheduler(const Sender& sender) {
+#ifdef TN_STDEXEC
+  return stdexec::get_completion_scheduler<stdexec::set_value_t>(
+      stdexec::get_env(sender));
+#else
+  return sender.get_completion_scheduler();
+#endif
+}
+
+}  // namespace Detail
+
+template <class Sender, class Shape, class Foo>
+BulkSender<std::decay_t<Sender>, Shape, std::decay_t<Foo>> bulk(
+    Scheduler sched, Sender&& sender, Shape shape, Foo&& foo) {
+  return {sched, std::forward<Sender>(sender), shape,
+          std::forward<Foo>(foo)};
+}
+
+/* For senders that complete on a pool, like schedule() */
+template <class Sender, class Shape, class Foo>
+BulkSender<std::decay_t<Sender>, Shape, std::decay_t<Foo>> bulk(
+    Sender&& sender, Shape shape, Foo&& foo) {
+  Scheduler sched = Detail::CompletionScheduler(sender);
+  return {sched, std::forward<Sender>(sender), shape,
+          std::forward<Foo>(foo)};
+}
+
+template <class Sender, class Receiver>
+auto connect(Sender&& sender, Receiver&& receiver) {
+  return Detail::Connect(std::forward<Sender>(sender),
+                         std::forward<Receiver>(receiver));
+}
+
+template <class Operation>
+void start(Operation& op) noexcept {
+#ifdef TN_STDEXEC
+  stdexec::start(op);
+#else
+  op.start();
+#endif
+}
+
+}  // namespace TnExec
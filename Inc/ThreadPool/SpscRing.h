@@ -0,0 +1,36 @@
+#pragma once
+#include "Worker/Worker.h"
+#include "malloc.h"
+
+#define SPSC_CACHE_LINE 64
+
+/* Bounded single-producer single-consumer ring of tasks. Each side keeps
+ * a cached copy of the other side's index and only rereads it when the
+ * ring looks full or empty, so the shared lines move rarely. */
+typedef struct {
+  WorkerTask* Buffer;
+  size_t Mask;
+
+  /* Producer side */
+  size_t Head __attribute__((aligned(SPSC_CACHE_LINE))); /* Atomic */
+  size_t CachedTail;
+
+  /* Consumer side */
+  size_t Tail __attribute__((aligned(SPSC_CACHE_LINE))); /* Atomic */
+  size_t CachedHead;
+} SpscRing;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Capacity is rounded up to a power of two */
+TnStatus SpscRingInit(SpscRing* ring, size_t capacity);
+TnStatus SpscRingDestroy(SpscRing* ring);
+TnStatus SpscRingPush(SpscRing* ring, const WorkerTask* task);
+TnStatus SpscRingPop(SpscRing* ring, WorkerTask* task);
+TnStatus SpscRingEmpty(const SpscRing* ring, int* empty);
+
+#ifdef __cplusplus
+}
+#endif
@@ -2,14 +2,53 @@
 #include "ThreadPool/TaskQueue.h"
 #include "errno.h"
 #include "pthread.h"
+#include "time.h"
+
+#define TQ_MAX_SOURCES 64
+#define TQ_SOURCE_NAME_SIZE 32
+#define TQ_NO_SOURCE ((TaskSourceID)-1)
+#define TQ_DELAY_BUCKETS 64
+
+typedef size_t TaskSourceID; /* 0 is the default source */
 
 typedef struct {
+  size_t NTasks;  /* Dequeued so far */
+  size_t Pending; /* Still queued */
+
+  /* Queueing delay in ns, bucket i counts delays in [2^i, 2^(i+1)) */
+  uint64_t TotalDelay;
+  uint64_t MaxDelay;
+  size_t DelayBuckets[TQ_DELAY_BUCKETS];
+} TaskSourceStats;
+
+typedef struct {
+  char Name[TQ_SOURCE_NAME_SIZE];
+  size_t Weight; /* Tasks served per round */
+
   TaskQueue Tasks;
+  size_t Deficit;
+  TaskSourceID NextActive;
+
+  TaskSourceStats Stats;
+} TaskSource;
+
+/* Sources with queued tasks are served by deficit round robin */
+typedef struct {
+  TaskSource Sources[TQ_MAX_SOURCES];
+  size_t NSources;
+  TaskSourceID ActiveHead;
+  TaskSourceID ActiveTail;
+  size_t Size; /* Atomic, written under Mutex */
 
   pthread_mutex_t Mutex;
   pthread_cond_t CondEmpty;
+  size_t NEmptyWaiters; /* Dequeues only signal CondEmpty if any */
+  LockProfile MutexProfile;
 
   int HasError;
+  int StampTasks;    /* Record EnqueueTime even with a single source */
+  size_t NConsumers; /* GetTasks takes at most 1/NConsumers of Size */
+  size_t Reserve;    /* Tasks every source has room for up front */
 } TQMonitor;
 
 #ifdef __cplusplus
@@ -20,12 +59,42 @@ TnStatus TQMonitorInit(TQMonitor* tqm);
 TnStatus TQMonitorDestroy(TQMonitor* tqm);
 TnStatus TQMonitorAddTask(TQMonitor* tqm, const WorkerTask* task);
 TnStatus TQMonitorGetTask(TQMonitor* tqm, WorkerTask* task);
+
+/* Takes up to max tasks under one lock, in the order GetTask would */
+TnStatus TQMonitorGetTasks(TQMonitor* tqm, WorkerTask* tasks, size_t max,
+                           size_t* n);
 TnStatus TQMonitorWaitEmpty(TQMonitor* tqm);
+TnStatus TQMonitorSize(TQMonitor* tqm, size_t* size);
+TnStatus TQMonitorPeekSize(const TQMonitor* tqm, size_t* size);
 TnStatus TQMonitorSignalError(TQMonitor* tqm);
 
+/* TaskQueueReserve for every source, including ones added later */
+TnStatus TQMonitorReserve(TQMonitor* tqm, size_t nTasks);
+
+TnStatus TQMonitorAddSource(TQMonitor* tqm, const char* name, size_t weight,
+                            TaskSourceID* id);
+
+/* AddSource in two steps, for callers that add a source to several
+ * monitors at once: Prepare allocates its queue, which may fail, Commit
+ * only fails with TN_OVERFLOW if a source was added since, and takes the
+ * queue over when it succeeds */
+TnStatus TQMonitorPrepareSource(TQMonitor* tqm, TaskQueue* tasks);
+TnStatus TQMonitorCommitSource(TQMonitor* tqm, const char* name,
+                               size_t weight, TaskQueue* tasks,
+                               TaskSourceID* id);
+TnStatus TQMonitorAddSourceTask(TQMonitor* tqm, TaskSourceID id,
+                                const WorkerTask* task);
+TnStatus TQMonitorGetSourceStats(TQMonitor* tqm, TaskSourceID id,
+                                 TaskSourceStats* stats);
+
 #ifdef __cplusplus
 }
 #endif
 
 static void TQMonitorLock(TQMonitor* tqm);
 static void TQMonitorUnlock(TQMonitor* tqm);
+
+static uint64_t TQMonitorNow();
+static void TQMonitorPop(TQMonitor* tqm, WorkerTask* task);
+static void TQMonitorActivate(TQMonitor* tqm, TaskSourceID id);
+static void TQMonitorRecordDelay(TaskSource* source, uint64_t delay);
@@ -0,0 +1,34 @@
+#pragma once
+#include "Worker/Worker.h"
+
+struct FiberImpl;
+
+/* Counts tasks of a fork-join scope that are not finished yet. Fibers
+ * waiting for it park on Waiters instead of blocking their thread. */
+typedef struct TaskGroupImpl {
+  size_t Pending; /* Atomic, only dropped under Mutex */
+  struct FiberImpl* Waiters;
+  pthread_mutex_t Mutex;
+} TaskGroup;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+TnStatus TaskGroupInit(TaskGroup* group);
+TnStatus TaskGroupDestroy(TaskGroup* group);
+TnStatus TaskGroupAdd(TaskGroup* group);
+
+/* The last task to finish takes the parked waiters. TaskGroupDestroy
+ * waits for it to let go of the group. */
+TnStatus TaskGroupDone(TaskGroup* group, int* isLast,
+                       struct FiberImpl** waiters);
+
+/* Adds the fiber to the waiters unless no task is pending */
+TnStatus TaskGroupPark(TaskGroup* group, struct FiberImpl* fiber,
+                       int* parked);
+TnStatus TaskGroupPending(const TaskGroup* group, size_t* pending);
+
+#ifdef __cplusplus
+}
+#endif
@@ -3,14 +3,27 @@
 #include "malloc.h"
 #include "string.h"
 
-#define TQ_INITIAL_CAPACITY 2
+#define TQ_CHUNK_CAPACITY 256
+#define TQ_CHUNK_CACHE_SIZE 4 /* Idle chunks kept around after a burst */
 
+typedef struct TaskChunkImpl {
+  struct TaskChunkImpl* Next;
+  WorkerTask Tasks[TQ_CHUNK_CAPACITY];
+} TaskChunk;
+
+/* FIFO of fixed-size chunks: growing links one more chunk and never moves
+ * the queued tasks, drained chunks go to a small cache or back to the
+ * system once the cache is full */
 typedef struct {
-  WorkerTask* Tasks;
+  TaskChunk* HeadChunk; /* Pushed into */
+  TaskChunk* TailChunk; /* Popped from */
   size_t Head;
   size_t Tail;
   size_t Size;
-  size_t Capacity;
+
+  TaskChunk* Cache;
+  size_t NCached;
+  size_t CacheLimit;
 } TaskQueue;
 
 #ifdef __cplusplus
@@ -23,8 +36,13 @@ TnStatus TaskQueuePush(TaskQueue* tq, const WorkerTask* task);
 TnStatus TaskQueuePop(TaskQueue* tq, WorkerTask* task);
 TnStatus TaskQueueSize(const TaskQueue* tq, size_t* size);
 
+/* Caches enough chunks for nTasks queued at once and keeps them, so that
+ * the queue neither allocates nor frees until it grows past that */
+TnStatus TaskQueueReserve(TaskQueue* tq, size_t nTasks);
+
 #ifdef __cplusplus
 }
 #endif
 
-static TnStatus TaskQueueResize(TaskQueue* tq);
\ No newline at end of file
+static TaskChunk* TaskQueueGetChunk(TaskQueue* tq);
+static void TaskQueuePutChunk(TaskQueue* tq, TaskChunk* chunk);
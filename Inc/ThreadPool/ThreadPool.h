@@ -1,27 +1,434 @@
 #pragma once
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <limits.h>
+
+#include "ThreadPool/Arbiter.h"
+#include "ThreadPool/CompletionQueue.h"
+#include "ThreadPool/CpuQuota.h"
+#include "ThreadPool/Fiber.h"
+#include "ThreadPool/Futex.h"
+#include "ThreadPool/Histogram.h"
 #include "ThreadPool/TQMonitor.h"
+#include "ThreadPool/TaskGroup.h"
+#include "ThreadPool/Topology.h"
 #include "ThreadPool/WQMonitor.h"
 #include "ThreadPool/WorkerArray.h"
+#include "ThreadPool/WorkerInbox.h"
+
+#define TP_NO_WORKER ((WorkerID)-1)
+
+/* NWorkers sized to the CPU quota of the process, see CpuQuota.h.
+ * Not 0, so a worker count computed as 0 still fails. */
+#define TP_WORKERS_AUTO ((size_t)-1)
+
+/* Most tasks a worker takes from a shard at once */
+#define TP_BATCH_MAX 16
+
+/* Workers every freshly started worker starts in turn, TP_START_PARALLEL */
+#define TP_SPAWN_FANOUT 2
+
+/* Rounds an idle worker polls the queues for before it sleeps */
+#define TP_SPIN_ROUNDS 1024
+
+/* ThreadPool.Wake of a worker between tasks */
+#define TP_WAKE_NONE 0    /* Looking for a task */
+#define TP_WAKE_PENDING 1 /* Told to look again */
+#define TP_WAKE_WAITING 2 /* Asleep on the word */
+
+/* Period of the stall watchdog, ns */
+#define TP_STALL_INTERVAL 10000000
+
+/* Set in ThreadPool.NClaimed once no more workers may be started */
+#define TP_SPAWN_CLOSED ((size_t)1 << (sizeof(size_t) * 8 - 1))
+
+typedef enum {
+  TP_SHARD_BY_THREAD, /* Every producer thread sticks to one shard */
+  TP_SHARD_BY_CPU     /* Shard of the CPU the producer runs on */
+} ThreadPoolShardPolicy;
+
+typedef enum {
+  TP_START_SERIAL,   /* ThreadPoolRun creates every worker thread */
+  TP_START_PARALLEL, /* It creates a few, each new worker creates more */
+  TP_START_LAZY      /* A worker is created whenever a task finds none free */
+} ThreadPoolStartPolicy;
+
+/* Parts of the pool in the order ThreadPoolInitConfig sets them up */
+typedef enum {
+  TP_INIT_SHARDS,
+  TP_INIT_FREE_WORKERS,
+  TP_INIT_WORKERS,
+  TP_INIT_INBOXES,
+  TP_INIT_ADMISSION,
+  TP_INIT_FIBERS,
+  TP_INIT_LATENCY,
+  TP_INIT_ACTIVE,
+  TP_INIT_STALL,
+  TP_INIT_ALL = TP_INIT_STALL
+} ThreadPoolInitStage;
+
+/* A task that has run longer than the stall budget */
+typedef struct {
+  WorkerID Worker;
+  WorkerFooT Function; /* As submitted, also for a task run in a fiber */
+  void* Args;
+  uint64_t TaskID;
+  uint64_t Elapsed; /* ns */
+} ThreadPoolStall;
+
+typedef void (*ThreadPoolStallT)(void* args, const ThreadPoolStall* stall);
+
+typedef struct {
+  size_t NWorkers; /* Or TP_WORKERS_AUTO */
+  ThreadPoolStartPolicy StartPolicy;
+
+  /* Cgroup hierarchy to read the quota from, NULL for the system one */
+  const char* CgroupRoot;
+
+  /* Every this many ns the quota is read again and workers above it are
+   * parked, 0 disables it */
+  uint64_t QuotaInterval;
+
+  /* Leases workers and their cores from a budget shared with other pools
+   * while running, e.g. ArbiterGlobal(). Replaces the quota monitor. */
+  Arbiter* WorkerArbiter;
+  size_t ArbiterWeight;
+
+  /* Polls of the queues by an idle worker before it sleeps, 0 disables
+   * spinning. Only one worker spins at a time, and submitting to the
+   * shared queues wakes nobody while it does. */
+  size_t SpinRounds;
+
+  /* Tasks a worker may take from a shard at once, up to TP_BATCH_MAX. It
+   * takes fewer when the queue is short, 1 disables batching. */
+  size_t MaxBatch;
+
+  /* Number of submission queues, 1 disables sharding */
+  size_t NShards;
+  ThreadPoolShardPolicy ShardPolicy;
+
+  /* Runs every task in a fiber of this stack size so it can TnYield() or
+   * wait on a FiberEvent, 0 runs tasks on the worker stack */
+  size_t FiberStackSize;
+
+  /* Guard pages under fiber stacks, 0 carves them from slabs so that
+   * hundreds of thousands fit in vm.max_map_count. MaxFibers caps the
+   * fibers alive at once, 0 if unlimited: a task that gets no fiber waits
+   * off the queues until one finishes, it never runs on a worker stack.
+   * Fibers parked in ThreadPoolWaitGroup keep theirs. */
+  int FiberGuard;
+  size_t MaxFibers;
+
+  /* Admission limits, 0 disables either: tasks waiting in the shards and
+   * inboxes, and queueing delay (ns) of the last task taken from them.
+   * Only ThreadPoolTryAddTask, ThreadPoolTryAddTaskTo and
+   * ThreadPoolAddTaskTimed check them. */
+  size_t MaxQueueDepth;
+  uint64_t MaxQueueDelay;
+
+  /* Sized at init and kept, so that a steady load within them submits
+   * and runs tasks without touching the allocator: tasks queued at once
+   * per shard, per worker inbox, and fibers alive at once */
+  size_t ReserveTasks;
+  size_t ReserveInboxTasks;
+  size_t ReserveFibers;
+
+  /* A watchdog thread checks every StallInterval ns for tasks that run
+   * longer than StallBudget ns, 0 disables it. OnStall, if set, is
+   * called on that thread once per overrun and must not stop the pool.
+   * A fiber's budget is per slice, and tasks run by helper threads are
+   * not watched. */
+  uint64_t StallBudget;
+  uint64_t StallInterval;
+  ThreadPoolStallT OnStall;
+  void* StallArgs;
+} ThreadPoolConfig;
+
+typedef enum {
+  TP_TARGET_WORKER, /* ID is a WorkerID */
+  TP_TARGET_CPU,    /* ID is a cpu some worker is pinned to */
+  TP_TARGET_NODE    /* ID is a NUMA node */
+} ThreadPoolTargetKind;
+
+typedef struct {
+  ThreadPoolTargetKind Kind;
+  size_t ID;
+  int AllowSteal; /* Only prefer the target, idle workers may take it */
+} ThreadPoolTarget;
+
+/* Written by its worker only */
+typedef struct {
+  Histogram QueueDelay; /* Submit to start */
+  Histogram Execution;  /* Start to end, per slice for fibers */
+  uint64_t Start;       /* Ticks, 0 if the running task is not measured */
+} ThreadPoolLatency;
 
+/* Task a worker runs, for the watchdog. Written by its worker only,
+ * Start last, so the rest is only valid while Start is unchanged. */
 typedef struct {
-  TQMonitor Tasks;
+  uint64_t Start;      /* Atomic, ticks, 0 between tasks */
+  WorkerFooT Function; /* Atomic */
+  void* Args;          /* Atomic */
+  uint64_t TaskID;     /* Atomic */
+  uint64_t Reported;   /* Watchdog only, Start of the last overrun */
+} ThreadPoolRunning;
+
+/* Tasks a worker took at once, run as one task */
+typedef struct {
+  void* Pool;
+  WorkerID Worker;
+  size_t N;
+  WorkerTask Tasks[TP_BATCH_MAX];
+} ThreadPoolBatch;
+
+typedef struct {
+  ThreadPoolConfig Config;
+
+  TQMonitor* Tasks; /* Config.NShards queues */
+  pthread_mutex_t SourceMutex; /* Held while a source is added to them */
   WQMonitor FreeWorkers;
   WorkerArray Workers;
+
+  /* Tasks addressed to a particular worker */
+  WorkerInbox* Inboxes;
+  int* WorkerNodes;          /* Atomic, per worker, node of its Core */
+  ThreadPoolBatch* Batches; /* Per worker */
+  size_t TargetSeed; /* Atomic */
+
+  /* Idle workers: active ones wait in FreeWorkers, parked ones in Parked,
+   * and whoever takes one out wakes it through its word */
+  uint32_t* Wake;    /* Atomic, futex, per worker, TP_WAKE_* */
+  size_t NSpinning;  /* Atomic */
+  int Stopping;      /* Atomic */
+
+  /* Threads that run queued tasks while waiting, and sleep on HelpEpoch
+   * once there are none */
+  uint32_t HelpEpoch; /* Atomic, futex */
+  size_t NHelpers;    /* Atomic, asleep or about to */
+
+  FiberPool Fibers;
+  TaskQueue Starved; /* Tasks that got no fiber */
+  pthread_mutex_t StarvedMutex;
+
+  /* Admission control */
+  size_t NQueued;      /* Atomic, tasks in the shards and inboxes */
+  uint64_t QueueDelay; /* Atomic */
+  pthread_mutex_t SpaceMutex;
+  pthread_cond_t SpaceCond; /* CLOCK_MONOTONIC */
+  size_t NBlocked;          /* Atomic, producers waiting for space */
+
+  /* Submitted tasks not finished yet, parked fibers included */
+  size_t InFlight;     /* Atomic */
+  uint32_t IdleEpoch;  /* Atomic, futex, bumped when InFlight drops to 0 */
+  size_t NIdleWaiters; /* Atomic */
+
+  /* Worker startup */
+  size_t NClaimed;   /* Atomic, workers handed to WorkerRun, TP_SPAWN_CLOSED */
+  size_t NSpawned;   /* Atomic, workers WorkerRun returned for */
+  uint32_t NReady;   /* Atomic, futex, threads that entered their loop */
+  int SpawnError;    /* Atomic, errno of the first failed start */
+
+  /* Workers with an ID below NActive take shared tasks, the rest park
+   * and only run tasks addressed to them */
+  size_t NActive;    /* Atomic */
+  uint8_t* Parked;   /* Atomic, per worker */
+  pthread_mutex_t ActiveMutex;
+
+  /* Quota monitor */
+  pthread_t QuotaThread;
+  pthread_cond_t QuotaCond; /* CLOCK_MONOTONIC, under ActiveMutex */
+  int QuotaRunning;
+  int QuotaStop;
+
+  ArbiterLease Lease;
+  int Leased;
+
+  int RecordLatency; /* Atomic */
+  ThreadPoolLatency* Latency; /* Per worker */
+
+  /* Stall watchdog */
+  ThreadPoolRunning* Running; /* Per worker */
+  size_t NStalled;            /* Atomic, as of the last check */
+  pthread_t StallThread;
+  pthread_mutex_t StallMutex;
+  pthread_cond_t StallCond; /* CLOCK_MONOTONIC */
+  int StallRunning;
+  int StallStop;
 } ThreadPool;
 
+typedef int (*ThreadPoolPredicateT)(void* args);
+
+/* Where a submission is queued: the producer's shard, under Source, or
+ * the inbox of Worker */
+typedef struct {
+  WorkerID Worker; /* TP_NO_WORKER for the shards */
+  TaskSourceID Source;
+  int Pinned; /* Inbox only, other workers may not steal it */
+} ThreadPoolDest;
+
 static void WorkerCallback(Worker* worker, void* args);
 
+static TnStatus ThreadPoolSubmit(ThreadPool* tp, TaskSourceID source,
+                                 WorkerTask task);
+static TnStatus ThreadPoolSubmitTo(ThreadPool* tp, const ThreadPoolDest* dest,
+                                   WorkerTask task);
+static TnStatus ThreadPoolDispatch(ThreadPool* tp, const ThreadPoolDest* dest,
+                                   WorkerTask task);
+static void ThreadPoolTaskRetired(ThreadPool* tp);
+static int ThreadPoolSpawnWorker(ThreadPool* tp);
+static void ThreadPoolSpawnLazy(ThreadPool* tp);
+static void ThreadPoolWorkerStarted(ThreadPool* tp);
+static uint64_t ThreadPoolNow();
+static TnStatus ThreadPoolQueueTask(ThreadPool* tp, const ThreadPoolDest* dest,
+                                    WorkerTask* task);
+static void ThreadPoolTaskDequeued(ThreadPool* tp, const WorkerTask* task);
+static int ThreadPoolAdmits(ThreadPool* tp);
+static TnStatus ThreadPoolWaitSpace(ThreadPool* tp, uint64_t timeout);
+static int ThreadPoolIsActive(ThreadPool* tp, WorkerID id);
+static int ThreadPoolUnpark(ThreadPool* tp, WorkerID id);
+static void ThreadPoolSetActive(ThreadPool* tp, size_t nActive);
+static TnStatus ThreadPoolActiveInit(ThreadPool* tp);
+static void ThreadPoolActiveDestroy(ThreadPool* tp);
+static void* ThreadPoolQuotaLoop(void* args);
+static TnStatus ThreadPoolQuotaStart(ThreadPool* tp);
+static size_t ThreadPoolLeaseDemand(void* args);
+static void ThreadPoolLeaseApply(void* args, size_t granted, const int* cores);
+static void ThreadPoolQuotaStop(ThreadPool* tp);
+static TnStatus ThreadPoolStallInit(ThreadPool* tp);
+static void ThreadPoolStallDestroy(ThreadPool* tp);
+static TnStatus ThreadPoolStallStart(ThreadPool* tp);
+static void ThreadPoolStallStop(ThreadPool* tp);
+static void* ThreadPoolStallLoop(void* args);
+static size_t ThreadPoolStallCheck(ThreadPool* tp);
+static TnStatus ThreadPoolAdmissionInit(ThreadPool* tp);
+static void ThreadPoolAdmissionDestroy(ThreadPool* tp);
+static TnStatus ThreadPoolUnwind(ThreadPool* tp, ThreadPoolInitStage done,
+                                 TnStatus status);
+static TnStatus ThreadPoolFibersInit(ThreadPool* tp);
+static void ThreadPoolFibersDestroy(ThreadPool* tp);
+static uint64_t ThreadPoolTaskID();
+static uint64_t ThreadPoolStamp(ThreadPool* tp);
+static void ThreadPoolTaskStarted(ThreadPool* tp, WorkerID id,
+                                  const WorkerTask* task);
+static void ThreadPoolTaskFinished(ThreadPool* tp, WorkerID id);
+static TnStatus ThreadPoolShardsInit(ThreadPool* tp);
+static void ThreadPoolShardsDestroy(ThreadPool* tp);
+static TnStatus ThreadPoolInboxesInit(ThreadPool* tp);
+static void ThreadPoolInboxesDestroy(ThreadPool* tp);
+static size_t ThreadPoolShard(ThreadPool* tp);
+static TnStatus ThreadPoolPopTask(ThreadPool* tp, WorkerID self, size_t home,
+                                  WorkerTask* tasks, size_t max, size_t* n);
+static int ThreadPoolHasTasks(ThreadPool* tp, WorkerID self);
+static int ThreadPoolDeliver(ThreadPool* tp, Worker* worker);
+static int ThreadPoolTakeTask(ThreadPool* tp, Worker* worker);
+static int ThreadPoolSpin(ThreadPool* tp, WorkerID id);
+static void ThreadPoolRelax();
+static void ThreadPoolSleep(ThreadPool* tp, Worker* worker);
+static void ThreadPoolSleepUnlocked(Worker* worker, void* args);
+static void ThreadPoolWake(ThreadPool* tp, WorkerID id);
+static int ThreadPoolWakeOne(ThreadPool* tp);
+static TnStatus ThreadPoolResolveTarget(ThreadPool* tp,
+                                        const ThreadPoolTarget* target,
+                                        WorkerID* id);
+static int ThreadPoolQueueEmpty(void* args);
+static int ThreadPoolGroupFinished(void* args);
+static void ThreadPoolBatchRun(void* args, void* result);
+static void ThreadPoolRunTask(ThreadPool* tp, WorkerTask* task);
+static void ThreadPoolTaskDone(ThreadPool* tp, WorkerTask* task);
+static void ThreadPoolGroupDone(ThreadPool* tp, TaskGroup* group);
+static void ThreadPoolGroupHook(Fiber* fiber, void* args);
+static void ThreadPoolWakeHelpers(ThreadPool* tp, int all);
+static TnStatus ThreadPoolHelpUntil(ThreadPool* tp, ThreadPoolPredicateT done,
+                                    void* args);
+static int ThreadPoolFiberWrap(ThreadPool* tp, WorkerTask* task);
+static void ThreadPoolFiberStarve(ThreadPool* tp, const WorkerTask* task,
+                                  size_t nPut);
+static void ThreadPoolFiberRequeue(ThreadPool* tp);
+static void ThreadPoolFiberRun(void* args, void* result);
+static void ThreadPoolFiberSchedule(Fiber* fiber, void* args);
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+TnStatus ThreadPoolConfigInit(ThreadPoolConfig* config, size_t nWorkers);
+
+/* nWorkers may be TP_WORKERS_AUTO */
 TnStatus ThreadPoolInit(ThreadPool* tp, size_t nWorkers);
+TnStatus ThreadPoolInitConfig(ThreadPool* tp, const ThreadPoolConfig* config);
 TnStatus ThreadPoolRun(ThreadPool* tp);
+
+/* Starts the workers a lazy or parallel start has not started yet and
+ * waits until every worker thread runs */
+TnStatus ThreadPoolWaitReady(ThreadPool* tp);
 TnStatus ThreadPoolStop(ThreadPool* tp);
 TnStatus ThreadPoolDestroy(ThreadPool* tp);
 TnStatus ThreadPoolAddTask(ThreadPool* tp, WorkerTask task);
+/* TN_OVERFLOW while the queues are over a configured limit. The limits
+ * are soft by at most the number of concurrent producers. */
+TnStatus ThreadPoolTryAddTask(ThreadPool* tp, WorkerTask task);
+
+/* Waits up to timeout ns for the queues to get under the limits, then
+ * fails with TN_ERRNO and errno ETIMEDOUT. From a task of the same pool
+ * it does not wait, as the workers might all be waiting too. */
+TnStatus ThreadPoolAddTaskTimed(ThreadPool* tp, WorkerTask task,
+                                uint64_t timeout);
+
+TnStatus ThreadPoolAddTaskTo(ThreadPool* tp, ThreadPoolTarget target,
+                             WorkerTask task);
+/* TN_OVERFLOW under the same limits as ThreadPoolTryAddTask */
+TnStatus ThreadPoolTryAddTaskTo(ThreadPool* tp, ThreadPoolTarget target,
+                                WorkerTask task);
+
+/* Returns once every task submitted so far has finished, including
+ * fibers parked on an event or channel, so someone else must wake them */
 TnStatus ThreadPoolWaitAll(ThreadPool* tp);
 
+TnStatus ThreadPoolAddGroupTask(ThreadPool* tp, TaskGroup* group,
+                                WorkerTask task);
+/* Runs queued tasks until the group is done. Called from a fiber, it
+ * parks the fiber instead. */
+TnStatus ThreadPoolWaitGroup(ThreadPool* tp, TaskGroup* group);
+
+/* Pushes {tag, task.Result} to the queue once the task is done. Room for
+ * it is reserved here, TN_BAD_ALLOC if the queue cannot make any. */
+TnStatus ThreadPoolAddTaskCompletion(ThreadPool* tp, CompletionQueue* cq,
+                                     uint64_t tag, WorkerTask task);
+
+/* Weighted fair sharing between task sources, e.g. tenants */
+TnStatus ThreadPoolAddSource(ThreadPool* tp, const char* name, size_t weight,
+                             TaskSourceID* id);
+TnStatus ThreadPoolAddSourceTask(ThreadPool* tp, TaskSourceID source,
+                                 WorkerTask task);
+TnStatus ThreadPoolGetSourceStats(ThreadPool* tp, TaskSourceID source,
+                                  TaskSourceStats* stats);
+
+/* Lets only workers 0..n-1 take shared tasks, at least one. Busy workers
+ * above park once their task is done. Tasks sent to a particular worker
+ * still run there. The quota monitor overrides it on its next read. */
+TnStatus ThreadPoolSetActiveWorkers(ThreadPool* tp, size_t n);
+
+/* Records queueing delay and execution time of the tasks run by workers,
+ * off by default. While off it costs a load per task. */
+TnStatus ThreadPoolRecordLatency(ThreadPool* tp, int enable);
+
+/* Merges the histograms of all the workers, either may be NULL */
+TnStatus ThreadPoolGetLatency(ThreadPool* tp, Histogram* queueDelay,
+                              Histogram* execution);
+
+/* Workers whose task was over Config.StallBudget at the watchdog's last
+ * check, 0 while it does not run */
+TnStatus ThreadPoolGetStalled(ThreadPool* tp, size_t* n);
+
+/* One profile per task queue shard, then the idle worker registry, then
+ * one per worker. *n is set to the count, TN_OVERFLOW if above capacity.
+ * The counters stay at zero unless built with TN_LOCK_PROFILE. */
+TnStatus ThreadPoolGetLockProfiles(ThreadPool* tp, LockProfile* profiles,
+                                   size_t capacity, size_t* n);
+
 #ifdef __cplusplus
 }
-#endif
\ No newline at end of file
+#endif
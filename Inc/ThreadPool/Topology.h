@@ -0,0 +1,23 @@
+#pragma once
+#include "Worker/Worker.h"
+#include "stdlib.h"
+
+#define TOPOLOGY_SYSFS_NODES "/sys/devices/system/node"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Parses the kernel cpulist format, e.g. "0-3,8,10-11" */
+TnStatus TopologyParseCpuList(const char* list, cpu_set_t* set);
+TnStatus TopologyReadCpuList(const char* path, cpu_set_t* set);
+
+/* NUMA node of a cpu, 0 when the machine exposes no nodes */
+TnStatus TopologyCpuNode(int cpu, int* node);
+
+/* Same, with root in place of TOPOLOGY_SYSFS_NODES */
+TnStatus TopologyCpuNodeIn(const char* root, int cpu, int* node);
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,13 +1,31 @@
 #pragma once
-#include "ThreadPool/WorkerQueue.h"
+#include <stdint.h>
+
+#include "Worker/Worker.h"
 #include "errno.h"
+#include "malloc.h"
 #include "pthread.h"
 
+#define WQ_NIL UINT32_MAX
+
+/* Lock-free registry of idle workers.
+ * Free workers form a Treiber stack so that the most recently idle (cache
+ * warm) worker is handed out first. A popped entry only counts once its
+ * Idle flag is claimed, which also lets a specific worker be claimed
+ * without unlinking it: such entries are skipped as stale on pop. */
 typedef struct {
-  WorkerQueue Workers;
+  size_t Capacity;
 
+  uint64_t Head;    /* Atomic, top ID in low half, ABA tag in high half */
+  uint32_t* Next;   /* Atomic, stack links by WorkerID */
+  uint8_t* InStack; /* Atomic, worker is linked into the stack */
+  uint8_t* Idle;    /* Atomic, worker may be claimed */
+  size_t Size;      /* Atomic, number of idle workers */
+
+  /* Only used to wait for all the workers to become idle */
   pthread_mutex_t Mutex;
   pthread_cond_t CondFull;
+  LockProfile MutexProfile;
 
   int HasError;
 } WQMonitor;
@@ -21,7 +39,9 @@ TnStatus WQMonitorDestroy(WQMonitor* wqm);
 
 TnStatus WQMonitorAddWorker(WQMonitor* wqm, const WorkerID* id);
 TnStatus WQMonitorGetWorker(WQMonitor* wqm, WorkerID* id);
+TnStatus WQMonitorClaimWorker(WQMonitor* wqm, const WorkerID* id);
 TnStatus WQMonitorWaitFull(WQMonitor* wqm);
+TnStatus WQMonitorPeekSize(const WQMonitor* wqm, size_t* size);
 TnStatus WQMonitorSignalError(WQMonitor* wq);
 
 #ifdef __cplusplus
@@ -29,4 +49,7 @@ TnStatus WQMonitorSignalError(WQMonitor* wq);
 #endif
 
 static void WQMonitorLock(WQMonitor* wqm);
-static void WQMonitorUnlock(WQMonitor* wqm);
\ No newline at end of file
+static void WQMonitorUnlock(WQMonitor* wqm);
+
+static void WQMonitorPush(WQMonitor* wqm, uint32_t id);
+static uint32_t WQMonitorPop(WQMonitor* wqm);
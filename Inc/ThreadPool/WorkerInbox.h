@@ -0,0 +1,37 @@
+#pragma once
+#include "ThreadPool/TaskQueue.h"
+#include "errno.h"
+#include "pthread.h"
+
+/* Tasks addressed to one worker */
+typedef struct {
+  TaskQueue Pinned;    /* Only the owner runs these */
+  TaskQueue Preferred; /* The owner runs these first, others may steal */
+
+  size_t NPinned;    /* Atomic mirror of Pinned.Size */
+  size_t NPreferred; /* Atomic mirror of Preferred.Size */
+
+  pthread_mutex_t Mutex;
+} WorkerInbox;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+TnStatus WorkerInboxInit(WorkerInbox* inbox);
+TnStatus WorkerInboxDestroy(WorkerInbox* inbox);
+TnStatus WorkerInboxPush(WorkerInbox* inbox, const WorkerTask* task,
+                         int pinned);
+TnStatus WorkerInboxPop(WorkerInbox* inbox, WorkerTask* task);
+TnStatus WorkerInboxSteal(WorkerInbox* inbox, WorkerTask* task);
+TnStatus WorkerInboxPeekSize(const WorkerInbox* inbox, size_t* pinned,
+                             size_t* preferred);
+TnStatus WorkerInboxReserve(WorkerInbox* inbox, size_t nTasks);
+
+#ifdef __cplusplus
+}
+#endif
+
+static void WorkerInboxLock(WorkerInbox* inbox);
+static void WorkerInboxUnlock(WorkerInbox* inbox);
+static void WorkerInboxSync(WorkerInbox* inbox);
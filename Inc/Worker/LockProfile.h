@@ -0,0 +1,63 @@
+#pragma once
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "TnStatus.h"
+
+#define LOCK_PROFILE_BUCKETS 40
+#define LOCK_PROFILE_NAME_SIZE 16
+
+/* Contention of one mutex. Updated by whoever holds it, so a snapshot
+ * taken with LockProfileRead may be off by the acquisition in flight.
+ * Bucket i of the histograms counts times in [2^i, 2^(i+1)) ns. */
+typedef struct {
+  char Name[LOCK_PROFILE_NAME_SIZE];
+  size_t ID; /* Of the shard or worker owning the lock */
+
+  size_t NAcquired;  /* Atomic */
+  size_t NContended; /* Atomic, trylock failed first */
+  uint64_t TotalWait; /* Atomic, ns */
+  uint64_t TotalHold; /* Atomic, ns */
+  size_t WaitBuckets[LOCK_PROFILE_BUCKETS]; /* Atomic, contended only */
+  size_t HoldBuckets[LOCK_PROFILE_BUCKETS]; /* Atomic */
+
+  uint64_t AcquiredAt; /* Holder only */
+} LockProfile;
+
+/* With TN_LOCK_PROFILE the pool's locks go through the profiler, without
+ * it they compile to the plain pthread calls and the counters stay zero */
+#ifdef TN_LOCK_PROFILE
+#define TN_MUTEX_LOCK(mutex, profile) LockProfileLock(mutex, profile)
+#define TN_MUTEX_UNLOCK(mutex, profile) LockProfileUnlock(mutex, profile)
+#define TN_COND_WAIT(cond, mutex, profile) \
+  LockProfileCondWait(cond, mutex, profile)
+#else
+#define TN_MUTEX_LOCK(mutex, profile) pthread_mutex_lock(mutex)
+#define TN_MUTEX_UNLOCK(mutex, profile) pthread_mutex_unlock(mutex)
+#define TN_COND_WAIT(cond, mutex, profile) pthread_cond_wait(cond, mutex)
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+TnStatus LockProfileInit(LockProfile* profile, const char* name, size_t id);
+TnStatus LockProfileRead(const LockProfile* profile, LockProfile* snapshot);
+
+void LockProfileLock(pthread_mutex_t* mutex, LockProfile* profile);
+void LockProfileUnlock(pthread_mutex_t* mutex, LockProfile* profile);
+
+/* The wait itself counts as neither hold nor contention */
+void LockProfileCondWait(pthread_cond_t* cond, pthread_mutex_t* mutex,
+                         LockProfile* profile);
+
+#ifdef __cplusplus
+}
+#endif
+
+static uint64_t LockProfileNow();
+static void LockProfileRecord(size_t* buckets, uint64_t time);
+static void LockProfileAcquired(LockProfile* profile, uint64_t now);
+static void LockProfileReleasing(LockProfile* profile);
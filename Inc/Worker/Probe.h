@@ -0,0 +1,23 @@
+#pragma once
+
+/* USDT probes of the "tnasync" provider. `readelf -n` lists them under
+ * stapsdt, tracers attach to e.g. usdt:<binary>:tnasync:submit. With
+ * <sys/sdt.h> an idle probe is a single nop, without it they compile to
+ * nothing. */
+#ifdef TN_HAVE_SDT
+#include <sys/sdt.h>
+
+#define TN_PROBE0(name) DTRACE_PROBE(tnasync, name)
+#define TN_PROBE1(name, a) DTRACE_PROBE1(tnasync, name, a)
+#define TN_PROBE2(name, a, b) DTRACE_PROBE2(tnasync, name, a, b)
+#define TN_PROBE3(name, a, b, c) DTRACE_PROBE3(tnasync, name, a, b, c)
+#define TN_PROBE4(name, a, b, c, d) DTRACE_PROBE4(tnasync, name, a, b, c, d)
+#else
+#define TN_PROBE0(name) \
+  do {              \
+  } while (0)
+#define TN_PROBE1(name, a) TN_PROBE0(name)
+#define TN_PROBE2(name, a, b) TN_PROBE0(name)
+#define TN_PROBE3(name, a, b, c) TN_PROBE0(name)
+#define TN_PROBE4(name, a, b, c, d) TN_PROBE0(name)
+#endif
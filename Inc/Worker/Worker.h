@@ -8,12 +8,17 @@
 #include <errno.h>
 #include <pthread.h>
 #include <sched.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <unistd.h>
 
 #include "TnStatus.h"
+#include "Worker/LockProfile.h"
+#include "Worker/Probe.h"
 
 struct WorkerImpl;
+struct TaskGroupImpl;
+struct CompletionQueueImpl;
 typedef size_t WorkerID;
 
 typedef void (*WorkerFooT)(void* args, void* result);
@@ -28,6 +33,14 @@ typedef struct {
   WorkerFooT Function;
   void* Args;
   void* Result;
+
+  /* Set by the pool */
+  struct TaskGroupImpl* Group;
+  struct CompletionQueueImpl* Completions;
+  uint64_t Tag;
+  uint64_t EnqueueTime; /* ns, CLOCK_MONOTONIC */
+  uint64_t SubmitTime;  /* HistogramNow() ticks, 0 if not recorded */
+  uint64_t ID;          /* Unique per submission, for tracing */
 } WorkerTask;
 
 typedef enum {
@@ -40,10 +53,13 @@ typedef enum {
 
 typedef struct WorkerImpl {
   WorkerID ID;
+  int Core;       /* Atomic, pinned to */
+  int PinnedCore; /* Thread only, Core when it last pinned itself */
 
   pthread_t Thread;
   pthread_mutex_t Mutex;
   pthread_cond_t Cond;
+  LockProfile MutexProfile;
 
   WorkerCallbackT StateCallback;
 
@@ -66,6 +82,9 @@ extern "C" {
 TnStatus WorkerInit(Worker* self, WorkerID id);
 TnStatus WorkerDestroy(Worker* self);
 
+/* Takes effect before the next task the worker runs */
+TnStatus WorkerSetCore(Worker* self, int core);
+
 TnStatus WorkerRun(Worker* self, WorkerCallbackT* stateCb);
 TnStatus WorkerStop(Worker* self);
 
@@ -78,11 +97,16 @@ TnStatus WorkerFinishTaskAsync(Worker* self);
 
 TnStatus WorkerGetState(Worker* self, WorkerState* state);
 
+/* Thread, from the state callback only: runs the callback with the
+ * worker's mutex released, so that the worker may block in it */
+TnStatus WorkerCallUnlocked(Worker* self, WorkerCallbackT callback);
+
 #ifdef __cplusplus
 }
 #endif
 
 static TnStatus ValidateTask(WorkerTask task);
+static int WorkerPickCore(WorkerID id);
 static void WorkerAssignToCore(Worker* self);
 
 static void WorkerLock(Worker* self);
@@ -0,0 +1,282 @@
+#include "ThreadPool/Arbiter.h"
+
+static Arbiter GlobalArbiter;
+static int GlobalArbiterOk = 0;
+static pthread_once_t GlobalArbiterOnce = PTHREAD_ONCE_INIT;
+
+TnStatus ArbiterInit(Arbiter* arb, size_t budget, const cpu_set_t* cpus,
+                     uint64_t interval) {
+  if (!arb) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  TnStatus status;
+  CpuQuota quota;
+  cpu_set_t affinity;
+  pthread_condattr_t attr;
+  int res;
+
+  if (budget == 0) {
+    status = CpuQuotaRead(NULL, &quota);
+    if (!TnStatusOk(status)) return status;
+    budget = quota.Limit;
+  }
+
+  if (!cpus) {
+    if (sched_getaffinity(getpid(), sizeof(affinity), &affinity) != 0)
+      return TNSTATUS(TN_ERRNO);
+    cpus = &affinity;
+  }
+
+  if (CPU_COUNT(cpus) == 0) return TNSTATUS(TN_BAD_ARG_VAL);
+
+  arb->Budget = budget;
+  arb->NCpus = CPU_COUNT(cpus);
+  arb->Cpus = (int*)malloc(arb->NCpus * sizeof(int));
+  arb->CpuUsers = (size_t*)calloc(CPU_SETSIZE, sizeof(size_t));
+
+  if (!arb->Cpus || !arb->CpuUsers) {
+    free(arb->Cpus);
+    free(arb->CpuUsers);
+    return TNSTATUS(TN_BAD_ALLOC);
+  }
+
+  for (int cpu = 0, i = 0; cpu < CPU_SETSIZE; ++cpu)
+    if (CPU_ISSET(cpu, cpus)) arb->Cpus[i++] = cpu;
+
+  arb->Leases = NULL;
+  arb->NLeases = 0;
+  arb->Interval = interval;
+  arb->Running = 0;
+  arb->Stop = 0;
+
+  res = pthread_mutex_init(&arb->Mutex, NULL);
+  if (res != 0) {
+    errno = res;
+    free(arb->Cpus);
+    free(arb->CpuUsers);
+    return TNSTATUS(TN_ERRNO);
+  }
+
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  res = pthread_cond_init(&arb->Cond, &attr);
+  pthread_condattr_destroy(&attr);
+
+  if (res != 0) {
+    errno = res;
+    free(arb->Cpus);
+    free(arb->CpuUsers);
+    pthread_mutex_destroy(&arb->Mutex);
+    return TNSTATUS(TN_ERRNO);
+  }
+
+  if (interval == 0) return TN_OK;
+
+  res = pthread_create(&arb->Thread, NULL, ArbiterLoop, arb);
+  if (res != 0) {
+    errno = res;
+    free(arb->Cpus);
+    free(arb->CpuUsers);
+    pthread_mutex_destroy(&arb->Mutex);
+    pthread_cond_destroy(&arb->Cond);
+    return TNSTATUS(TN_ERRNO);
+  }
+
+  arb->Running = 1;
+  return TN_OK;
+}
+
+/* Every member must have left */
+TnStatus ArbiterDestroy(Arbiter* arb) {
+  if (!arb) return TNSTATUS(TN_BAD_ARG_PTR);
+  if (arb->NLeases != 0) return TNSTATUS(TN_FSM_WRONG_STATE);
+
+  if (arb->Running) {
+    pthread_mutex_lock(&arb->Mutex);
+    arb->Stop = 1;
+    pthread_cond_signal(&arb->Cond);
+    pthread_mutex_unlock(&arb->Mutex);
+
+    pthread_join(arb->Thread, NULL);
+    arb->Running = 0;
+  }
+
+  free(arb->Cpus);
+  free(arb->CpuUsers);
+  pthread_mutex_destroy(&arb->Mutex);
+  pthread_cond_destroy(&arb->Cond);
+
+  return TN_OK;
+}
+
+static void ArbiterGlobalInit() {
+  GlobalArbiterOk = TnStatusOk(
+      ArbiterInit(&GlobalArbiter, 0, NULL, ARBITER_GLOBAL_INTERVAL));
+}
+
+Arbiter* ArbiterGlobal() {
+  pthread_once(&GlobalArbiterOnce, ArbiterGlobalInit);
+  return GlobalArbiterOk ? &GlobalArbiter : NULL;
+}
+
+/* Sets Target: one worker each, then the rest of the budget one by one
+ * to the member furthest below its weighted share that still wants more */
+static void ArbiterGrant(Arbiter* arb) {
+  assert(arb);
+  ArbiterLease* lease;
+
+  size_t left = arb->Budget > arb->NLeases ? arb->Budget - arb->NLeases : 0;
+
+  for (lease = arb->Leases; lease; lease = lease->Next) lease->Target = 1;
+
+  for (; left > 0; --left) {
+    ArbiterLease* best = NULL;
+
+    for (lease = arb->Leases; lease; lease = lease->Next) {
+      if (lease->Target >= lease->Wanted) continue;
+      if (!best || lease->Target * best->Weight < best->Target * lease->Weight)
+        best = lease;
+    }
+
+    if (!best) break;
+    best->Target++;
+  }
+}
+
+static int ArbiterLeastUsedCpu(Arbiter* arb) {
+  assert(arb);
+  int best = arb->Cpus[0];
+
+  for (size_t i = 1; i < arb->NCpus; ++i)
+    if (arb->CpuUsers[arb->Cpus[i]] < arb->CpuUsers[best]) best = arb->Cpus[i];
+
+  return best;
+}
+
+/* Cores kept stay where they are so that workers do not move needlessly */
+static void ArbiterPlace(Arbiter* arb, ArbiterLease* lease, size_t granted) {
+  assert(arb);
+  assert(lease);
+
+  while (lease->Granted > granted)
+    arb->CpuUsers[lease->Cores[--lease->Granted]]--;
+
+  while (lease->Granted < granted) {
+    int cpu = ArbiterLeastUsedCpu(arb);
+    arb->CpuUsers[cpu]++;
+    lease->Cores[lease->Granted++] = cpu;
+  }
+}
+
+static void ArbiterRebalanceLocked(Arbiter* arb) {
+  assert(arb);
+  ArbiterLease* lease;
+
+  for (lease = arb->Leases; lease; lease = lease->Next) {
+    size_t wanted = lease->Demand(lease->Args);
+    if (wanted < 1) wanted = 1;
+    if (wanted > lease->Max) wanted = lease->Max;
+    lease->Wanted = wanted;
+  }
+
+  ArbiterGrant(arb);
+
+  /* Shrink first, so that growing members get the cpus freed */
+  for (lease = arb->Leases; lease; lease = lease->Next)
+    if (lease->Target < lease->Granted) {
+      ArbiterPlace(arb, lease, lease->Target);
+      lease->Apply(lease->Args, lease->Granted, lease->Cores);
+    }
+
+  for (lease = arb->Leases; lease; lease = lease->Next)
+    if (lease->Target > lease->Granted) {
+      ArbiterPlace(arb, lease, lease->Target);
+      lease->Apply(lease->Args, lease->Granted, lease->Cores);
+    }
+}
+
+TnStatus ArbiterRebalance(Arbiter* arb) {
+  if (!arb) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  pthread_mutex_lock(&arb->Mutex);
+  ArbiterRebalanceLocked(arb);
+  pthread_mutex_unlock(&arb->Mutex);
+
+  return TN_OK;
+}
+
+TnStatus ArbiterJoin(Arbiter* arb, ArbiterLease* lease) {
+  if (!arb || !lease) return TNSTATUS(TN_BAD_ARG_PTR);
+  if (!lease->Demand || !lease->Apply) return TNSTATUS(TN_BAD_ARG_PTR);
+  if (lease->Weight == 0 || lease->Max == 0) return TNSTATUS(TN_BAD_ARG_VAL);
+
+  lease->Cores = (int*)malloc(lease->Max * sizeof(int));
+  if (!lease->Cores) return TNSTATUS(TN_BAD_ALLOC);
+
+  lease->Granted = 0;
+  lease->Next = NULL;
+
+  pthread_mutex_lock(&arb->Mutex);
+
+  ArbiterLease** tail = &arb->Leases;
+  while (*tail) tail = &(*tail)->Next;
+  *tail = lease;
+  arb->NLeases++;
+
+  ArbiterRebalanceLocked(arb);
+  pthread_mutex_unlock(&arb->Mutex);
+
+  return TN_OK;
+}
+
+TnStatus ArbiterLeave(Arbiter* arb, ArbiterLease* lease) {
+  if (!arb || !lease) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  pthread_mutex_lock(&arb->Mutex);
+
+  ArbiterLease** link = &arb->Leases;
+  while (*link && *link != lease) link = &(*link)->Next;
+
+  if (!*link) {
+    pthread_mutex_unlock(&arb->Mutex);
+    return TNSTATUS(TN_BAD_ARG_VAL);
+  }
+
+  *link = lease->Next;
+  arb->NLeases--;
+
+  ArbiterPlace(arb, lease, 0);
+  ArbiterRebalanceLocked(arb);
+  pthread_mutex_unlock(&arb->Mutex);
+
+  free(lease->Cores);
+  lease->Cores = NULL;
+
+  return TN_OK;
+}
+
+static void* ArbiterLoop(void* args) {
+  assert(args);
+  Arbiter* arb = (Arbiter*)args;
+  struct timespec deadline;
+
+  pthread_mutex_lock(&arb->Mutex);
+
+  while (!arb->Stop) {
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += arb->Interval / 1000000000ull;
+    deadline.tv_nsec += arb->Interval % 1000000000ull;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+
+    int res = 0;
+    while (res == 0 && !arb->Stop)
+      res = pthread_cond_timedwait(&arb->Cond, &arb->Mutex, &deadline);
+
+    if (!arb->Stop) ArbiterRebalanceLocked(arb);
+  }
+
+  pthread_mutex_unlock(&arb->Mutex);
+  return NULL;
+}
@@ -0,0 +1,294 @@
+#include "ThreadPool/Channel.h"
+
+TnStatus ChannelInit(Channel* ch, size_t elemSize, size_t capacity) {
+  if (!ch) return TNSTATUS(TN_BAD_ARG_PTR);
+  if (elemSize == 0 || capacity == 0) return TNSTATUS(TN_BAD_ARG_VAL);
+
+  ch->Buffer = (char*)malloc(elemSize * capacity);
+  if (!ch->Buffer) return TNSTATUS(TN_BAD_ALLOC);
+
+  int res = pthread_mutex_init(&ch->Mutex, NULL);
+  if (res != 0) {
+    errno = res;
+    free(ch->Buffer);
+    return TNSTATUS(TN_ERRNO);
+  }
+
+  res = pthread_cond_init(&ch->NotFull, NULL);
+  if (res != 0) {
+    errno = res;
+    free(ch->Buffer);
+    pthread_mutex_destroy(&ch->Mutex);
+    return TNSTATUS(TN_ERRNO);
+  }
+
+  res = pthread_cond_init(&ch->NotEmpty, NULL);
+  if (res != 0) {
+    errno = res;
+    free(ch->Buffer);
+    pthread_mutex_destroy(&ch->Mutex);
+    pthread_cond_destroy(&ch->NotFull);
+    return TNSTATUS(TN_ERRNO);
+  }
+
+  ch->ElemSize = elemSize;
+  ch->Capacity = capacity;
+  ch->Head = 0;
+  ch->Size = 0;
+  ch->Closed = 0;
+  ch->Senders.Head = ch->Senders.Tail = NULL;
+  ch->Receivers.Head = ch->Receivers.Tail = NULL;
+
+  return TN_OK;
+}
+
+TnStatus ChannelDestroy(Channel* ch) {
+  if (!ch) return TNSTATUS(TN_BAD_ARG_PTR);
+  if (ch->Senders.Head || ch->Receivers.Head)
+    return TNSTATUS(TN_FSM_WRONG_STATE);
+
+  free(ch->Buffer);
+  pthread_mutex_destroy(&ch->Mutex);
+  pthread_cond_destroy(&ch->NotFull);
+  pthread_cond_destroy(&ch->NotEmpty);
+
+  return TN_OK;
+}
+
+static void ChannelWaitersPush(ChannelWaiters* waiters, Fiber* fiber) {
+  assert(waiters);
+  assert(fiber);
+
+  fiber->Next = NULL;
+
+  if (waiters->Tail)
+    waiters->Tail->Next = fiber;
+  else
+    waiters->Head = fiber;
+
+  waiters->Tail = fiber;
+}
+
+static Fiber* ChannelWaitersPop(ChannelWaiters* waiters) {
+  assert(waiters);
+
+  Fiber* fiber = waiters->Head;
+  if (!fiber) return NULL;
+
+  waiters->Head = fiber->Next;
+  if (!waiters->Head) waiters->Tail = NULL;
+
+  return fiber;
+}
+
+/* Under the lock: lets one waiter of each kind retry. The returned fiber
+ * is scheduled once the lock is released. */
+static Fiber* ChannelWake(ChannelWaiters* waiters, pthread_cond_t* cond) {
+  assert(waiters);
+  assert(cond);
+
+  pthread_cond_signal(cond);
+  return ChannelWaitersPop(waiters);
+}
+
+static void ChannelSchedule(Fiber* fiber) {
+  if (!fiber) return;
+
+  TnStatus status = FiberSchedule(fiber);
+  assert(TnStatusOk(status));
+}
+
+static TnStatus ChannelPush(Channel* ch, const void* value) {
+  assert(ch);
+  assert(value);
+
+  if (ch->Size == ch->Capacity) return TNSTATUS(TN_OVERFLOW);
+
+  size_t tail = (ch->Head + ch->Size) % ch->Capacity;
+  memcpy(ch->Buffer + tail * ch->ElemSize, value, ch->ElemSize);
+  ch->Size++;
+
+  return TN_OK;
+}
+
+static TnStatus ChannelPop(Channel* ch, void* value) {
+  assert(ch);
+  assert(value);
+
+  if (ch->Size == 0) return TNSTATUS(TN_UNDERFLOW);
+
+  memcpy(value, ch->Buffer + ch->Head * ch->ElemSize, ch->ElemSize);
+  ch->Head = (ch->Head + 1) % ch->Capacity;
+  ch->Size--;
+
+  return TN_OK;
+}
+
+/* The hooks run after the fiber switched out and check again under the
+ * lock, the channel may have become ready in between */
+static void ChannelSendHook(Fiber* fiber, void* args) {
+  Channel* ch = (Channel*)args;
+
+  pthread_mutex_lock(&ch->Mutex);
+  if (!ch->Closed && ch->Size == ch->Capacity) {
+    ChannelWaitersPush(&ch->Senders, fiber);
+    fiber = NULL;
+  }
+  pthread_mutex_unlock(&ch->Mutex);
+
+  ChannelSchedule(fiber);
+}
+
+static void ChannelReceiveHook(Fiber* fiber, void* args) {
+  Channel* ch = (Channel*)args;
+
+  pthread_mutex_lock(&ch->Mutex);
+  if (!ch->Closed && ch->Size == 0) {
+    ChannelWaitersPush(&ch->Receivers, fiber);
+    fiber = NULL;
+  }
+  pthread_mutex_unlock(&ch->Mutex);
+
+  ChannelSchedule(fiber);
+}
+
+TnStatus ChannelSend(Channel* ch, const void* value) {
+  if (!ch || !value) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  TnStatus status;
+  Fiber* self;
+  Fiber* woken = NULL;
+
+  FiberCurrent(&self);
+  pthread_mutex_lock(&ch->Mutex);
+
+  while (1) {
+    if (ch->Closed) {
+      status = TNSTATUS(TN_FSM_WRONG_STATE);
+      break;
+    }
+
+    status = ChannelPush(ch, value);
+    if (TnStatusOk(status)) {
+      woken = ChannelWake(&ch->Receivers, &ch->NotEmpty);
+      break;
+    }
+
+    if (!self) {
+      pthread_cond_wait(&ch->NotFull, &ch->Mutex);
+      continue;
+    }
+
+    pthread_mutex_unlock(&ch->Mutex);
+    status = FiberPark(ChannelSendHook, ch);
+    assert(TnStatusOk(status));
+    pthread_mutex_lock(&ch->Mutex);
+  }
+
+  pthread_mutex_unlock(&ch->Mutex);
+  ChannelSchedule(woken);
+
+  return status;
+}
+
+TnStatus ChannelReceive(Channel* ch, void* value) {
+  if (!ch || !value) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  TnStatus status;
+  Fiber* self;
+  Fiber* woken = NULL;
+
+  FiberCurrent(&self);
+  pthread_mutex_lock(&ch->Mutex);
+
+  while (1) {
+    status = ChannelPop(ch, value);
+    if (TnStatusOk(status)) {
+      woken = ChannelWake(&ch->Senders, &ch->NotFull);
+      break;
+    }
+
+    if (ch->Closed) {
+      status = TNSTATUS(TN_FSM_WRONG_STATE);
+      break;
+    }
+
+    if (!self) {
+      pthread_cond_wait(&ch->NotEmpty, &ch->Mutex);
+      continue;
+    }
+
+    pthread_mutex_unlock(&ch->Mutex);
+    status = FiberPark(ChannelReceiveHook, ch);
+    assert(TnStatusOk(status));
+    pthread_mutex_lock(&ch->Mutex);
+  }
+
+  pthread_mutex_unlock(&ch->Mutex);
+  ChannelSchedule(woken);
+
+  return status;
+}
+
+TnStatus ChannelTrySend(Channel* ch, const void* value) {
+  if (!ch || !value) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  TnStatus status = TNSTATUS(TN_FSM_WRONG_STATE);
+  Fiber* woken = NULL;
+
+  pthread_mutex_lock(&ch->Mutex);
+
+  if (!ch->Closed) {
+    status = ChannelPush(ch, value);
+    if (TnStatusOk(status))
+      woken = ChannelWake(&ch->Receivers, &ch->NotEmpty);
+  }
+
+  pthread_mutex_unlock(&ch->Mutex);
+  ChannelSchedule(woken);
+
+  return status;
+}
+
+TnStatus ChannelTryReceive(Channel* ch, void* value) {
+  if (!ch || !value) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  TnStatus status;
+  Fiber* woken = NULL;
+
+  pthread_mutex_lock(&ch->Mutex);
+
+  status = ChannelPop(ch, value);
+  if (TnStatusOk(status))
+    woken = ChannelWake(&ch->Senders, &ch->NotFull);
+  else if (ch->Closed)
+    status = TNSTATUS(TN_FSM_WRONG_STATE);
+
+  pthread_mutex_unlock(&ch->Mutex);
+  ChannelSchedule(woken);
+
+  return status;
+}
+
+TnStatus ChannelClose(Channel* ch) {
+  if (!ch) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  pthread_mutex_lock(&ch->Mutex);
+
+  ch->Closed = 1;
+  ChannelWaiters senders = ch->Senders;
+  ChannelWaiters receivers = ch->Receivers;
+  ch->Senders.Head = ch->Senders.Tail = NULL;
+  ch->Receivers.Head = ch->Receivers.Tail = NULL;
+
+  pthread_cond_broadcast(&ch->NotFull);
+  pthread_cond_broadcast(&ch->NotEmpty);
+
+  pthread_mutex_unlock(&ch->Mutex);
+
+  Fiber* fiber;
+  while ((fiber = ChannelWaitersPop(&senders))) ChannelSchedule(fiber);
+  while ((fiber = ChannelWaitersPop(&receivers))) ChannelSchedule(fiber);
+
+  return TN_OK;
+}
@@ -0,0 +1,308 @@
+#include "ThreadPool/CompletionQueue.h"
+
+TnStatus CompletionQueueInit(CompletionQueue* cq, size_t capacity) {
+  if (!cq) return TNSTATUS(TN_BAD_ARG_PTR);
+  if (capacity == 0) return TNSTATUS(TN_BAD_ARG_VAL);
+
+  size_t size = 1;
+  while (size < capacity) size <<= 1;
+
+  cq->Cells = (CompletionCell*)malloc(size * sizeof(CompletionCell));
+  if (!cq->Cells) return TNSTATUS(TN_BAD_ALLOC);
+
+  cq->EventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (cq->EventFd < 0) {
+    free(cq->Cells);
+    return TNSTATUS(TN_ERRNO);
+  }
+
+  int res = pthread_mutex_init(&cq->OverflowMutex, NULL);
+  if (res != 0) {
+    errno = res;
+    close(cq->EventFd);
+    free(cq->Cells);
+    return TNSTATUS(TN_ERRNO);
+  }
+
+  for (size_t i = 0; i < size; ++i) cq->Cells[i].Sequence = i;
+
+  cq->Overflow = NULL;
+  cq->OverflowCapacity = 0;
+  cq->OverflowHead = 0;
+  cq->NOverflow = 0;
+  cq->NPromised = 0;
+
+  cq->Mask = size - 1;
+  cq->Head = 0;
+  cq->Tail = 0;
+  cq->Armed = 0;
+
+  return TN_OK;
+}
+
+TnStatus CompletionQueueDestroy(CompletionQueue* cq) {
+  if (!cq) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  close(cq->EventFd);
+  free(cq->Cells);
+  free(cq->Overflow);
+  pthread_mutex_destroy(&cq->OverflowMutex);
+
+  return TN_OK;
+}
+
+/* Producers */
+static TnStatus CompletionQueueRingPush(CompletionQueue* cq,
+                                        const Completion* value) {
+  assert(cq);
+  assert(value);
+
+  CompletionCell* cell;
+  size_t head = __atomic_load_n(&cq->Head, __ATOMIC_RELAXED);
+
+  while (1) {
+    cell = cq->Cells + (head & cq->Mask);
+    size_t seq = __atomic_load_n(&cell->Sequence, __ATOMIC_ACQUIRE);
+    intptr_t diff = (intptr_t)seq - (intptr_t)head;
+
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&cq->Head, &head, head + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if (diff < 0) {
+      return TNSTATUS(TN_OVERFLOW);
+    } else {
+      head = __atomic_load_n(&cq->Head, __ATOMIC_RELAXED);
+    }
+  }
+
+  cell->Value = *value;
+  __atomic_store_n(&cell->Sequence, head + 1, __ATOMIC_SEQ_CST);
+
+  return TN_OK;
+}
+
+/* A push only spills when every cell of the ring is held by a completion
+ * or pusher that NPromised still counts, with the pusher itself and the
+ * backlog on top of them. Reserve keeps NPromised within the ring and the
+ * backlog capacity, so there is room. */
+static void CompletionQueueOverflowPush(CompletionQueue* cq,
+                                        const Completion* value) {
+  assert(cq);
+  assert(value);
+
+  pthread_mutex_lock(&cq->OverflowMutex);
+
+  size_t capacity = cq->OverflowCapacity;
+  assert(cq->NOverflow < capacity);
+
+  cq->Overflow[(cq->OverflowHead + cq->NOverflow) & (capacity - 1)] = *value;
+  __atomic_store_n(&cq->NOverflow, cq->NOverflow + 1, __ATOMIC_SEQ_CST);
+
+  pthread_mutex_unlock(&cq->OverflowMutex);
+}
+
+/* Grows the backlog to hold the pushes promised so far beyond the ring.
+ * The capacity is a power of two, doubling it leaves room to unwrap the
+ * backlog behind the old end. */
+static TnStatus CompletionQueueGrow(CompletionQueue* cq) {
+  assert(cq);
+  TnStatus status = TN_OK;
+
+  pthread_mutex_lock(&cq->OverflowMutex);
+
+  size_t promised = __atomic_load_n(&cq->NPromised, __ATOMIC_SEQ_CST);
+  size_t ring = cq->Mask + 1;
+  size_t need = (promised > ring) ? promised - ring : 0;
+
+  size_t old = cq->OverflowCapacity;
+  size_t capacity = old ? old : 64;
+  while (capacity < need) capacity *= 2;
+
+  if (capacity != old) {
+    Completion* overflow =
+        (Completion*)realloc(cq->Overflow, capacity * sizeof(Completion));
+
+    if (overflow) {
+      size_t end = cq->OverflowHead + cq->NOverflow;
+      if (old != 0 && end > old)
+        memcpy(overflow + old, overflow, (end - old) * sizeof(Completion));
+
+      cq->Overflow = overflow;
+      __atomic_store_n(&cq->OverflowCapacity, capacity, __ATOMIC_SEQ_CST);
+    } else {
+      status = TNSTATUS(TN_BAD_ALLOC);
+    }
+  }
+
+  pthread_mutex_unlock(&cq->OverflowMutex);
+
+  return status;
+}
+
+/* Pairs with the store in Arm: either the consumer sees the completion or
+ * the producer sees it armed */
+static void CompletionQueueNotify(CompletionQueue* cq) {
+  assert(cq);
+
+  if (__atomic_load_n(&cq->Armed, __ATOMIC_SEQ_CST) &&
+      __atomic_exchange_n(&cq->Armed, 0, __ATOMIC_SEQ_CST)) {
+    uint64_t one = 1;
+    ssize_t res = write(cq->EventFd, &one, sizeof(one));
+    (void)res;  // Can only fail if the counter is saturated
+  }
+}
+
+TnStatus CompletionQueuePush(CompletionQueue* cq, const Completion* value) {
+  if (!cq || !value) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  TnStatus status = CompletionQueueReserve(cq);
+  if (!TnStatusOk(status)) return status;
+
+  return CompletionQueuePushReserved(cq, value);
+}
+
+/* Every reservation is counted before it checks the capacity, so those
+ * that pass never outnumber the ring and the backlog. The backlog itself
+ * is only touched when they would. */
+TnStatus CompletionQueueReserve(CompletionQueue* cq) {
+  if (!cq) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  size_t promised = __atomic_add_fetch(&cq->NPromised, 1, __ATOMIC_SEQ_CST);
+  if (promised <= cq->Mask + 1 +
+                      __atomic_load_n(&cq->OverflowCapacity, __ATOMIC_SEQ_CST))
+    return TN_OK;
+
+  TnStatus status = CompletionQueueGrow(cq);
+  if (!TnStatusOk(status))
+    __atomic_sub_fetch(&cq->NPromised, 1, __ATOMIC_SEQ_CST);
+
+  return status;
+}
+
+TnStatus CompletionQueueUnreserve(CompletionQueue* cq) {
+  if (!cq) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  __atomic_sub_fetch(&cq->NPromised, 1, __ATOMIC_SEQ_CST);
+
+  return TN_OK;
+}
+
+TnStatus CompletionQueuePushReserved(CompletionQueue* cq,
+                                     const Completion* value) {
+  if (!cq || !value) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  /* The reservation stays counted until the consumer takes the
+   * completion, in the ring or in the backlog */
+  if (!TnStatusOk(CompletionQueueRingPush(cq, value)))
+    CompletionQueueOverflowPush(cq, value);
+
+  CompletionQueueNotify(cq);
+
+  return TN_OK;
+}
+
+/* Consumer */
+static int CompletionQueueEmpty(CompletionQueue* cq) {
+  assert(cq);
+
+  CompletionCell* cell = cq->Cells + (cq->Tail & cq->Mask);
+  return __atomic_load_n(&cell->Sequence, __ATOMIC_SEQ_CST) != cq->Tail + 1 &&
+         __atomic_load_n(&cq->NOverflow, __ATOMIC_SEQ_CST) == 0;
+}
+
+static size_t CompletionQueueOverflowPop(CompletionQueue* cq,
+                                         Completion* values, size_t max) {
+  assert(cq);
+  assert(values);
+
+  if (max == 0 || __atomic_load_n(&cq->NOverflow, __ATOMIC_SEQ_CST) == 0)
+    return 0;
+
+  pthread_mutex_lock(&cq->OverflowMutex);
+
+  size_t n = (cq->NOverflow < max) ? cq->NOverflow : max;
+  size_t head = cq->OverflowHead;
+  size_t capacity = cq->OverflowCapacity;
+
+  /* Up to the end of the buffer, then from its start */
+  size_t first = (capacity - head < n) ? capacity - head : n;
+  memcpy(values, cq->Overflow + head, first * sizeof(Completion));
+  memcpy(values + first, cq->Overflow, (n - first) * sizeof(Completion));
+
+  cq->OverflowHead = (head + n) & (capacity - 1);
+  __atomic_store_n(&cq->NOverflow, cq->NOverflow - n, __ATOMIC_SEQ_CST);
+  __atomic_sub_fetch(&cq->NPromised, n, __ATOMIC_SEQ_CST);
+
+  pthread_mutex_unlock(&cq->OverflowMutex);
+
+  return n;
+}
+
+TnStatus CompletionQueuePoll(CompletionQueue* cq, Completion* values,
+                             size_t max, size_t* n) {
+  if (!cq || !values || !n) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  size_t taken = 0;
+
+  while (taken < max) {
+    CompletionCell* cell = cq->Cells + (cq->Tail & cq->Mask);
+    if (__atomic_load_n(&cell->Sequence, __ATOMIC_ACQUIRE) != cq->Tail + 1)
+      break;
+
+    values[taken++] = cell->Value;
+    __atomic_store_n(&cell->Sequence, cq->Tail + cq->Mask + 1,
+                     __ATOMIC_RELEASE);
+    cq->Tail++;
+  }
+
+  /* Only once the cells are free again, see OverflowPush */
+  if (taken != 0) __atomic_sub_fetch(&cq->NPromised, taken, __ATOMIC_SEQ_CST);
+
+  taken += CompletionQueueOverflowPop(cq, values + taken, max - taken);
+
+  *n = taken;
+  return TN_OK;
+}
+
+TnStatus CompletionQueueArm(CompletionQueue* cq, int* ready) {
+  if (!cq || !ready) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  uint64_t count;
+  ssize_t res = read(cq->EventFd, &count, sizeof(count));  // Rearm the fd
+  (void)res;
+
+  __atomic_store_n(&cq->Armed, 1, __ATOMIC_SEQ_CST);
+  *ready = !CompletionQueueEmpty(cq);
+
+  return TN_OK;
+}
+
+TnStatus CompletionQueueWait(CompletionQueue* cq, Completion* values,
+                             size_t max, size_t* n) {
+  if (!cq || !values || !n) return TNSTATUS(TN_BAD_ARG_PTR);
+  if (max == 0) return TNSTATUS(TN_BAD_ARG_VAL);
+
+  TnStatus status;
+  int ready;
+
+  while (1) {
+    status = CompletionQueuePoll(cq, values, max, n);
+    if (!TnStatusOk(status) || *n != 0) return status;
+
+    status = CompletionQueueArm(cq, &ready);
+    if (!TnStatusOk(status)) return status;
+    if (ready) continue;
+
+    struct pollfd pfd = {cq->EventFd, POLLIN, 0};
+    if (poll(&pfd, 1, -1) < 0 && errno != EINTR) return TNSTATUS(TN_ERRNO);
+  }
+}
+
+TnStatus CompletionQueueFd(const CompletionQueue* cq, int* fd) {
+  if (!cq || !fd) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  *fd = cq->EventFd;
+
+  return TN_OK;
+}
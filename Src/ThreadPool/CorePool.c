@@ -0,0 +1,283 @@
+#include "ThreadPool/CorePool.h"
+
+static __thread CorePoolCore* CurrentCore = NULL;
+
+TnStatus CorePoolInit(CorePool* cp, size_t nCores, size_t ringCapacity) {
+  if (!cp) return TNSTATUS(TN_BAD_ARG_PTR);
+  if (nCores == 0 || ringCapacity == 0) return TNSTATUS(TN_BAD_ARG_VAL);
+
+  TnStatus status = TN_OK;
+  size_t nRings = nCores * nCores;
+  cpu_set_t cpus;
+
+  /* Only the cpus the process may run on, its cpuset included */
+  if (sched_getaffinity(getpid(), sizeof(cpus), &cpus) != 0)
+    return TNSTATUS(TN_ERRNO);
+  if (CPU_COUNT(&cpus) == 0) return TNSTATUS(TN_BAD_ARG_VAL);
+
+  cp->Cores = (CorePoolCore*)calloc(nCores, sizeof(CorePoolCore));
+  cp->Rings = (SpscRing*)malloc(nRings * sizeof(SpscRing));
+
+  if (!cp->Cores || !cp->Rings) {
+    free(cp->Cores);
+    free(cp->Rings);
+    return TNSTATUS(TN_BAD_ALLOC);
+  }
+
+  size_t nInitRings = 0;
+  for (; nInitRings < nRings; ++nInitRings) {
+    status = SpscRingInit(cp->Rings + nInitRings, ringCapacity);
+    if (!TnStatusOk(status)) break;
+  }
+
+  size_t nInitCores = 0;
+  for (; TnStatusOk(status) && nInitCores < nCores; ++nInitCores) {
+    CorePoolCore* core = cp->Cores + nInitCores;
+
+    core->Dirty = (size_t*)malloc(nCores * sizeof(size_t));
+    if (!core->Dirty) {
+      status = TNSTATUS(TN_BAD_ALLOC);
+      break;
+    }
+
+    status = WorkerInboxInit(&core->External);
+    if (!TnStatusOk(status)) {
+      free(core->Dirty);
+      break;
+    }
+
+    core->Pool = cp;
+    core->ID = nInitCores;
+    core->Cpu = CorePoolPickCpu(&cpus, nInitCores);
+    core->NDirty = 0;
+    core->Doorbell = 0;
+    core->Sleeping = 0;
+  }
+
+  if (TnStatusOk(status)) {
+    cp->NCores = nCores;
+    cp->RingCapacity = ringCapacity;
+    cp->DoStop = 0;
+    return status;
+  }
+
+  while (nInitCores-- > 0) {
+    WorkerInboxDestroy(&cp->Cores[nInitCores].External);
+    free(cp->Cores[nInitCores].Dirty);
+  }
+
+  while (nInitRings-- > 0) SpscRingDestroy(cp->Rings + nInitRings);
+
+  free(cp->Cores);
+  free(cp->Rings);
+
+  return status;
+}
+
+TnStatus CorePoolDestroy(CorePool* cp) {
+  if (!cp) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  for (size_t i = 0; i < cp->NCores; ++i) {
+    WorkerInboxDestroy(&cp->Cores[i].External);
+    free(cp->Cores[i].Dirty);
+  }
+
+  for (size_t i = 0; i < cp->NCores * cp->NCores; ++i)
+    SpscRingDestroy(cp->Rings + i);
+
+  free(cp->Cores);
+  free(cp->Rings);
+
+  return TN_OK;
+}
+
+TnStatus CorePoolRun(CorePool* cp) {
+  if (!cp) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  __atomic_store_n(&cp->DoStop, 0, __ATOMIC_SEQ_CST);
+
+  size_t i = 0;
+  int res = 0;
+
+  for (; i < cp->NCores; ++i) {
+    res = pthread_create(&cp->Cores[i].Thread, NULL, CorePoolLoop,
+                         cp->Cores + i);
+    if (res != 0) break;
+  }
+
+  if (res == 0) return TN_OK;
+
+  __atomic_store_n(&cp->DoStop, 1, __ATOMIC_SEQ_CST);
+
+  while (i-- > 0) {
+    CorePoolRing(cp->Cores + i);
+    pthread_join(cp->Cores[i].Thread, NULL);
+  }
+
+  errno = res;
+  return TNSTATUS(TN_ERRNO);
+}
+
+/* Tasks still in the rings are dropped */
+TnStatus CorePoolStop(CorePool* cp) {
+  if (!cp) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  __atomic_store_n(&cp->DoStop, 1, __ATOMIC_SEQ_CST);
+
+  for (size_t i = 0; i < cp->NCores; ++i) {
+    CorePoolRing(cp->Cores + i);
+    pthread_join(cp->Cores[i].Thread, NULL);
+  }
+
+  return TN_OK;
+}
+
+TnStatus CorePoolPost(CorePool* cp, size_t core, WorkerTask task) {
+  if (!cp) return TNSTATUS(TN_BAD_ARG_PTR);
+  if (!task.Function || !task.Args || !task.Result)
+    return TNSTATUS(TN_BAD_ARG_PTR);
+  if (core >= cp->NCores) return TNSTATUS(TN_BAD_ARG_VAL);
+
+  TnStatus status;
+  CorePoolCore* self = CurrentCore;
+  CorePoolCore* target = cp->Cores + core;
+
+  if (!self || self->Pool != cp) {  // Foreign thread, no ring of its own
+    status = WorkerInboxPush(&target->External, &task, 1);
+    if (TnStatusOk(status)) CorePoolRing(target);
+    return status;
+  }
+
+  status = SpscRingPush(cp->Rings + self->ID * cp->NCores + core, &task);
+  if (!TnStatusOk(status)) return status;
+
+  /* The doorbell is rung once the current pass is over */
+  size_t i = 0;
+  while (i < self->NDirty && self->Dirty[i] != core) ++i;
+  if (i == self->NDirty) self->Dirty[self->NDirty++] = core;
+
+  return TN_OK;
+}
+
+TnStatus CorePoolSelf(const CorePool* cp, size_t* core) {
+  if (!cp || !core) return TNSTATUS(TN_BAD_ARG_PTR);
+  if (!CurrentCore || CurrentCore->Pool != cp)
+    return TNSTATUS(TN_FSM_WRONG_STATE);
+
+  *core = CurrentCore->ID;
+
+  return TN_OK;
+}
+
+static size_t CorePoolPoll(CorePoolCore* core) {
+  assert(core);
+
+  CorePool* cp = core->Pool;
+  WorkerTask task;
+  size_t nDone = 0;
+
+  for (size_t from = 0; from < cp->NCores; ++from) {
+    SpscRing* ring = cp->Rings + from * cp->NCores + core->ID;
+
+    for (size_t i = 0; i < CP_BATCH; ++i) {
+      if (!TnStatusOk(SpscRingPop(ring, &task))) break;
+      task.Function(task.Args, task.Result);
+      nDone++;
+    }
+  }
+
+  for (size_t i = 0; i < CP_BATCH; ++i) {
+    if (!TnStatusOk(WorkerInboxPop(&core->External, &task))) break;
+    task.Function(task.Args, task.Result);
+    nDone++;
+  }
+
+  return nDone;
+}
+
+static int CorePoolHasWork(CorePoolCore* core) {
+  assert(core);
+
+  CorePool* cp = core->Pool;
+  size_t pinned, preferred;
+  int empty;
+
+  for (size_t from = 0; from < cp->NCores; ++from) {
+    SpscRingEmpty(cp->Rings + from * cp->NCores + core->ID, &empty);
+    if (!empty) return 1;
+  }
+
+  WorkerInboxPeekSize(&core->External, &pinned, &preferred);
+
+  return pinned + preferred != 0;
+}
+
+/* Wakes the core if it is asleep */
+static void CorePoolRing(CorePoolCore* core) {
+  assert(core);
+
+  if (!__atomic_load_n(&core->Sleeping, __ATOMIC_SEQ_CST)) return;
+
+  __atomic_add_fetch(&core->Doorbell, 1, __ATOMIC_SEQ_CST);
+  FutexWake(&core->Doorbell, 1);
+}
+
+static void CorePoolFlush(CorePoolCore* core) {
+  assert(core);
+
+  for (size_t i = 0; i < core->NDirty; ++i)
+    CorePoolRing(core->Pool->Cores + core->Dirty[i]);
+
+  core->NDirty = 0;
+}
+
+static void CorePoolPark(CorePoolCore* core) {
+  assert(core);
+
+  uint32_t bell = __atomic_load_n(&core->Doorbell, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&core->Sleeping, 1, __ATOMIC_SEQ_CST);
+
+  /* Recheck after announcing, a sender either sees us asleep or we see
+   * its message */
+  if (!CorePoolHasWork(core) &&
+      !__atomic_load_n(&core->Pool->DoStop, __ATOMIC_SEQ_CST))
+    FutexWait(&core->Doorbell, bell);
+
+  __atomic_store_n(&core->Sleeping, 0, __ATOMIC_SEQ_CST);
+}
+
+/* The n-th allowed cpu, round robin */
+static int CorePoolPickCpu(const cpu_set_t* cpus, size_t n) {
+  assert(cpus);
+
+  n %= CPU_COUNT(cpus);
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+    if (CPU_ISSET(cpu, cpus) && n-- == 0) return cpu;
+
+  return 0;
+}
+
+static void* CorePoolLoop(void* args) {
+  assert(args);
+  CorePoolCore* core = (CorePoolCore*)args;
+
+  /* E.g. the cpuset shrank since init: the core still runs, unpinned */
+  cpu_set_t cpuSet;
+  CPU_ZERO(&cpuSet);
+  CPU_SET(core->Cpu, &cpuSet);
+  if (sched_setaffinity(0, sizeof(cpuSet), &cpuSet) != 0)
+    __atomic_store_n(&core->Cpu, -1, __ATOMIC_RELAXED);
+
+  CurrentCore = core;
+
+  while (!__atomic_load_n(&core->Pool->DoStop, __ATOMIC_SEQ_CST)) {
+    size_t nDone = CorePoolPoll(core);
+    CorePoolFlush(core);
+
+    if (nDone == 0) CorePoolPark(core);
+  }
+
+  CurrentCore = NULL;
+
+  return NULL;
+}
@@ -0,0 +1,179 @@
+#include "ThreadPool/CpuQuota.h"
+
+TnStatus CpuQuotaParseMax(const char* line, double* quota) {
+  if (!line || !quota) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  char* end;
+  double max, period = 100000;
+
+  if (strncmp(line, "max", 3) == 0) {
+    *quota = 0;
+    return TN_OK;
+  }
+
+  max = strtod(line, &end);
+  if (end == line || max <= 0) return TNSTATUS(TN_BAD_ARG_VAL);
+
+  if (*end == ' ') {
+    line = end + 1;
+    period = strtod(line, &end);
+    if (end == line || period <= 0) return TNSTATUS(TN_BAD_ARG_VAL);
+  }
+
+  *quota = max / period;
+  return TN_OK;
+}
+
+/* Whether the first line of the file was read */
+static int CpuQuotaReadLine(const char* path, char* buf, size_t size) {
+  assert(path);
+  assert(buf);
+
+  FILE* file = fopen(path, "r");
+  if (!file) return 0;
+
+  int ok = fgets(buf, size, file) != NULL;
+  fclose(file);
+
+  return ok;
+}
+
+/* Directory of the process's group in the hierarchy of the controller,
+ * "" for the v2 one */
+static void CpuQuotaGroupDir(const char* root, const char* controller,
+                             char* dir, size_t size) {
+  assert(root);
+  assert(controller);
+  assert(dir);
+
+  char line[4096];
+  char* save;
+
+  snprintf(dir, size, "%s%s%s", root, *controller ? "/" : "", controller);
+  size_t baseLen = strlen(dir);
+
+  FILE* file = fopen(CPU_QUOTA_PROC_CGROUP, "r");
+  if (!file) return;
+
+  /* hierarchy-ID:controller-list:path */
+  while (fgets(line, sizeof(line), file)) {
+    char* list = strchr(line, ':');
+    if (!list) continue;
+
+    char* path = strchr(++list, ':');
+    if (!path) continue;
+
+    *path++ = '\0';
+    path[strcspn(path, "\n")] = '\0';
+
+    int match = !*controller && !*list;
+    for (char* name = strtok_r(list, ",", &save); name && !match;
+         name = strtok_r(NULL, ",", &save))
+      match = strcmp(name, controller) == 0;
+
+    if (!match) continue;
+
+    /* Without a cgroup namespace the path is the host's one, and the
+     * container sees its own group at the root */
+    snprintf(dir + baseLen, size - baseLen, "%s", path);
+    if (access(dir, F_OK) != 0) dir[baseLen] = '\0';
+    break;
+  }
+
+  fclose(file);
+}
+
+static void CpuQuotaMin(double* quota, double value) {
+  assert(quota);
+  if (value > 0 && (*quota == 0 || value < *quota)) *quota = value;
+}
+
+static void CpuQuotaReadV2(const char* root, CpuQuota* quota,
+                           cpu_set_t* cpus) {
+  assert(root);
+  assert(quota);
+  assert(cpus);
+
+  char dir[4096], path[4200], line[256];
+  double value;
+
+  CpuQuotaGroupDir(root, "", dir, sizeof(dir));
+
+  snprintf(path, sizeof(path), "%s/cpuset.cpus.effective", dir);
+  TopologyReadCpuList(path, cpus);
+
+  /* The tightest quota on the way up to the root applies */
+  while (1) {
+    snprintf(path, sizeof(path), "%s/cpu.max", dir);
+    if (CpuQuotaReadLine(path, line, sizeof(line)) &&
+        TnStatusOk(CpuQuotaParseMax(line, &value)))
+      CpuQuotaMin(&quota->Quota, value);
+
+    char* parent = strrchr(dir, '/');
+    if (!parent || (size_t)(parent - dir) < strlen(root)) break;
+    *parent = '\0';
+  }
+}
+
+static void CpuQuotaReadV1(const char* root, CpuQuota* quota,
+                           cpu_set_t* cpus) {
+  assert(root);
+  assert(quota);
+  assert(cpus);
+
+  char dir[4096], path[4200], line[256];
+  long max = -1, period = 0;
+
+  CpuQuotaGroupDir(root, "cpu", dir, sizeof(dir));
+
+  snprintf(path, sizeof(path), "%s/cpu.cfs_quota_us", dir);
+  if (CpuQuotaReadLine(path, line, sizeof(line))) max = strtol(line, NULL, 10);
+
+  snprintf(path, sizeof(path), "%s/cpu.cfs_period_us", dir);
+  if (CpuQuotaReadLine(path, line, sizeof(line)))
+    period = strtol(line, NULL, 10);
+
+  if (max > 0 && period > 0) CpuQuotaMin(&quota->Quota, (double)max / period);
+
+  CpuQuotaGroupDir(root, "cpuset", dir, sizeof(dir));
+
+  snprintf(path, sizeof(path), "%s/cpuset.effective_cpus", dir);
+  if (TnStatusOk(TopologyReadCpuList(path, cpus))) return;
+
+  snprintf(path, sizeof(path), "%s/cpuset.cpus", dir);
+  TopologyReadCpuList(path, cpus);
+}
+
+TnStatus CpuQuotaRead(const char* root, CpuQuota* quota) {
+  if (!quota) return TNSTATUS(TN_BAD_ARG_PTR);
+  if (!root) root = CPU_QUOTA_CGROUP_ROOT;
+
+  char path[4096];
+  cpu_set_t affinity, cpus, both;
+
+  if (sched_getaffinity(getpid(), sizeof(affinity), &affinity) != 0)
+    return TNSTATUS(TN_ERRNO);
+
+  quota->Quota = 0;
+  cpus = affinity;
+
+  /* Only the v2 root lists its controllers */
+  snprintf(path, sizeof(path), "%s/cgroup.controllers", root);
+  if (access(path, F_OK) == 0)
+    CpuQuotaReadV2(root, quota, &cpus);
+  else
+    CpuQuotaReadV1(root, quota, &cpus);
+
+  CPU_AND(&both, &cpus, &affinity);
+  quota->NCpus = CPU_COUNT(&both);
+  if (quota->NCpus == 0) quota->NCpus = CPU_COUNT(&affinity);
+
+  /* Rounded down: a fractional CPU is better left unused than throttled */
+  quota->Limit = quota->NCpus;
+  if (quota->Quota > 0) {
+    size_t whole = quota->Quota < 1 ? 1 : (size_t)quota->Quota;
+    if (whole < quota->Limit) quota->Limit = whole;
+  }
+
+  return TN_OK;
+}
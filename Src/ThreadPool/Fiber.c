@@ -0,0 +1,445 @@
+#include "ThreadPool/Fiber.h"
+
+static __thread Fiber* CurrentFiber = NULL;
+
+static Fiber* FiberGetCurrent() { return CurrentFiber; }
+
+static void FiberSetCurrent(Fiber* fiber) { CurrentFiber = fiber; }
+
+TnStatus FiberPoolInit(FiberPool* pool, size_t stackSize, int guard) {
+  if (!pool) return TNSTATUS(TN_BAD_ARG_PTR);
+  if (stackSize < FIBER_MIN_STACK_SIZE) return TNSTATUS(TN_BAD_ARG_VAL);
+
+  size_t page = sysconf(_SC_PAGESIZE);
+
+  pool->StackSize = (stackSize + page - 1) / page * page;
+  pool->Guard = guard != 0;
+  pool->Free = NULL;
+  pool->NFree = 0;
+  pool->CacheLimit = FIBER_CACHE_SIZE;
+  pool->Slabs = NULL;
+  pool->NLive = 0;
+  pool->Limit = 0;
+  pool->NPut = 0;
+
+  int res = pthread_mutex_init(&pool->Mutex, NULL);
+  if (res != 0) {
+    errno = res;
+    return TNSTATUS(TN_ERRNO);
+  }
+
+  return TN_OK;
+}
+
+/* Fibers still suspended are not owned by the pool. Those with a mapping
+ * of their own leak, slab stacks go away with their slab. */
+TnStatus FiberPoolDestroy(FiberPool* pool) {
+  if (!pool) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  while (pool->Free) {
+    Fiber* fiber = pool->Free;
+    pool->Free = fiber->Next;
+    if (fiber->Map) FiberUnmap(fiber);
+  }
+
+  while (pool->Slabs) {
+    FiberSlab* slab = pool->Slabs;
+    pool->Slabs = slab->Next;
+    munmap(slab->Map, FIBER_SLAB_STACKS * pool->StackSize);
+    free(slab);
+  }
+
+  pthread_mutex_destroy(&pool->Mutex);
+
+  return TN_OK;
+}
+
+/* The stack grows down from the Fiber at its top */
+static Fiber* FiberAt(char* stack, size_t size) {
+  assert(stack);
+
+  Fiber* fiber = (Fiber*)(stack + ((size - sizeof(Fiber)) & ~(size_t)63));
+  fiber->Stack = stack;
+
+  return fiber;
+}
+
+static TnStatus FiberMap(FiberPool* pool, Fiber** fiber) {
+  assert(pool);
+  assert(fiber);
+
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t size = page + pool->StackSize;
+
+  char* map = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+  if (map == MAP_FAILED) return TNSTATUS(TN_ERRNO);
+
+  if (mprotect(map, page, PROT_NONE) != 0) {
+    munmap(map, size);
+    return TNSTATUS(TN_ERRNO);
+  }
+
+  Fiber* result = FiberAt(map + page, pool->StackSize);
+
+  result->Map = map;
+  result->MapSize = size;
+
+  *fiber = result;
+  return TN_OK;
+}
+
+/* Under the pool's mutex */
+static TnStatus FiberCarve(FiberPool* pool, Fiber** fiber) {
+  assert(pool);
+  assert(fiber);
+
+  FiberSlab* slab = pool->Slabs;
+
+  if (!slab || slab->NCarved == FIBER_SLAB_STACKS) {
+    slab = (FiberSlab*)malloc(sizeof(FiberSlab));
+    if (!slab) return TNSTATUS(TN_BAD_ALLOC);
+
+    slab->Map = (char*)mmap(NULL, FIBER_SLAB_STACKS * pool->StackSize,
+                            PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (slab->Map == MAP_FAILED) {
+      free(slab);
+      return TNSTATUS(TN_ERRNO);
+    }
+
+    slab->NCarved = 0;
+    slab->Next = pool->Slabs;
+    pool->Slabs = slab;
+  }
+
+  char* stack = slab->Map + slab->NCarved++ * pool->StackSize;
+  Fiber* result = FiberAt(stack, pool->StackSize);
+
+  result->Map = NULL;
+  result->MapSize = 0;
+
+  *fiber = result;
+  return TN_OK;
+}
+
+static void FiberUnmap(Fiber* fiber) {
+  assert(fiber);
+  munmap(fiber->Map, fiber->MapSize);
+}
+
+/* A fiber not kept for reuse: its mapping goes, or for a slab stack the
+ * pages under the Fiber */
+static void FiberRelease(FiberPool* pool, Fiber* fiber) {
+  assert(pool);
+  assert(fiber);
+
+  if (fiber->Map) {
+    FiberUnmap(fiber);
+    return;
+  }
+
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t size = ((char*)fiber - fiber->Stack) / page * page;
+  madvise(fiber->Stack, size, MADV_DONTNEED);
+}
+
+TnStatus FiberPoolGet(FiberPool* pool, const WorkerTask* task,
+                      Fiber** fiber) {
+  if (!pool || !task || !fiber) return TNSTATUS(TN_BAD_ARG_PTR);
+  TnStatus status = TN_OK;
+  Fiber* result = NULL;
+
+  pthread_mutex_lock(&pool->Mutex);
+
+  if (pool->Limit != 0 && pool->NLive >= pool->Limit) {
+    pthread_mutex_unlock(&pool->Mutex);
+    return TNSTATUS(TN_OVERFLOW);
+  }
+
+  result = pool->Free;
+  if (result) {
+    pool->Free = result->Next;
+    pool->NFree--;
+  } else if (!pool->Guard) {
+    status = FiberCarve(pool, &result);
+  }
+
+  if (TnStatusOk(status)) pool->NLive++;
+  pthread_mutex_unlock(&pool->Mutex);
+
+  if (!TnStatusOk(status)) return status;
+
+  /* Mapped outside the lock, that is a few syscalls */
+  if (!result) {
+    status = FiberMap(pool, &result);
+    if (!TnStatusOk(status)) {
+      pthread_mutex_lock(&pool->Mutex);
+      pool->NLive--;
+      pthread_mutex_unlock(&pool->Mutex);
+      return status;
+    }
+  }
+
+  if (getcontext(&result->Context) != 0) {
+    FiberPoolPut(pool, result);
+    return TNSTATUS(TN_ERRNO);
+  }
+
+  result->Context.uc_stack.ss_sp = result->Stack;
+  result->Context.uc_stack.ss_size = (char*)result - result->Stack;
+  result->Context.uc_link = NULL;
+  makecontext(&result->Context, FiberEntry, 0);
+
+  result->Return = NULL;
+  result->Task = *task;
+  result->Finished = 0;
+  result->Schedule = NULL;
+  result->ScheduleArgs = NULL;
+  result->OnPark = NULL;
+  result->OnParkArgs = NULL;
+  result->Next = NULL;
+
+  *fiber = result;
+  return TN_OK;
+}
+
+TnStatus FiberPoolPut(FiberPool* pool, Fiber* fiber) {
+  if (!pool || !fiber) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  pthread_mutex_lock(&pool->Mutex);
+  pool->NLive--;
+  int keep = pool->NFree < pool->CacheLimit;
+  pthread_mutex_unlock(&pool->Mutex);
+
+  /* Released before it is free, a slab stack can be taken right after */
+  if (!keep) FiberRelease(pool, fiber);
+
+  if (keep || !fiber->Map) {
+    pthread_mutex_lock(&pool->Mutex);
+    fiber->Next = pool->Free;
+    pool->Free = fiber;
+    pool->NFree++;
+    pthread_mutex_unlock(&pool->Mutex);
+  }
+
+  __atomic_add_fetch(&pool->NPut, 1, __ATOMIC_SEQ_CST);
+
+  return TN_OK;
+}
+
+TnStatus FiberPoolReserve(FiberPool* pool, size_t nFibers) {
+  if (!pool) return TNSTATUS(TN_BAD_ARG_PTR);
+  TnStatus status = TN_OK;
+  Fiber* fiber;
+
+  pthread_mutex_lock(&pool->Mutex);
+
+  if (nFibers > pool->CacheLimit) pool->CacheLimit = nFibers;
+
+  while (pool->NFree < nFibers) {
+    if (pool->Guard)
+      status = FiberMap(pool, &fiber);
+    else
+      status = FiberCarve(pool, &fiber);
+    if (!TnStatusOk(status)) break;
+
+    fiber->Next = pool->Free;
+    pool->Free = fiber;
+    pool->NFree++;
+  }
+
+  pthread_mutex_unlock(&pool->Mutex);
+
+  return status;
+}
+
+TnStatus FiberPoolSetLimit(FiberPool* pool, size_t nFibers) {
+  if (!pool) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  pthread_mutex_lock(&pool->Mutex);
+  pool->Limit = nFibers;
+  pthread_mutex_unlock(&pool->Mutex);
+
+  return TN_OK;
+}
+
+static void FiberEntry() {
+  Fiber* fiber = FiberGetCurrent();
+  assert(fiber);
+
+  fiber->Task.Function(fiber->Task.Args, fiber->Task.Result);
+  fiber->Finished = 1;
+
+  /* The task may have moved to another thread while parked */
+  setcontext(fiber->Return);
+}
+
+TnStatus FiberSwitchIn(Fiber* fiber, int* finished) {
+  if (!fiber || !finished) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  ucontext_t here;
+  Fiber* prev = FiberGetCurrent();
+
+  fiber->Return = &here;
+  FiberSetCurrent(fiber);
+
+  if (swapcontext(&here, &fiber->Context) != 0) {
+    FiberSetCurrent(prev);
+    return TNSTATUS(TN_ERRNO);
+  }
+
+  FiberSetCurrent(prev);
+  *finished = fiber->Finished;
+
+  /* The fiber is fully switched out now, whoever resumes it may run it */
+  if (!*finished && fiber->OnPark) {
+    FiberHookT onPark = fiber->OnPark;
+    fiber->OnPark = NULL;
+    onPark(fiber, fiber->OnParkArgs);
+  }
+
+  return TN_OK;
+}
+
+TnStatus FiberPark(FiberHookT onPark, void* args) {
+  if (!onPark) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  Fiber* fiber = FiberGetCurrent();
+  if (!fiber) return TNSTATUS(TN_FSM_WRONG_STATE);
+
+  fiber->OnPark = onPark;
+  fiber->OnParkArgs = args;
+  TN_PROBE2(fiber_park, fiber, fiber->Task.ID);
+
+  if (swapcontext(&fiber->Context, fiber->Return) != 0)
+    return TNSTATUS(TN_ERRNO);
+
+  return TN_OK;
+}
+
+TnStatus FiberSchedule(Fiber* fiber) {
+  if (!fiber) return TNSTATUS(TN_BAD_ARG_PTR);
+  if (!fiber->Schedule) return TNSTATUS(TN_FSM_WRONG_STATE);
+
+  TN_PROBE2(fiber_wake, fiber, fiber->Task.ID);
+  fiber->Schedule(fiber, fiber->ScheduleArgs);
+
+  return TN_OK;
+}
+
+TnStatus FiberCurrent(Fiber** fiber) {
+  if (!fiber) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  *fiber = FiberGetCurrent();
+
+  return TN_OK;
+}
+
+static void FiberYieldHook(Fiber* fiber, void* args) {
+  TnStatus status = FiberSchedule(fiber);
+  assert(TnStatusOk(status));
+}
+
+TnStatus TnYield() {
+  if (!FiberGetCurrent()) {
+    sched_yield();
+    return TN_OK;
+  }
+
+  return FiberPark(FiberYieldHook, NULL);
+}
+
+TnStatus FiberEventInit(FiberEvent* event) {
+  if (!event) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  event->Set = 0;
+  event->Waiters = NULL;
+
+  int res = pthread_mutex_init(&event->Mutex, NULL);
+  if (res != 0) {
+    errno = res;
+    return TNSTATUS(TN_ERRNO);
+  }
+
+  res = pthread_cond_init(&event->Cond, NULL);
+  if (res != 0) {
+    errno = res;
+    pthread_mutex_destroy(&event->Mutex);
+    return TNSTATUS(TN_ERRNO);
+  }
+
+  return TN_OK;
+}
+
+TnStatus FiberEventDestroy(FiberEvent* event) {
+  if (!event) return TNSTATUS(TN_BAD_ARG_PTR);
+  if (event->Waiters) return TNSTATUS(TN_FSM_WRONG_STATE);
+
+  pthread_mutex_destroy(&event->Mutex);
+  pthread_cond_destroy(&event->Cond);
+
+  return TN_OK;
+}
+
+TnStatus FiberEventSet(FiberEvent* event) {
+  if (!event) return TNSTATUS(TN_BAD_ARG_PTR);
+  TnStatus status;
+
+  pthread_mutex_lock(&event->Mutex);
+  event->Set = 1;
+  Fiber* waiters = event->Waiters;
+  event->Waiters = NULL;
+  pthread_cond_broadcast(&event->Cond);
+  pthread_mutex_unlock(&event->Mutex);
+
+  while (waiters) {
+    Fiber* fiber = waiters;
+    waiters = fiber->Next;
+
+    status = FiberSchedule(fiber);
+    assert(TnStatusOk(status));
+  }
+
+  return TN_OK;
+}
+
+/* The event could be set between the check in FiberEventWait and the
+ * switch, so the hook checks again under the lock */
+static void FiberEventHook(Fiber* fiber, void* args) {
+  FiberEvent* event = (FiberEvent*)args;
+  TnStatus status;
+
+  pthread_mutex_lock(&event->Mutex);
+  if (!event->Set) {
+    fiber->Next = event->Waiters;
+    event->Waiters = fiber;
+    fiber = NULL;
+  }
+  pthread_mutex_unlock(&event->Mutex);
+
+  if (fiber) {
+    status = FiberSchedule(fiber);
+    assert(TnStatusOk(status));
+  }
+}
+
+TnStatus FiberEventWait(FiberEvent* event) {
+  if (!event) return TNSTATUS(TN_BAD_ARG_PTR);
+  int set;
+
+  if (!FiberGetCurrent()) {
+    pthread_mutex_lock(&event->Mutex);
+    while (!event->Set) pthread_cond_wait(&event->Cond, &event->Mutex);
+    pthread_mutex_unlock(&event->Mutex);
+    return TN_OK;
+  }
+
+  pthread_mutex_lock(&event->Mutex);
+  set = event->Set;
+  pthread_mutex_unlock(&event->Mutex);
+
+  if (set) return TN_OK;
+
+  return FiberPark(FiberEventHook, event);
+}
@@ -0,0 +1,19 @@
+#include "ThreadPool/Futex.h"
+
+TnStatus FutexWait(uint32_t* addr, uint32_t value) {
+  assert(addr);
+
+  long res = syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+  if (res != 0 && errno != EAGAIN && errno != EINTR) return TNSTATUS(TN_ERRNO);
+
+  return TN_OK;
+}
+
+TnStatus FutexWake(uint32_t* addr, int count) {
+  assert(addr);
+
+  long res = syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+  if (res < 0) return TNSTATUS(TN_ERRNO);
+
+  return TN_OK;
+}
@@ -0,0 +1,144 @@
+#include "ThreadPool/Histogram.h"
+
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define HISTOGRAM_HAS_TSC 1
+#else
+#define HISTOGRAM_HAS_TSC 0
+#endif
+
+/* ns per tick in 32.32 fixed point, 0 when reading the raw clock */
+static uint64_t TickScale = 0;
+static pthread_once_t CalibrateOnce = PTHREAD_ONCE_INIT;
+
+TnStatus HistogramInit(Histogram* hist) {
+  if (!hist) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  memset(hist, 0, sizeof(Histogram));
+
+  return TN_OK;
+}
+
+static size_t HistogramBucket(uint64_t value) {
+  if (value < 2 * HISTOGRAM_SUB_BUCKETS) return value;
+  if (value >> HISTOGRAM_MAX_BITS) return HISTOGRAM_BUCKETS - 1;
+
+  size_t shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+  return shift * HISTOGRAM_SUB_BUCKETS + (value >> shift);
+}
+
+static uint64_t HistogramBucketTop(size_t bucket) {
+  if (bucket < 2 * HISTOGRAM_SUB_BUCKETS) return bucket;
+
+  size_t shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+  uint64_t sub = bucket % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS;
+
+  return ((sub + 1) << shift) - 1;
+}
+
+void HistogramRecord(Histogram* hist, uint64_t value) {
+  uint64_t* count = &hist->Counts[HistogramBucket(value)];
+
+  /* Plain increments, only the readers need atomicity */
+  __atomic_store_n(count, __atomic_load_n(count, __ATOMIC_RELAXED) + 1,
+                   __ATOMIC_RELAXED);
+
+  if (value > __atomic_load_n(&hist->Max, __ATOMIC_RELAXED))
+    __atomic_store_n(&hist->Max, value, __ATOMIC_RELAXED);
+}
+
+TnStatus HistogramMerge(Histogram* dst, const Histogram* src) {
+  if (!dst || !src) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i)
+    dst->Counts[i] += __atomic_load_n(&src->Counts[i], __ATOMIC_RELAXED);
+
+  uint64_t max = __atomic_load_n(&src->Max, __ATOMIC_RELAXED);
+  if (max > dst->Max) dst->Max = max;
+
+  return TN_OK;
+}
+
+TnStatus HistogramCount(const Histogram* hist, uint64_t* count) {
+  if (!hist || !count) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  *count = 0;
+  for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i)
+    *count += __atomic_load_n(&hist->Counts[i], __ATOMIC_RELAXED);
+
+  return TN_OK;
+}
+
+TnStatus HistogramPercentile(const Histogram* hist, double percentile,
+                             uint64_t* value) {
+  if (!hist || !value) return TNSTATUS(TN_BAD_ARG_PTR);
+  if (percentile < 0 || percentile > 100) return TNSTATUS(TN_BAD_ARG_VAL);
+
+  uint64_t total;
+  HistogramCount(hist, &total);
+
+  *value = 0;
+  if (total == 0) return TN_OK;
+
+  uint64_t rank = (uint64_t)(percentile / 100 * total + 0.5);
+  if (rank == 0) rank = 1;
+
+  uint64_t max = __atomic_load_n(&hist->Max, __ATOMIC_RELAXED);
+  uint64_t seen = 0;
+
+  for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+    seen += __atomic_load_n(&hist->Counts[i], __ATOMIC_RELAXED);
+    if (seen < rank) continue;
+
+    *value = HistogramBucketTop(i);
+    break;
+  }
+
+  if (*value > max || seen < rank) *value = max;
+
+  return TN_OK;
+}
+
+static uint64_t HistogramRawNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Counts TSC ticks over a millisecond of the raw clock. A TSC that stops
+ * or drifts between cores is not used. */
+static void HistogramCalibrate() {
+#if HISTOGRAM_HAS_TSC
+  unsigned a, b, c, d;
+  if (!__get_cpuid(0x80000007, &a, &b, &c, &d) || !(d & (1u << 8))) return;
+
+  uint64_t start = HistogramRawNs();
+  uint64_t startTicks = __rdtsc();
+  uint64_t now;
+
+  while ((now = HistogramRawNs()) - start < 1000000) {}
+  uint64_t ticks = __rdtsc() - startTicks;
+
+  if (ticks != 0) TickScale = ((now - start) << 32) / ticks;
+#endif
+}
+
+uint64_t HistogramNow() {
+  pthread_once(&CalibrateOnce, HistogramCalibrate);
+
+#if HISTOGRAM_HAS_TSC
+  if (TickScale) return __rdtsc();
+#endif
+
+  return HistogramRawNs();
+}
+
+uint64_t HistogramTicksToNs(uint64_t ticks) {
+  pthread_once(&CalibrateOnce, HistogramCalibrate);
+
+  if (!TickScale) return ticks;
+  return (uint64_t)(((unsigned __int128)ticks * TickScale) >> 32);
+}
@@ -0,0 +1,492 @@
+#include "ThreadPool/Parallel.h"
+
+static size_t ParallelGrain(size_t size) {
+  size_t grain = PARALLEL_BLOCK_SIZE / size;
+  return grain ? grain : 1;
+}
+
+/* Claims chunks until none are left */
+static void ParallelLoopRun(void* args, void* result) {
+  assert(args);
+  ParallelLoop* loop = (ParallelLoop*)args;
+
+  while (1) {
+    size_t begin =
+        __atomic_fetch_add(&loop->Next, loop->Grain, __ATOMIC_RELAXED);
+    if (begin >= loop->N) return;
+
+    size_t end = (loop->N - begin < loop->Grain) ? loop->N
+                                                 : begin + loop->Grain;
+    loop->Body(begin, end, loop->Args);
+  }
+}
+
+TnStatus ParallelFor(ThreadPool* tp, size_t n, size_t grain,
+                     ParallelBodyT body, void* args) {
+  if (!tp || !body) return TNSTATUS(TN_BAD_ARG_PTR);
+  if (n == 0) return TN_OK;
+  if (grain == 0) grain = 1;
+
+  TnStatus status = TN_OK;
+  size_t nChunks = (n + grain - 1) / grain;
+  size_t nTasks = (nChunks - 1 < tp->Workers.Size) ? nChunks - 1
+                                                    : tp->Workers.Size;
+
+  ParallelLoop loop = {body, args, n, grain, 0};
+
+  TaskGroup group;
+  TaskGroupInit(&group);
+
+  WorkerTask task;
+  task.Function = ParallelLoopRun;
+  task.Args = &loop;
+  task.Result = &loop;
+
+  for (size_t i = 0; i < nTasks && TnStatusOk(status); ++i)
+    status = ThreadPoolAddGroupTask(tp, &group, task);
+
+  ParallelLoopRun(&loop, NULL);  // Whatever the tasks have not taken yet
+
+  TnStatus waitStatus = ThreadPoolWaitGroup(tp, &group);
+  TaskGroupDestroy(&group);
+
+  return TnStatusOk(status) ? waitStatus : status;
+}
+
+/* Sort */
+
+typedef struct {
+  char* Base;
+  size_t N;
+  size_t Size;
+  size_t RunLen;
+  ParallelCompareT Cmp;
+  void* Ctx;
+} ParallelSortRuns;
+
+static void ParallelSortRun(size_t begin, size_t end, void* args) {
+  ParallelSortRuns* runs = (ParallelSortRuns*)args;
+
+  for (size_t run = begin; run < end; ++run) {
+    size_t start = run * runs->RunLen;
+    size_t len = runs->N - start;
+    if (len > runs->RunLen) len = runs->RunLen;
+
+    qsort_r(runs->Base + start * runs->Size, len, runs->Size, runs->Cmp,
+            runs->Ctx);
+  }
+}
+
+typedef struct {
+  const char* Src;
+  char* Dst;
+  size_t N;
+  size_t Size;
+  size_t Width; /* Of the runs being merged */
+  ParallelCompareT Cmp;
+  void* Ctx;
+} ParallelMergeRound;
+
+/* Number of elements of a among the first k of merge(a, b), with ties
+ * taken from a first */
+static size_t ParallelCoRank(const char* a, size_t na, const char* b,
+                             size_t nb, size_t k, size_t size,
+                             ParallelCompareT cmp, void* ctx) {
+  size_t lo = (k > nb) ? k - nb : 0;
+  size_t hi = (k < na) ? k : na;
+
+  while (lo < hi) {
+    size_t i = lo + (hi - lo) / 2;
+    size_t j = k - i;
+
+    if (j > 0 && cmp(b + (j - 1) * size, a + i * size, ctx) >= 0)
+      lo = i + 1;
+    else
+      hi = i;
+  }
+
+  return lo;
+}
+
+/* Writes output positions [begin, end) of the round, which may span
+ * several pairs of runs */
+static void ParallelMergeBlock(size_t begin, size_t end, void* args) {
+  ParallelMergeRound* round = (ParallelMergeRound*)args;
+  size_t size = round->Size;
+  size_t width = round->Width;
+
+  while (begin < end) {
+    size_t pairStart = begin / (2 * width) * (2 * width);
+    size_t mid =
+        (round->N - pairStart < width) ? round->N : pairStart + width;
+    size_t pairEnd =
+        (round->N - pairStart < 2 * width) ? round->N : pairStart + 2 * width;
+    size_t blockEnd = (end < pairEnd) ? end : pairEnd;
+
+    const char* a = round->Src + pairStart * size;
+    const char* b = round->Src + mid * size;
+    size_t na = mid - pairStart;
+    size_t nb = pairEnd - mid;
+
+    size_t k0 = begin - pairStart;
+    size_t k1 = blockEnd - pairStart;
+    size_t i =
+        ParallelCoRank(a, na, b, nb, k0, size, round->Cmp, round->Ctx);
+    size_t iEnd =
+        ParallelCoRank(a, na, b, nb, k1, size, round->Cmp, round->Ctx);
+    size_t j = k0 - i;
+    size_t jEnd = k1 - iEnd;
+
+    char* out = round->Dst + begin * size;
+
+    while (i < iEnd && j < jEnd) {
+      if (round->Cmp(b + j * size, a + i * size, round->Ctx) < 0)
+        memcpy(out, b + size * j++, size);
+      else
+        memcpy(out, a + size * i++, size);
+      out += size;
+    }
+
+    memcpy(out, a + i * size, (iEnd - i) * size);
+    out += (iEnd - i) * size;
+    memcpy(out, b + j * size, (jEnd - j) * size);
+
+    begin = blockEnd;
+  }
+}
+
+typedef struct {
+  const char* Src;
+  char* Dst;
+  size_t Size;
+} ParallelCopy;
+
+static void ParallelCopyBlock(size_t begin, size_t end, void* args) {
+  ParallelCopy* copy = (ParallelCopy*)args;
+  size_t size = copy->Size;
+
+  memcpy(copy->Dst + begin * size, copy->Src + begin * size,
+         (end - begin) * size);
+}
+
+TnStatus ParallelSort(ThreadPool* tp, void* base, size_t n, size_t size,
+                      ParallelCompareT cmp, void* ctx) {
+  if (!tp || !base || !cmp) return TNSTATUS(TN_BAD_ARG_PTR);
+  if (size == 0) return TNSTATUS(TN_BAD_ARG_VAL);
+
+  if (n < PARALLEL_SORT_CUTOFF) {
+    qsort_r(base, n, size, cmp, ctx);
+    return TN_OK;
+  }
+
+  TnStatus status;
+  size_t grain = ParallelGrain(size);
+  size_t nRuns = (n + grain - 1) / grain;
+
+  ParallelSortRuns runs = {(char*)base, n, size, grain, cmp, ctx};
+  status = ParallelFor(tp, nRuns, 1, ParallelSortRun, &runs);
+  if (!TnStatusOk(status)) return status;
+
+  char* tmp = (char*)malloc(n * size);
+  if (!tmp) return TNSTATUS(TN_BAD_ALLOC);
+
+  ParallelMergeRound round = {(char*)base, tmp, n, size, grain, cmp, ctx};
+
+  for (; round.Width < n; round.Width *= 2) {
+    status = ParallelFor(tp, n, grain, ParallelMergeBlock, &round);
+    if (!TnStatusOk(status)) break;
+
+    char* src = round.Dst;
+    round.Dst = (char*)round.Src;
+    round.Src = src;
+  }
+
+  if (TnStatusOk(status) && round.Src != base) {
+    ParallelCopy copy = {round.Src, (char*)base, size};
+    status = ParallelFor(tp, n, grain, ParallelCopyBlock, &copy);
+  }
+
+  free(tmp);
+  return status;
+}
+
+/* Scan: every chunk is reduced, the chunk sums are scanned serially, and
+ * the chunks are scanned again starting from their prefix */
+
+typedef struct {
+  const char* In;
+  char* Out;
+  size_t Size;
+  size_t Grain;
+  char* Carry;   /* Per chunk: its sum, then the prefix before it */
+  char* Scratch; /* Per chunk */
+  int Inclusive;
+  int HasInit;
+  ParallelCombineT Op;
+  void* Ctx;
+} ParallelScanData;
+
+static void ParallelScanReduce(size_t begin, size_t end, void* args) {
+  ParallelScanData* data = (ParallelScanData*)args;
+  size_t size = data->Size;
+  char* acc = data->Carry + begin / data->Grain * size;
+
+  memcpy(acc, data->In + begin * size, size);
+  for (size_t i = begin + 1; i < end; ++i)
+    data->Op(acc, data->In + i * size, data->Ctx);
+}
+
+static void ParallelScanApply(size_t begin, size_t end, void* args) {
+  ParallelScanData* data = (ParallelScanData*)args;
+  size_t size = data->Size;
+  size_t chunk = begin / data->Grain;
+
+  char* acc = data->Carry + chunk * size;
+  char* next = data->Scratch + chunk * size;
+  size_t i = begin;
+
+  if (data->Inclusive) {
+    if (chunk == 0 && !data->HasInit) {
+      memcpy(acc, data->In + i * size, size);
+      memcpy(data->Out + i * size, acc, size);
+      i++;
+    }
+
+    for (; i < end; ++i) {
+      data->Op(acc, data->In + i * size, data->Ctx);
+      memcpy(data->Out + i * size, acc, size);
+    }
+    return;
+  }
+
+  for (; i < end; ++i) {  // Out may alias In, read it first
+    memcpy(next, acc, size);
+    data->Op(next, data->In + i * size, data->Ctx);
+    memcpy(data->Out + i * size, acc, size);
+
+    char* tmp = acc;
+    acc = next;
+    next = tmp;
+  }
+}
+
+static TnStatus ParallelScan(ThreadPool* tp, const void* in, void* out,
+                             size_t n, size_t size, const void* init,
+                             int inclusive, ParallelCombineT op, void* ctx) {
+  assert(tp);
+  if (n == 0) return TN_OK;
+
+  TnStatus status;
+  size_t grain = ParallelGrain(size);
+  size_t nChunks = (n + grain - 1) / grain;
+
+  char* buffers = (char*)malloc((2 * nChunks + 2) * size);
+  if (!buffers) return TNSTATUS(TN_BAD_ALLOC);
+
+  ParallelScanData data = {(const char*)in,
+                           (char*)out,
+                           size,
+                           grain,
+                           buffers,
+                           buffers + nChunks * size,
+                           inclusive,
+                           init != NULL,
+                           op,
+                           ctx};
+
+  status = ParallelFor(tp, n, grain, ParallelScanReduce, &data);
+  if (!TnStatusOk(status)) {
+    free(buffers);
+    return status;
+  }
+
+  char* running = buffers + 2 * nChunks * size;
+  char* sum = running + size;
+  size_t chunk = 0;
+
+  if (init) {
+    memcpy(running, init, size);
+  } else {
+    memcpy(running, data.Carry, size);
+    chunk = 1;
+  }
+
+  for (; chunk < nChunks; ++chunk) {
+    char* carry = data.Carry + chunk * size;
+
+    memcpy(sum, carry, size);
+    memcpy(carry, running, size);
+    op(running, sum, ctx);
+  }
+
+  status = ParallelFor(tp, n, grain, ParallelScanApply, &data);
+
+  free(buffers);
+  return status;
+}
+
+TnStatus ParallelInclusiveScan(ThreadPool* tp, const void* in, void* out,
+                               size_t n, size_t size, ParallelCombineT op,
+                               void* ctx) {
+  if (!tp || !in || !out || !op) return TNSTATUS(TN_BAD_ARG_PTR);
+  if (size == 0) return TNSTATUS(TN_BAD_ARG_VAL);
+
+  return ParallelScan(tp, in, out, n, size, NULL, 1, op, ctx);
+}
+
+TnStatus ParallelExclusiveScan(ThreadPool* tp, const void* in, void* out,
+                               size_t n, size_t size, const void* init,
+                               ParallelCombineT op, void* ctx) {
+  if (!tp || !in || !out || !init || !op) return TNSTATUS(TN_BAD_ARG_PTR);
+  if (size == 0) return TNSTATUS(TN_BAD_ARG_VAL);
+
+  return ParallelScan(tp, in, out, n, size, init, 0, op, ctx);
+}
+
+/* Partition and copy_if: matches are counted per chunk, the counts give
+ * every chunk its output offsets, then the chunks scatter. The predicate
+ * is called twice per element. */
+
+typedef struct {
+  const char* In;
+  char* Out;
+  size_t Size;
+  size_t Grain;
+  size_t* Counts; /* Per chunk: matches, then offset of the first one */
+  size_t* Rest;   /* Per chunk: offset of the first non-match */
+  ParallelPredicateT Pred;
+  void* Ctx;
+  int KeepRest;
+} ParallelSelectData;
+
+static void ParallelSelectCount(size_t begin, size_t end, void* args) {
+  ParallelSelectData* data = (ParallelSelectData*)args;
+  size_t count = 0;
+
+  for (size_t i = begin; i < end; ++i)
+    count += data->Pred(data->In + i * data->Size, data->Ctx) != 0;
+
+  data->Counts[begin / data->Grain] = count;
+}
+
+static void ParallelSelectScatter(size_t begin, size_t end, void* args) {
+  ParallelSelectData* data = (ParallelSelectData*)args;
+  size_t size = data->Size;
+  size_t chunk = begin / data->Grain;
+
+  char* match = data->Out + data->Counts[chunk] * size;
+  char* rest = data->KeepRest ? data->Out + data->Rest[chunk] * size : NULL;
+
+  for (size_t i = begin; i < end; ++i) {
+    const char* value = data->In + i * size;
+
+    if (data->Pred(value, data->Ctx)) {
+      memcpy(match, value, size);
+      match += size;
+    } else if (rest) {
+      memcpy(rest, value, size);
+      rest += size;
+    }
+  }
+}
+
+static TnStatus ParallelSelect(ThreadPool* tp, const void* in, void* out,
+                               size_t n, size_t size, ParallelPredicateT pred,
+                               void* ctx, int keepRest, size_t* nTrue) {
+  assert(tp);
+  assert(nTrue);
+
+  *nTrue = 0;
+  if (n == 0) return TN_OK;
+
+  TnStatus status;
+  size_t grain = ParallelGrain(size);
+  size_t nChunks = (n + grain - 1) / grain;
+
+  size_t* counts = (size_t*)malloc(2 * nChunks * sizeof(size_t));
+  if (!counts) return TNSTATUS(TN_BAD_ALLOC);
+
+  ParallelSelectData data = {(const char*)in,   (char*)out, size,
+                             grain,             counts,     counts + nChunks,
+                             pred,              ctx,        keepRest};
+
+  status = ParallelFor(tp, n, grain, ParallelSelectCount, &data);
+  if (!TnStatusOk(status)) {
+    free(counts);
+    return status;
+  }
+
+  size_t total = 0;
+  for (size_t chunk = 0; chunk < nChunks; ++chunk) {
+    size_t count = counts[chunk];
+    counts[chunk] = total;
+    total += count;
+  }
+
+  size_t rest = total;
+  for (size_t chunk = 0; chunk < nChunks; ++chunk) {
+    size_t chunkSize = (chunk == nChunks - 1) ? n - chunk * grain : grain;
+    size_t next = (chunk == nChunks - 1) ? total : counts[chunk + 1];
+
+    data.Rest[chunk] = rest;
+    rest += chunkSize - (next - counts[chunk]);
+  }
+
+  status = ParallelFor(tp, n, grain, ParallelSelectScatter, &data);
+  if (TnStatusOk(status)) *nTrue = total;
+
+  free(counts);
+  return status;
+}
+
+TnStatus ParallelStablePartition(ThreadPool* tp, const void* in, void* out,
+                                 size_t n, size_t size,
+                                 ParallelPredicateT pred, void* ctx,
+                                 size_t* nTrue) {
+  if (!tp || !in || !out || !pred || !nTrue) return TNSTATUS(TN_BAD_ARG_PTR);
+  if (size == 0 || in == out) return TNSTATUS(TN_BAD_ARG_VAL);
+
+  return ParallelSelect(tp, in, out, n, size, pred, ctx, 1, nTrue);
+}
+
+TnStatus ParallelCopyIf(ThreadPool* tp, const void* in, void* out, size_t n,
+                        size_t size, ParallelPredicateT pred, void* ctx,
+                        size_t* nOut) {
+  if (!tp || !in || !out || !pred || !nOut) return TNSTATUS(TN_BAD_ARG_PTR);
+  if (size == 0 || in == out) return TNSTATUS(TN_BAD_ARG_VAL);
+
+  return ParallelSelect(tp, in, out, n, size, pred, ctx, 0, nOut);
+}
+
+/* Transform */
+
+typedef struct {
+  const char* In;
+  char* Out;
+  size_t InSize;
+  size_t OutSize;
+  ParallelTransformT Foo;
+  void* Ctx;
+} ParallelTransformData;
+
+static void ParallelTransformBlock(size_t begin, size_t end, void* args) {
+  ParallelTransformData* data = (ParallelTransformData*)args;
+
+  for (size_t i = begin; i < end; ++i)
+    data->Foo(data->In + i * data->InSize, data->Out + i * data->OutSize,
+              data->Ctx);
+}
+
+TnStatus ParallelTransform(ThreadPool* tp, const void* in, void* out,
+                           size_t n, size_t inSize, size_t outSize,
+                           ParallelTransformT foo, void* ctx) {
+  if (!tp || !in || !out || !foo) return TNSTATUS(TN_BAD_ARG_PTR);
+  if (inSize == 0 || outSize == 0) return TNSTATUS(TN_BAD_ARG_VAL);
+
+  size_t larger = (inSize > outSize) ? inSize : outSize;
+  ParallelTransformData data = {(const char*)in, (char*)out, inSize,
+                                outSize,         foo,        ctx};
+
+  return ParallelFor(tp, n, ParallelGrain(larger), ParallelTransformBlock,
+                     &data);
+}
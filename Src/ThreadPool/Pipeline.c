@@ -0,0 +1,231 @@
+#include "ThreadPool/Pipeline.h"
+
+TnStatus PipelineInit(Pipeline* pl, ThreadPool* tp, size_t nTokens) {
+  if (!pl || !tp) return TNSTATUS(TN_BAD_ARG_PTR);
+  if (nTokens == 0) return TNSTATUS(TN_BAD_ARG_VAL);
+
+  pl->Tokens = (PipelineToken*)malloc(nTokens * sizeof(PipelineToken));
+  pl->FreeTokens = (PipelineToken**)malloc(nTokens * sizeof(PipelineToken*));
+
+  if (!pl->Tokens || !pl->FreeTokens) {
+    free(pl->Tokens);
+    free(pl->FreeTokens);
+    return TNSTATUS(TN_BAD_ALLOC);
+  }
+
+  int res = pthread_mutex_init(&pl->Mutex, NULL);
+  if (res != 0) {
+    errno = res;
+    free(pl->Tokens);
+    free(pl->FreeTokens);
+    return TNSTATUS(TN_ERRNO);
+  }
+
+  for (size_t i = 0; i < nTokens; ++i) pl->Tokens[i].Pipeline = pl;
+
+  pl->Pool = tp;
+  pl->NStages = 0;
+  pl->NTokens = nTokens;
+
+  TaskGroupInit(&pl->Group);
+
+  return TN_OK;
+}
+
+TnStatus PipelineDestroy(Pipeline* pl) {
+  if (!pl) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  TnStatus status = TaskGroupDestroy(&pl->Group);
+  if (!TnStatusOk(status)) return status;
+
+  for (size_t i = 0; i < pl->NStages; ++i) {
+    free(pl->Stages[i].Waiting);
+    pthread_mutex_destroy(&pl->Stages[i].Mutex);
+  }
+
+  free(pl->Tokens);
+  free(pl->FreeTokens);
+  pthread_mutex_destroy(&pl->Mutex);
+
+  return TN_OK;
+}
+
+TnStatus PipelineAddStage(Pipeline* pl, PipelineStageKind kind,
+                          PipelineStageFooT function, void* args) {
+  if (!pl || !function) return TNSTATUS(TN_BAD_ARG_PTR);
+  if (kind != PIPELINE_SERIAL && kind != PIPELINE_PARALLEL)
+    return TNSTATUS(TN_BAD_ARG_VAL);
+  if (pl->NStages == 0 && kind != PIPELINE_SERIAL)
+    return TNSTATUS(TN_BAD_ARG_VAL);  // The input is read in order
+  if (pl->NStages == PIPELINE_MAX_STAGES) return TNSTATUS(TN_OVERFLOW);
+
+  PipelineStage* stage = pl->Stages + pl->NStages;
+
+  stage->Kind = kind;
+  stage->Function = function;
+  stage->Args = args;
+  stage->Waiting = NULL;
+
+  if (kind == PIPELINE_SERIAL && pl->NStages != 0) {
+    stage->Waiting =
+        (PipelineToken**)calloc(pl->NTokens, sizeof(PipelineToken*));
+    if (!stage->Waiting) return TNSTATUS(TN_BAD_ALLOC);
+  }
+
+  int res = pthread_mutex_init(&stage->Mutex, NULL);
+  if (res != 0) {
+    errno = res;
+    free(stage->Waiting);
+    return TNSTATUS(TN_ERRNO);
+  }
+
+  pl->NStages++;
+
+  return TN_OK;
+}
+
+TnStatus PipelineRun(Pipeline* pl) {
+  if (!pl) return TNSTATUS(TN_BAD_ARG_PTR);
+  if (pl->NStages == 0) return TNSTATUS(TN_BAD_ARG_VAL);
+
+  for (size_t i = 0; i < pl->NStages; ++i) pl->Stages[i].NextSeq = 0;
+
+  for (size_t i = 0; i < pl->NTokens; ++i)
+    pl->FreeTokens[i] = pl->Tokens + i;
+
+  pl->NFree = pl->NTokens;
+  pl->Feeding = 0;
+  pl->Done = 0;
+  pl->NextSeq = 0;
+
+  PipelineFeed(pl);
+
+  return ThreadPoolWaitGroup(pl->Pool, &pl->Group);
+}
+
+static TnStatus PipelineSubmit(Pipeline* pl, PipelineToken* token) {
+  assert(pl);
+  assert(token);
+
+  WorkerTask task;
+  task.Function = PipelineTokenRun;
+  task.Args = token;
+  task.Result = token;
+
+  return ThreadPoolAddGroupTask(pl->Pool, &pl->Group, task);
+}
+
+/* Starts free tokens with new items for as long as there are any. Only
+ * one thread reads the input, the others leave their tokens to it. */
+static void PipelineFeed(Pipeline* pl) {
+  assert(pl);
+  PipelineStage* input = pl->Stages;
+  TnStatus status;
+
+  pthread_mutex_lock(&pl->Mutex);
+
+  if (pl->Feeding) {
+    pthread_mutex_unlock(&pl->Mutex);
+    return;
+  }
+
+  pl->Feeding = 1;
+
+  while (!pl->Done && pl->NFree > 0) {
+    PipelineToken* token = pl->FreeTokens[--pl->NFree];
+    pthread_mutex_unlock(&pl->Mutex);
+
+    void* item = input->Function(NULL, input->Args);
+
+    pthread_mutex_lock(&pl->Mutex);
+
+    if (!item) {
+      pl->Done = 1;
+      pl->FreeTokens[pl->NFree++] = token;
+      break;
+    }
+
+    token->Seq = pl->NextSeq++;
+    token->Stage = 1;
+    token->Item = item;
+
+    pthread_mutex_unlock(&pl->Mutex);
+    status = PipelineSubmit(pl, token);
+    assert(TnStatusOk(status));
+    pthread_mutex_lock(&pl->Mutex);
+  }
+
+  pl->Feeding = 0;
+  pthread_mutex_unlock(&pl->Mutex);
+}
+
+static void PipelineRelease(Pipeline* pl, PipelineToken* token) {
+  assert(pl);
+  assert(token);
+
+  pthread_mutex_lock(&pl->Mutex);
+  pl->FreeTokens[pl->NFree++] = token;
+  pthread_mutex_unlock(&pl->Mutex);
+}
+
+/* Whether it is the token's turn, otherwise parks it in the stage */
+static int PipelineEnter(PipelineStage* stage, PipelineToken* token) {
+  assert(stage);
+  assert(token);
+  int turn;
+
+  pthread_mutex_lock(&stage->Mutex);
+
+  turn = token->Seq == stage->NextSeq;
+  if (!turn) {
+    size_t slot = token->Seq % token->Pipeline->NTokens;
+    assert(!stage->Waiting[slot]);
+    stage->Waiting[slot] = token;
+  }
+
+  pthread_mutex_unlock(&stage->Mutex);
+
+  return turn;
+}
+
+/* Passes the turn on, resuming the next token if it is already parked */
+static void PipelineLeave(Pipeline* pl, PipelineStage* stage) {
+  assert(pl);
+  assert(stage);
+  TnStatus status;
+
+  pthread_mutex_lock(&stage->Mutex);
+
+  size_t slot = ++stage->NextSeq % pl->NTokens;
+  PipelineToken* next = stage->Waiting[slot];
+  stage->Waiting[slot] = NULL;
+  assert(!next || next->Seq == stage->NextSeq);
+
+  pthread_mutex_unlock(&stage->Mutex);
+
+  if (next) {
+    status = PipelineSubmit(pl, next);
+    assert(TnStatusOk(status));
+  }
+}
+
+/* Carries the token through as many stages as it can */
+static void PipelineTokenRun(void* args, void* result) {
+  assert(args);
+  PipelineToken* token = (PipelineToken*)args;
+  Pipeline* pl = token->Pipeline;
+
+  for (; token->Stage < pl->NStages; token->Stage++) {
+    PipelineStage* stage = pl->Stages + token->Stage;
+    int serial = stage->Kind == PIPELINE_SERIAL;
+
+    if (serial && !PipelineEnter(stage, token)) return;
+
+    token->Item = stage->Function(token->Item, stage->Args);
+
+    if (serial) PipelineLeave(pl, stage);
+  }
+
+  PipelineRelease(pl, token);
+  PipelineFeed(pl);
+}
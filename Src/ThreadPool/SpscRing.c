@@ -0,0 +1,73 @@
+#include "ThreadPool/SpscRing.h"
+
+TnStatus SpscRingInit(SpscRing* ring, size_t capacity) {
+  assert(ring);
+  if (capacity == 0) return TNSTATUS(TN_BAD_ARG_VAL);
+
+  size_t size = 1;
+  while (size < capacity) size <<= 1;
+
+  ring->Buffer = (WorkerTask*)malloc(size * sizeof(WorkerTask));
+  if (!ring->Buffer) return TNSTATUS(TN_BAD_ALLOC);
+
+  ring->Mask = size - 1;
+  ring->Head = 0;
+  ring->CachedTail = 0;
+  ring->Tail = 0;
+  ring->CachedHead = 0;
+
+  return TN_OK;
+}
+
+TnStatus SpscRingDestroy(SpscRing* ring) {
+  assert(ring);
+  free(ring->Buffer);
+
+  return TN_OK;
+}
+
+/* Producer */
+TnStatus SpscRingPush(SpscRing* ring, const WorkerTask* task) {
+  assert(ring);
+  assert(task);
+
+  size_t head = ring->Head;
+
+  if (head - ring->CachedTail > ring->Mask) {
+    ring->CachedTail = __atomic_load_n(&ring->Tail, __ATOMIC_ACQUIRE);
+    if (head - ring->CachedTail > ring->Mask) return TNSTATUS(TN_OVERFLOW);
+  }
+
+  ring->Buffer[head & ring->Mask] = *task;
+  __atomic_store_n(&ring->Head, head + 1, __ATOMIC_SEQ_CST);
+
+  return TN_OK;
+}
+
+/* Consumer */
+TnStatus SpscRingPop(SpscRing* ring, WorkerTask* task) {
+  assert(ring);
+  assert(task);
+
+  size_t tail = ring->Tail;
+
+  if (tail == ring->CachedHead) {
+    ring->CachedHead = __atomic_load_n(&ring->Head, __ATOMIC_ACQUIRE);
+    if (tail == ring->CachedHead) return TNSTATUS(TN_UNDERFLOW);
+  }
+
+  *task = ring->Buffer[tail & ring->Mask];
+  __atomic_store_n(&ring->Tail, tail + 1, __ATOMIC_RELEASE);
+
+  return TN_OK;
+}
+
+/* Consumer */
+TnStatus SpscRingEmpty(const SpscRing* ring, int* empty) {
+  assert(ring);
+  assert(empty);
+
+  *empty = __atomic_load_n(&ring->Head, __ATOMIC_SEQ_CST) == ring->Tail;
+
+  return TN_OK;
+}
@@ -5,14 +5,18 @@ TnStatus TQMonitorInit(TQMonitor* tqm) {
   TnStatus status;
   int res;
 
-  status = TaskQueueInit(&tqm->Tasks);
-  if (!TnStatusOk(status)) return status;
+  tqm->NSources = 0;
+  tqm->ActiveHead = TQ_NO_SOURCE;
+  tqm->ActiveTail = TQ_NO_SOURCE;
+  tqm->Size = 0;
+  tqm->NEmptyWaiters = 0;
+  tqm->NConsumers = 1;
+  tqm->Reserve = 0;
 
   res = pthread_mutex_init(&tqm->Mutex, NULL);
 
   if (res != 0) {
     errno = res;
-    TaskQueueDestroy(&tqm->Tasks);
     return TNSTATUS(TN_ERRNO);
   }
 
@@ -20,13 +24,26 @@ TnStatus TQMonitorInit(TQMonitor* tqm) {
 
   if (res != 0) {
     errno = res;
-    TaskQueueDestroy(&tqm->Tasks);
     pthread_mutex_destroy(&tqm->Mutex);
 
     return TNSTATUS(TN_ERRNO);
   }
 
+  LockProfileInit(&tqm->MutexProfile, "TQMonitor", 0);
+
+  TaskSourceID id;
+  status = TQMonitorAddSource(tqm, "default", 1, &id);
+
+  if (!TnStatusOk(status)) {
+    pthread_mutex_destroy(&tqm->Mutex);
+    pthread_cond_destroy(&tqm->CondEmpty);
+
+    return status;
+  }
+
+  assert(id == 0);
   tqm->HasError = 0;
+  tqm->StampTasks = 0;
 
   return TN_OK;
 }
@@ -34,7 +51,9 @@ TnStatus TQMonitorInit(TQMonitor* tqm) {
 TnStatus TQMonitorDestroy(TQMonitor* tqm) {
   assert(tqm);
 
-  TaskQueueDestroy(&tqm->Tasks);
+  for (size_t i = 0; i < tqm->NSources; ++i)
+    TaskQueueDestroy(&tqm->Sources[i].Tasks);
+
   pthread_mutex_destroy(&tqm->Mutex);
   pthread_cond_destroy(&tqm->CondEmpty);
 
@@ -43,52 +62,287 @@ TnStatus TQMonitorDestroy(TQMonitor* tqm) {
 
 static void TQMonitorLock(TQMonitor* tqm) {
   assert(tqm);
-  pthread_mutex_lock(&tqm->Mutex);
+  TN_MUTEX_LOCK(&tqm->Mutex, &tqm->MutexProfile);
 }
 
 static void TQMonitorUnlock(TQMonitor* tqm) {
   assert(tqm);
-  pthread_mutex_unlock(&tqm->Mutex);
+  TN_MUTEX_UNLOCK(&tqm->Mutex, &tqm->MutexProfile);
+}
+
+static uint64_t TQMonitorNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Appends a source that just got a task to the round robin */
+static void TQMonitorActivate(TQMonitor* tqm, TaskSourceID id) {
+  assert(tqm);
+
+  tqm->Sources[id].NextActive = TQ_NO_SOURCE;
+
+  if (tqm->ActiveTail == TQ_NO_SOURCE)
+    tqm->ActiveHead = id;
+  else
+    tqm->Sources[tqm->ActiveTail].NextActive = id;
+
+  tqm->ActiveTail = id;
+}
+
+static void TQMonitorRecordDelay(TaskSource* source, uint64_t delay) {
+  assert(source);
+  TaskSourceStats* stats = &source->Stats;
+
+  size_t bucket = delay ? 63 - __builtin_clzll(delay) : 0;
+
+  stats->TotalDelay += delay;
+  stats->DelayBuckets[bucket]++;
+  if (delay > stats->MaxDelay) stats->MaxDelay = delay;
+}
+
+TnStatus TQMonitorAddSource(TQMonitor* tqm, const char* name, size_t weight,
+                            TaskSourceID* id) {
+  if (!tqm || !name || !id) return TNSTATUS(TN_BAD_ARG_PTR);
+  if (weight == 0) return TNSTATUS(TN_BAD_ARG_VAL);
+
+  TaskQueue tasks;
+
+  TnStatus status = TQMonitorPrepareSource(tqm, &tasks);
+  if (!TnStatusOk(status)) return status;
+
+  status = TQMonitorCommitSource(tqm, name, weight, &tasks, id);
+  if (!TnStatusOk(status)) TaskQueueDestroy(&tasks);
+
+  return status;
+}
+
+TnStatus TQMonitorPrepareSource(TQMonitor* tqm, TaskQueue* tasks) {
+  if (!tqm || !tasks) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  TQMonitorLock(tqm);
+  size_t reserve = tqm->Reserve;
+  size_t nSources = tqm->NSources;
+  TQMonitorUnlock(tqm);
+
+  if (nSources == TQ_MAX_SOURCES) return TNSTATUS(TN_OVERFLOW);
+
+  TnStatus status = TaskQueueInit(tasks);
+  if (!TnStatusOk(status)) return status;
+
+  status = TaskQueueReserve(tasks, reserve);
+  if (!TnStatusOk(status)) TaskQueueDestroy(tasks);
+
+  return status;
+}
+
+TnStatus TQMonitorCommitSource(TQMonitor* tqm, const char* name,
+                               size_t weight, TaskQueue* tasks,
+                               TaskSourceID* id) {
+  if (!tqm || !name || !tasks || !id) return TNSTATUS(TN_BAD_ARG_PTR);
+  if (weight == 0) return TNSTATUS(TN_BAD_ARG_VAL);
+
+  TQMonitorLock(tqm);
+
+  if (tqm->NSources == TQ_MAX_SOURCES) {
+    TQMonitorUnlock(tqm);
+    return TNSTATUS(TN_OVERFLOW);
+  }
+
+  TaskSource* source = &tqm->Sources[tqm->NSources];
+
+  source->Tasks = *tasks;
+  strncpy(source->Name, name, TQ_SOURCE_NAME_SIZE - 1);
+  source->Name[TQ_SOURCE_NAME_SIZE - 1] = '\0';
+  source->Weight = weight;
+  source->Deficit = 0;
+  source->NextActive = TQ_NO_SOURCE;
+  memset(&source->Stats, 0, sizeof(TaskSourceStats));
+
+  *id = tqm->NSources;
+  __atomic_store_n(&tqm->NSources, *id + 1, __ATOMIC_RELAXED);
+
+  TQMonitorUnlock(tqm);
+
+  return TN_OK;
 }
 
 TnStatus TQMonitorAddTask(TQMonitor* tqm, const WorkerTask* task) {
+  return TQMonitorAddSourceTask(tqm, 0, task);
+}
+
+TnStatus TQMonitorAddSourceTask(TQMonitor* tqm, TaskSourceID id,
+                                const WorkerTask* task) {
   TnStatus status;
   assert(tqm);
   assert(task);
 
+  WorkerTask stamped = *task;
+
+  /* Delays only matter once there are sources to compare, or if the
+   * owner asked for them */
+  int stamp = tqm->StampTasks ||
+              __atomic_load_n(&tqm->NSources, __ATOMIC_RELAXED) > 1;
+  stamped.EnqueueTime = stamp ? TQMonitorNow() : 0;
+
   TQMonitorLock(tqm);
-  status = TaskQueuePush(&tqm->Tasks, task);
+
+  if (id >= tqm->NSources) {
+    TQMonitorUnlock(tqm);
+    return TNSTATUS(TN_BAD_ARG_VAL);
+  }
+
+  TaskSource* source = &tqm->Sources[id];
+  status = TaskQueuePush(&source->Tasks, &stamped);
+
+  if (TnStatusOk(status)) {
+    if (source->Tasks.Size == 1) TQMonitorActivate(tqm, id);
+    __atomic_store_n(&tqm->Size, tqm->Size + 1, __ATOMIC_SEQ_CST);
+    TN_PROBE4(tq_push, tqm, id, stamped.ID, tqm->Size);
+  }
+
   TQMonitorUnlock(tqm);
 
   return status;
 }
 
+/* Locked, Size != 0 */
+static void TQMonitorPop(TQMonitor* tqm, WorkerTask* task) {
+  assert(tqm);
+  assert(task);
+
+  TaskSourceID id = tqm->ActiveHead;
+  TaskSource* source = &tqm->Sources[id];
+
+  if (source->Deficit == 0) source->Deficit = source->Weight;
+
+  TnStatus status = TaskQueuePop(&source->Tasks, task);
+  assert(TnStatusOk(status));
+
+  source->Deficit--;
+  source->Stats.NTasks++;
+  __atomic_store_n(&tqm->Size, tqm->Size - 1, __ATOMIC_RELAXED);
+  TN_PROBE4(tq_pop, tqm, id, task->ID, tqm->Size);
+
+  if (task->EnqueueTime) {
+    uint64_t now = TQMonitorNow();
+    if (now > task->EnqueueTime)
+      TQMonitorRecordDelay(source, now - task->EnqueueTime);
+  }
+
+  if (source->Tasks.Size == 0 || source->Deficit == 0) {
+    tqm->ActiveHead = source->NextActive;
+    if (tqm->ActiveHead == TQ_NO_SOURCE) tqm->ActiveTail = TQ_NO_SOURCE;
+
+    if (source->Tasks.Size == 0)
+      source->Deficit = 0;
+    else  // Quantum used up, go to the back of the round
+      TQMonitorActivate(tqm, id);
+  }
+}
+
 TnStatus TQMonitorGetTask(TQMonitor* tqm, WorkerTask* task) {
-  TnStatus status;
   assert(tqm);
   assert(task);
 
   TQMonitorLock(tqm);
-  status = TaskQueuePop(&tqm->Tasks, task);
 
-  if (tqm->Tasks.Size == 0) pthread_cond_signal(&tqm->CondEmpty);
+  if (tqm->Size == 0) {
+    TQMonitorUnlock(tqm);
+    return TNSTATUS(TN_UNDERFLOW);
+  }
+
+  TQMonitorPop(tqm, task);
+
+  if (tqm->Size == 0 && tqm->NEmptyWaiters != 0)
+    pthread_cond_broadcast(&tqm->CondEmpty);
 
   TQMonitorUnlock(tqm);
 
-  return status;
+  return TN_OK;
+}
+
+TnStatus TQMonitorGetTasks(TQMonitor* tqm, WorkerTask* tasks, size_t max,
+                           size_t* n) {
+  if (!tqm || !tasks || !n) return TNSTATUS(TN_BAD_ARG_PTR);
+  if (max == 0) return TNSTATUS(TN_BAD_ARG_VAL);
+
+  TQMonitorLock(tqm);
+
+  if (tqm->Size == 0) {
+    TQMonitorUnlock(tqm);
+    *n = 0;
+    return TNSTATUS(TN_UNDERFLOW);
+  }
+
+  /* A fair share of what is queued, so one consumer does not sit on tasks
+   * the others could run */
+  size_t share = (tqm->Size + tqm->NConsumers - 1) / tqm->NConsumers;
+  if (share < max) max = share;
+
+  for (*n = 0; *n < max; ++*n) TQMonitorPop(tqm, tasks + *n);
+
+  if (tqm->Size == 0 && tqm->NEmptyWaiters != 0)
+    pthread_cond_broadcast(&tqm->CondEmpty);
+
+  TQMonitorUnlock(tqm);
+
+  return TN_OK;
+}
+
+TnStatus TQMonitorGetSourceStats(TQMonitor* tqm, TaskSourceID id,
+                                 TaskSourceStats* stats) {
+  if (!tqm || !stats) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  TQMonitorLock(tqm);
+
+  if (id >= tqm->NSources) {
+    TQMonitorUnlock(tqm);
+    return TNSTATUS(TN_BAD_ARG_VAL);
+  }
+
+  *stats = tqm->Sources[id].Stats;
+  stats->Pending = tqm->Sources[id].Tasks.Size;
+
+  TQMonitorUnlock(tqm);
+
+  return TN_OK;
 }
 
 TnStatus TQMonitorWaitEmpty(TQMonitor* tqm) {
   assert(tqm);
 
   TQMonitorLock(tqm);
-  while (!tqm->HasError && tqm->Tasks.Size != 0)
-    pthread_cond_wait(&tqm->CondEmpty, &tqm->Mutex);
+  tqm->NEmptyWaiters++;
+  while (!tqm->HasError && tqm->Size != 0)
+    TN_COND_WAIT(&tqm->CondEmpty, &tqm->Mutex, &tqm->MutexProfile);
+  tqm->NEmptyWaiters--;
+  TQMonitorUnlock(tqm);
+
+  return TN_OK;
+}
+
+TnStatus TQMonitorSize(TQMonitor* tqm, size_t* size) {
+  assert(tqm);
+  assert(size);
+
+  TQMonitorLock(tqm);
+  *size = tqm->Size;
   TQMonitorUnlock(tqm);
 
   return TN_OK;
 }
 
+/* Lock-free hint, may be stale by the time it returns */
+TnStatus TQMonitorPeekSize(const TQMonitor* tqm, size_t* size) {
+  assert(tqm);
+  assert(size);
+
+  *size = __atomic_load_n(&tqm->Size, __ATOMIC_SEQ_CST);
+
+  return TN_OK;
+}
+
 TnStatus TQMonitorSignalError(TQMonitor* tqm) {
   assert(tqm);
 
@@ -98,4 +352,19 @@ TnStatus TQMonitorSignalError(TQMonitor* tqm) {
   TQMonitorUnlock(tqm);
 
   return TN_OK;
-}
\ No newline at end of file
+}
+
+TnStatus TQMonitorReserve(TQMonitor* tqm, size_t nTasks) {
+  assert(tqm);
+  TnStatus status = TN_OK;
+
+  TQMonitorLock(tqm);
+
+  tqm->Reserve = nTasks;
+  for (size_t i = 0; i < tqm->NSources && TnStatusOk(status); ++i)
+    status = TaskQueueReserve(&tqm->Sources[i].Tasks, nTasks);
+
+  TQMonitorUnlock(tqm);
+
+  return status;
+}
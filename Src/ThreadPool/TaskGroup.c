@@ -0,0 +1,92 @@
+#include "ThreadPool/TaskGroup.h"
+
+#include "ThreadPool/Fiber.h"
+
+TnStatus TaskGroupInit(TaskGroup* group) {
+  if (!group) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  __atomic_store_n(&group->Pending, 0, __ATOMIC_SEQ_CST);
+  group->Waiters = NULL;
+
+  int res = pthread_mutex_init(&group->Mutex, NULL);
+  if (res != 0) {
+    errno = res;
+    return TNSTATUS(TN_ERRNO);
+  }
+
+  return TN_OK;
+}
+
+TnStatus TaskGroupDestroy(TaskGroup* group) {
+  if (!group) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  /* The last TaskGroupDone may still hold the mutex */
+  pthread_mutex_lock(&group->Mutex);
+  size_t pending = __atomic_load_n(&group->Pending, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&group->Mutex);
+
+  if (pending != 0) return TNSTATUS(TN_FSM_WRONG_STATE);
+
+  pthread_mutex_destroy(&group->Mutex);
+
+  return TN_OK;
+}
+
+TnStatus TaskGroupAdd(TaskGroup* group) {
+  assert(group);
+
+  __atomic_add_fetch(&group->Pending, 1, __ATOMIC_SEQ_CST);
+
+  return TN_OK;
+}
+
+TnStatus TaskGroupDone(TaskGroup* group, int* isLast,
+                       struct FiberImpl** waiters) {
+  assert(group);
+  assert(isLast);
+  assert(waiters);
+
+  *waiters = NULL;
+
+  pthread_mutex_lock(&group->Mutex);
+
+  size_t prev = __atomic_fetch_sub(&group->Pending, 1, __ATOMIC_SEQ_CST);
+  assert(prev > 0);
+
+  *isLast = (prev == 1);
+  if (*isLast) {
+    *waiters = group->Waiters;
+    group->Waiters = NULL;
+  }
+
+  pthread_mutex_unlock(&group->Mutex);
+
+  return TN_OK;
+}
+
+TnStatus TaskGroupPark(TaskGroup* group, struct FiberImpl* fiber,
+                       int* parked) {
+  assert(group);
+  assert(fiber);
+  assert(parked);
+
+  pthread_mutex_lock(&group->Mutex);
+
+  *parked = __atomic_load_n(&group->Pending, __ATOMIC_SEQ_CST) != 0;
+  if (*parked) {
+    fiber->Next = group->Waiters;
+    group->Waiters = fiber;
+  }
+
+  pthread_mutex_unlock(&group->Mutex);
+
+  return TN_OK;
+}
+
+TnStatus TaskGroupPending(const TaskGroup* group, size_t* pending) {
+  if (!group || !pending) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  *pending = __atomic_load_n(&group->Pending, __ATOMIC_SEQ_CST);
+
+  return TN_OK;
+}
@@ -6,26 +6,71 @@ static void TaskQueueDump(const TaskQueue* tq) {
   fprintf(stderr,
           "TaskQueue: \n"
           "  Size: %lu\n"
-          "  C-ty: %lu\n"
           "  Head: %lu\n"
           "  Tail: %lu\n"
+          "  Cached: %lu\n"
           "  Data: { ",
-          tq->Size, tq->Capacity, tq->Head, tq->Tail);
+          tq->Size, tq->Head, tq->Tail, tq->NCached);
 
-  for (int i = 0; i < tq->Capacity; ++i)
-    fprintf(stderr, "%p ", tq->Tasks[(tq->Tail + i) % tq->Capacity].Args);
+  const TaskChunk* chunk = tq->TailChunk;
+  size_t pos = tq->Tail;
+
+  for (size_t i = 0; i < tq->Size; ++i) {
+    if (pos == TQ_CHUNK_CAPACITY) {
+      chunk = chunk->Next;
+      pos = 0;
+    }
+    fprintf(stderr, "%p ", chunk->Tasks[pos++].Args);
+  }
 
   fprintf(stderr, "}\n");
 }
 
+static TaskChunk* TaskQueueGetChunk(TaskQueue* tq) {
+  assert(tq);
+  TaskChunk* chunk = tq->Cache;
+
+  if (chunk) {
+    tq->Cache = chunk->Next;
+    tq->NCached--;
+    TN_PROBE3(tq_chunk_get, tq, chunk, 1);
+  } else {
+    chunk = (TaskChunk*)malloc(sizeof(TaskChunk));
+    if (!chunk) return NULL;
+    TN_PROBE3(tq_chunk_get, tq, chunk, 0);
+  }
+
+  chunk->Next = NULL;
+  return chunk;
+}
+
+static void TaskQueuePutChunk(TaskQueue* tq, TaskChunk* chunk) {
+  assert(tq);
+  assert(chunk);
+
+  TN_PROBE3(tq_chunk_put, tq, chunk, tq->NCached >= tq->CacheLimit);
+
+  if (tq->NCached >= tq->CacheLimit) {
+    free(chunk);
+    return;
+  }
+
+  chunk->Next = tq->Cache;
+  tq->Cache = chunk;
+  tq->NCached++;
+}
+
 TnStatus TaskQueueInit(TaskQueue* tq) {
   assert(tq);
 
-  tq->Capacity = TQ_INITIAL_CAPACITY;
+  tq->Cache = NULL;
+  tq->NCached = 0;
+  tq->CacheLimit = TQ_CHUNK_CACHE_SIZE;
 
-  tq->Tasks = (WorkerTask*)malloc(tq->Capacity * sizeof(WorkerTask));
-  if (!tq->Tasks) return TNSTATUS(TN_BAD_ALLOC);
+  tq->HeadChunk = TaskQueueGetChunk(tq);
+  if (!tq->HeadChunk) return TNSTATUS(TN_BAD_ALLOC);
 
+  tq->TailChunk = tq->HeadChunk;
   tq->Size = 0;
   tq->Head = 0;
   tq->Tail = 0;
@@ -35,79 +80,89 @@ TnStatus TaskQueueInit(TaskQueue* tq) {
 
 TnStatus TaskQueueDestroy(TaskQueue* tq) {
   assert(tq);
-  free(tq->Tasks);
+  TaskChunk* next;
+
+  for (TaskChunk* chunk = tq->TailChunk; chunk; chunk = next) {
+    next = chunk->Next;
+    free(chunk);
+  }
+
+  for (TaskChunk* chunk = tq->Cache; chunk; chunk = next) {
+    next = chunk->Next;
+    free(chunk);
+  }
 
   return TN_OK;
 }
 
 TnStatus TaskQueuePush(TaskQueue* tq, const WorkerTask* task) {
-  TnStatus status;
-
   assert(tq);
   assert(task);
 
-  if (tq->Size == tq->Capacity) {
-    status = TaskQueueResize(tq);
-    if (!TnStatusOk(status)) return status;
-  }
+  if (tq->Head == TQ_CHUNK_CAPACITY) {
+    TaskChunk* chunk = TaskQueueGetChunk(tq);
+    if (!chunk) return TNSTATUS(TN_BAD_ALLOC);
 
-  assert(tq->Size < tq->Capacity);
+    tq->HeadChunk->Next = chunk;
+    tq->HeadChunk = chunk;
+    tq->Head = 0;
+  }
 
-  tq->Tasks[tq->Head] = *task;
-  tq->Head = (tq->Head + 1) % tq->Capacity;
+  tq->HeadChunk->Tasks[tq->Head++] = *task;
   tq->Size++;
 
   return TN_OK;
 }
 
 TnStatus TaskQueuePop(TaskQueue* tq, WorkerTask* task) {
-  TnStatus status;
-
   assert(tq);
   assert(task);
 
   if (tq->Size == 0) return TNSTATUS(TN_UNDERFLOW);
 
+  *task = tq->TailChunk->Tasks[tq->Tail++];
   tq->Size--;
-  *task = tq->Tasks[tq->Tail];
-  tq->Tail = (tq->Tail + 1) % tq->Capacity;
+
+  if (tq->Size == 0) {  // Drained, restart the only chunk left
+    assert(tq->TailChunk == tq->HeadChunk);
+    tq->Head = 0;
+    tq->Tail = 0;
+  } else if (tq->Tail == TQ_CHUNK_CAPACITY) {
+    TaskChunk* drained = tq->TailChunk;
+
+    tq->TailChunk = drained->Next;
+    tq->Tail = 0;
+    TaskQueuePutChunk(tq, drained);
+  }
 
   return TN_OK;
 }
 
-static TnStatus TaskQueueResize(TaskQueue* tq) {
+TnStatus TaskQueueSize(const TaskQueue* tq, size_t* size) {
   assert(tq);
-  assert(tq->Size == tq->Capacity);
-  assert(tq->Size);
-  assert(tq->Head == tq->Tail);
-
-  size_t newCapacity = tq->Capacity * 2;
-  WorkerTask* newTasks = (WorkerTask*)calloc(newCapacity, sizeof(WorkerTask));
-
-  if (!newTasks) return TNSTATUS(TN_BAD_ALLOC);
-
-  size_t center = tq->Head;  // == tq->Tail;
-
-  size_t nRight = tq->Capacity - center;
-  size_t nLeft = center;
-
-  memcpy(newTasks, tq->Tasks + center, nRight * sizeof(WorkerTask));
-  memcpy(newTasks + nRight, tq->Tasks, nLeft * sizeof(WorkerTask));
-  free(tq->Tasks);
+  assert(size);
 
-  tq->Capacity = newCapacity;
-  tq->Tasks = newTasks;
-  tq->Tail = 0;
-  tq->Head = tq->Size;
+  *size = tq->Size;
 
   return TN_OK;
 }
 
-TnStatus TaskQueueSize(const TaskQueue* tq, size_t* size) {
+TnStatus TaskQueueReserve(TaskQueue* tq, size_t nTasks) {
   assert(tq);
-  assert(size);
 
-  *size = tq->Size;
+  /* n tasks span up to one chunk more than they fill, the chunk pushed
+   * into now is that one */
+  size_t nChunks = (nTasks + TQ_CHUNK_CAPACITY - 1) / TQ_CHUNK_CAPACITY;
+  if (nChunks > tq->CacheLimit) tq->CacheLimit = nChunks;
+
+  while (tq->NCached < nChunks) {
+    TaskChunk* chunk = (TaskChunk*)malloc(sizeof(TaskChunk));
+    if (!chunk) return TNSTATUS(TN_BAD_ALLOC);
+
+    chunk->Next = tq->Cache;
+    tq->Cache = chunk;
+    tq->NCached++;
+  }
 
   return TN_OK;
-}
\ No newline at end of file
+}
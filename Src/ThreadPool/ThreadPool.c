@@ -1,60 +1,1522 @@
 #include "ThreadPool/ThreadPool.h"
 
+/* Pool served by the current worker thread, if any */
+static __thread ThreadPool *CurrentPool = NULL;
+
+/* Shard seed of the current producer thread */
+static __thread size_t ThreadShardSeed = (size_t)-1;
+static size_t NextShardSeed = 0; /* Atomic */
+
+/* Task IDs are handed to producer threads in blocks, 0 is never used */
+#define TP_TASK_ID_BLOCK 1024
+static __thread uint64_t NextTaskID = 0;
+static __thread uint64_t EndTaskID = 0;
+static uint64_t NextTaskIDBlock = 1; /* Atomic */
+
 static void WorkerCallback(Worker *worker, void *args) {
   assert(worker);
   assert(args);
 
-  ThreadPool *tp = (ThreadPool *)args;
-  WorkerState state = worker->State;
-  TnStatus status;
-  WorkerTask task;
+  ThreadPool *tp = (ThreadPool *)args;
+  WorkerState state = worker->State;
+  TnStatus status;
+
+  if (state == WORKER_STARTED) {
+    CurrentPool = tp;
+    ThreadPoolWorkerStarted(tp);
+  } else if (state == WORKER_READY) {
+    ThreadPoolDeliver(tp, worker);
+  } else if (state == WORKER_BUSY) {
+    if (worker->Task.Function != ThreadPoolBatchRun) {
+      TN_PROBE2(task_start, tp, worker->Task.ID);
+      ThreadPoolTaskStarted(tp, worker->ID, &worker->Task);
+    }
+  } else if (state == WORKER_DONE) {
+    /* A batch accounts for its tasks itself */
+    if (worker->Task.Function != ThreadPoolBatchRun) {
+      TN_PROBE2(task_end, tp, worker->Task.ID);
+      ThreadPoolTaskFinished(tp, worker->ID);
+      ThreadPoolTaskDone(tp, &worker->Task);
+      if (worker->Task.Function != ThreadPoolFiberRun)
+        ThreadPoolTaskRetired(tp);
+    }
+
+    status = WorkerFinishTaskAsync(worker);
+    assert(TnStatusOk(status));
+  }
+}
+
+/* Starts the next worker unless all are started or the pool is stopping.
+ * Returns whether it did. */
+static int ThreadPoolSpawnWorker(ThreadPool *tp) {
+  assert(tp);
+  size_t claimed = __atomic_load_n(&tp->NClaimed, __ATOMIC_SEQ_CST);
+
+  do {
+    if ((claimed & TP_SPAWN_CLOSED) || claimed == tp->Workers.Size) return 0;
+  } while (!__atomic_compare_exchange_n(&tp->NClaimed, &claimed, claimed + 1,
+                                        0, __ATOMIC_SEQ_CST,
+                                        __ATOMIC_SEQ_CST));
+
+  WorkerCallbackT callback;
+  callback.Args = tp;
+  callback.Function = WorkerCallback;
+
+  TnStatus status = WorkerRun(tp->Workers.Workers + claimed, &callback);
+
+  if (!TnStatusOk(status)) {
+    int error = errno ? errno : EAGAIN;
+    int none = 0;
+    __atomic_compare_exchange_n(&tp->SpawnError, &none, error, 0,
+                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    FutexWake(&tp->NReady, INT_MAX);
+  }
+
+  __atomic_add_fetch(&tp->NSpawned, 1, __ATOMIC_SEQ_CST);
+
+  return TnStatusOk(status);
+}
+
+/* A lazy pool grows when a task finds no worker free, up to the active
+ * limit */
+static void ThreadPoolSpawnLazy(ThreadPool *tp) {
+  assert(tp);
+
+  if (tp->Config.StartPolicy != TP_START_LAZY) return;
+  if (__atomic_load_n(&tp->NClaimed, __ATOMIC_SEQ_CST) >=
+      __atomic_load_n(&tp->NActive, __ATOMIC_SEQ_CST))
+    return;
+
+  ThreadPoolSpawnWorker(tp);
+}
+
+/* Worker thread, once */
+static void ThreadPoolWorkerStarted(ThreadPool *tp) {
+  assert(tp);
+
+  if (tp->Config.StartPolicy == TP_START_PARALLEL)
+    for (size_t i = 0; i < TP_SPAWN_FANOUT; ++i) ThreadPoolSpawnWorker(tp);
+
+  if (__atomic_add_fetch(&tp->NReady, 1, __ATOMIC_SEQ_CST) ==
+      tp->Workers.Size)
+    FutexWake(&tp->NReady, INT_MAX);
+}
+
+static uint64_t ThreadPoolTaskID() {
+  if (NextTaskID == EndTaskID) {
+    NextTaskID = __atomic_fetch_add(&NextTaskIDBlock, TP_TASK_ID_BLOCK,
+                                    __ATOMIC_RELAXED);
+    EndTaskID = NextTaskID + TP_TASK_ID_BLOCK;
+  }
+
+  return NextTaskID++;
+}
+
+static uint64_t ThreadPoolStamp(ThreadPool *tp) {
+  assert(tp);
+
+  if (!__atomic_load_n(&tp->RecordLatency, __ATOMIC_RELAXED)) return 0;
+  return HistogramNow();
+}
+
+static void ThreadPoolTaskStarted(ThreadPool *tp, WorkerID id,
+                                  const WorkerTask *task) {
+  assert(tp);
+  assert(task);
+  ThreadPoolLatency *latency = tp->Latency + id;
+
+  if (tp->Config.StallBudget != 0) {
+    ThreadPoolRunning *running = tp->Running + id;
+    const WorkerTask *watched = task;
+
+    /* A fiber is reported as the task it runs */
+    if (watched->Function == ThreadPoolFiberRun)
+      watched = &((Fiber *)watched->Args)->Task;
+
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&running->Function, watched->Function, __ATOMIC_RELAXED);
+    __atomic_store_n(&running->Args, watched->Args, __ATOMIC_RELAXED);
+    __atomic_store_n(&running->TaskID, watched->ID, __ATOMIC_RELAXED);
+    __atomic_store_n(&running->Start, HistogramNow(), __ATOMIC_RELEASE);
+  }
+
+  latency->Start = ThreadPoolStamp(tp);
+  if (!latency->Start) return;
+
+  uint64_t submit = task->SubmitTime;
+  if (submit && latency->Start > submit)
+    HistogramRecord(&latency->QueueDelay,
+                    HistogramTicksToNs(latency->Start - submit));
+}
+
+static void ThreadPoolTaskFinished(ThreadPool *tp, WorkerID id) {
+  assert(tp);
+  ThreadPoolLatency *latency = tp->Latency + id;
+
+  if (tp->Config.StallBudget != 0)
+    __atomic_store_n(&tp->Running[id].Start, 0, __ATOMIC_RELAXED);
+
+  if (!latency->Start) return;
+
+  uint64_t end = HistogramNow();
+  if (end > latency->Start)
+    HistogramRecord(&latency->Execution,
+                    HistogramTicksToNs(end - latency->Start));
+  latency->Start = 0;
+}
+
+static size_t ThreadPoolShard(ThreadPool *tp) {
+  assert(tp);
+  size_t nShards = tp->Config.NShards;
+
+  if (nShards == 1) return 0;
+
+  if (tp->Config.ShardPolicy == TP_SHARD_BY_CPU) {
+    int cpu = sched_getcpu();
+    if (cpu >= 0) return (size_t)cpu % nShards;
+  }
+
+  if (ThreadShardSeed == (size_t)-1)
+    ThreadShardSeed =
+        __atomic_fetch_add(&NextShardSeed, 1, __ATOMIC_RELAXED);
+
+  return ThreadShardSeed % nShards;
+}
+
+/* Takes a task for the given worker (TP_NO_WORKER for helpers): its own
+ * inbox first, then the home shard, the other shards, and finally tasks
+ * that other workers' inboxes allow to steal. Only the shards hand out
+ * more than one, up to max. */
+static TnStatus ThreadPoolPopTask(ThreadPool *tp, WorkerID self, size_t home,
+                                  WorkerTask *tasks, size_t max, size_t *n) {
+  assert(tp);
+  assert(tasks);
+  assert(n);
+
+  TnStatus status = TNSTATUS(TN_UNDERFLOW);
+  size_t nShards = tp->Config.NShards;
+  size_t nWorkers = tp->Workers.Size;
+
+  *n = 1;
+
+  if (self != TP_NO_WORKER) {
+    status = WorkerInboxPop(tp->Inboxes + self, tasks);
+    if (status.Code == TN_SUCCESS) ThreadPoolTaskDequeued(tp, tasks);
+    if (status.Code != TN_UNDERFLOW) return status;
+  }
+
+  for (size_t i = 0; i < nShards; ++i) {
+    status = TQMonitorGetTasks(tp->Tasks + (home + i) % nShards, tasks, max, n);
+    if (status.Code == TN_SUCCESS)
+      for (size_t k = 0; k < *n; ++k) ThreadPoolTaskDequeued(tp, tasks + k);
+    if (status.Code != TN_UNDERFLOW) return status;
+  }
+
+  *n = 1;
+
+  size_t start = (self != TP_NO_WORKER) ? self + 1 : 0;
+  for (size_t i = 0; i < nWorkers; ++i) {
+    status = WorkerInboxSteal(tp->Inboxes + (start + i) % nWorkers, tasks);
+    if (status.Code == TN_SUCCESS) ThreadPoolTaskDequeued(tp, tasks);
+    if (status.Code != TN_UNDERFLOW) return status;
+  }
+
+  return status;
+}
+
+/* Whether the given worker (TP_NO_WORKER for helpers) could pop a task */
+static int ThreadPoolHasTasks(ThreadPool *tp, WorkerID self) {
+  assert(tp);
+  size_t size, pinned, preferred;
+
+  if (self != TP_NO_WORKER) {
+    WorkerInboxPeekSize(tp->Inboxes + self, &pinned, &preferred);
+    if (pinned != 0) return 1;
+  }
+
+  for (size_t i = 0; i < tp->Config.NShards; ++i) {
+    TQMonitorPeekSize(tp->Tasks + i, &size);
+    if (size != 0) return 1;
+  }
+
+  for (size_t i = 0; i < tp->Workers.Size; ++i) {
+    WorkerInboxPeekSize(tp->Inboxes + i, &pinned, &preferred);
+    if (preferred != 0) return 1;
+  }
+
+  return 0;
+}
+
+/* Pops the next task for the worker and assigns it. Inactive workers
+ * only take the ones addressed to them. */
+static int ThreadPoolTakeTask(ThreadPool *tp, Worker *worker) {
+  assert(tp);
+  assert(worker);
+
+  TnStatus status;
+  WorkerTask task;
+  size_t home = worker->ID % tp->Config.NShards;
+
+  /* Nobody else touches the batch of a worker between its tasks, and its
+   * last one has finished */
+  ThreadPoolBatch *batch = tp->Batches + worker->ID;
+
+  do {  // A task that gets no fiber is set aside, take the next one
+    batch->N = 1;
+
+    if (ThreadPoolIsActive(tp, worker->ID))
+      status = ThreadPoolPopTask(tp, worker->ID, home, batch->Tasks,
+                                 tp->Config.MaxBatch, &batch->N);
+    else {
+      status = WorkerInboxPop(tp->Inboxes + worker->ID, batch->Tasks);
+      if (status.Code == TN_SUCCESS) ThreadPoolTaskDequeued(tp, batch->Tasks);
+    }
+
+    if (status.Code == TN_UNDERFLOW) return 0;
+    assert(status.Code == TN_SUCCESS);
+
+    task = batch->Tasks[0];
+    if (batch->N > 1) {
+      task.Function = ThreadPoolBatchRun;
+      task.Args = batch;
+      task.Result = batch;
+      task.Group = NULL;
+      task.Completions = NULL;
+      task.ID = 0;
+    }
+  } while (!ThreadPoolFiberWrap(tp, &task));
+
+  status = WorkerAssignTaskAsync(worker, task);
+  assert(TnStatusOk(status));
+
+  return 1;
+}
+
+/* Worker thread, READY callback. Gives the worker its next task, and
+ * until there is one spins, then sleeps as a free or parked worker.
+ * Returns 0 once the pool is stopping. */
+static int ThreadPoolDeliver(ThreadPool *tp, Worker *worker) {
+  assert(tp);
+  assert(worker);
+
+  WorkerID id = worker->ID;
+  size_t pinned, preferred;
+  int spun = 0, found = 0;
+
+  while (1) {
+    if (__atomic_load_n(&tp->Stopping, __ATOMIC_SEQ_CST)) return 0;
+
+    if (ThreadPoolTakeTask(tp, worker)) {
+      /* Producers left the wakeups to the spinner, pass them on */
+      if (found && ThreadPoolHasTasks(tp, TP_NO_WORKER)) ThreadPoolWakeOne(tp);
+      return 1;
+    }
+
+    if (!spun) {
+      spun = 1;
+      found = ThreadPoolIsActive(tp, id) && ThreadPoolSpin(tp, id);
+      if (found) continue;
+    }
+
+    found = 0;
+
+    if (!ThreadPoolIsActive(tp, id)) {
+      /* Whoever raises the limit or sends a task here after the worker is
+       * seen parked unparks and wakes it. If the unpark fails, someone
+       * else did and the wakeup is on its way. */
+      __atomic_store_n(tp->Parked + id, 1, __ATOMIC_SEQ_CST);
+
+      WorkerInboxPeekSize(tp->Inboxes + id, &pinned, &preferred);
+      if ((pinned == 0 && preferred == 0 && !ThreadPoolIsActive(tp, id) &&
+           !__atomic_load_n(&tp->Stopping, __ATOMIC_SEQ_CST)) ||
+          !ThreadPoolUnpark(tp, id))
+        ThreadPoolSleep(tp, worker);
+      continue;
+    }
+
+    TnStatus status = WQMonitorAddWorker(&tp->FreeWorkers, &id);
+    assert(TnStatusOk(status));
+
+    /* A task pushed before the worker became visible as free would be
+     * stranded: take the worker back and retry. If the claim fails, a
+     * producer already picked the worker and is about to wake it. The
+     * same goes for a limit lowered meanwhile, which would leave it free,
+     * and for a stop. */
+    if ((!ThreadPoolHasTasks(tp, id) && ThreadPoolIsActive(tp, id) &&
+         !__atomic_load_n(&tp->Stopping, __ATOMIC_SEQ_CST)) ||
+        !TnStatusOk(WQMonitorClaimWorker(&tp->FreeWorkers, &id)))
+      ThreadPoolSleep(tp, worker);
+  }
+}
+
+/* Polls the queues for a while unless another worker already does.
+ * Returns whether something turned up. */
+static int ThreadPoolSpin(ThreadPool *tp, WorkerID id) {
+  assert(tp);
+  size_t none = 0;
+  int found = 0;
+
+  if (tp->Config.SpinRounds == 0) return 0;
+  if (!__atomic_compare_exchange_n(&tp->NSpinning, &none, 1, 0,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+    return 0;
+
+  for (size_t i = 0; i < tp->Config.SpinRounds && !found; ++i) {
+    found = ThreadPoolHasTasks(tp, id) ||
+            __atomic_load_n(&tp->Stopping, __ATOMIC_SEQ_CST);
+    ThreadPoolRelax();
+  }
+
+  /* A producer that saw the spinner relies on it to look once more, and
+   * everything below does */
+  __atomic_sub_fetch(&tp->NSpinning, 1, __ATOMIC_SEQ_CST);
+
+  return found;
+}
+
+static void ThreadPoolRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield");
+#endif
+}
+
+/* Sleeps until ThreadPoolWake, which may have come already */
+static void ThreadPoolSleep(ThreadPool *tp, Worker *worker) {
+  assert(tp);
+  assert(worker);
+
+  /* Setting the core or stopping the worker takes its mutex */
+  WorkerCallbackT callback;
+  callback.Args = tp;
+  callback.Function = ThreadPoolSleepUnlocked;
+
+  TnStatus status = WorkerCallUnlocked(worker, callback);
+  assert(TnStatusOk(status));
+}
+
+static void ThreadPoolSleepUnlocked(Worker *worker, void *args) {
+  assert(worker);
+  assert(args);
+  ThreadPool *tp = (ThreadPool *)args;
+  uint32_t *wake = tp->Wake + worker->ID;
+  uint32_t none = TP_WAKE_NONE;
+
+  if (__atomic_compare_exchange_n(wake, &none, TP_WAKE_WAITING, 0,
+                                  __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+    while (__atomic_load_n(wake, __ATOMIC_SEQ_CST) == TP_WAKE_WAITING)
+      FutexWait(wake, TP_WAKE_WAITING);
+
+  __atomic_store_n(wake, TP_WAKE_NONE, __ATOMIC_SEQ_CST);
+}
+
+/* Wakes a worker taken out of FreeWorkers or Parked. The syscall is only
+ * made if it sleeps already. */
+static void ThreadPoolWake(ThreadPool *tp, WorkerID id) {
+  assert(tp);
+
+  if (__atomic_exchange_n(tp->Wake + id, TP_WAKE_PENDING, __ATOMIC_SEQ_CST) ==
+      TP_WAKE_WAITING)
+    FutexWake(tp->Wake + id, 1);
+}
+
+/* After a task went to the shared queues: wakes a free worker, unless one
+ * is spinning and will find the task itself. Returns whether either
+ * will. */
+static int ThreadPoolWakeOne(ThreadPool *tp) {
+  assert(tp);
+  WorkerID id;
+
+  if (__atomic_load_n(&tp->NSpinning, __ATOMIC_SEQ_CST) != 0) return 1;
+  if (!TnStatusOk(WQMonitorGetWorker(&tp->FreeWorkers, &id))) return 0;
+
+  ThreadPoolWake(tp, id);
+  return 1;
+}
+
+static int ThreadPoolIsActive(ThreadPool *tp, WorkerID id) {
+  assert(tp);
+  return id < __atomic_load_n(&tp->NActive, __ATOMIC_SEQ_CST);
+}
+
+/* Takes over a parked worker, which must then be woken */
+static int ThreadPoolUnpark(ThreadPool *tp, WorkerID id) {
+  assert(tp);
+  uint8_t parked = 1;
+
+  return __atomic_compare_exchange_n(tp->Parked + id, &parked, 0, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+/* Under ActiveMutex. Idle workers above the new limit are woken to park,
+ * parked ones below it to take shared tasks again. */
+static void ThreadPoolSetActive(ThreadPool *tp, size_t nActive) {
+  assert(tp);
+
+  if (nActive == 0) nActive = 1;
+  if (nActive > tp->Workers.Size) nActive = tp->Workers.Size;
+
+  size_t old = __atomic_exchange_n(&tp->NActive, nActive, __ATOMIC_SEQ_CST);
+
+  for (WorkerID id = nActive; id < old; ++id)
+    if (TnStatusOk(WQMonitorClaimWorker(&tp->FreeWorkers, &id)))
+      ThreadPoolWake(tp, id);
+
+  for (WorkerID id = old; id < nActive; ++id)
+    if (ThreadPoolUnpark(tp, id)) ThreadPoolWake(tp, id);
+}
+
+static void *ThreadPoolQuotaLoop(void *args) {
+  assert(args);
+  ThreadPool *tp = (ThreadPool *)args;
+  struct timespec deadline;
+  CpuQuota quota;
+
+  uint64_t interval = tp->Config.QuotaInterval;
+
+  pthread_mutex_lock(&tp->ActiveMutex);
+
+  while (!tp->QuotaStop) {
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += interval / 1000000000ull;
+    deadline.tv_nsec += interval % 1000000000ull;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+
+    int res = 0;
+    while (res == 0 && !tp->QuotaStop)
+      res = pthread_cond_timedwait(&tp->QuotaCond, &tp->ActiveMutex,
+                                   &deadline);
+
+    if (tp->QuotaStop) break;
+
+    if (TnStatusOk(CpuQuotaRead(tp->Config.CgroupRoot, &quota)))
+      ThreadPoolSetActive(tp, quota.Limit);
+  }
+
+  pthread_mutex_unlock(&tp->ActiveMutex);
+  return NULL;
+}
+
+/* Applies the quota once, then keeps polling it */
+static TnStatus ThreadPoolQuotaStart(ThreadPool *tp) {
+  assert(tp);
+  CpuQuota quota;
+
+  if (tp->Config.QuotaInterval == 0 || tp->Config.WorkerArbiter ||
+      tp->QuotaRunning)
+    return TN_OK;
+
+  TnStatus status = CpuQuotaRead(tp->Config.CgroupRoot, &quota);
+  if (!TnStatusOk(status)) return status;
+
+  pthread_mutex_lock(&tp->ActiveMutex);
+  ThreadPoolSetActive(tp, quota.Limit);
+  tp->QuotaStop = 0;
+  pthread_mutex_unlock(&tp->ActiveMutex);
+
+  int res = pthread_create(&tp->QuotaThread, NULL, ThreadPoolQuotaLoop, tp);
+  if (res != 0) {
+    errno = res;
+    return TNSTATUS(TN_ERRNO);
+  }
+
+  tp->QuotaRunning = 1;
+  return TN_OK;
+}
+
+static void ThreadPoolQuotaStop(ThreadPool *tp) {
+  assert(tp);
+
+  if (!tp->QuotaRunning) return;
+
+  pthread_mutex_lock(&tp->ActiveMutex);
+  tp->QuotaStop = 1;
+  pthread_cond_signal(&tp->QuotaCond);
+  pthread_mutex_unlock(&tp->ActiveMutex);
+
+  pthread_join(tp->QuotaThread, NULL);
+  tp->QuotaRunning = 0;
+}
+
+/* Reports the overruns not reported yet and returns the number of
+ * workers over the budget. A task that finishes meanwhile is skipped. */
+static size_t ThreadPoolStallCheck(ThreadPool *tp) {
+  assert(tp);
+  size_t nStalled = 0;
+
+  uint64_t now = HistogramNow();
+
+  for (WorkerID id = 0; id < tp->Workers.Size; ++id) {
+    ThreadPoolRunning *running = tp->Running + id;
+    ThreadPoolStall stall;
+
+    uint64_t start = __atomic_load_n(&running->Start, __ATOMIC_ACQUIRE);
+    if (!start || now <= start) continue;
+
+    stall.Elapsed = HistogramTicksToNs(now - start);
+    if (stall.Elapsed <= tp->Config.StallBudget) continue;
+
+    stall.Worker = id;
+    stall.Function = __atomic_load_n(&running->Function, __ATOMIC_RELAXED);
+    stall.Args = __atomic_load_n(&running->Args, __ATOMIC_RELAXED);
+    stall.TaskID = __atomic_load_n(&running->TaskID, __ATOMIC_RELAXED);
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&running->Start, __ATOMIC_RELAXED) != start) continue;
+
+    nStalled++;
+
+    if (running->Reported == start) continue;
+    running->Reported = start;
+
+    if (tp->Config.OnStall) tp->Config.OnStall(tp->Config.StallArgs, &stall);
+  }
+
+  return nStalled;
+}
+
+static void *ThreadPoolStallLoop(void *args) {
+  assert(args);
+  ThreadPool *tp = (ThreadPool *)args;
+  struct timespec deadline;
+
+  uint64_t interval = tp->Config.StallInterval;
+
+  pthread_mutex_lock(&tp->StallMutex);
+
+  while (!tp->StallStop) {
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += interval / 1000000000ull;
+    deadline.tv_nsec += interval % 1000000000ull;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+
+    int res = 0;
+    while (res == 0 && !tp->StallStop)
+      res = pthread_cond_timedwait(&tp->StallCond, &tp->StallMutex,
+                                   &deadline);
+
+    if (tp->StallStop) break;
+
+    __atomic_store_n(&tp->NStalled, ThreadPoolStallCheck(tp),
+                     __ATOMIC_RELAXED);
+  }
+
+  pthread_mutex_unlock(&tp->StallMutex);
+  return NULL;
+}
+
+static TnStatus ThreadPoolStallStart(ThreadPool *tp) {
+  assert(tp);
+
+  if (tp->Config.StallBudget == 0 || tp->StallRunning) return TN_OK;
+
+  tp->StallStop = 0;
+  tp->NStalled = 0;
+
+  int res = pthread_create(&tp->StallThread, NULL, ThreadPoolStallLoop, tp);
+  if (res != 0) {
+    errno = res;
+    return TNSTATUS(TN_ERRNO);
+  }
+
+  tp->StallRunning = 1;
+  return TN_OK;
+}
+
+static void ThreadPoolStallStop(ThreadPool *tp) {
+  assert(tp);
+
+  if (!tp->StallRunning) return;
+
+  pthread_mutex_lock(&tp->StallMutex);
+  tp->StallStop = 1;
+  pthread_cond_signal(&tp->StallCond);
+  pthread_mutex_unlock(&tp->StallMutex);
+
+  pthread_join(tp->StallThread, NULL);
+  tp->StallRunning = 0;
+  __atomic_store_n(&tp->NStalled, 0, __ATOMIC_RELAXED);
+}
+
+static size_t ThreadPoolLeaseDemand(void *args) {
+  assert(args);
+  ThreadPool *tp = (ThreadPool *)args;
+
+  return __atomic_load_n(&tp->InFlight, __ATOMIC_SEQ_CST);
+}
+
+/* Under the arbiter's mutex */
+static void ThreadPoolLeaseApply(void *args, size_t granted,
+                                 const int *cores) {
+  assert(args);
+  assert(cores);
+  ThreadPool *tp = (ThreadPool *)args;
+
+  for (size_t i = 0; i < granted; ++i) {
+    Worker *worker = tp->Workers.Workers + i;
+    int node;
+
+    if (__atomic_load_n(&worker->Core, __ATOMIC_RELAXED) == cores[i]) continue;
+
+    WorkerSetCore(worker, cores[i]);
+    TopologyCpuNode(cores[i], &node);
+    __atomic_store_n(tp->WorkerNodes + i, node, __ATOMIC_RELAXED);
+  }
+
+  pthread_mutex_lock(&tp->ActiveMutex);
+  ThreadPoolSetActive(tp, granted);
+  pthread_mutex_unlock(&tp->ActiveMutex);
+}
+
+/* Runs the tasks of a batch back to back on the worker, without going
+ * through its state machine between them */
+static void ThreadPoolBatchRun(void *args, void *result) {
+  assert(args);
+  ThreadPoolBatch *batch = (ThreadPoolBatch *)args;
+  ThreadPool *tp = (ThreadPool *)batch->Pool;
+
+  for (size_t i = 0; i < batch->N; ++i) {
+    ThreadPoolTaskStarted(tp, batch->Worker, batch->Tasks + i);
+    ThreadPoolRunTask(tp, batch->Tasks + i);
+    ThreadPoolTaskFinished(tp, batch->Worker);
+  }
+}
+
+static void ThreadPoolRunTask(ThreadPool *tp, WorkerTask *task) {
+  assert(tp);
+  assert(task);
+
+  if (!ThreadPoolFiberWrap(tp, task)) return;
+
+  /* Batches and helpers run tasks outside the worker state machine, so
+   * the probes are fired here too */
+  TN_PROBE2(task_start, tp, task->ID);
+  task->Function(task->Args, task->Result);
+  TN_PROBE2(task_end, tp, task->ID);
+
+  ThreadPoolTaskDone(tp, task);
+  if (task->Function != ThreadPoolFiberRun) ThreadPoolTaskRetired(tp);
+}
+
+/* A submitted task has finished. Waiters are only woken when the last
+ * one does. */
+static void ThreadPoolTaskRetired(ThreadPool *tp) {
+  assert(tp);
+
+  if (__atomic_sub_fetch(&tp->InFlight, 1, __ATOMIC_SEQ_CST) != 0) return;
+  if (__atomic_load_n(&tp->NIdleWaiters, __ATOMIC_SEQ_CST) == 0) return;
+
+  __atomic_add_fetch(&tp->IdleEpoch, 1, __ATOMIC_SEQ_CST);
+  FutexWake(&tp->IdleEpoch, INT_MAX);
+}
+
+static void ThreadPoolTaskDone(ThreadPool *tp, WorkerTask *task) {
+  assert(tp);
+  assert(task);
+  TnStatus status;
+
+  if (task->Completions) {
+    Completion completion = {task->Tag, task->Result};
+
+    /* Reserved at submission */
+    status = CompletionQueuePushReserved(task->Completions, &completion);
+    assert(TnStatusOk(status));
+  }
+
+  if (task->Group) ThreadPoolGroupDone(tp, task->Group);
+}
+
+/* Resumes the fibers parked on the group once its last task is done */
+static void ThreadPoolGroupDone(ThreadPool *tp, TaskGroup *group) {
+  assert(tp);
+  assert(group);
+  TnStatus status;
+  Fiber *waiters;
+  int isLast;
+
+  status = TaskGroupDone(group, &isLast, &waiters);
+  assert(TnStatusOk(status));
+
+  if (!isLast) return;
+
+  while (waiters) {
+    Fiber *fiber = waiters;
+    waiters = fiber->Next;
+
+    status = FiberSchedule(fiber);
+    assert(TnStatusOk(status));
+  }
+
+  ThreadPoolWakeHelpers(tp, 1);
+}
+
+/* The group could finish between the check in ThreadPoolWaitGroup and
+ * the switch, so TaskGroupPark checks again under its lock */
+static void ThreadPoolGroupHook(Fiber *fiber, void *args) {
+  assert(fiber);
+  assert(args);
+  TnStatus status;
+  int parked;
+
+  status = TaskGroupPark((TaskGroup *)args, fiber, &parked);
+  assert(TnStatusOk(status));
+
+  if (!parked) {
+    status = FiberSchedule(fiber);
+    assert(TnStatusOk(status));
+  }
+}
+
+static void ThreadPoolWakeHelpers(ThreadPool *tp, int all) {
+  assert(tp);
+
+  if (__atomic_load_n(&tp->NHelpers, __ATOMIC_SEQ_CST) == 0) return;
+
+  __atomic_add_fetch(&tp->HelpEpoch, 1, __ATOMIC_SEQ_CST);
+  FutexWake(&tp->HelpEpoch, all ? INT_MAX : 1);
+}
+
+/* Runs queued tasks on the calling thread until done(args) holds */
+static TnStatus ThreadPoolHelpUntil(ThreadPool *tp, ThreadPoolPredicateT done,
+                                    void *args) {
+  assert(tp);
+  assert(done);
+
+  TnStatus status = TN_OK;
+  WorkerTask task;
+  size_t n;
+
+  size_t home = ThreadPoolShard(tp);
+
+  while (!done(args)) {
+    status = ThreadPoolPopTask(tp, TP_NO_WORKER, home, &task, 1, &n);
+
+    if (status.Code == TN_SUCCESS) {
+      ThreadPoolRunTask(tp, &task);
+      continue;
+    }
+
+    if (status.Code != TN_UNDERFLOW) break;
+    status = TN_OK;
+
+    /* Registered before the recheck, so that whoever queues a task or
+     * ends the wait after it also bumps the epoch */
+    __atomic_add_fetch(&tp->NHelpers, 1, __ATOMIC_SEQ_CST);
+    uint32_t epoch = __atomic_load_n(&tp->HelpEpoch, __ATOMIC_SEQ_CST);
+
+    if (!done(args) && !ThreadPoolHasTasks(tp, TP_NO_WORKER))
+      status = FutexWait(&tp->HelpEpoch, epoch);
+
+    __atomic_sub_fetch(&tp->NHelpers, 1, __ATOMIC_SEQ_CST);
+    if (!TnStatusOk(status)) break;
+  }
+
+  return status;
+}
+
+/* Moves a task that is about to run onto a fiber. Resumed fibers are
+ * already wrapped. Returns 0 if the task got no fiber and was set aside
+ * until one is put back, the caller must not run it. */
+static int ThreadPoolFiberWrap(ThreadPool *tp, WorkerTask *task) {
+  assert(tp);
+  assert(task);
+  Fiber *fiber;
+
+  if (tp->Config.FiberStackSize == 0) return 1;
+  if (task->Function == ThreadPoolFiberRun) return 1;
+  if (task->Function == ThreadPoolBatchRun) return 1;
+
+  size_t nPut = __atomic_load_n(&tp->Fibers.NPut, __ATOMIC_SEQ_CST);
+
+  if (!TnStatusOk(FiberPoolGet(&tp->Fibers, task, &fiber))) {
+    ThreadPoolFiberStarve(tp, task, nPut);
+    return 0;
+  }
+
+  fiber->Schedule = ThreadPoolFiberSchedule;
+  fiber->ScheduleArgs = tp;
+
+  /* The group is finished by the fiber, not by the wrapper */
+  task->Function = ThreadPoolFiberRun;
+  task->Args = fiber;
+  task->Result = fiber;
+  task->Group = NULL;
+  task->Completions = NULL;
+
+  return 1;
+}
+
+/* Sets a task aside until a fiber is put back. One put since nPut, read
+ * before the failed get, may have missed it, so it requeues then. */
+static void ThreadPoolFiberStarve(ThreadPool *tp, const WorkerTask *task,
+                                  size_t nPut) {
+  assert(tp);
+  assert(task);
+  TnStatus status;
+
+  pthread_mutex_lock(&tp->StarvedMutex);
+  status = TaskQueuePush(&tp->Starved, task);
+  pthread_mutex_unlock(&tp->StarvedMutex);
+
+  if (!TnStatusOk(status)) {  // Retried from the shards then
+    ThreadPoolDest dest = {TP_NO_WORKER, 0, 0};
+    status = ThreadPoolDispatch(tp, &dest, *task);
+    assert(TnStatusOk(status));
+    return;
+  }
+
+  if (__atomic_load_n(&tp->Fibers.NPut, __ATOMIC_SEQ_CST) != nPut)
+    ThreadPoolFiberRequeue(tp);
+}
+
+/* A fiber was put back, gives it to the oldest task set aside */
+static void ThreadPoolFiberRequeue(ThreadPool *tp) {
+  assert(tp);
+  TnStatus status;
+  WorkerTask task;
+
+  pthread_mutex_lock(&tp->StarvedMutex);
+  status = TaskQueuePop(&tp->Starved, &task);
+  pthread_mutex_unlock(&tp->StarvedMutex);
+
+  if (status.Code != TN_SUCCESS) return;
+
+  ThreadPoolDest dest = {TP_NO_WORKER, 0, 0};
+  status = ThreadPoolDispatch(tp, &dest, task);
+  if (TnStatusOk(status)) return;
+
+  /* Back in line for the next put */
+  pthread_mutex_lock(&tp->StarvedMutex);
+  status = TaskQueuePush(&tp->Starved, &task);
+  pthread_mutex_unlock(&tp->StarvedMutex);
+  assert(TnStatusOk(status));
+}
+
+static void ThreadPoolFiberRun(void *args, void *result) {
+  assert(args);
+  Fiber *fiber = (Fiber *)args;
+  ThreadPool *tp = (ThreadPool *)fiber->ScheduleArgs;
+  TnStatus status;
+  int finished;
+
+  status = FiberSwitchIn(fiber, &finished);
+  assert(TnStatusOk(status));
+
+  if (!finished) return;
+
+  ThreadPoolTaskDone(tp, &fiber->Task);
+  FiberPoolPut(&tp->Fibers, fiber);
+  ThreadPoolFiberRequeue(tp);
+  ThreadPoolTaskRetired(tp);
+}
+
+/* Queues a parked fiber to continue on any thread of the pool */
+static void ThreadPoolFiberSchedule(Fiber *fiber, void *args) {
+  assert(fiber);
+  assert(args);
+  ThreadPool *tp = (ThreadPool *)args;
+
+  WorkerTask task;
+  task.Function = ThreadPoolFiberRun;
+  task.Args = fiber;
+  task.Result = fiber;
+  task.Group = NULL;
+  task.Completions = NULL;
+  task.ID = fiber->Task.ID;  // Slices of a task share its ID
+
+  TnStatus status = ThreadPoolSubmit(tp, 0, task);
+  assert(TnStatusOk(status));
+}
+
+/* CLOCK_MONOTONIC, ns, as the shards stamp EnqueueTime */
+static uint64_t ThreadPoolNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Pushes to the producer's shard or to the worker's inbox. The task is
+ * counted before it becomes visible so that NQueued never drops below
+ * zero. */
+static TnStatus ThreadPoolQueueTask(ThreadPool *tp, const ThreadPoolDest *dest,
+                                    WorkerTask *task) {
+  assert(tp);
+  assert(dest);
+  assert(task);
+  TnStatus status;
+
+  __atomic_add_fetch(&tp->NQueued, 1, __ATOMIC_SEQ_CST);
+
+  if (dest->Worker == TP_NO_WORKER) {
+    status = TQMonitorAddSourceTask(tp->Tasks + ThreadPoolShard(tp),
+                                    dest->Source, task);
+  } else {
+    if (tp->Config.MaxQueueDelay != 0) task->EnqueueTime = ThreadPoolNow();
+    status = WorkerInboxPush(tp->Inboxes + dest->Worker, task, dest->Pinned);
+  }
+
+  if (!TnStatusOk(status)) ThreadPoolTaskDequeued(tp, task);
+
+  return status;
+}
+
+static void ThreadPoolTaskDequeued(ThreadPool *tp, const WorkerTask *task) {
+  assert(tp);
+  assert(task);
+
+  size_t nQueued = __atomic_sub_fetch(&tp->NQueued, 1, __ATOMIC_SEQ_CST);
+
+  if (tp->Config.MaxQueueDelay != 0) {
+    uint64_t delay = 0;
+    if (nQueued != 0 && task->EnqueueTime != 0) {
+      uint64_t now = ThreadPoolNow();
+      if (now > task->EnqueueTime) delay = now - task->EnqueueTime;
+    }
+    __atomic_store_n(&tp->QueueDelay, delay, __ATOMIC_RELAXED);
+  }
+
+  if (__atomic_load_n(&tp->NBlocked, __ATOMIC_SEQ_CST) == 0) return;
+
+  pthread_mutex_lock(&tp->SpaceMutex);
+  pthread_cond_signal(&tp->SpaceCond);
+  pthread_mutex_unlock(&tp->SpaceMutex);
+}
+
+static int ThreadPoolAdmits(ThreadPool *tp) {
+  assert(tp);
+  size_t nQueued = __atomic_load_n(&tp->NQueued, __ATOMIC_SEQ_CST);
+
+  if (tp->Config.MaxQueueDepth != 0 && nQueued >= tp->Config.MaxQueueDepth)
+    return 0;
+
+  /* An empty queue admits regardless of how long the last task waited */
+  if (tp->Config.MaxQueueDelay != 0 && nQueued != 0 &&
+      __atomic_load_n(&tp->QueueDelay, __ATOMIC_RELAXED) >
+          tp->Config.MaxQueueDelay)
+    return 0;
+
+  return 1;
+}
+
+static TnStatus ThreadPoolWaitSpace(ThreadPool *tp, uint64_t timeout) {
+  assert(tp);
+  int res = 0;
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += timeout / 1000000000ull;
+  deadline.tv_nsec += timeout % 1000000000ull;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  pthread_mutex_lock(&tp->SpaceMutex);
+  __atomic_add_fetch(&tp->NBlocked, 1, __ATOMIC_SEQ_CST);
+
+  while (res == 0 && !ThreadPoolAdmits(tp))
+    res = pthread_cond_timedwait(&tp->SpaceCond, &tp->SpaceMutex, &deadline);
+
+  /* Pass the wakeup on, another producer may fit too */
+  if (res == 0) pthread_cond_signal(&tp->SpaceCond);
+
+  __atomic_sub_fetch(&tp->NBlocked, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&tp->SpaceMutex);
+
+  if (res == ETIMEDOUT && ThreadPoolAdmits(tp)) res = 0;
+  if (res == 0) return TN_OK;
+
+  errno = res;
+  return TNSTATUS(TN_ERRNO);
+}
+
+static int ThreadPoolQueueEmpty(void *args) {
+  return !ThreadPoolHasTasks((ThreadPool *)args, TP_NO_WORKER);
+}
+
+static int ThreadPoolGroupFinished(void *args) {
+  size_t pending;
+  TaskGroupPending((TaskGroup *)args, &pending);
+  return pending == 0;
+}
+
+TnStatus ThreadPoolConfigInit(ThreadPoolConfig *config, size_t nWorkers) {
+  if (!config) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  config->NWorkers = nWorkers;
+  config->StartPolicy = TP_START_SERIAL;
+  config->CgroupRoot = NULL;
+  config->QuotaInterval = 0;
+  config->WorkerArbiter = NULL;
+  config->ArbiterWeight = 1;
+  config->SpinRounds = TP_SPIN_ROUNDS;
+  config->MaxBatch = TP_BATCH_MAX;
+  config->NShards = 1;
+  config->ShardPolicy = TP_SHARD_BY_THREAD;
+  config->FiberStackSize = 0;
+  config->FiberGuard = 1;
+  config->MaxFibers = 0;
+  config->MaxQueueDepth = 0;
+  config->MaxQueueDelay = 0;
+  config->ReserveTasks = 0;
+  config->ReserveInboxTasks = 0;
+  config->ReserveFibers = 0;
+  config->StallBudget = 0;
+  config->StallInterval = TP_STALL_INTERVAL;
+  config->OnStall = NULL;
+  config->StallArgs = NULL;
+
+  return TN_OK;
+}
+
+static TnStatus ThreadPoolShardsInit(ThreadPool *tp) {
+  assert(tp);
+  TnStatus status = TN_OK;
+  size_t nShards = tp->Config.NShards;
+
+  tp->Tasks = (TQMonitor *)malloc(nShards * sizeof(TQMonitor));
+  if (!tp->Tasks) return TNSTATUS(TN_BAD_ALLOC);
+
+  int res = pthread_mutex_init(&tp->SourceMutex, NULL);
+  if (res != 0) {
+    errno = res;
+    free(tp->Tasks);
+    return TNSTATUS(TN_ERRNO);
+  }
+
+  size_t created = 0;
+  for (; created < nShards; ++created) {
+    status = TQMonitorInit(tp->Tasks + created);
+    if (!TnStatusOk(status)) break;
+
+    status = TQMonitorReserve(tp->Tasks + created, tp->Config.ReserveTasks);
+    if (!TnStatusOk(status)) {
+      TQMonitorDestroy(tp->Tasks + created);
+      break;
+    }
+
+    tp->Tasks[created].MutexProfile.ID = created;
+    tp->Tasks[created].StampTasks = tp->Config.MaxQueueDelay != 0;
+    tp->Tasks[created].NConsumers =
+        (tp->Config.NWorkers + nShards - 1) / nShards;
+  }
+
+  if (TnStatusOk(status)) return status;
+
+  while (created-- > 0) TQMonitorDestroy(tp->Tasks + created);
+  pthread_mutex_destroy(&tp->SourceMutex);
+  free(tp->Tasks);
+
+  return status;
+}
+
+static TnStatus ThreadPoolAdmissionInit(ThreadPool *tp) {
+  assert(tp);
+  pthread_condattr_t attr;
+  int res;
+
+  tp->NQueued = 0;
+  tp->QueueDelay = 0;
+  tp->NBlocked = 0;
+
+  res = pthread_mutex_init(&tp->SpaceMutex, NULL);
+  if (res != 0) {
+    errno = res;
+    return TNSTATUS(TN_ERRNO);
+  }
+
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  res = pthread_cond_init(&tp->SpaceCond, &attr);
+  pthread_condattr_destroy(&attr);
+
+  if (res != 0) {
+    errno = res;
+    pthread_mutex_destroy(&tp->SpaceMutex);
+    return TNSTATUS(TN_ERRNO);
+  }
+
+  return TN_OK;
+}
+
+static void ThreadPoolAdmissionDestroy(ThreadPool *tp) {
+  assert(tp);
+
+  pthread_mutex_destroy(&tp->SpaceMutex);
+  pthread_cond_destroy(&tp->SpaceCond);
+}
+
+static TnStatus ThreadPoolFibersInit(ThreadPool *tp) {
+  assert(tp);
+  const ThreadPoolConfig *config = &tp->Config;
+  TnStatus status;
+  int res;
+
+  if (config->FiberStackSize == 0) return TN_OK;
+
+  status = FiberPoolInit(&tp->Fibers, config->FiberStackSize,
+                         config->FiberGuard);
+  if (!TnStatusOk(status)) return status;
+
+  FiberPoolSetLimit(&tp->Fibers, config->MaxFibers);
+
+  status = FiberPoolReserve(&tp->Fibers, config->ReserveFibers);
+  if (!TnStatusOk(status)) {
+    FiberPoolDestroy(&tp->Fibers);
+    return status;
+  }
+
+  status = TaskQueueInit(&tp->Starved);
+  if (!TnStatusOk(status)) {
+    FiberPoolDestroy(&tp->Fibers);
+    return status;
+  }
+
+  res = pthread_mutex_init(&tp->StarvedMutex, NULL);
+  if (res != 0) {
+    errno = res;
+    TaskQueueDestroy(&tp->Starved);
+    FiberPoolDestroy(&tp->Fibers);
+    return TNSTATUS(TN_ERRNO);
+  }
+
+  return TN_OK;
+}
+
+static void ThreadPoolFibersDestroy(ThreadPool *tp) {
+  assert(tp);
+
+  if (tp->Config.FiberStackSize == 0) return;
+
+  pthread_mutex_destroy(&tp->StarvedMutex);
+  TaskQueueDestroy(&tp->Starved);
+  FiberPoolDestroy(&tp->Fibers);
+}
+
+static TnStatus ThreadPoolActiveInit(ThreadPool *tp) {
+  assert(tp);
+  pthread_condattr_t attr;
+  int res;
+
+  tp->NActive = tp->Config.NWorkers;
+  tp->QuotaRunning = 0;
+  tp->QuotaStop = 0;
+  tp->Leased = 0;
+
+  tp->Parked = (uint8_t *)calloc(tp->Config.NWorkers, sizeof(uint8_t));
+  tp->Wake = (uint32_t *)calloc(tp->Config.NWorkers, sizeof(uint32_t));
+
+  if (!tp->Parked || !tp->Wake) {
+    free(tp->Parked);
+    free(tp->Wake);
+    return TNSTATUS(TN_BAD_ALLOC);
+  }
+
+  res = pthread_mutex_init(&tp->ActiveMutex, NULL);
+  if (res != 0) {
+    errno = res;
+    free(tp->Parked);
+    free(tp->Wake);
+    return TNSTATUS(TN_ERRNO);
+  }
+
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  res = pthread_cond_init(&tp->QuotaCond, &attr);
+  pthread_condattr_destroy(&attr);
+
+  if (res != 0) {
+    errno = res;
+    free(tp->Parked);
+    free(tp->Wake);
+    pthread_mutex_destroy(&tp->ActiveMutex);
+    return TNSTATUS(TN_ERRNO);
+  }
+
+  return TN_OK;
+}
+
+static void ThreadPoolActiveDestroy(ThreadPool *tp) {
+  assert(tp);
+
+  free(tp->Parked);
+  free(tp->Wake);
+  pthread_mutex_destroy(&tp->ActiveMutex);
+  pthread_cond_destroy(&tp->QuotaCond);
+}
+
+static TnStatus ThreadPoolStallInit(ThreadPool *tp) {
+  assert(tp);
+  pthread_condattr_t attr;
+  int res;
+
+  tp->NStalled = 0;
+  tp->StallRunning = 0;
+  tp->StallStop = 0;
+
+  tp->Running = (ThreadPoolRunning *)calloc(tp->Config.NWorkers,
+                                            sizeof(ThreadPoolRunning));
+  if (!tp->Running) return TNSTATUS(TN_BAD_ALLOC);
+
+  res = pthread_mutex_init(&tp->StallMutex, NULL);
+  if (res != 0) {
+    errno = res;
+    free(tp->Running);
+    return TNSTATUS(TN_ERRNO);
+  }
+
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  res = pthread_cond_init(&tp->StallCond, &attr);
+  pthread_condattr_destroy(&attr);
+
+  if (res != 0) {
+    errno = res;
+    free(tp->Running);
+    pthread_mutex_destroy(&tp->StallMutex);
+    return TNSTATUS(TN_ERRNO);
+  }
+
+  return TN_OK;
+}
+
+static void ThreadPoolStallDestroy(ThreadPool *tp) {
+  assert(tp);
+
+  free(tp->Running);
+  pthread_mutex_destroy(&tp->StallMutex);
+  pthread_cond_destroy(&tp->StallCond);
+}
+
+static void ThreadPoolShardsDestroy(ThreadPool *tp) {
+  assert(tp);
+
+  for (size_t i = 0; i < tp->Config.NShards; ++i)
+    TQMonitorDestroy(tp->Tasks + i);
+
+  pthread_mutex_destroy(&tp->SourceMutex);
+  free(tp->Tasks);
+}
+
+static TnStatus ThreadPoolInboxesInit(ThreadPool *tp) {
+  assert(tp);
+  TnStatus status = TN_OK;
+  size_t nWorkers = tp->Workers.Size;
 
-  if (state == WORKER_READY) {
-    status = TQMonitorGetTask(&tp->Tasks, &task);
-    TnStatusCode code = status.Code;
-
-    if (code == TN_SUCCESS) {
-      status = WorkerAssignTaskAsync(worker, task);
-      assert(TnStatusOk(status));
-    } else if (code == TN_UNDERFLOW) {
-      status = WQMonitorAddWorker(&tp->FreeWorkers, &worker->ID);
-      assert(TnStatusOk(status));
-    } else
-      assert(0);
-  } else if (state == WORKER_DONE) {
-    status = WorkerFinishTaskAsync(worker);
-    assert(TnStatusOk(status));
+  tp->Inboxes = (WorkerInbox *)malloc(nWorkers * sizeof(WorkerInbox));
+  tp->WorkerNodes = (int *)malloc(nWorkers * sizeof(int));
+  tp->Batches = (ThreadPoolBatch *)malloc(nWorkers * sizeof(ThreadPoolBatch));
+
+  if (!tp->Inboxes || !tp->WorkerNodes || !tp->Batches) {
+    free(tp->Inboxes);
+    free(tp->WorkerNodes);
+    free(tp->Batches);
+    return TNSTATUS(TN_BAD_ALLOC);
+  }
+
+  size_t created = 0;
+  for (; created < nWorkers; ++created) {
+    status = WorkerInboxInit(tp->Inboxes + created);
+    if (!TnStatusOk(status)) break;
+
+    status = WorkerInboxReserve(tp->Inboxes + created,
+                                tp->Config.ReserveInboxTasks);
+    if (!TnStatusOk(status)) {
+      WorkerInboxDestroy(tp->Inboxes + created);
+      break;
+    }
+
+    TopologyCpuNode(__atomic_load_n(&tp->Workers.Workers[created].Core,
+                                    __ATOMIC_RELAXED),
+                    tp->WorkerNodes + created);
+
+    tp->Batches[created].Pool = tp;
+    tp->Batches[created].Worker = created;
+    tp->Batches[created].N = 0;
+  }
+
+  if (TnStatusOk(status)) {
+    tp->TargetSeed = 0;
+    return status;
   }
+
+  while (created-- > 0) WorkerInboxDestroy(tp->Inboxes + created);
+  free(tp->Inboxes);
+  free(tp->WorkerNodes);
+  free(tp->Batches);
+
+  return status;
+}
+
+static void ThreadPoolInboxesDestroy(ThreadPool *tp) {
+  assert(tp);
+
+  for (size_t i = 0; i < tp->Workers.Size; ++i)
+    WorkerInboxDestroy(tp->Inboxes + i);
+
+  free(tp->Inboxes);
+  free(tp->WorkerNodes);
+  free(tp->Batches);
 }
 
 TnStatus ThreadPoolInit(ThreadPool *tp, size_t nWorkers) {
-  if (!tp) return TNSTATUS(TN_BAD_ARG_PTR);
-  if (nWorkers == 0) return TNSTATUS(TN_BAD_ARG_VAL);
+  ThreadPoolConfig config;
+  ThreadPoolConfigInit(&config, nWorkers);
+
+  return ThreadPoolInitConfig(tp, &config);
+}
+
+/* Tears down what ThreadPoolInitConfig has set up up to and including
+ * the stage, in reverse order. Returns status, the reason to unwind. */
+static TnStatus ThreadPoolUnwind(ThreadPool *tp, ThreadPoolInitStage done,
+                                 TnStatus status) {
+  assert(tp);
+
+  if (done >= TP_INIT_STALL) ThreadPoolStallDestroy(tp);
+  if (done >= TP_INIT_ACTIVE) ThreadPoolActiveDestroy(tp);
+  if (done >= TP_INIT_LATENCY) free(tp->Latency);
+  if (done >= TP_INIT_FIBERS) ThreadPoolFibersDestroy(tp);
+  if (done >= TP_INIT_ADMISSION) ThreadPoolAdmissionDestroy(tp);
+  if (done >= TP_INIT_INBOXES) ThreadPoolInboxesDestroy(tp);
+  if (done >= TP_INIT_WORKERS) WorkerArrayDestroy(&tp->Workers);
+  if (done >= TP_INIT_FREE_WORKERS) WQMonitorDestroy(&tp->FreeWorkers);
+  if (done >= TP_INIT_SHARDS) ThreadPoolShardsDestroy(tp);
+
+  return status;
+}
+
+TnStatus ThreadPoolInitConfig(ThreadPool *tp, const ThreadPoolConfig *config) {
+  if (!tp || !config) return TNSTATUS(TN_BAD_ARG_PTR);
+  if (config->NWorkers == 0 || config->NShards == 0 ||
+      config->MaxBatch == 0 || config->MaxBatch > TP_BATCH_MAX)
+    return TNSTATUS(TN_BAD_ARG_VAL);
+  if (config->StallBudget != 0 && config->StallInterval == 0)
+    return TNSTATUS(TN_BAD_ARG_VAL);
 
   TnStatus status;
+  CpuQuota quota;
 
-  status = TQMonitorInit(&tp->Tasks);
-  if (!TnStatusOk(status)) return status;
+  tp->Config = *config;
 
-  status = WQMonitorInit(&tp->FreeWorkers, nWorkers);
-  if (!TnStatusOk(status)) {
-    TQMonitorDestroy(&tp->Tasks);
-    return status;
+  if (config->NWorkers == TP_WORKERS_AUTO) {
+    status = CpuQuotaRead(config->CgroupRoot, &quota);
+    if (!TnStatusOk(status)) return status;
+
+    tp->Config.NWorkers = quota.Limit;
   }
 
-  status = WorkerArrayInit(&tp->Workers, nWorkers);
-  if (!TnStatusOk(status)) {
-    TQMonitorDestroy(&tp->Tasks);
-    WQMonitorDestroy(&tp->FreeWorkers);
-    return status;
+  config = &tp->Config;
+
+  status = ThreadPoolShardsInit(tp);
+  if (!TnStatusOk(status)) return status;
+
+  status = WQMonitorInit(&tp->FreeWorkers, config->NWorkers);
+  if (!TnStatusOk(status)) return ThreadPoolUnwind(tp, TP_INIT_SHARDS, status);
+
+  status = WorkerArrayInit(&tp->Workers, config->NWorkers);
+  if (!TnStatusOk(status))
+    return ThreadPoolUnwind(tp, TP_INIT_FREE_WORKERS, status);
+
+  status = ThreadPoolInboxesInit(tp);
+  if (!TnStatusOk(status)) return ThreadPoolUnwind(tp, TP_INIT_WORKERS, status);
+
+  status = ThreadPoolAdmissionInit(tp);
+  if (!TnStatusOk(status)) return ThreadPoolUnwind(tp, TP_INIT_INBOXES, status);
+
+  status = ThreadPoolFibersInit(tp);
+  if (!TnStatusOk(status))
+    return ThreadPoolUnwind(tp, TP_INIT_ADMISSION, status);
+
+  tp->Latency =
+      (ThreadPoolLatency *)malloc(config->NWorkers * sizeof(ThreadPoolLatency));
+  if (!tp->Latency)
+    return ThreadPoolUnwind(tp, TP_INIT_FIBERS, TNSTATUS(TN_BAD_ALLOC));
+
+  status = ThreadPoolActiveInit(tp);
+  if (!TnStatusOk(status)) return ThreadPoolUnwind(tp, TP_INIT_LATENCY, status);
+
+  status = ThreadPoolStallInit(tp);
+  if (!TnStatusOk(status)) return ThreadPoolUnwind(tp, TP_INIT_ACTIVE, status);
+
+  for (size_t i = 0; i < config->NWorkers; ++i) {
+    HistogramInit(&tp->Latency[i].QueueDelay);
+    HistogramInit(&tp->Latency[i].Execution);
+    tp->Latency[i].Start = 0;
   }
 
+  tp->NHelpers = 0;
+  tp->HelpEpoch = 0;
+  tp->NClaimed = 0;
+  tp->NSpawned = 0;
+  tp->NReady = 0;
+  tp->SpawnError = 0;
+  tp->RecordLatency = 0;
+  tp->InFlight = 0;
+  tp->IdleEpoch = 0;
+  tp->NIdleWaiters = 0;
+  tp->NSpinning = 0;
+  tp->Stopping = 0;
+
   return TN_OK;
 }
 
 TnStatus ThreadPoolRun(ThreadPool *tp) {
   if (!tp) return TNSTATUS(TN_BAD_ARG_PTR);
 
+  TnStatus status = ThreadPoolQuotaStart(tp);
+  if (!TnStatusOk(status)) return status;
+
+  if (tp->Config.WorkerArbiter && !tp->Leased) {
+    tp->Lease.Weight = tp->Config.ArbiterWeight;
+    tp->Lease.Max = tp->Workers.Size;
+    tp->Lease.Demand = ThreadPoolLeaseDemand;
+    tp->Lease.Apply = ThreadPoolLeaseApply;
+    tp->Lease.Args = tp;
+
+    status = ArbiterJoin(tp->Config.WorkerArbiter, &tp->Lease);
+    if (!TnStatusOk(status)) {
+      ThreadPoolQuotaStop(tp);
+      return status;
+    }
+
+    tp->Leased = 1;
+  }
+
+  status = ThreadPoolStallStart(tp);
+  if (!TnStatusOk(status)) {
+    if (tp->Leased) {
+      ArbiterLeave(tp->Config.WorkerArbiter, &tp->Lease);
+      tp->Leased = 0;
+    }
+    ThreadPoolQuotaStop(tp);
+    return status;
+  }
+
+  tp->NReady = 0;
+  tp->SpawnError = 0;
+  tp->Stopping = 0;
+  memset(tp->Wake, 0, tp->Workers.Size * sizeof(uint32_t));
+
+  if (tp->Config.StartPolicy != TP_START_SERIAL) {
+    tp->NClaimed = 0;
+    tp->NSpawned = 0;
+
+    if (tp->Config.StartPolicy == TP_START_PARALLEL)
+      for (size_t i = 0; i < TP_SPAWN_FANOUT; ++i) ThreadPoolSpawnWorker(tp);
+
+    return TN_OK;
+  }
+
+  tp->NClaimed = tp->Workers.Size;
+  tp->NSpawned = tp->Workers.Size;
+
   WorkerCallbackT callback;
   callback.Args = tp;
   callback.Function = WorkerCallback;
@@ -62,63 +1524,460 @@ TnStatus ThreadPoolRun(ThreadPool *tp) {
   return WorkerArrayRun(&tp->Workers, callback);
 }
 
+TnStatus ThreadPoolWaitReady(ThreadPool *tp) {
+  if (!tp) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  while (ThreadPoolSpawnWorker(tp)) {
+  }
+
+  while (1) {
+    uint32_t nReady = __atomic_load_n(&tp->NReady, __ATOMIC_SEQ_CST);
+    if (nReady == tp->Workers.Size) return TN_OK;
+
+    int error = __atomic_load_n(&tp->SpawnError, __ATOMIC_SEQ_CST);
+    if (error) {
+      errno = error;
+      return TNSTATUS(TN_ERRNO);
+    }
+
+    if (__atomic_load_n(&tp->NClaimed, __ATOMIC_SEQ_CST) & TP_SPAWN_CLOSED)
+      return TNSTATUS(TN_FSM_WRONG_STATE);
+
+    TnStatus status = FutexWait(&tp->NReady, nReady);
+    if (!TnStatusOk(status)) return status;
+  }
+}
+
 TnStatus ThreadPoolStop(ThreadPool *tp) {
   if (!tp) return TNSTATUS(TN_BAD_ARG_PTR);
 
+  ThreadPoolQuotaStop(tp);
+  ThreadPoolStallStop(tp);
+
+  if (tp->Leased) {
+    ArbiterLeave(tp->Config.WorkerArbiter, &tp->Lease);
+    tp->Leased = 0;
+  }
+
+  /* No more starts, and let the ones under way finish so that their
+   * workers get stopped too */
+  size_t claimed =
+      __atomic_fetch_or(&tp->NClaimed, TP_SPAWN_CLOSED, __ATOMIC_SEQ_CST) &
+      ~TP_SPAWN_CLOSED;
+  while (__atomic_load_n(&tp->NSpawned, __ATOMIC_SEQ_CST) != claimed)
+    sched_yield();
+
+  FutexWake(&tp->NReady, INT_MAX);
+
+  /* Idle workers sleep outside their mutex, get them back to it */
+  __atomic_store_n(&tp->Stopping, 1, __ATOMIC_SEQ_CST);
+  for (WorkerID id = 0; id < tp->Workers.Size; ++id) ThreadPoolWake(tp, id);
+
   return WorkerArrayStop(&tp->Workers);
 }
 
 TnStatus ThreadPoolDestroy(ThreadPool *tp) {
   if (!tp) return TNSTATUS(TN_BAD_ARG_PTR);
 
-  TQMonitorDestroy(&tp->Tasks);
-  WQMonitorDestroy(&tp->FreeWorkers);
-  WorkerArrayDestroy(&tp->Workers);
+  return ThreadPoolUnwind(tp, TP_INIT_ALL, TN_OK);
+}
 
-  return TN_OK;
+static TnStatus ThreadPoolSubmit(ThreadPool *tp, TaskSourceID source,
+                                 WorkerTask task) {
+  assert(tp);
+
+  ThreadPoolDest dest = {TP_NO_WORKER, source, 0};
+  return ThreadPoolSubmitTo(tp, &dest, task);
+}
+
+static TnStatus ThreadPoolSubmitTo(ThreadPool *tp, const ThreadPoolDest *dest,
+                                   WorkerTask task) {
+  assert(tp);
+  assert(dest);
+
+  if (!task.Function || !task.Args || !task.Result)
+    return TNSTATUS(TN_BAD_ARG_PTR);
+
+  /* A resumed fiber is still counted from its first submission */
+  int isNew = task.Function != ThreadPoolFiberRun;
+
+  task.EnqueueTime = 0;
+  task.SubmitTime = ThreadPoolStamp(tp);
+  if (isNew) {
+    task.ID = ThreadPoolTaskID();
+    __atomic_add_fetch(&tp->InFlight, 1, __ATOMIC_SEQ_CST);
+  }
+
+  TnStatus status = ThreadPoolDispatch(tp, dest, task);
+  if (!TnStatusOk(status)) {
+    if (isNew) ThreadPoolTaskRetired(tp);
+    return status;
+  }
+
+  /* Only for queued tasks, a worker may have started it already */
+  TN_PROBE4(submit, tp, task.ID, task.Function, task.Args);
+
+  return status;
+}
+
+/* Queues the task and wakes a worker for it */
+static TnStatus ThreadPoolDispatch(ThreadPool *tp, const ThreadPoolDest *dest,
+                                   WorkerTask task) {
+  assert(tp);
+  assert(dest);
+
+  TnStatus status;
+  WorkerID id = dest->Worker;
+
+  if (id == TP_NO_WORKER) {
+    status = ThreadPoolQueueTask(tp, dest, &task);
+    if (!TnStatusOk(status)) return status;
+
+    if (!ThreadPoolWakeOne(tp)) ThreadPoolSpawnLazy(tp);
+    ThreadPoolWakeHelpers(tp, 0);
+
+    return status;
+  }
+
+  /* Workers start in ID order, a lazy pool may not be there yet */
+  while (__atomic_load_n(&tp->NClaimed, __ATOMIC_SEQ_CST) <= id &&
+         ThreadPoolSpawnWorker(tp)) {
+  }
+
+  status = ThreadPoolQueueTask(tp, dest, &task);
+  if (!TnStatusOk(status)) return status;
+
+  if (TnStatusOk(WQMonitorClaimWorker(&tp->FreeWorkers, &id)) ||
+      ThreadPoolUnpark(tp, id)) {
+    ThreadPoolWake(tp, id);
+    return status;
+  }
+
+  if (!dest->Pinned) {  // Busy target, let anyone idle take it
+    ThreadPoolWakeOne(tp);
+    ThreadPoolWakeHelpers(tp, 0);
+  }
+
+  return status;
 }
 
 TnStatus ThreadPoolAddTask(ThreadPool *tp, WorkerTask task) {
   if (!tp) return TNSTATUS(TN_BAD_ARG_PTR);
 
-  TnStatus status;
-  WorkerID workerID;
-  Worker *worker;
+  task.Group = NULL;
+  task.Completions = NULL;
 
-  status = WQMonitorGetWorker(&tp->FreeWorkers, &workerID);
-  TnStatusCode code = status.Code;
+  return ThreadPoolSubmit(tp, 0, task);
+}
 
-  if (code == TN_SUCCESS) {  // Has free worker, assign task
-    status = WorkerArrayGet(&tp->Workers, workerID, &worker);
-    assert(TnStatusOk(status));
+TnStatus ThreadPoolTryAddTask(ThreadPool *tp, WorkerTask task) {
+  if (!tp) return TNSTATUS(TN_BAD_ARG_PTR);
+  if (!ThreadPoolAdmits(tp)) return TNSTATUS(TN_OVERFLOW);
+
+  return ThreadPoolAddTask(tp, task);
+}
+
+TnStatus ThreadPoolAddTaskTimed(ThreadPool *tp, WorkerTask task,
+                                uint64_t timeout) {
+  if (!tp) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  if (!ThreadPoolAdmits(tp)) {
+    if (CurrentPool == tp) return TNSTATUS(TN_OVERFLOW);
+
+    TnStatus status = ThreadPoolWaitSpace(tp, timeout);
     if (!TnStatusOk(status)) return status;
+  }
 
-    status = WorkerAssignTask(worker, task);
+  return ThreadPoolAddTask(tp, task);
+}
+
+/* Picks a worker for the target, rotating between equal candidates */
+static TnStatus ThreadPoolResolveTarget(ThreadPool *tp,
+                                        const ThreadPoolTarget *target,
+                                        WorkerID *id) {
+  assert(tp);
+  assert(target);
+  assert(id);
+
+  size_t nWorkers = tp->Workers.Size;
+
+  if (target->Kind == TP_TARGET_WORKER) {
+    if (target->ID >= nWorkers) return TNSTATUS(TN_BAD_ARG_VAL);
+    *id = target->ID;
+    return TN_OK;
+  }
+
+  size_t start = __atomic_fetch_add(&tp->TargetSeed, 1, __ATOMIC_RELAXED);
 
-    if (!TnStatusOk(status)) {  // Failed to assign
-      assert(TnStatusOk(WQMonitorAddWorker(&tp->FreeWorkers, &workerID)));
+  for (size_t i = 0; i < nWorkers; ++i) {
+    WorkerID candidate = (start + i) % nWorkers;
+    int match;
+
+    switch (target->Kind) {
+      case TP_TARGET_CPU:
+        match = __atomic_load_n(&tp->Workers.Workers[candidate].Core,
+                                __ATOMIC_RELAXED) == (int)target->ID;
+        break;
+      case TP_TARGET_NODE:
+        match = __atomic_load_n(tp->WorkerNodes + candidate,
+                                __ATOMIC_RELAXED) == (int)target->ID;
+        break;
+      default:
+        return TNSTATUS(TN_BAD_ARG_VAL);
     }
-  } else if (code == TN_UNDERFLOW) {  // No free workers, save task
-    status = TQMonitorAddTask(&tp->Tasks, &task);
-    if (!TnStatusOk(status)) {  // Failed to assign
-      assert(TnStatusOk(WQMonitorAddWorker(&tp->FreeWorkers, &workerID)));
+
+    if (match) {
+      *id = candidate;
+      return TN_OK;
     }
-  } else assert(0);
+  }
+
+  return TNSTATUS(TN_BAD_ARG_VAL);  // No worker runs there
+}
+
+TnStatus ThreadPoolAddTaskTo(ThreadPool *tp, ThreadPoolTarget target,
+                             WorkerTask task) {
+  if (!tp) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  ThreadPoolDest dest = {TP_NO_WORKER, 0, !target.AllowSteal};
+
+  TnStatus status = ThreadPoolResolveTarget(tp, &target, &dest.Worker);
+  if (!TnStatusOk(status)) return status;
+
+  task.Group = NULL;
+  task.Completions = NULL;
+
+  return ThreadPoolSubmitTo(tp, &dest, task);
+}
+
+TnStatus ThreadPoolTryAddTaskTo(ThreadPool *tp, ThreadPoolTarget target,
+                                WorkerTask task) {
+  if (!tp) return TNSTATUS(TN_BAD_ARG_PTR);
+  if (!ThreadPoolAdmits(tp)) return TNSTATUS(TN_OVERFLOW);
+
+  return ThreadPoolAddTaskTo(tp, target, task);
+}
+
+TnStatus ThreadPoolAddSource(ThreadPool *tp, const char *name, size_t weight,
+                             TaskSourceID *id) {
+  if (!tp || !name || !id) return TNSTATUS(TN_BAD_ARG_PTR);
+  if (weight == 0) return TNSTATUS(TN_BAD_ARG_VAL);
+
+  TnStatus status = TN_OK;
+  TaskSourceID shardID;
+  size_t nShards = tp->Config.NShards;
+  size_t prepared = 0;
+
+  TaskQueue *queues = (TaskQueue *)malloc(nShards * sizeof(TaskQueue));
+  if (!queues) return TNSTATUS(TN_BAD_ALLOC);
+
+  /* A source has the same ID on every shard: only one is added at a time,
+   * and only once every shard has its queue, so that committing them
+   * cannot fail halfway */
+  pthread_mutex_lock(&tp->SourceMutex);
+
+  for (; prepared < nShards; ++prepared) {
+    status = TQMonitorPrepareSource(tp->Tasks + prepared, queues + prepared);
+    if (!TnStatusOk(status)) break;
+  }
+
+  if (!TnStatusOk(status)) {
+    while (prepared-- > 0) TaskQueueDestroy(queues + prepared);
+
+    pthread_mutex_unlock(&tp->SourceMutex);
+    free(queues);
+    return status;
+  }
+
+  for (size_t i = 0; i < nShards; ++i) {
+    status = TQMonitorCommitSource(tp->Tasks + i, name, weight, queues + i,
+                                   &shardID);
+    assert(TnStatusOk(status));
+
+    if (i == 0) *id = shardID;
+    assert(shardID == *id);
+  }
+
+  pthread_mutex_unlock(&tp->SourceMutex);
+  free(queues);
+
+  return TN_OK;
+}
+
+TnStatus ThreadPoolAddSourceTask(ThreadPool *tp, TaskSourceID source,
+                                 WorkerTask task) {
+  if (!tp) return TNSTATUS(TN_BAD_ARG_PTR);
+  if (source >= tp->Tasks[0].NSources) return TNSTATUS(TN_BAD_ARG_VAL);
+
+  task.Group = NULL;
+  task.Completions = NULL;
+
+  return ThreadPoolSubmit(tp, source, task);
+}
+
+TnStatus ThreadPoolGetSourceStats(ThreadPool *tp, TaskSourceID source,
+                                  TaskSourceStats *stats) {
+  if (!tp || !stats) return TNSTATUS(TN_BAD_ARG_PTR);
+  TnStatus status;
+  TaskSourceStats shardStats;
+
+  memset(stats, 0, sizeof(TaskSourceStats));
+
+  for (size_t i = 0; i < tp->Config.NShards; ++i) {
+    status = TQMonitorGetSourceStats(tp->Tasks + i, source, &shardStats);
+    if (!TnStatusOk(status)) return status;
+
+    stats->NTasks += shardStats.NTasks;
+    stats->Pending += shardStats.Pending;
+    stats->TotalDelay += shardStats.TotalDelay;
+    if (shardStats.MaxDelay > stats->MaxDelay)
+      stats->MaxDelay = shardStats.MaxDelay;
+
+    for (size_t j = 0; j < TQ_DELAY_BUCKETS; ++j)
+      stats->DelayBuckets[j] += shardStats.DelayBuckets[j];
+  }
+
+  return TN_OK;
+}
+
+TnStatus ThreadPoolSetActiveWorkers(ThreadPool *tp, size_t n) {
+  if (!tp) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  pthread_mutex_lock(&tp->ActiveMutex);
+  ThreadPoolSetActive(tp, n);
+  pthread_mutex_unlock(&tp->ActiveMutex);
+
+  return TN_OK;
+}
+
+TnStatus ThreadPoolRecordLatency(ThreadPool *tp, int enable) {
+  if (!tp) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  __atomic_store_n(&tp->RecordLatency, enable != 0, __ATOMIC_RELAXED);
+
+  return TN_OK;
+}
+
+TnStatus ThreadPoolGetLatency(ThreadPool *tp, Histogram *queueDelay,
+                              Histogram *execution) {
+  if (!tp) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  if (queueDelay) HistogramInit(queueDelay);
+  if (execution) HistogramInit(execution);
+
+  for (size_t i = 0; i < tp->Workers.Size; ++i) {
+    if (queueDelay) HistogramMerge(queueDelay, &tp->Latency[i].QueueDelay);
+    if (execution) HistogramMerge(execution, &tp->Latency[i].Execution);
+  }
+
+  return TN_OK;
+}
+
+TnStatus ThreadPoolGetStalled(ThreadPool *tp, size_t *n) {
+  if (!tp || !n) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  *n = __atomic_load_n(&tp->NStalled, __ATOMIC_RELAXED);
+  return TN_OK;
+}
+
+TnStatus ThreadPoolGetLockProfiles(ThreadPool *tp, LockProfile *profiles,
+                                   size_t capacity, size_t *n) {
+  if (!tp || !n) return TNSTATUS(TN_BAD_ARG_PTR);
+  if (!profiles && capacity != 0) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  size_t nShards = tp->Config.NShards;
+  size_t nWorkers = tp->Workers.Size;
+
+  *n = nShards + 1 + nWorkers;
+  if (capacity < *n) return TNSTATUS(TN_OVERFLOW);
+
+  for (size_t i = 0; i < nShards; ++i)
+    LockProfileRead(&tp->Tasks[i].MutexProfile, profiles++);
+
+  LockProfileRead(&tp->FreeWorkers.MutexProfile, profiles++);
+
+  for (size_t i = 0; i < nWorkers; ++i)
+    LockProfileRead(&tp->Workers.Workers[i].MutexProfile, profiles++);
+
+  return TN_OK;
+}
+
+TnStatus ThreadPoolAddGroupTask(ThreadPool *tp, TaskGroup *group,
+                                WorkerTask task) {
+  if (!tp || !group) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  TnStatus status;
+
+  task.Group = group;
+  task.Completions = NULL;
+  TaskGroupAdd(group);
+
+  status = ThreadPoolSubmit(tp, 0, task);
+  if (!TnStatusOk(status)) ThreadPoolGroupDone(tp, group);
+
+  return status;
+}
+
+TnStatus ThreadPoolAddTaskCompletion(ThreadPool *tp, CompletionQueue *cq,
+                                     uint64_t tag, WorkerTask task) {
+  if (!tp || !cq) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  task.Group = NULL;
+  task.Completions = cq;
+  task.Tag = tag;
+
+  /* Completions are pushed from workers, which have nobody to report a
+   * full backlog to */
+  TnStatus status = CompletionQueueReserve(cq);
+  if (!TnStatusOk(status)) return status;
+
+  status = ThreadPoolSubmit(tp, 0, task);
+  if (!TnStatusOk(status)) CompletionQueueUnreserve(cq);
 
   return status;
 }
 
+TnStatus ThreadPoolWaitGroup(ThreadPool *tp, TaskGroup *group) {
+  if (!tp || !group) return TNSTATUS(TN_BAD_ARG_PTR);
+  TnStatus status;
+  Fiber *fiber = NULL;
+
+  /* Nested tasks would run on the fiber's small stack, and blocking would
+   * hold up the thread's other fibers: park instead */
+  FiberCurrent(&fiber);
+  if (!fiber) return ThreadPoolHelpUntil(tp, ThreadPoolGroupFinished, group);
+
+  while (!ThreadPoolGroupFinished(group)) {
+    status = FiberPark(ThreadPoolGroupHook, group);
+    if (!TnStatusOk(status)) return status;
+  }
+
+  return TN_OK;
+}
+
 TnStatus ThreadPoolWaitAll(ThreadPool *tp) {
   if (!tp) return TNSTATUS(TN_BAD_ARG_PTR);
   TnStatus status;
 
-  status =
-      TQMonitorWaitEmpty(&tp->Tasks);  // Wait for all the tasks to be taken
-  if (!TnStatusOk(status)) return status;
+  /* A worker can not wait for itself to become free, use a TaskGroup */
+  if (CurrentPool == tp) return TNSTATUS(TN_FSM_WRONG_STATE);
 
-  status = WQMonitorWaitFull(
-      &tp->FreeWorkers);  // Wait for all the workers to finish
+  status = ThreadPoolHelpUntil(tp, ThreadPoolQueueEmpty,
+                               tp);  // Run queued tasks until none left
   if (!TnStatusOk(status)) return status;
 
+  /* Then sleep until the last running one retires */
+  __atomic_add_fetch(&tp->NIdleWaiters, 1, __ATOMIC_SEQ_CST);
+
+  while (1) {
+    uint32_t epoch = __atomic_load_n(&tp->IdleEpoch, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&tp->InFlight, __ATOMIC_SEQ_CST) == 0) break;
+
+    status = FutexWait(&tp->IdleEpoch, epoch);
+    if (!TnStatusOk(status)) break;
+  }
+
+  __atomic_sub_fetch(&tp->NIdleWaiters, 1, __ATOMIC_SEQ_CST);
+
   return status;
-}
\ No newline at end of file
+}
@@ -0,0 +1,76 @@
+#include "ThreadPool/Topology.h"
+
+TnStatus TopologyParseCpuList(const char* list, cpu_set_t* set) {
+  if (!list || !set) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  const char* pos = list;
+  char* end;
+
+  CPU_ZERO(set);
+
+  while (*pos && *pos != '\n') {
+    long first = strtol(pos, &end, 10);
+    if (end == pos || first < 0) return TNSTATUS(TN_BAD_ARG_VAL);
+
+    long last = first;
+    pos = end;
+
+    if (*pos == '-') {
+      last = strtol(pos + 1, &end, 10);
+      if (end == pos + 1 || last < first) return TNSTATUS(TN_BAD_ARG_VAL);
+      pos = end;
+    }
+
+    for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu)
+      CPU_SET(cpu, set);
+
+    if (*pos == ',') pos++;
+  }
+
+  return TN_OK;
+}
+
+TnStatus TopologyReadCpuList(const char* path, cpu_set_t* set) {
+  if (!path || !set) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  char buf[4096];
+  FILE* file = fopen(path, "r");
+  if (!file) return TNSTATUS(TN_ERRNO);
+
+  if (!fgets(buf, sizeof(buf), file)) buf[0] = '\0';
+  fclose(file);
+
+  return TopologyParseCpuList(buf, set);
+}
+
+TnStatus TopologyCpuNode(int cpu, int* node) {
+  return TopologyCpuNodeIn(TOPOLOGY_SYSFS_NODES, cpu, node);
+}
+
+TnStatus TopologyCpuNodeIn(const char* root, int cpu, int* node) {
+  if (!root || !node) return TNSTATUS(TN_BAD_ARG_PTR);
+  if (cpu < 0 || cpu >= CPU_SETSIZE) return TNSTATUS(TN_BAD_ARG_VAL);
+
+  char path[256];
+  cpu_set_t nodes, set;
+
+  *node = 0;
+
+  /* Node IDs need not be contiguous, the online list names them */
+  snprintf(path, sizeof(path), "%s/online", root);
+  if (!TnStatusOk(TopologyReadCpuList(path, &nodes))) return TN_OK;
+
+  for (int i = 0; i < CPU_SETSIZE; ++i) {
+    if (!CPU_ISSET(i, &nodes)) continue;
+
+    snprintf(path, sizeof(path), "%s/node%d/cpulist", root, i);
+    if (!TnStatusOk(TopologyReadCpuList(path, &set))) continue;
+
+    if (CPU_ISSET(cpu, &set)) {
+      *node = i;
+      break;
+    }
+  }
+
+  return TN_OK;
+}
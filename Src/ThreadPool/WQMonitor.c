@@ -1,18 +1,33 @@
 #include "ThreadPool/WQMonitor.h"
 
+#define WQ_HEAD(id, tag) (((uint64_t)(tag) << 32) | (uint32_t)(id))
+#define WQ_HEAD_ID(head) ((uint32_t)(head))
+#define WQ_HEAD_TAG(head) ((uint32_t)((head) >> 32))
+
 TnStatus WQMonitorInit(WQMonitor* wqm, size_t capacity) {
   assert(wqm);
-  TnStatus status;
   int res;
 
-  status = WorkerQueueInit(&wqm->Workers, capacity);
-  if (!TnStatusOk(status)) return status;
+  if (capacity == 0 || capacity >= WQ_NIL) return TNSTATUS(TN_BAD_ARG_VAL);
+
+  wqm->Next = (uint32_t*)malloc(capacity * sizeof(uint32_t));
+  wqm->InStack = (uint8_t*)calloc(capacity, sizeof(uint8_t));
+  wqm->Idle = (uint8_t*)calloc(capacity, sizeof(uint8_t));
+
+  if (!wqm->Next || !wqm->InStack || !wqm->Idle) {
+    free(wqm->Next);
+    free(wqm->InStack);
+    free(wqm->Idle);
+    return TNSTATUS(TN_BAD_ALLOC);
+  }
 
   res = pthread_mutex_init(&wqm->Mutex, NULL);
 
   if (res != 0) {
     errno = res;
-    WorkerQueueDestroy(&wqm->Workers);
+    free(wqm->Next);
+    free(wqm->InStack);
+    free(wqm->Idle);
     return TNSTATUS(TN_ERRNO);
   }
 
@@ -20,23 +35,29 @@ TnStatus WQMonitorInit(WQMonitor* wqm, size_t capacity) {
 
   if (res != 0) {
     errno = res;
-    WorkerQueueDestroy(&wqm->Workers);
+    free(wqm->Next);
+    free(wqm->InStack);
+    free(wqm->Idle);
     pthread_mutex_destroy(&wqm->Mutex);
     return TNSTATUS(TN_ERRNO);
   }
 
+  LockProfileInit(&wqm->MutexProfile, "WQMonitor", 0);
+
+  wqm->Capacity = capacity;
+  wqm->Head = WQ_HEAD(WQ_NIL, 0);
+  wqm->Size = 0;
   wqm->HasError = 0;
 
   return TN_OK;
 }
 
 TnStatus WQMonitorDestroy(WQMonitor* wqm) {
-  TnStatus status;
-  int res;
-
   assert(wqm);
 
-  WorkerQueueDestroy(&wqm->Workers);
+  free(wqm->Next);
+  free(wqm->InStack);
+  free(wqm->Idle);
   pthread_mutex_destroy(&wqm->Mutex);
   pthread_cond_destroy(&wqm->CondFull);
 
@@ -45,53 +66,124 @@ TnStatus WQMonitorDestroy(WQMonitor* wqm) {
 
 static void WQMonitorLock(WQMonitor* wqm) {
   assert(wqm);
-  pthread_mutex_lock(&wqm->Mutex);
+  TN_MUTEX_LOCK(&wqm->Mutex, &wqm->MutexProfile);
 }
 
 static void WQMonitorUnlock(WQMonitor* wqm) {
   assert(wqm);
-  pthread_mutex_unlock(&wqm->Mutex);
+  TN_MUTEX_UNLOCK(&wqm->Mutex, &wqm->MutexProfile);
+}
+
+static void WQMonitorPush(WQMonitor* wqm, uint32_t id) {
+  assert(wqm);
+  uint64_t head = __atomic_load_n(&wqm->Head, __ATOMIC_SEQ_CST);
+  uint64_t newHead;
+
+  do {
+    __atomic_store_n(&wqm->Next[id], WQ_HEAD_ID(head), __ATOMIC_RELAXED);
+    newHead = WQ_HEAD(id, WQ_HEAD_TAG(head) + 1);
+  } while (!__atomic_compare_exchange_n(&wqm->Head, &head, newHead, 1,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+}
+
+static uint32_t WQMonitorPop(WQMonitor* wqm) {
+  assert(wqm);
+  uint64_t head = __atomic_load_n(&wqm->Head, __ATOMIC_SEQ_CST);
+  uint64_t newHead;
+  uint32_t id;
+
+  do {
+    id = WQ_HEAD_ID(head);
+    if (id == WQ_NIL) return WQ_NIL;
+
+    uint32_t next = __atomic_load_n(&wqm->Next[id], __ATOMIC_RELAXED);
+    newHead = WQ_HEAD(next, WQ_HEAD_TAG(head) + 1);
+  } while (!__atomic_compare_exchange_n(&wqm->Head, &head, newHead, 1,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+
+  return id;
 }
 
 TnStatus WQMonitorAddWorker(WQMonitor* wqm, const WorkerID* id) {
-  TnStatus status;
   assert(wqm);
   assert(id);
 
-  WQMonitorLock(wqm);
-  status = WorkerQueuePush(&wqm->Workers, id);
+  if (*id >= wqm->Capacity) return TNSTATUS(TN_OVERFLOW);
+  if (__atomic_exchange_n(&wqm->Idle[*id], 1, __ATOMIC_SEQ_CST))
+    return TNSTATUS(TN_OVERFLOW);
 
-  if (wqm->Workers.Size == wqm->Workers.Capacity)
-    pthread_cond_signal(&wqm->CondFull);
-  WQMonitorUnlock(wqm);
+  /* A stale entry left by WQMonitorClaimWorker becomes valid again */
+  if (!__atomic_exchange_n(&wqm->InStack[*id], 1, __ATOMIC_SEQ_CST))
+    WQMonitorPush(wqm, *id);
+
+  if (__atomic_add_fetch(&wqm->Size, 1, __ATOMIC_SEQ_CST) == wqm->Capacity) {
+    WQMonitorLock(wqm);
+    pthread_cond_broadcast(&wqm->CondFull);
+    WQMonitorUnlock(wqm);
+  }
 
-  return status;
+  return TN_OK;
 }
 
 TnStatus WQMonitorGetWorker(WQMonitor* wqm, WorkerID* id) {
-  TnStatus status;
   assert(wqm);
   assert(id);
+  uint32_t top;
+
+  while ((top = WQMonitorPop(wqm)) != WQ_NIL) {
+    __atomic_store_n(&wqm->InStack[top], 0, __ATOMIC_SEQ_CST);
+
+    uint8_t idle = 1;
+    if (__atomic_compare_exchange_n(&wqm->Idle[top], &idle, 0, 0,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+      __atomic_sub_fetch(&wqm->Size, 1, __ATOMIC_SEQ_CST);
+      *id = top;
+      return TN_OK;
+    }
+  }
 
-  WQMonitorLock(wqm);
-  status = WorkerQueuePop(&wqm->Workers, id);
-  WQMonitorUnlock(wqm);
+  return TNSTATUS(TN_UNDERFLOW);
+}
+
+/* Takes the given worker out of the idle set, if it is still there */
+TnStatus WQMonitorClaimWorker(WQMonitor* wqm, const WorkerID* id) {
+  assert(wqm);
+  assert(id);
+
+  if (*id >= wqm->Capacity) return TNSTATUS(TN_OVERFLOW);
 
-  return status;
+  uint8_t idle = 1;
+  if (!__atomic_compare_exchange_n(&wqm->Idle[*id], &idle, 0, 0,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+    return TNSTATUS(TN_UNDERFLOW);
+
+  __atomic_sub_fetch(&wqm->Size, 1, __ATOMIC_SEQ_CST);
+
+  return TN_OK;
 }
 
 TnStatus WQMonitorWaitFull(WQMonitor* wqm) {
   assert(wqm);
-  TnStatus status;
 
   WQMonitorLock(wqm);
-  while (!wqm->HasError && wqm->Workers.Size != wqm->Workers.Capacity)
-    pthread_cond_wait(&wqm->CondFull, &wqm->Mutex);
+  while (!wqm->HasError &&
+         __atomic_load_n(&wqm->Size, __ATOMIC_SEQ_CST) != wqm->Capacity)
+    TN_COND_WAIT(&wqm->CondFull, &wqm->Mutex, &wqm->MutexProfile);
   WQMonitorUnlock(wqm);
 
   return TN_OK;
 }
 
+/* Lock-free hint, may be stale by the time it returns */
+TnStatus WQMonitorPeekSize(const WQMonitor* wqm, size_t* size) {
+  assert(wqm);
+  assert(size);
+
+  *size = __atomic_load_n(&wqm->Size, __ATOMIC_SEQ_CST);
+
+  return TN_OK;
+}
+
 TnStatus WQMonitorSignalError(WQMonitor* wqm) {
   assert(wqm);
 
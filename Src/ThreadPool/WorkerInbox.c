@@ -0,0 +1,138 @@
+#include "ThreadPool/WorkerInbox.h"
+
+TnStatus WorkerInboxInit(WorkerInbox* inbox) {
+  assert(inbox);
+  TnStatus status;
+  int res;
+
+  status = TaskQueueInit(&inbox->Pinned);
+  if (!TnStatusOk(status)) return status;
+
+  status = TaskQueueInit(&inbox->Preferred);
+  if (!TnStatusOk(status)) {
+    TaskQueueDestroy(&inbox->Pinned);
+    return status;
+  }
+
+  res = pthread_mutex_init(&inbox->Mutex, NULL);
+
+  if (res != 0) {
+    errno = res;
+    TaskQueueDestroy(&inbox->Pinned);
+    TaskQueueDestroy(&inbox->Preferred);
+    return TNSTATUS(TN_ERRNO);
+  }
+
+  inbox->NPinned = 0;
+  inbox->NPreferred = 0;
+
+  return TN_OK;
+}
+
+TnStatus WorkerInboxDestroy(WorkerInbox* inbox) {
+  assert(inbox);
+
+  TaskQueueDestroy(&inbox->Pinned);
+  TaskQueueDestroy(&inbox->Preferred);
+  pthread_mutex_destroy(&inbox->Mutex);
+
+  return TN_OK;
+}
+
+static void WorkerInboxLock(WorkerInbox* inbox) {
+  assert(inbox);
+  pthread_mutex_lock(&inbox->Mutex);
+}
+
+static void WorkerInboxUnlock(WorkerInbox* inbox) {
+  assert(inbox);
+  pthread_mutex_unlock(&inbox->Mutex);
+}
+
+static void WorkerInboxSync(WorkerInbox* inbox) {
+  assert(inbox);
+
+  __atomic_store_n(&inbox->NPinned, inbox->Pinned.Size, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&inbox->NPreferred, inbox->Preferred.Size,
+                   __ATOMIC_SEQ_CST);
+}
+
+TnStatus WorkerInboxPush(WorkerInbox* inbox, const WorkerTask* task,
+                         int pinned) {
+  TnStatus status;
+  assert(inbox);
+  assert(task);
+
+  WorkerInboxLock(inbox);
+  status = TaskQueuePush(pinned ? &inbox->Pinned : &inbox->Preferred, task);
+  WorkerInboxSync(inbox);
+  WorkerInboxUnlock(inbox);
+
+  return status;
+}
+
+/* Owner side */
+TnStatus WorkerInboxPop(WorkerInbox* inbox, WorkerTask* task) {
+  TnStatus status;
+  assert(inbox);
+  assert(task);
+
+  if (__atomic_load_n(&inbox->NPinned, __ATOMIC_SEQ_CST) == 0 &&
+      __atomic_load_n(&inbox->NPreferred, __ATOMIC_SEQ_CST) == 0)
+    return TNSTATUS(TN_UNDERFLOW);
+
+  WorkerInboxLock(inbox);
+  status = TaskQueuePop(&inbox->Pinned, task);
+  if (status.Code == TN_UNDERFLOW)
+    status = TaskQueuePop(&inbox->Preferred, task);
+  WorkerInboxSync(inbox);
+  WorkerInboxUnlock(inbox);
+
+  return status;
+}
+
+/* Any other thread */
+TnStatus WorkerInboxSteal(WorkerInbox* inbox, WorkerTask* task) {
+  TnStatus status;
+  assert(inbox);
+  assert(task);
+
+  if (__atomic_load_n(&inbox->NPreferred, __ATOMIC_SEQ_CST) == 0)
+    return TNSTATUS(TN_UNDERFLOW);
+
+  WorkerInboxLock(inbox);
+  status = TaskQueuePop(&inbox->Preferred, task);
+  WorkerInboxSync(inbox);
+  WorkerInboxUnlock(inbox);
+
+  return status;
+}
+
+/* Lock-free hint, may be stale by the time it returns */
+TnStatus WorkerInboxPeekSize(const WorkerInbox* inbox, size_t* pinned,
+                             size_t* preferred) {
+  assert(inbox);
+  assert(pinned);
+  assert(preferred);
+
+  *pinned = __atomic_load_n(&inbox->NPinned, __ATOMIC_SEQ_CST);
+  *preferred = __atomic_load_n(&inbox->NPreferred, __ATOMIC_SEQ_CST);
+
+  return TN_OK;
+}
+
+/* Room for nTasks in either queue */
+TnStatus WorkerInboxReserve(WorkerInbox* inbox, size_t nTasks) {
+  assert(inbox);
+  TnStatus status;
+
+  WorkerInboxLock(inbox);
+
+  status = TaskQueueReserve(&inbox->Pinned, nTasks);
+  if (TnStatusOk(status))
+    status = TaskQueueReserve(&inbox->Preferred, nTasks);
+
+  WorkerInboxUnlock(inbox);
+
+  return status;
+}
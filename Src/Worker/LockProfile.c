@@ -0,0 +1,88 @@
+#include "Worker/LockProfile.h"
+
+TnStatus LockProfileInit(LockProfile* profile, const char* name, size_t id) {
+  if (!profile || !name) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  memset(profile, 0, sizeof(*profile));
+  strncpy(profile->Name, name, LOCK_PROFILE_NAME_SIZE - 1);
+  profile->ID = id;
+
+  return TN_OK;
+}
+
+TnStatus LockProfileRead(const LockProfile* profile, LockProfile* snapshot) {
+  if (!profile || !snapshot) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  memcpy(snapshot->Name, profile->Name, LOCK_PROFILE_NAME_SIZE);
+  snapshot->ID = profile->ID;
+  snapshot->AcquiredAt = 0;
+
+  snapshot->NAcquired = __atomic_load_n(&profile->NAcquired, __ATOMIC_RELAXED);
+  snapshot->NContended =
+      __atomic_load_n(&profile->NContended, __ATOMIC_RELAXED);
+  snapshot->TotalWait = __atomic_load_n(&profile->TotalWait, __ATOMIC_RELAXED);
+  snapshot->TotalHold = __atomic_load_n(&profile->TotalHold, __ATOMIC_RELAXED);
+
+  for (size_t i = 0; i < LOCK_PROFILE_BUCKETS; ++i) {
+    snapshot->WaitBuckets[i] =
+        __atomic_load_n(&profile->WaitBuckets[i], __ATOMIC_RELAXED);
+    snapshot->HoldBuckets[i] =
+        __atomic_load_n(&profile->HoldBuckets[i], __ATOMIC_RELAXED);
+  }
+
+  return TN_OK;
+}
+
+static uint64_t LockProfileNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void LockProfileRecord(size_t* buckets, uint64_t time) {
+  size_t bucket = time ? 63 - __builtin_clzll(time) : 0;
+  if (bucket >= LOCK_PROFILE_BUCKETS) bucket = LOCK_PROFILE_BUCKETS - 1;
+
+  __atomic_fetch_add(&buckets[bucket], 1, __ATOMIC_RELAXED);
+}
+
+static void LockProfileAcquired(LockProfile* profile, uint64_t now) {
+  profile->AcquiredAt = now;
+  __atomic_fetch_add(&profile->NAcquired, 1, __ATOMIC_RELAXED);
+}
+
+static void LockProfileReleasing(LockProfile* profile) {
+  uint64_t hold = LockProfileNow() - profile->AcquiredAt;
+
+  __atomic_fetch_add(&profile->TotalHold, hold, __ATOMIC_RELAXED);
+  LockProfileRecord(profile->HoldBuckets, hold);
+}
+
+void LockProfileLock(pthread_mutex_t* mutex, LockProfile* profile) {
+  if (pthread_mutex_trylock(mutex) == 0) {
+    LockProfileAcquired(profile, LockProfileNow());
+    return;
+  }
+
+  uint64_t start = LockProfileNow();
+  pthread_mutex_lock(mutex);
+  uint64_t now = LockProfileNow();
+
+  __atomic_fetch_add(&profile->NContended, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&profile->TotalWait, now - start, __ATOMIC_RELAXED);
+  LockProfileRecord(profile->WaitBuckets, now - start);
+
+  LockProfileAcquired(profile, now);
+}
+
+void LockProfileUnlock(pthread_mutex_t* mutex, LockProfile* profile) {
+  LockProfileReleasing(profile);
+  pthread_mutex_unlock(mutex);
+}
+
+void LockProfileCondWait(pthread_cond_t* cond, pthread_mutex_t* mutex,
+                         LockProfile* profile) {
+  LockProfileReleasing(profile);
+  pthread_cond_wait(cond, mutex);
+  LockProfileAcquired(profile, LockProfileNow());
+}
@@ -5,9 +5,22 @@ TnStatus WorkerInit(Worker* self, WorkerID id) {
   if (!self) return TNSTATUS(TN_BAD_ARG_PTR);
 
   self->ID = id;
+  self->Core = WorkerPickCore(id);
+  self->State = WORKER_STOPPED; /* Until WorkerRun */
 
   pthread_mutex_init(&self->Mutex, NULL);
   pthread_cond_init(&self->Cond, NULL);
+  LockProfileInit(&self->MutexProfile, "Worker", id);
+
+  return TN_OK;
+}
+
+/* Any thread, the worker moves before its next task */
+TnStatus WorkerSetCore(Worker* self, int core) {
+  if (!self) return TNSTATUS(TN_BAD_ARG_PTR);
+  if (core < 0 || core >= CPU_SETSIZE) return TNSTATUS(TN_BAD_ARG_VAL);
+
+  __atomic_store_n(&self->Core, core, __ATOMIC_RELAXED);
 
   return TN_OK;
 }
@@ -39,6 +52,7 @@ TnStatus WorkerRun(Worker* self, WorkerCallbackT* stateCb) {
 
   int res = pthread_create(&self->Thread, NULL, WorkerLoop, self);
   if (res != 0) {
+    self->State = WORKER_STOPPED;
     errno = res;
     return TNSTATUS(TN_ERRNO);
   }
@@ -114,19 +128,22 @@ TnStatus WorkerFinishTask(Worker* self) {
 
 TnStatus WorkerStop(Worker* self) {
   if (!self) return TNSTATUS(TN_BAD_ARG_PTR);
-  TnStatus status;
 
   WorkerLock(self);
 
-  if (self->State != WORKER_STOPPED) {
+  /* The thread may pass through other states on its way out, and needs
+   * the mutex to get there */
+  int running = self->State != WORKER_STOPPED;
+  if (running) {
     self->DoStop = 1;
     WorkerWakeUp(self);
-    WorkerSleepUntilStateChanges(self);
-    pthread_join(self->Thread, NULL);
+    while (self->State != WORKER_STOPPED) WorkerSleep(self);
   }
 
   WorkerUnlock(self);
 
+  if (running) pthread_join(self->Thread, NULL);
+
   return TN_OK;
 }
 
@@ -140,6 +157,16 @@ TnStatus WorkerGetState(Worker* self, WorkerState* state) {
   return TN_OK;
 }
 
+TnStatus WorkerCallUnlocked(Worker* self, WorkerCallbackT callback) {
+  if (!self || !callback.Function) return TNSTATUS(TN_BAD_ARG_PTR);
+
+  WorkerUnlock(self);
+  callback.Function(self, callback.Args);
+  WorkerLock(self);
+
+  return TN_OK;
+}
+
 TnStatus WorkerAssignTaskAsync(Worker* self, WorkerTask task) {
   if (!self) return TNSTATUS(TN_BAD_ARG_PTR);
 
@@ -170,7 +197,7 @@ TnStatus WorkerFinishTaskAsync(Worker* self) {
 /* Thread */
 static void WorkerSleep(Worker* self) {
   assert(self);
-  pthread_cond_wait(&self->Cond, &self->Mutex);
+  TN_COND_WAIT(&self->Cond, &self->Mutex, &self->MutexProfile);
 }
 
 /* Main */
@@ -181,12 +208,12 @@ static void WorkerWakeUp(Worker* self) {
 
 static void WorkerLock(Worker* self) {
   assert(self);
-  pthread_mutex_lock(&self->Mutex);
+  TN_MUTEX_LOCK(&self->Mutex, &self->MutexProfile);
 }
 
 static void WorkerUnlock(Worker* self) {
   assert(self);
-  pthread_mutex_unlock(&self->Mutex);
+  TN_MUTEX_UNLOCK(&self->Mutex, &self->MutexProfile);
 }
 
 static void WorkerSleepUntilCond(Worker* self, int* condition) {
@@ -205,18 +232,33 @@ static void WorkerSleepUntilStateChanges(Worker* self) {
     WorkerSleep(self);
 }
 
+/* Round robin over the cpus the process may use, which a container's
+ * cpuset or taskset may have cut down */
+static int WorkerPickCore(WorkerID id) {
+  cpu_set_t set;
+
+  if (sched_getaffinity(getpid(), sizeof(set), &set) != 0 ||
+      CPU_COUNT(&set) == 0)
+    return id % sysconf(_SC_NPROCESSORS_ONLN);
+
+  size_t n = id % CPU_COUNT(&set);
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+    if (CPU_ISSET(cpu, &set) && n-- == 0) return cpu;
+
+  return 0;
+}
+
 static void WorkerAssignToCore(Worker* self) {
   assert(self);
 
   cpu_set_t cpuSet;
-  int numCores = sysconf(_SC_NPROCESSORS_ONLN);
+  int core = __atomic_load_n(&self->Core, __ATOMIC_RELAXED);
 
-  int coreNumber = self->ID % numCores;
-
-  CPU_ZERO(&cpuSet);             // clears the cpuset
-  CPU_SET(coreNumber, &cpuSet);  // set CPU 2 on cpuset
+  CPU_ZERO(&cpuSet);       // clears the cpuset
+  CPU_SET(core, &cpuSet);  // set CPU 2 on cpuset
 
   sched_setaffinity(0, sizeof(cpuSet), &cpuSet);
+  self->PinnedCore = core;
 }
 
 /* Thread */
@@ -249,6 +291,8 @@ static void* WorkerLoop(void* selfPtr) {
         self->State = WORKER_BUSY;
         break;
       case WORKER_BUSY:
+        if (self->PinnedCore != __atomic_load_n(&self->Core, __ATOMIC_RELAXED))
+          WorkerAssignToCore(self);
         WorkerWakeUp(self);
         WorkerUnlock(self);
         self->Task.Function(self->Task.Args, self->Task.Result);
@@ -264,6 +308,8 @@ static void* WorkerLoop(void* selfPtr) {
         assert(0);
     }
 
+    TN_PROBE3(worker_state, self->ID, self->State, self->Task.ID);
+
     WorkerUnlock(self);
   }
 }
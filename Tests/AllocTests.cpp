@@ -0,0 +1,228 @@
+#include <malloc.h>
+#include <sched.h>
+
+#include <vector>
+
+#include "ThreadPool/ThreadPool.h"
+#include "gtest/gtest.h"
+
+#define CALL(foo) ASSERT_EQ(foo.Code, TN_SUCCESS);
+
+/* Every allocation of the process goes through these while the test runs,
+ * and counts while armed */
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t n, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+void __libc_free(void* ptr);
+}
+
+static int Armed = 0;           /* Atomic */
+static size_t NAllocations = 0; /* Atomic */
+
+static void CountAllocation() {
+  if (__atomic_load_n(&Armed, __ATOMIC_RELAXED))
+    __atomic_fetch_add(&NAllocations, 1, __ATOMIC_RELAXED);
+}
+
+extern "C" {
+void* malloc(size_t size) {
+  CountAllocation();
+  return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size) {
+  CountAllocation();
+  return __libc_calloc(n, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+  CountAllocation();
+  return __libc_realloc(ptr, size);
+}
+
+void* memalign(size_t alignment, size_t size) {
+  CountAllocation();
+  return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+  return memalign(alignment, size);
+}
+
+int posix_memalign(void** ptr, size_t alignment, size_t size) {
+  void* res = memalign(alignment, size);
+  if (!res) return ENOMEM;
+
+  *ptr = res;
+  return 0;
+}
+
+void free(void* ptr) { __libc_free(ptr); }
+}
+
+static void Arm() {
+  __atomic_store_n(&NAllocations, 0, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&Armed, 1, __ATOMIC_SEQ_CST);
+}
+
+static size_t Disarm() {
+  __atomic_store_n(&Armed, 0, __ATOMIC_SEQ_CST);
+  return __atomic_load_n(&NAllocations, __ATOMIC_SEQ_CST);
+}
+
+const size_t NWorkers = 4;
+const size_t RoundSize = 4096;
+const size_t NRounds = 512; /* 2M submissions */
+
+/* Tasks take their Args and Result from caller-owned slots, allocated
+ * once before the measurement */
+struct Slot {
+  size_t Input;
+  size_t Output;
+};
+
+static void Square(void* args, void* result) {
+  *(size_t*)result = *(size_t*)args * *(size_t*)args;
+}
+
+/* Holds its worker until released, so that a round queues up in full */
+static void Hold(void* args, void* result) {
+  while (!__atomic_load_n((int*)args, __ATOMIC_ACQUIRE)) sched_yield();
+}
+
+static WorkerTask SlotTask(Slot* slot) {
+  WorkerTask task;
+  task.Function = Square;
+  task.Args = &slot->Input;
+  task.Result = &slot->Output;
+  return task;
+}
+
+/* Submits the round with every worker held, then lets them run it */
+template <class SubmitT>
+static TnStatus SubmitRound(ThreadPool* tp, std::vector<Slot>& slots,
+                            SubmitT submit) {
+  static int released;
+  TnStatus status = TN_OK;
+
+  WorkerTask hold;
+  hold.Function = Hold;
+  hold.Args = &released;
+  hold.Result = &released;
+
+  __atomic_store_n(&released, 0, __ATOMIC_RELEASE);
+
+  for (size_t i = 0; i < NWorkers && TnStatusOk(status); ++i)
+    status = ThreadPoolAddTask(tp, hold);
+
+  for (size_t i = 0; i < RoundSize && TnStatusOk(status); ++i) {
+    slots[i].Output = 0;
+    status = submit(tp, &slots[i], i);
+  }
+
+  __atomic_store_n(&released, 1, __ATOMIC_RELEASE);
+  if (!TnStatusOk(status)) return status;
+
+  return ThreadPoolWaitAll(tp);
+}
+
+/* Runs the rounds and checks the results once the allocator is no longer
+ * watched */
+template <class SubmitT>
+static void RunRounds(ThreadPool* tp, size_t nRounds, SubmitT submit) {
+  std::vector<Slot> slots(RoundSize);
+  for (size_t i = 0; i < RoundSize; ++i) slots[i].Input = i;
+
+  /* Warm-up: faults the reserved chunks in */
+  CALL(SubmitRound(tp, slots, submit));
+
+  int failed = 0;
+  Arm();
+
+  for (size_t round = 0; round < nRounds; ++round)
+    failed |= !TnStatusOk(SubmitRound(tp, slots, submit));
+
+  size_t nAllocations = Disarm();
+
+  ASSERT_FALSE(failed);
+  EXPECT_EQ(nAllocations, 0u);
+
+  for (size_t i = 0; i < RoundSize; ++i)
+    ASSERT_EQ(slots[i].Output, i * i);
+}
+
+static TnStatus SubmitShared(ThreadPool* tp, Slot* slot, size_t i) {
+  return ThreadPoolAddTask(tp, SlotTask(slot));
+}
+
+static TnStatus SubmitTargeted(ThreadPool* tp, Slot* slot, size_t i) {
+  ThreadPoolTarget target = {TP_TARGET_WORKER, i % NWorkers, (int)(i % 2)};
+  return ThreadPoolAddTaskTo(tp, target, SlotTask(slot));
+}
+
+TEST(AllocFree, CountsAllocations) {
+  Arm();
+  void* volatile ptr = malloc(1);
+  size_t nAllocations = Disarm();
+
+  free(ptr);
+  EXPECT_EQ(nAllocations, 1u);
+}
+
+TEST(AllocFree, SharedQueue) {
+  ThreadPool tp;
+  ThreadPoolConfig config;
+
+  CALL(ThreadPoolConfigInit(&config, NWorkers));
+  config.ReserveTasks = RoundSize;
+
+  CALL(ThreadPoolInitConfig(&tp, &config));
+  CALL(ThreadPoolRun(&tp));
+  CALL(ThreadPoolWaitReady(&tp));
+
+  RunRounds(&tp, NRounds, SubmitShared);
+
+  CALL(ThreadPoolStop(&tp));
+  CALL(ThreadPoolDestroy(&tp));
+}
+
+TEST(AllocFree, ShardsAndInboxes) {
+  ThreadPool tp;
+  ThreadPoolConfig config;
+
+  CALL(ThreadPoolConfigInit(&config, NWorkers));
+  config.NShards = 2;
+  config.ReserveTasks = RoundSize;
+  config.ReserveInboxTasks = RoundSize / NWorkers;
+
+  CALL(ThreadPoolInitConfig(&tp, &config));
+  CALL(ThreadPoolRun(&tp));
+  CALL(ThreadPoolWaitReady(&tp));
+
+  RunRounds(&tp, NRounds / 4, SubmitShared);
+  RunRounds(&tp, NRounds / 4, SubmitTargeted);
+
+  CALL(ThreadPoolStop(&tp));
+  CALL(ThreadPoolDestroy(&tp));
+}
+
+TEST(AllocFree, Fibers) {
+  ThreadPool tp;
+  ThreadPoolConfig config;
+
+  CALL(ThreadPoolConfigInit(&config, NWorkers));
+  config.FiberStackSize = FIBER_DEFAULT_STACK_SIZE;
+  config.ReserveTasks = RoundSize;
+  config.ReserveFibers = NWorkers;
+
+  CALL(ThreadPoolInitConfig(&tp, &config));
+  CALL(ThreadPoolRun(&tp));
+  CALL(ThreadPoolWaitReady(&tp));
+
+  RunRounds(&tp, NRounds / 8, SubmitShared);
+
+  CALL(ThreadPoolStop(&tp));
+  CALL(ThreadPoolDestroy(&tp));
+}
@@ -1,7 +1,26 @@
+#include <elf.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
 #include <vector>
 
 #include "Worker/Worker.h"
+#include "ThreadPool/Channel.h"
+#include "ThreadPool/CorePool.h"
+#include "ThreadPool/Parallel.hpp"
+#include "ThreadPool/Pipeline.h"
+#include "ThreadPool/Scheduler.hpp"
 #include "ThreadPool/ThreadPool.h"
+#include "ThreadPool/WorkerQueue.h"
 #include "gtest/gtest.h"
 
 #define CALL(foo) ASSERT_EQ(foo.Code, TN_SUCCESS);
@@ -268,6 +287,42 @@ TEST(TQMonitor, FillFlushWait) {
   pthread_join(thread, NULL);
 }
 
+TEST(TQMonitor, BatchPop) {
+  static constexpr size_t NTasks = 10;
+
+  TQMonitor tqm;
+  CALL(TQMonitorInit(&tqm));
+
+  int values[NTasks];
+  WorkerTask task;
+  for (size_t i = 0; i < NTasks; ++i) {
+    task.Args = values + i;
+    CALL(TQMonitorAddTask(&tqm, &task));
+  }
+
+  WorkerTask tasks[NTasks];
+  size_t n;
+
+  /* A quarter of what is queued, rounded up */
+  tqm.NConsumers = 4;
+  CALL(TQMonitorGetTasks(&tqm, tasks, NTasks, &n));
+  EXPECT_EQ(n, 3);
+
+  tqm.NConsumers = 1;
+  CALL(TQMonitorGetTasks(&tqm, tasks + 3, 4, &n));
+  EXPECT_EQ(n, 4);
+
+  CALL(TQMonitorGetTasks(&tqm, tasks + 7, NTasks, &n));
+  EXPECT_EQ(n, 3);
+
+  for (size_t i = 0; i < NTasks; ++i) EXPECT_EQ(tasks[i].Args, values + i);
+
+  EXPECT_EQ(TQMonitorGetTasks(&tqm, tasks, NTasks, &n).Code, TN_UNDERFLOW);
+  EXPECT_EQ(n, 0);
+
+  CALL(TQMonitorDestroy(&tqm));
+}
+
 TEST(WorkerQueue, FillAndFlush) {
   size_t NWorkers = 10;
   WorkerQueue wq;
@@ -332,7 +387,7 @@ TEST(WQMonitor, FillWait) {
   ASSERT_EQ(FillStatus.Code, TN_SUCCESS) << "Filled totally: " << NFilled << std::endl;
   ASSERT_EQ(WQMonitorAddWorker(&wq, &id).Code, TN_OVERFLOW);
 
-  for (int i = 0; i < FILLSIZE; ++i) {
+  for (int i = FILLSIZE - 1; i >= 0; --i) {  // Recently idle come first
     CALL(WQMonitorGetWorker(&wq, &id));
     EXPECT_EQ(id, i);
   }
@@ -430,4 +485,1809 @@ TEST(ThreadPool, EqualWorkersTasks) {
   static constexpr size_t NWorkers = 100;
 
   TestThreadPool<NWorkers, NTasks>();
-}
\ No newline at end of file
+}
+struct FibData {
+  ThreadPool* Pool;
+  int N;
+};
+
+void Fib(void* args, void* res) {
+  FibData* data = (FibData*)args;
+  int* result = (int*)res;
+
+  if (data->N < 2) {
+    *result = data->N;
+    return;
+  }
+
+  FibData subData[2] = {{data->Pool, data->N - 1}, {data->Pool, data->N - 2}};
+  int subRes[2] = {0, 0};
+
+  TaskGroup group;
+  TaskGroupInit(&group);
+
+  for (int i = 0; i < 2; ++i) {
+    WorkerTask task;
+    task.Function = Fib;
+    task.Args = &subData[i];
+    task.Result = &subRes[i];
+    ThreadPoolAddGroupTask(data->Pool, &group, task);
+  }
+
+  ThreadPoolWaitGroup(data->Pool, &group);
+  TaskGroupDestroy(&group);
+
+  *result = subRes[0] + subRes[1];
+}
+
+TEST(TaskGroup, NestedForkJoin) {
+  static constexpr size_t NWorkers = 2;
+  ThreadPool tp;
+
+  CALL(ThreadPoolInit(&tp, NWorkers));
+  CALL(ThreadPoolRun(&tp));
+
+  FibData data = {&tp, 15};
+  int result = -1;
+
+  WorkerTask task;
+  task.Function = Fib;
+  task.Args = &data;
+  task.Result = &result;
+
+  TaskGroup group;
+  CALL(TaskGroupInit(&group));
+  CALL(ThreadPoolAddGroupTask(&tp, &group, task));
+  CALL(ThreadPoolWaitGroup(&tp, &group));
+  CALL(TaskGroupDestroy(&group));
+
+  ASSERT_EQ(result, 610);
+
+  CALL(ThreadPoolWaitAll(&tp));
+  CALL(ThreadPoolStop(&tp));
+  CALL(ThreadPoolDestroy(&tp));
+}
+
+struct ProducerData {
+  ThreadPool* Pool;
+  TaskData* Tasks;
+  size_t NTasks;
+};
+
+void* Produce(void* args) {
+  ProducerData* data = (ProducerData*)args;
+
+  for (size_t i = 0; i < data->NTasks; ++i) {
+    WorkerTask task;
+    task.Function = Pow;
+    task.Args = &data->Tasks[i].Arg;
+    task.Result = &data->Tasks[i].Res;
+
+    if (!TnStatusOk(ThreadPoolAddTask(data->Pool, task))) break;
+  }
+
+  return NULL;
+}
+
+TEST(ThreadPool, ShardedManyProducers) {
+  static constexpr size_t NWorkers = 4;
+  static constexpr size_t NProducers = 8;
+  static constexpr size_t NTasks = 2000;
+
+  ThreadPoolConfig config;
+  CALL(ThreadPoolConfigInit(&config, NWorkers));
+  config.NShards = NWorkers;
+
+  ThreadPool tp;
+  CALL(ThreadPoolInitConfig(&tp, &config));
+  CALL(ThreadPoolRun(&tp));
+
+  std::vector<TaskData> tasks(NProducers * NTasks);
+  for (size_t i = 0; i < tasks.size(); ++i) tasks[i] = {(int)i, -1};
+
+  pthread_t threads[NProducers];
+  ProducerData data[NProducers];
+
+  for (size_t i = 0; i < NProducers; ++i) {
+    data[i] = {&tp, tasks.data() + i * NTasks, NTasks};
+    ASSERT_EQ(pthread_create(threads + i, NULL, Produce, data + i), 0);
+  }
+
+  for (size_t i = 0; i < NProducers; ++i) pthread_join(threads[i], NULL);
+
+  CALL(ThreadPoolWaitAll(&tp));
+
+  for (size_t i = 0; i < tasks.size(); ++i)
+    ASSERT_EQ(tasks[i].Res, (int)(i * i));
+
+  CALL(ThreadPoolStop(&tp));
+  CALL(ThreadPoolDestroy(&tp));
+}
+
+TEST(TaskQueue, ReleasesChunksAfterBurst) {
+  static constexpr size_t NBurst = 100 * TQ_CHUNK_CAPACITY + 7;
+
+  TaskQueue tq;
+  CALL(TaskQueueInit(&tq));
+
+  int dummy;
+  WorkerTask task;
+
+  for (int round = 0; round < 2; ++round) {
+    for (size_t i = 0; i < NBurst; ++i) {
+      task.Args = &dummy + i;
+      CALL(TaskQueuePush(&tq, &task));
+    }
+
+    for (size_t i = 0; i < NBurst; ++i) {
+      CALL(TaskQueuePop(&tq, &task));
+      ASSERT_EQ(task.Args, &dummy + i);
+    }
+
+    EXPECT_EQ(TaskQueuePop(&tq, &task).Code, TN_UNDERFLOW);
+    EXPECT_LE(tq.NCached, TQ_CHUNK_CACHE_SIZE);
+    EXPECT_EQ(tq.HeadChunk, tq.TailChunk);
+  }
+
+  CALL(TaskQueueDestroy(&tq));
+}
+
+TEST(TQMonitor, WeightedSources) {
+  TQMonitor tqm;
+  CALL(TQMonitorInit(&tqm));
+
+  TaskSourceID big, small;
+  CALL(TQMonitorAddSource(&tqm, "big", 1, &big));
+  CALL(TQMonitorAddSource(&tqm, "small", 3, &small));
+
+  int dummy;
+  WorkerTask task;
+
+  task.Args = &dummy;
+  for (int i = 0; i < 100; ++i) CALL(TQMonitorAddSourceTask(&tqm, big, &task));
+
+  task.Args = &tqm;
+  for (int i = 0; i < 3; ++i)
+    CALL(TQMonitorAddSourceTask(&tqm, small, &task));
+
+  int nSmall = 0;
+  for (int i = 0; i < 4; ++i) {
+    CALL(TQMonitorGetTask(&tqm, &task));
+    if (task.Args == &tqm) nSmall++;
+  }
+
+  EXPECT_EQ(nSmall, 3);
+
+  TaskSourceStats stats;
+  CALL(TQMonitorGetSourceStats(&tqm, small, &stats));
+  EXPECT_EQ(stats.NTasks, 3);
+  EXPECT_EQ(stats.Pending, 0);
+  EXPECT_GE(stats.MaxDelay * 3, stats.TotalDelay);
+
+  CALL(TQMonitorGetSourceStats(&tqm, big, &stats));
+  EXPECT_EQ(stats.NTasks, 1);
+  EXPECT_EQ(stats.Pending, 99);
+
+  while (TnStatusOk(TQMonitorGetTask(&tqm, &task)));
+  CALL(TQMonitorDestroy(&tqm));
+}
+
+TEST(ThreadPool, SourcesMatchAcrossShards) {
+  static constexpr size_t NShards = 4;
+  static constexpr size_t NThreads = 4;
+
+  ThreadPoolConfig config;
+  CALL(ThreadPoolConfigInit(&config, 2));
+  config.NShards = NShards;
+
+  ThreadPool tp;
+  CALL(ThreadPoolInitConfig(&tp, &config));
+
+  /* Racing registrations until the shards are full */
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < NThreads; ++t)
+    threads.emplace_back([&tp, t] {
+      TaskSourceID id;
+      std::string name = "source" + std::to_string(t);
+      while (ThreadPoolAddSource(&tp, name.c_str(), 1, &id).Code ==
+             TN_SUCCESS) {
+      }
+    });
+  for (std::thread& thread : threads) thread.join();
+
+  for (size_t i = 0; i < NShards; ++i) {
+    ASSERT_EQ(tp.Tasks[i].NSources, TQ_MAX_SOURCES);
+    for (size_t id = 0; id < TQ_MAX_SOURCES; ++id)
+      EXPECT_STREQ(tp.Tasks[i].Sources[id].Name, tp.Tasks[0].Sources[id].Name);
+  }
+
+  TaskSourceID id;
+  EXPECT_EQ(ThreadPoolAddSource(&tp, "full", 1, &id).Code, TN_OVERFLOW);
+  for (size_t i = 0; i < NShards; ++i)
+    EXPECT_EQ(tp.Tasks[i].NSources, TQ_MAX_SOURCES);
+
+  CALL(ThreadPoolDestroy(&tp));
+}
+
+void RecordThread(void* args, void* res) { *(pthread_t*)res = pthread_self(); }
+
+TEST(ThreadPool, AddTaskToWorker) {
+  static constexpr size_t NWorkers = 4;
+  static constexpr size_t NTasks = 400;
+
+  ThreadPool tp;
+  CALL(ThreadPoolInit(&tp, NWorkers));
+  CALL(ThreadPoolRun(&tp));
+
+  std::vector<pthread_t> threads(NTasks);
+  int dummy;
+
+  for (size_t i = 0; i < NTasks; ++i) {
+    ThreadPoolTarget target = {TP_TARGET_WORKER, i % NWorkers, 0};
+
+    WorkerTask task;
+    task.Function = RecordThread;
+    task.Args = &dummy;
+    task.Result = &threads[i];
+
+    CALL(ThreadPoolAddTaskTo(&tp, target, task));
+  }
+
+  CALL(ThreadPoolWaitAll(&tp));
+
+  for (size_t i = 0; i < NTasks; ++i)
+    ASSERT_TRUE(
+        pthread_equal(threads[i], tp.Workers.Workers[i % NWorkers].Thread));
+
+  ThreadPoolTarget bad = {TP_TARGET_WORKER, NWorkers, 0};
+  WorkerTask task = {RecordThread, &dummy, &threads[0]};
+  EXPECT_EQ(ThreadPoolAddTaskTo(&tp, bad, task).Code, TN_BAD_ARG_VAL);
+
+  CALL(ThreadPoolStop(&tp));
+  CALL(ThreadPoolDestroy(&tp));
+}
+
+TEST(ThreadPool, LockProfiles) {
+  static constexpr size_t NWorkers = 4;
+  static constexpr size_t NShards = 2;
+  static constexpr size_t NTasks = 2000;
+
+  ThreadPoolConfig config;
+  CALL(ThreadPoolConfigInit(&config, NWorkers));
+  config.NShards = NShards;
+
+  ThreadPool tp;
+  CALL(ThreadPoolInitConfig(&tp, &config));
+  CALL(ThreadPoolRun(&tp));
+  CALL(ThreadPoolWaitReady(&tp));
+
+  pthread_t thread;
+  WorkerTask task = {RecordThread, &thread, &thread};
+  for (size_t i = 0; i < NTasks; ++i) CALL(ThreadPoolAddTask(&tp, task));
+  CALL(ThreadPoolWaitAll(&tp));
+
+  size_t n, nShardLocks = 0, nWorkerLocks = 0;
+  EXPECT_EQ(ThreadPoolGetLockProfiles(&tp, NULL, 0, &n).Code, TN_OVERFLOW);
+  ASSERT_EQ(n, NShards + 1 + NWorkers);
+
+  std::vector<LockProfile> profiles(n);
+  CALL(ThreadPoolGetLockProfiles(&tp, profiles.data(), n, &n));
+
+  for (size_t i = 0; i < n; ++i) {
+    const LockProfile& profile = profiles[i];
+    const char* name = (i < NShards)    ? "TQMonitor"
+                       : (i == NShards) ? "WQMonitor"
+                                        : "Worker";
+    size_t id = (i < NShards) ? i : (i > NShards) ? i - NShards - 1 : 0;
+
+    EXPECT_STREQ(profile.Name, name);
+    EXPECT_EQ(profile.ID, id);
+
+#ifdef TN_LOCK_PROFILE
+    size_t nHolds = 0;
+    for (size_t count : profile.HoldBuckets) nHolds += count;
+    EXPECT_LE(profile.NContended, profile.NAcquired);
+    EXPECT_LE(profile.NAcquired - nHolds, 1);  // One may be held right now
+#else
+    EXPECT_EQ(profile.NAcquired, 0);
+#endif
+
+    if (i < NShards) nShardLocks += profile.NAcquired;
+    if (i > NShards) nWorkerLocks += profile.NAcquired;
+  }
+
+  /* Which shard or worker a task goes through is up to the scheduler */
+#ifdef TN_LOCK_PROFILE
+  EXPECT_GT(nShardLocks, 0);
+  EXPECT_GT(nWorkerLocks, 0);
+#endif
+
+  CALL(ThreadPoolStop(&tp));
+  CALL(ThreadPoolDestroy(&tp));
+}
+
+struct SpawnChain {
+  ThreadPool* Pool;
+  size_t Depth;
+  size_t* NRun; /* Atomic */
+};
+
+void SpawnNext(void* args, void* res) {
+  SpawnChain* link = (SpawnChain*)args;
+
+  if (link->Depth > 1) {
+    link->Depth--;
+    WorkerTask next = {SpawnNext, link, link};
+    ASSERT_EQ(ThreadPoolAddTask(link->Pool, next).Code, TN_SUCCESS);
+  }
+
+  __atomic_add_fetch(link->NRun, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Every link is submitted by the previous one, possibly while WaitAll
+ * already found the queues empty */
+TEST(ThreadPool, WaitAllSeesSpawnedTasks) {
+  static constexpr size_t NWorkers = 4;
+  static constexpr size_t NChains = 50;
+  static constexpr size_t Depth = 20;
+
+  ThreadPool tp;
+  CALL(ThreadPoolInit(&tp, NWorkers));
+  CALL(ThreadPoolRun(&tp));
+
+  size_t nRun = 0;
+  std::vector<SpawnChain> chains(NChains, SpawnChain{&tp, Depth, &nRun});
+
+  for (SpawnChain& chain : chains) {
+    WorkerTask task = {SpawnNext, &chain, &chain};
+    CALL(ThreadPoolAddTask(&tp, task));
+  }
+
+  CALL(ThreadPoolWaitAll(&tp));
+  EXPECT_EQ(nRun, NChains * Depth);
+
+  CALL(ThreadPoolStop(&tp));
+  CALL(ThreadPoolDestroy(&tp));
+}
+
+struct Gate {
+  int Started; /* Atomic */
+  int Open;    /* Atomic */
+  size_t NRun; /* Atomic */
+};
+
+void WaitForGate(void* args, void* res) {
+  Gate* gate = (Gate*)args;
+
+  __atomic_store_n(&gate->Started, 1, __ATOMIC_SEQ_CST);
+  while (!__atomic_load_n(&gate->Open, __ATOMIC_SEQ_CST)) usleep(100);
+
+  __atomic_add_fetch(&gate->NRun, 1, __ATOMIC_SEQ_CST);
+}
+
+TEST(ThreadPool, AdmissionControl) {
+  static constexpr size_t MaxQueueDepth = 4;
+
+  ThreadPoolConfig config;
+  CALL(ThreadPoolConfigInit(&config, 1));
+  config.MaxQueueDepth = MaxQueueDepth;
+
+  ThreadPool tp;
+  CALL(ThreadPoolInitConfig(&tp, &config));
+  CALL(ThreadPoolRun(&tp));
+
+  Gate gate = {0, 0, 0};
+  WorkerTask task = {WaitForGate, &gate, &gate};
+
+  CALL(ThreadPoolTryAddTask(&tp, task));
+  while (!__atomic_load_n(&gate.Started, __ATOMIC_SEQ_CST)) usleep(100);
+
+  for (size_t i = 0; i < MaxQueueDepth; ++i)
+    CALL(ThreadPoolTryAddTask(&tp, task));
+  EXPECT_EQ(ThreadPoolTryAddTask(&tp, task).Code, TN_OVERFLOW);
+
+  EXPECT_EQ(ThreadPoolAddTaskTimed(&tp, task, 10000000).Code, TN_ERRNO);
+  EXPECT_EQ(errno, ETIMEDOUT);
+
+  TnStatus status = TNSTATUS(TN_ERRNO);
+  std::thread producer(
+      [&] { status = ThreadPoolAddTaskTimed(&tp, task, 10000000000ull); });
+
+  usleep(10000);
+  __atomic_store_n(&gate.Open, 1, __ATOMIC_SEQ_CST);
+  producer.join();
+  CALL(status);
+
+  CALL(ThreadPoolWaitAll(&tp));
+  EXPECT_EQ(gate.NRun, MaxQueueDepth + 2);
+
+  CALL(ThreadPoolStop(&tp));
+  CALL(ThreadPoolDestroy(&tp));
+}
+
+TEST(ThreadPool, AdmissionCountsInboxes) {
+  static constexpr size_t MaxQueueDepth = 4;
+
+  ThreadPoolConfig config;
+  CALL(ThreadPoolConfigInit(&config, 1));
+  config.MaxQueueDepth = MaxQueueDepth;
+
+  ThreadPool tp;
+  CALL(ThreadPoolInitConfig(&tp, &config));
+  CALL(ThreadPoolRun(&tp));
+
+  Gate gate = {0, 0, 0};
+  WorkerTask task = {WaitForGate, &gate, &gate};
+  ThreadPoolTarget target = {TP_TARGET_WORKER, 0, 0};
+
+  CALL(ThreadPoolTryAddTaskTo(&tp, target, task));
+  while (!__atomic_load_n(&gate.Started, __ATOMIC_SEQ_CST)) usleep(100);
+
+  for (size_t i = 0; i < MaxQueueDepth; ++i)
+    CALL(ThreadPoolTryAddTaskTo(&tp, target, task));
+  EXPECT_EQ(ThreadPoolTryAddTaskTo(&tp, target, task).Code, TN_OVERFLOW);
+  EXPECT_EQ(ThreadPoolTryAddTask(&tp, task).Code, TN_OVERFLOW);
+  EXPECT_EQ(tp.NQueued, MaxQueueDepth);
+
+  __atomic_store_n(&gate.Open, 1, __ATOMIC_SEQ_CST);
+  CALL(ThreadPoolWaitAll(&tp));
+  EXPECT_EQ(gate.NRun, MaxQueueDepth + 1);
+  EXPECT_EQ(tp.NQueued, 0);
+
+  CALL(ThreadPoolTryAddTaskTo(&tp, target, task));
+  CALL(ThreadPoolWaitAll(&tp));
+
+  CALL(ThreadPoolStop(&tp));
+  CALL(ThreadPoolDestroy(&tp));
+}
+
+TEST(Histogram, Percentiles) {
+  static Histogram hist;
+  CALL(HistogramInit(&hist));
+
+  for (uint64_t value = 1; value <= 100000; ++value)
+    HistogramRecord(&hist, value);
+
+  uint64_t count, p50, p99, max;
+  CALL(HistogramCount(&hist, &count));
+  CALL(HistogramPercentile(&hist, 50, &p50));
+  CALL(HistogramPercentile(&hist, 99, &p99));
+  CALL(HistogramPercentile(&hist, 100, &max));
+
+  EXPECT_EQ(count, 100000);
+  EXPECT_NEAR(p50, 50000, 50000 / HISTOGRAM_SUB_BUCKETS);
+  EXPECT_NEAR(p99, 99000, 99000 / HISTOGRAM_SUB_BUCKETS);
+  EXPECT_EQ(max, 100000);
+}
+
+void SleepAndCount(void* args, void* res) {
+  usleep(200);
+  __atomic_add_fetch((size_t*)res, 1, __ATOMIC_SEQ_CST);
+}
+
+TEST(ThreadPool, LatencyHistograms) {
+  static constexpr size_t NWorkers = 2;
+  static constexpr size_t NTasks = 200;
+
+  ThreadPool tp;
+  CALL(ThreadPoolInit(&tp, NWorkers));
+  CALL(ThreadPoolRun(&tp));
+  CALL(ThreadPoolRecordLatency(&tp, 1));
+
+  size_t nDone = 0;
+  WorkerTask task = {SleepAndCount, &nDone, &nDone};
+
+  /* Not ThreadPoolWaitAll: tasks it runs itself are not recorded */
+  for (size_t i = 0; i < NTasks; ++i) CALL(ThreadPoolAddTask(&tp, task));
+  while (__atomic_load_n(&nDone, __ATOMIC_SEQ_CST) != NTasks) usleep(1000);
+
+  CALL(ThreadPoolRecordLatency(&tp, 0));
+  CALL(ThreadPoolAddTask(&tp, task));
+  CALL(ThreadPoolWaitAll(&tp));
+
+  static Histogram queueDelay, execution;
+  CALL(ThreadPoolGetLatency(&tp, &queueDelay, &execution));
+
+  uint64_t count, p50, p999, max;
+  CALL(HistogramCount(&execution, &count));
+  CALL(HistogramPercentile(&execution, 50, &p50));
+  CALL(HistogramPercentile(&execution, 99.9, &p999));
+  CALL(HistogramPercentile(&execution, 100, &max));
+
+  EXPECT_EQ(count, NTasks);
+  EXPECT_GE(p50, 200000 - 200000 / HISTOGRAM_SUB_BUCKETS);
+  EXPECT_LE(p50, p999);
+  EXPECT_LE(p999, max);
+
+  CALL(HistogramCount(&queueDelay, &count));
+  EXPECT_EQ(count, NTasks);
+
+  CALL(ThreadPoolStop(&tp));
+  CALL(ThreadPoolDestroy(&tp));
+}
+
+struct StallLog {
+  std::mutex Mutex;
+  std::vector<ThreadPoolStall> Stalls;
+
+  size_t Size() {
+    std::lock_guard<std::mutex> lock(Mutex);
+    return Stalls.size();
+  }
+};
+
+void LogStall(void* args, const ThreadPoolStall* stall) {
+  StallLog* log = (StallLog*)args;
+  std::lock_guard<std::mutex> lock(log->Mutex);
+  log->Stalls.push_back(*stall);
+}
+
+void WaitForFlag(void* args, void* res) {
+  while (!__atomic_load_n((int*)args, __ATOMIC_SEQ_CST)) usleep(1000);
+}
+
+TEST(ThreadPool, StallWatchdog) {
+  static constexpr size_t NWorkers = 2;
+  static constexpr uint64_t Budget = 20000000;
+
+  StallLog log;
+  ThreadPoolConfig config;
+  CALL(ThreadPoolConfigInit(&config, NWorkers));
+  config.StallBudget = Budget;
+  config.StallInterval = 2000000;
+  config.OnStall = LogStall;
+  config.StallArgs = &log;
+
+  ThreadPool tp;
+  CALL(ThreadPoolInitConfig(&tp, &config));
+  CALL(ThreadPoolRun(&tp));
+
+  /* Short tasks stay under the budget */
+  size_t nDone = 0;
+  WorkerTask task = {SleepAndCount, &nDone, &nDone};
+  for (size_t i = 0; i < 100; ++i) CALL(ThreadPoolAddTask(&tp, task));
+  while (__atomic_load_n(&nDone, __ATOMIC_SEQ_CST) != 100) usleep(1000);
+
+  int released = 0;
+  WorkerTask hold = {WaitForFlag, &released, &released};
+  CALL(ThreadPoolAddTask(&tp, hold));
+
+  size_t nStalled = 0;
+  while (nStalled != 1) {
+    usleep(1000);
+    CALL(ThreadPoolGetStalled(&tp, &nStalled));
+  }
+
+  /* Reported once, however long it stays over */
+  usleep(20000);
+  ASSERT_EQ(log.Size(), 1);
+
+  ThreadPoolStall stall = log.Stalls[0];
+  EXPECT_LT(stall.Worker, NWorkers);
+  EXPECT_EQ(stall.Function, WaitForFlag);
+  EXPECT_EQ(stall.Args, &released);
+  EXPECT_GT(stall.Elapsed, Budget);
+
+  __atomic_store_n(&released, 1, __ATOMIC_SEQ_CST);
+  CALL(ThreadPoolWaitAll(&tp));
+
+  while (nStalled != 0) {
+    usleep(1000);
+    CALL(ThreadPoolGetStalled(&tp, &nStalled));
+  }
+
+  EXPECT_EQ(log.Size(), 1);
+
+  CALL(ThreadPoolStop(&tp));
+  CALL(ThreadPoolDestroy(&tp));
+}
+
+/* Names of the tnasync probes in the stapsdt notes of an ELF file */
+std::set<std::string> ReadProbes(const char* path) {
+  std::set<std::string> probes;
+  std::ifstream file(path, std::ios::binary);
+  std::vector<char> elf((std::istreambuf_iterator<char>(file)),
+                        std::istreambuf_iterator<char>());
+
+  const Elf64_Ehdr* header = (const Elf64_Ehdr*)elf.data();
+  const Elf64_Shdr* sections =
+      (const Elf64_Shdr*)(elf.data() + header->e_shoff);
+  const char* names = elf.data() + sections[header->e_shstrndx].sh_offset;
+
+  for (size_t i = 0; i < header->e_shnum; ++i) {
+    if (strcmp(names + sections[i].sh_name, ".note.stapsdt")) continue;
+
+    const char* note = elf.data() + sections[i].sh_offset;
+    const char* end = note + sections[i].sh_size;
+
+    while (note < end) {
+      const Elf64_Nhdr* nhdr = (const Elf64_Nhdr*)note;
+      const char* desc =
+          note + sizeof(Elf64_Nhdr) + ((nhdr->n_namesz + 3) & ~3);
+
+      /* pc, base and semaphore addresses, then provider and name */
+      const char* provider = desc + 3 * sizeof(uint64_t);
+      if (!strcmp(provider, "tnasync"))
+        probes.insert(provider + strlen(provider) + 1);
+
+      note = desc + ((nhdr->n_descsz + 3) & ~3);
+    }
+  }
+
+  return probes;
+}
+
+TEST(Probes, PresentInBinary) {
+#ifndef TN_HAVE_SDT
+  GTEST_SKIP() << "Built without <sys/sdt.h>";
+#endif
+  std::set<std::string> probes = ReadProbes("/proc/self/exe");
+
+  for (const char* name :
+       {"submit", "tq_push", "tq_pop", "worker_state", "task_start",
+        "task_end", "tq_chunk_get", "tq_chunk_put", "fiber_park",
+        "fiber_wake"})
+    EXPECT_TRUE(probes.count(name)) << name;
+}
+
+TEST(ThreadPool, StartPolicies) {
+  static constexpr size_t NWorkers = 16;
+  static constexpr size_t NTasks = 100;
+
+  for (ThreadPoolStartPolicy policy : {TP_START_PARALLEL, TP_START_LAZY}) {
+    ThreadPoolConfig config;
+    CALL(ThreadPoolConfigInit(&config, NWorkers));
+    config.StartPolicy = policy;
+
+    ThreadPool tp;
+    CALL(ThreadPoolInitConfig(&tp, &config));
+    CALL(ThreadPoolRun(&tp));
+
+    size_t nDone = 0;
+    WorkerTask task = {SleepAndCount, &nDone, &nDone};
+    for (size_t i = 0; i < NTasks; ++i) CALL(ThreadPoolAddTask(&tp, task));
+    CALL(ThreadPoolWaitAll(&tp));
+    EXPECT_EQ(nDone, NTasks);
+
+    /* Starts the workers in between in a lazy pool */
+    pthread_t thread;
+    ThreadPoolTarget last = {TP_TARGET_WORKER, NWorkers - 1, 0};
+    WorkerTask record = {RecordThread, &thread, &thread};
+    CALL(ThreadPoolAddTaskTo(&tp, last, record));
+    CALL(ThreadPoolWaitAll(&tp));
+    EXPECT_TRUE(
+        pthread_equal(thread, tp.Workers.Workers[NWorkers - 1].Thread));
+
+    CALL(ThreadPoolWaitReady(&tp));
+    EXPECT_EQ(tp.NReady, NWorkers);
+
+    CALL(ThreadPoolStop(&tp));
+    CALL(ThreadPoolDestroy(&tp));
+  }
+
+  /* Stopping a lazy pool that never started most of its workers */
+  ThreadPoolConfig config;
+  CALL(ThreadPoolConfigInit(&config, NWorkers));
+  config.StartPolicy = TP_START_LAZY;
+
+  ThreadPool tp;
+  CALL(ThreadPoolInitConfig(&tp, &config));
+  CALL(ThreadPoolRun(&tp));
+
+  size_t nDone = 0;
+  WorkerTask task = {SleepAndCount, &nDone, &nDone};
+  CALL(ThreadPoolAddTask(&tp, task));
+  CALL(ThreadPoolWaitAll(&tp));
+  EXPECT_LT(tp.NClaimed, NWorkers);
+
+  CALL(ThreadPoolStop(&tp));
+  CALL(ThreadPoolDestroy(&tp));
+}
+
+TEST(Topology, ParseCpuList) {
+  cpu_set_t set;
+  CALL(TopologyParseCpuList("0-3,8,10-11\n", &set));
+
+  EXPECT_EQ(CPU_COUNT(&set), 7);
+  EXPECT_TRUE(CPU_ISSET(3, &set));
+  EXPECT_TRUE(CPU_ISSET(8, &set));
+  EXPECT_FALSE(CPU_ISSET(9, &set));
+
+  EXPECT_EQ(TopologyParseCpuList("3-1", &set).Code, TN_BAD_ARG_VAL);
+}
+
+/* Fake cgroup hierarchy in a temporary directory */
+struct FakeCgroup {
+  std::string Root;
+  std::vector<std::string> Paths;
+
+  FakeCgroup() {
+    char dir[] = "/tmp/TnCgroupXXXXXX";
+    EXPECT_NE(mkdtemp(dir), nullptr);
+    Root = dir;
+  }
+
+  ~FakeCgroup() {
+    for (auto it = Paths.rbegin(); it != Paths.rend(); ++it)
+      std::remove(it->c_str());
+    rmdir(Root.c_str());
+  }
+
+  void MakeDir(const std::string& name) {
+    Paths.push_back(Root + "/" + name);
+    mkdir(Paths.back().c_str(), 0755);
+  }
+
+  /* Renamed into place so that a poller never sees it half written */
+  void Write(const std::string& name, const std::string& text) {
+    std::string path = Root + "/" + name;
+    std::ofstream(path + ".tmp") << text << "\n";
+    std::rename((path + ".tmp").c_str(), path.c_str());
+
+    if (std::find(Paths.begin(), Paths.end(), path) == Paths.end())
+      Paths.push_back(path);
+  }
+};
+
+TEST(Topology, SparseNodeIDs) {
+  FakeCgroup sysfs;  // Any directory tree will do
+  sysfs.Write("online", "0,2");
+  sysfs.MakeDir("node0");
+  sysfs.Write("node0/cpulist", "0-3");
+  sysfs.MakeDir("node2");
+  sysfs.Write("node2/cpulist", "4-7");
+
+  int node;
+  CALL(TopologyCpuNodeIn(sysfs.Root.c_str(), 1, &node));
+  EXPECT_EQ(node, 0);
+  CALL(TopologyCpuNodeIn(sysfs.Root.c_str(), 5, &node));
+  EXPECT_EQ(node, 2);
+  CALL(TopologyCpuNodeIn("/nonexistent", 5, &node));
+  EXPECT_EQ(node, 0);
+}
+
+TEST(CpuQuota, FakeCgroupFiles) {
+  cpu_set_t affinity;
+  ASSERT_EQ(sched_getaffinity(getpid(), sizeof(affinity), &affinity), 0);
+  size_t nCpus = CPU_COUNT(&affinity);
+
+  double value;
+  CALL(CpuQuotaParseMax("max 100000", &value));
+  EXPECT_EQ(value, 0);
+  EXPECT_EQ(CpuQuotaParseMax("junk", &value).Code, TN_BAD_ARG_VAL);
+
+  CpuQuota quota;
+
+  FakeCgroup v2;
+  v2.Write("cgroup.controllers", "cpuset cpu io memory pids");
+  v2.Write("cpuset.cpus.effective", "0-1023");
+  v2.Write("cpu.max", "150000 100000");
+
+  CALL(CpuQuotaRead(v2.Root.c_str(), &quota));
+  EXPECT_DOUBLE_EQ(quota.Quota, 1.5);
+  EXPECT_EQ(quota.NCpus, nCpus);
+  EXPECT_EQ(quota.Limit, 1);
+
+  v2.Write("cpu.max", "max 100000");
+  CALL(CpuQuotaRead(v2.Root.c_str(), &quota));
+  EXPECT_EQ(quota.Quota, 0);
+  EXPECT_EQ(quota.Limit, nCpus);
+
+  FakeCgroup v1;
+  v1.MakeDir("cpu");
+  v1.MakeDir("cpuset");
+  v1.Write("cpu/cpu.cfs_quota_us", "250000");
+  v1.Write("cpu/cpu.cfs_period_us", "100000");
+  v1.Write("cpuset/cpuset.effective_cpus", "0-1023");
+
+  CALL(CpuQuotaRead(v1.Root.c_str(), &quota));
+  EXPECT_DOUBLE_EQ(quota.Quota, 2.5);
+  EXPECT_EQ(quota.Limit, std::min<size_t>(2, nCpus));
+
+  v1.Write("cpu/cpu.cfs_quota_us", "-1");
+  CALL(CpuQuotaRead(v1.Root.c_str(), &quota));
+  EXPECT_EQ(quota.Quota, 0);
+  EXPECT_EQ(quota.Limit, nCpus);
+}
+
+struct ThreadLog {
+  std::mutex Mutex;
+  std::set<pthread_t> Threads;
+};
+
+void LogThread(void* args, void* res) {
+  ThreadLog* log = (ThreadLog*)args;
+  usleep(100);
+
+  std::lock_guard<std::mutex> lock(log->Mutex);
+  log->Threads.insert(pthread_self());
+}
+
+TEST(ThreadPool, ActiveWorkerLimit) {
+  static constexpr size_t NWorkers = 8;
+  static constexpr size_t NActive = 2;
+  static constexpr size_t NTasks = 200;
+
+  ThreadPool tp;
+  CALL(ThreadPoolInit(&tp, NWorkers));
+  CALL(ThreadPoolRun(&tp));
+  CALL(ThreadPoolWaitReady(&tp));
+  CALL(ThreadPoolSetActiveWorkers(&tp, NActive));
+
+  ThreadLog log;
+  WorkerTask task = {LogThread, &log, &log};
+  for (size_t i = 0; i < NTasks; ++i) CALL(ThreadPoolAddTask(&tp, task));
+  CALL(ThreadPoolWaitAll(&tp));
+
+  for (size_t i = NActive; i < NWorkers; ++i)
+    EXPECT_EQ(log.Threads.count(tp.Workers.Workers[i].Thread), 0);
+
+  /* A parked worker still runs what is sent to it */
+  pthread_t thread;
+  ThreadPoolTarget target = {TP_TARGET_WORKER, NWorkers - 1, 0};
+  WorkerTask record = {RecordThread, &thread, &thread};
+  CALL(ThreadPoolAddTaskTo(&tp, target, record));
+  CALL(ThreadPoolWaitAll(&tp));
+  EXPECT_TRUE(
+      pthread_equal(thread, tp.Workers.Workers[NWorkers - 1].Thread));
+
+  CALL(ThreadPoolSetActiveWorkers(&tp, NWorkers));
+  for (size_t i = 0; i < NWorkers; ++i) EXPECT_EQ(tp.Parked[i], 0);
+
+  for (size_t i = 0; i < NTasks; ++i) CALL(ThreadPoolAddTask(&tp, task));
+  CALL(ThreadPoolWaitAll(&tp));
+
+  CALL(ThreadPoolStop(&tp));
+  CALL(ThreadPoolDestroy(&tp));
+}
+
+TEST(ThreadPool, FollowsCpuQuota) {
+  static constexpr size_t NWorkers = 8;
+
+  FakeCgroup cgroup;
+  cgroup.Write("cgroup.controllers", "cpuset cpu");
+  cgroup.Write("cpu.max", "200000 100000");
+
+  CpuQuota quota;
+  CALL(CpuQuotaRead(cgroup.Root.c_str(), &quota));
+
+  ThreadPoolConfig config;
+  CALL(ThreadPoolConfigInit(&config, TP_WORKERS_AUTO));
+  config.CgroupRoot = cgroup.Root.c_str();
+
+  ThreadPool tp;
+  CALL(ThreadPoolInitConfig(&tp, &config));
+  EXPECT_EQ(tp.Config.NWorkers, quota.Limit);
+  CALL(ThreadPoolDestroy(&tp));
+
+  /* No workers is a mistake, not a request for the quota */
+  EXPECT_EQ(ThreadPoolInit(&tp, 0).Code, TN_BAD_ARG_VAL);
+  config.NWorkers = 0;
+  EXPECT_EQ(ThreadPoolInitConfig(&tp, &config).Code, TN_BAD_ARG_VAL);
+
+  cgroup.Write("cpu.max", "100000 100000");
+
+  config.NWorkers = NWorkers;
+  config.QuotaInterval = 1000000;
+  CALL(ThreadPoolInitConfig(&tp, &config));
+  CALL(ThreadPoolRun(&tp));
+  EXPECT_EQ(tp.NActive, 1);
+
+  /* Picked up by the monitor */
+  cgroup.Write("cpu.max", "max 100000");
+  size_t expected = std::min(NWorkers, quota.NCpus);
+  while (__atomic_load_n(&tp.NActive, __ATOMIC_SEQ_CST) != expected)
+    usleep(1000);
+
+  size_t nDone = 0;
+  WorkerTask task = {SleepAndCount, &nDone, &nDone};
+  for (size_t i = 0; i < 100; ++i) CALL(ThreadPoolAddTask(&tp, task));
+  CALL(ThreadPoolWaitAll(&tp));
+  EXPECT_EQ(nDone, 100);
+
+  CALL(ThreadPoolStop(&tp));
+  CALL(ThreadPoolDestroy(&tp));
+}
+
+TEST(Arbiter, SharesBudgetByDemand) {
+  static constexpr size_t Budget = 8;
+  static constexpr size_t NWorkers = 8;
+  static constexpr size_t NTasks = 16;
+
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  for (size_t i = 0; i < Budget; ++i) CPU_SET(i, &cpus);
+
+  Arbiter arb;
+  CALL(ArbiterInit(&arb, Budget, &cpus, 0));
+
+  ThreadPoolConfig config;
+  CALL(ThreadPoolConfigInit(&config, NWorkers));
+  config.WorkerArbiter = &arb;
+
+  ThreadPool busy, idle;
+  config.ArbiterWeight = 3;
+  CALL(ThreadPoolInitConfig(&busy, &config));
+  config.ArbiterWeight = 1;
+  CALL(ThreadPoolInitConfig(&idle, &config));
+
+  CALL(ThreadPoolRun(&busy));
+  CALL(ThreadPoolRun(&idle));
+  EXPECT_EQ(busy.NActive, 1);
+  EXPECT_EQ(idle.NActive, 1);
+
+  Gate gate = {0, 0, 0};
+  WorkerTask task = {WaitForGate, &gate, &gate};
+
+  /* An idle pool keeps one worker and lends the rest */
+  for (size_t i = 0; i < NTasks; ++i) CALL(ThreadPoolAddTask(&busy, task));
+  CALL(ArbiterRebalance(&arb));
+  EXPECT_EQ(busy.NActive, Budget - 1);
+  EXPECT_EQ(idle.NActive, 1);
+
+  /* Both busy, split 3:1 */
+  for (size_t i = 0; i < NTasks; ++i) CALL(ThreadPoolAddTask(&idle, task));
+  CALL(ArbiterRebalance(&arb));
+  EXPECT_EQ(busy.NActive, 6);
+  EXPECT_EQ(idle.NActive, 2);
+
+  std::set<int> cores;
+  for (size_t i = 0; i < busy.Lease.Granted; ++i)
+    cores.insert(busy.Lease.Cores[i]);
+  for (size_t i = 0; i < idle.Lease.Granted; ++i)
+    cores.insert(idle.Lease.Cores[i]);
+  EXPECT_EQ(cores.size(), Budget);
+
+  /* Targets follow the workers to their new cores */
+  for (size_t i = 0; i < busy.Lease.Granted; ++i) {
+    int node;
+    CALL(TopologyCpuNode(busy.Lease.Cores[i], &node));
+    EXPECT_EQ(busy.Workers.Workers[i].Core, busy.Lease.Cores[i]);
+    EXPECT_EQ(busy.WorkerNodes[i], node);
+  }
+
+  __atomic_store_n(&gate.Open, 1, __ATOMIC_SEQ_CST);
+  CALL(ThreadPoolWaitAll(&busy));
+  CALL(ThreadPoolWaitAll(&idle));
+  EXPECT_EQ(gate.NRun, 2 * NTasks);
+
+  CALL(ArbiterRebalance(&arb));
+  EXPECT_EQ(busy.NActive, 1);
+  EXPECT_EQ(idle.NActive, 1);
+
+  CALL(ThreadPoolStop(&busy));
+  CALL(ThreadPoolStop(&idle));
+  CALL(ThreadPoolDestroy(&busy));
+  CALL(ThreadPoolDestroy(&idle));
+  CALL(ArbiterDestroy(&arb));
+}
+
+struct CoreToken {
+  CorePool* Pool;
+  size_t Hops;
+  size_t Expected;
+  size_t* NWrongCore;
+  size_t* NDone;
+};
+
+void PassToken(void* args, void* res) {
+  CoreToken* token = (CoreToken*)args;
+  size_t self;
+
+  if (!TnStatusOk(CorePoolSelf(token->Pool, &self)) ||
+      self != token->Expected)
+    __atomic_add_fetch(token->NWrongCore, 1, __ATOMIC_SEQ_CST);
+
+  if (token->Hops-- == 0) {
+    __atomic_add_fetch(token->NDone, 1, __ATOMIC_SEQ_CST);
+    return;
+  }
+
+  token->Expected = (self + 1) % token->Pool->NCores;
+
+  WorkerTask task = {PassToken, token, token};
+  CorePoolPost(token->Pool, token->Expected, task);
+}
+
+TEST(CorePool, TokenRing) {
+  static constexpr size_t NCores = 4;
+  static constexpr size_t NTokens = 16;
+  static constexpr size_t NHops = 1000;
+
+  CorePool cp;
+  CALL(CorePoolInit(&cp, NCores, CP_RING_CAPACITY));
+  CALL(CorePoolRun(&cp));
+
+  size_t nWrongCore = 0, nDone = 0;
+  CoreToken tokens[NTokens];
+
+  for (size_t i = 0; i < NTokens; ++i) {
+    tokens[i] = {&cp, NHops, i % NCores, &nWrongCore, &nDone};
+
+    WorkerTask task = {PassToken, tokens + i, tokens + i};
+    CALL(CorePoolPost(&cp, i % NCores, task));
+  }
+
+  while (__atomic_load_n(&nDone, __ATOMIC_SEQ_CST) != NTokens) usleep(100);
+
+  EXPECT_EQ(nWrongCore, 0);
+
+  size_t self;
+  EXPECT_EQ(CorePoolSelf(&cp, &self).Code, TN_FSM_WRONG_STATE);
+
+  CALL(CorePoolStop(&cp));
+  CALL(CorePoolDestroy(&cp));
+}
+
+TEST(CorePool, PinsToAllowedCpus) {
+  static constexpr size_t NCores = 4;
+
+  cpu_set_t saved, only;
+  ASSERT_EQ(sched_getaffinity(0, sizeof(saved), &saved), 0);
+
+  /* As in a container limited to the highest cpu we have */
+  int last = 0;
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+    if (CPU_ISSET(cpu, &saved)) last = cpu;
+
+  CPU_ZERO(&only);
+  CPU_SET(last, &only);
+  ASSERT_EQ(sched_setaffinity(0, sizeof(only), &only), 0);
+
+  CorePool cp;
+  TnStatus status = CorePoolInit(&cp, NCores, CP_RING_CAPACITY);
+  ASSERT_EQ(sched_setaffinity(0, sizeof(saved), &saved), 0);
+  CALL(status);
+
+  for (size_t i = 0; i < NCores; ++i) EXPECT_EQ(cp.Cores[i].Cpu, last);
+
+  CALL(CorePoolDestroy(&cp));
+}
+
+struct FiberWaitData {
+  FiberEvent* Event;
+  size_t* NParked;
+  size_t* NDone;
+};
+
+void WaitOnEvent(void* args, void* res) {
+  FiberWaitData* data = (FiberWaitData*)args;
+
+  __atomic_add_fetch(data->NParked, 1, __ATOMIC_SEQ_CST);
+  FiberEventWait(data->Event);
+  TnYield();
+  __atomic_add_fetch(data->NDone, 1, __ATOMIC_SEQ_CST);
+}
+
+TEST(ThreadPool, FibersParkOnEvent) {
+  static constexpr size_t NWorkers = 2;
+  static constexpr size_t NTasks = 100000;
+
+  ThreadPoolConfig config;
+  CALL(ThreadPoolConfigInit(&config, NWorkers));
+  config.FiberStackSize = FIBER_DEFAULT_STACK_SIZE;
+  config.FiberGuard = 0;
+
+  ThreadPool tp;
+  CALL(ThreadPoolInitConfig(&tp, &config));
+  CALL(ThreadPoolRun(&tp));
+
+  FiberEvent event;
+  CALL(FiberEventInit(&event));
+
+  size_t nParked = 0, nDone = 0;
+  FiberWaitData data = {&event, &nParked, &nDone};
+
+  TaskGroup group;
+  CALL(TaskGroupInit(&group));
+
+  WorkerTask task = {WaitOnEvent, &data, &data};
+  for (size_t i = 0; i < NTasks; ++i)
+    CALL(ThreadPoolAddGroupTask(&tp, &group, task));
+
+  /* Two workers host all the waiting tasks */
+  while (__atomic_load_n(&nParked, __ATOMIC_SEQ_CST) != NTasks) usleep(100);
+  EXPECT_EQ(__atomic_load_n(&nDone, __ATOMIC_SEQ_CST), 0);
+
+  CALL(FiberEventSet(&event));
+  CALL(ThreadPoolWaitGroup(&tp, &group));
+  EXPECT_EQ(nDone, NTasks);
+
+  CALL(TaskGroupDestroy(&group));
+  CALL(FiberEventDestroy(&event));
+  CALL(ThreadPoolWaitAll(&tp));
+  CALL(ThreadPoolStop(&tp));
+  CALL(ThreadPoolDestroy(&tp));
+}
+
+struct FiberLimitData {
+  FiberEvent* Event;
+  size_t* NParked;
+  size_t* NDone;
+  size_t* NOffFiber;
+};
+
+void WaitOnEventInFiber(void* args, void* res) {
+  FiberLimitData* data = (FiberLimitData*)args;
+  Fiber* fiber = NULL;
+
+  FiberCurrent(&fiber);
+  if (!fiber) __atomic_add_fetch(data->NOffFiber, 1, __ATOMIC_SEQ_CST);
+
+  __atomic_add_fetch(data->NParked, 1, __ATOMIC_SEQ_CST);
+  FiberEventWait(data->Event);
+  __atomic_add_fetch(data->NDone, 1, __ATOMIC_SEQ_CST);
+}
+
+TEST(ThreadPool, FiberLimitSetsTasksAside) {
+  static constexpr size_t NWorkers = 2;
+  static constexpr size_t NTasks = 1000;
+  static constexpr size_t MaxFibers = 4;
+
+  ThreadPoolConfig config;
+  CALL(ThreadPoolConfigInit(&config, NWorkers));
+  config.FiberStackSize = FIBER_DEFAULT_STACK_SIZE;
+  config.MaxFibers = MaxFibers;
+
+  ThreadPool tp;
+  CALL(ThreadPoolInitConfig(&tp, &config));
+  CALL(ThreadPoolRun(&tp));
+
+  FiberEvent event;
+  CALL(FiberEventInit(&event));
+
+  size_t nParked = 0, nDone = 0, nOffFiber = 0;
+  FiberLimitData data = {&event, &nParked, &nDone, &nOffFiber};
+
+  TaskGroup group;
+  CALL(TaskGroupInit(&group));
+
+  WorkerTask task = {WaitOnEventInFiber, &data, &data};
+  for (size_t i = 0; i < NTasks; ++i)
+    CALL(ThreadPoolAddGroupTask(&tp, &group, task));
+
+  /* The rest wait for a fiber instead of running on a worker stack */
+  while (__atomic_load_n(&nParked, __ATOMIC_SEQ_CST) != MaxFibers)
+    usleep(100);
+  usleep(20000);
+  EXPECT_EQ(__atomic_load_n(&nParked, __ATOMIC_SEQ_CST), MaxFibers);
+
+  CALL(FiberEventSet(&event));
+  CALL(ThreadPoolWaitGroup(&tp, &group));
+  EXPECT_EQ(nDone, NTasks);
+  EXPECT_EQ(nOffFiber, 0);
+
+  CALL(TaskGroupDestroy(&group));
+  CALL(FiberEventDestroy(&event));
+  CALL(ThreadPoolWaitAll(&tp));
+  CALL(ThreadPoolStop(&tp));
+  CALL(ThreadPoolDestroy(&tp));
+}
+
+struct GroupParkData {
+  ThreadPool* Pool;
+  FiberEvent* Event;
+  int Waiting;
+  int Done;
+};
+
+void WaitForEvent(void* args, void* res) {
+  FiberEventWait((FiberEvent*)args);
+}
+
+void SetEvent(void* args, void* res) { FiberEventSet((FiberEvent*)args); }
+
+void WaitForChild(void* args, void* res) {
+  GroupParkData* data = (GroupParkData*)args;
+
+  TaskGroup group;
+  TaskGroupInit(&group);
+
+  WorkerTask child = {WaitForEvent, data->Event, data->Event};
+  ThreadPoolAddGroupTask(data->Pool, &group, child);
+
+  __atomic_store_n(&data->Waiting, 1, __ATOMIC_SEQ_CST);
+  ThreadPoolWaitGroup(data->Pool, &group);
+  TaskGroupDestroy(&group);
+
+  __atomic_store_n(&data->Done, 1, __ATOMIC_SEQ_CST);
+}
+
+TEST(ThreadPool, FibersParkOnGroup) {
+  ThreadPoolConfig config;
+  CALL(ThreadPoolConfigInit(&config, 1));
+  config.FiberStackSize = FIBER_DEFAULT_STACK_SIZE;
+
+  ThreadPool tp;
+  CALL(ThreadPoolInitConfig(&tp, &config));
+  CALL(ThreadPoolRun(&tp));
+
+  FiberEvent event;
+  CALL(FiberEventInit(&event));
+
+  GroupParkData data = {&tp, &event, 0, 0};
+  WorkerTask parent = {WaitForChild, &data, &data};
+  CALL(ThreadPoolAddTask(&tp, parent));
+
+  while (!__atomic_load_n(&data.Waiting, __ATOMIC_SEQ_CST)) usleep(100);
+  usleep(10000);
+
+  /* Only the worker takes from its inbox, so it must not be held by the
+   * waiting parent */
+  ThreadPoolTarget target = {TP_TARGET_WORKER, 0, 0};
+  WorkerTask set = {SetEvent, &event, &event};
+  CALL(ThreadPoolAddTaskTo(&tp, target, set));
+
+  for (size_t i = 0; i < 5000; ++i) {
+    if (__atomic_load_n(&data.Done, __ATOMIC_SEQ_CST)) break;
+    usleep(1000);
+  }
+  EXPECT_EQ(__atomic_load_n(&data.Done, __ATOMIC_SEQ_CST), 1);
+
+  CALL(FiberEventSet(&event));  // Unsticks a failed run
+  CALL(ThreadPoolWaitAll(&tp));
+  CALL(FiberEventDestroy(&event));
+  CALL(ThreadPoolStop(&tp));
+  CALL(ThreadPoolDestroy(&tp));
+}
+
+TEST(CompletionQueue, HarvestInBatches) {
+  static constexpr size_t NWorkers = 4;
+  static constexpr size_t NTasks = 1000;
+  static constexpr size_t Batch = 16;
+
+  ThreadPool tp;
+  CALL(ThreadPoolInit(&tp, NWorkers));
+  CALL(ThreadPoolRun(&tp));
+
+  CompletionQueue cq;
+  CALL(CompletionQueueInit(&cq, 64));  // Smaller than the number of tasks
+
+  std::vector<int> args(NTasks), results(NTasks, -1);
+
+  for (size_t i = 0; i < NTasks; ++i) {
+    args[i] = i;
+    WorkerTask task = {Pow, &args[i], &results[i]};
+    CALL(ThreadPoolAddTaskCompletion(&tp, &cq, i, task));
+  }
+
+  std::vector<int> seen(NTasks, 0);
+  Completion batch[Batch];
+  size_t total = 0, n;
+
+  while (total < NTasks) {
+    CALL(CompletionQueueWait(&cq, batch, Batch, &n));
+    ASSERT_GT(n, 0);
+    ASSERT_LE(n, Batch);
+
+    for (size_t i = 0; i < n; ++i) {
+      ASSERT_LT(batch[i].Tag, NTasks);
+      ASSERT_EQ(batch[i].Result, &results[batch[i].Tag]);
+      ASSERT_EQ(results[batch[i].Tag], batch[i].Tag * batch[i].Tag);
+      seen[batch[i].Tag]++;
+    }
+    total += n;
+  }
+
+  for (size_t i = 0; i < NTasks; ++i) ASSERT_EQ(seen[i], 1);
+
+  int ready;
+  CALL(CompletionQueueArm(&cq, &ready));
+  EXPECT_EQ(ready, 0);
+
+  CALL(ThreadPoolWaitAll(&tp));
+  CALL(CompletionQueueDestroy(&cq));
+  CALL(ThreadPoolStop(&tp));
+  CALL(ThreadPoolDestroy(&tp));
+}
+
+TEST(CompletionQueue, ReservedPushesOverflow) {
+  static constexpr size_t Ring = 4;
+  static constexpr size_t N = 1000;
+
+  CompletionQueue cq;
+  CALL(CompletionQueueInit(&cq, Ring));
+
+  /* Within the ring nothing is set aside */
+  for (size_t i = 0; i < Ring; ++i) CALL(CompletionQueueReserve(&cq));
+  EXPECT_EQ(cq.OverflowCapacity, 0);
+
+  for (size_t i = Ring; i < N; ++i) CALL(CompletionQueueReserve(&cq));
+  EXPECT_GE(cq.OverflowCapacity, N - Ring);
+  for (size_t i = 0; i < N; ++i) CALL(CompletionQueueUnreserve(&cq));
+  CALL(CompletionQueueDestroy(&cq));
+
+  CALL(CompletionQueueInit(&cq, Ring));
+
+  std::vector<int> seen(N, 0);
+  Completion batch[64];
+  size_t n, total = 0;
+
+  /* Takes a little less than it pushes, so that the backlog wraps around
+   * and grows while wrapped */
+  for (size_t i = 0; i < N; ++i) {
+    Completion completion = {i, &cq};
+    CALL(CompletionQueuePush(&cq, &completion));
+
+    if (i % 10 == 9) {
+      CALL(CompletionQueuePoll(&cq, batch, 9, &n));
+      for (size_t k = 0; k < n; ++k) seen[batch[k].Tag]++;
+      total += n;
+    }
+  }
+
+  do {
+    CALL(CompletionQueuePoll(&cq, batch, 64, &n));
+    for (size_t k = 0; k < n; ++k) seen[batch[k].Tag]++;
+    total += n;
+  } while (n != 0);
+
+  EXPECT_EQ(total, N);
+  for (size_t i = 0; i < N; ++i) EXPECT_EQ(seen[i], 1);
+  EXPECT_EQ(cq.NPromised, 0);
+  EXPECT_LT(cq.OverflowCapacity, N / 2);
+
+  CALL(CompletionQueueDestroy(&cq));
+}
+
+struct RecordStream {
+  size_t NItems;
+  size_t NRead;
+  size_t InFlight; /* Atomic */
+  size_t MaxInFlight;
+  std::vector<size_t> Output;
+};
+
+void* ReadRecord(void* item, void* args) {
+  RecordStream* stream = (RecordStream*)args;
+  if (stream->NRead == stream->NItems) return NULL;
+
+  size_t inFlight =
+      __atomic_add_fetch(&stream->InFlight, 1, __ATOMIC_SEQ_CST);
+  if (inFlight > stream->MaxInFlight) stream->MaxInFlight = inFlight;
+
+  return (void*)(++stream->NRead);
+}
+
+void* TransformRecord(void* item, void* args) {
+  size_t value = (size_t)item;
+  if (value % 7 == 0) usleep(100);  // Overtaken by the next records
+
+  return (void*)(value * 2);
+}
+
+void* WriteRecord(void* item, void* args) {
+  RecordStream* stream = (RecordStream*)args;
+
+  stream->Output.push_back((size_t)item);
+  __atomic_sub_fetch(&stream->InFlight, 1, __ATOMIC_SEQ_CST);
+
+  return NULL;
+}
+
+TEST(Pipeline, SerialStagesKeepOrder) {
+  static constexpr size_t NWorkers = 4;
+  static constexpr size_t NTokens = 8;
+  static constexpr size_t NItems = 2000;
+
+  ThreadPool tp;
+  CALL(ThreadPoolInit(&tp, NWorkers));
+  CALL(ThreadPoolRun(&tp));
+
+  RecordStream stream = {NItems, 0, 0, 0};
+
+  Pipeline pl;
+  CALL(PipelineInit(&pl, &tp, NTokens));
+  EXPECT_EQ(PipelineAddStage(&pl, PIPELINE_PARALLEL, ReadRecord, &stream).Code,
+            TN_BAD_ARG_VAL);
+  CALL(PipelineAddStage(&pl, PIPELINE_SERIAL, ReadRecord, &stream));
+  CALL(PipelineAddStage(&pl, PIPELINE_PARALLEL, TransformRecord, NULL));
+  CALL(PipelineAddStage(&pl, PIPELINE_SERIAL, WriteRecord, &stream));
+
+  CALL(PipelineRun(&pl));
+
+  ASSERT_EQ(stream.Output.size(), NItems);
+  for (size_t i = 0; i < NItems; ++i) ASSERT_EQ(stream.Output[i], 2 * (i + 1));
+  EXPECT_LE(stream.MaxInFlight, NTokens);
+
+  CALL(PipelineDestroy(&pl));
+  CALL(ThreadPoolWaitAll(&tp));
+  CALL(ThreadPoolStop(&tp));
+  CALL(ThreadPoolDestroy(&tp));
+}
+
+struct ChannelData {
+  Channel* Chan;
+  size_t NValues;
+  size_t* NProducers; /* Atomic */
+  size_t* Sum;        /* Atomic */
+};
+
+void ProduceValues(void* args, void* res) {
+  ChannelData* data = (ChannelData*)args;
+
+  for (size_t i = 1; i <= data->NValues; ++i)
+    ASSERT_EQ(ChannelSend(data->Chan, &i).Code, TN_SUCCESS);
+
+  if (__atomic_sub_fetch(data->NProducers, 1, __ATOMIC_SEQ_CST) == 0)
+    ChannelClose(data->Chan);
+}
+
+void ConsumeValues(void* args, void* res) {
+  ChannelData* data = (ChannelData*)args;
+  size_t value, sum = 0;
+
+  while (TnStatusOk(ChannelReceive(data->Chan, &value))) sum += value;
+
+  __atomic_add_fetch(data->Sum, sum, __ATOMIC_SEQ_CST);
+}
+
+struct SchedulerState {
+  std::mutex Mutex;
+  std::condition_variable Cond;
+  int NValue = 0;
+  int NError = 0;
+  int NStopped = 0;
+  int Value = 0;
+  pthread_t Thread;
+  TnExec::StopSource Stop;
+
+  void Finish(int* counter) {
+    std::lock_guard<std::mutex> lock(Mutex);
+    Thread = pthread_self();
+    ++*counter;
+    Cond.notify_all();
+  }
+
+  void Wait() {
+    std::unique_lock<std::mutex> lock(Mutex);
+    Cond.wait(lock, [this] { return NValue + NError + NStopped != 0; });
+  }
+};
+
+struct TestReceiver {
+#ifdef TN_STDEXEC
+  using receiver_concept = stdexec::receiver_t;
+#endif
+
+  struct Env {
+    const SchedulerState* State;
+
+    TnExec::StopToken query(TnExec::get_stop_token_t) const noexcept {
+      return State->Stop.get_token();
+    }
+  };
+
+  SchedulerState* State;
+
+  void set_value() noexcept { State->Finish(&State->NValue); }
+  void set_value(int value) noexcept {
+    State->Value = value;
+    State->Finish(&State->NValue);
+  }
+  void set_error(TnStatus) noexcept { State->Finish(&State->NError); }
+  void set_stopped() noexcept { State->Finish(&State->NStopped); }
+
+  Env get_env() const noexcept { return {State}; }
+};
+
+/* Sends a value inline from start(), not from the pool */
+struct ValueSender {
+#ifdef TN_STDEXEC
+  using sender_concept = stdexec::sender_t;
+  using completion_signatures =
+      stdexec::completion_signatures<stdexec::set_value_t(int)>;
+#endif
+
+  template <class Receiver>
+  struct Operation {
+    int Value;
+    Receiver Rcvr;
+
+    void start() noexcept { TnExec::Detail::SetValue(Rcvr, Value); }
+  };
+
+  int Value;
+
+  template <class Receiver>
+  Operation<std::decay_t<Receiver>> connect(Receiver&& receiver) const {
+    return {Value, std::forward<Receiver>(receiver)};
+  }
+};
+
+TEST(Scheduler, ScheduleCompletesOnWorker) {
+  static constexpr size_t NWorkers = 2;
+
+  ThreadPool tp;
+  CALL(ThreadPoolInit(&tp, NWorkers));
+  CALL(ThreadPoolRun(&tp));
+
+  TnExec::Scheduler sched(&tp);
+  EXPECT_TRUE(sched.schedule().get_completion_scheduler() == sched);
+
+  SchedulerState state;
+  auto op = TnExec::connect(sched.schedule(), TestReceiver{&state});
+  static_assert(!std::is_move_constructible<decltype(op)>::value,
+                "Operation states stay where the task points");
+
+  TnExec::start(op);
+  state.Wait();
+
+  EXPECT_EQ(state.NValue, 1);
+  bool onWorker = false;
+  for (size_t i = 0; i < NWorkers; ++i)
+    onWorker |= pthread_equal(state.Thread, tp.Workers.Workers[i].Thread);
+  EXPECT_TRUE(onWorker);
+
+  CALL(ThreadPoolStop(&tp));
+  CALL(ThreadPoolDestroy(&tp));
+}
+
+TEST(Scheduler, StopToken) {
+  ThreadPool tp;
+  CALL(ThreadPoolInit(&tp, 1));
+  CALL(ThreadPoolRun(&tp));
+
+  TnExec::Scheduler sched(&tp);
+
+  /* Stopped before start: completes inline */
+  SchedulerState early;
+  early.Stop.request_stop();
+  auto earlyOp = TnExec::connect(sched.schedule(), TestReceiver{&early});
+  TnExec::start(earlyOp);
+  EXPECT_EQ(early.NStopped, 1);
+
+  /* Stopped while queued behind a busy worker */
+  Gate gate = {0, 0, 0};
+  WorkerTask task = {WaitForGate, &gate, &gate};
+  CALL(ThreadPoolAddTask(&tp, task));
+  while (!__atomic_load_n(&gate.Started, __ATOMIC_SEQ_CST)) usleep(100);
+
+  SchedulerState queued;
+  auto queuedOp = TnExec::connect(sched.schedule(), TestReceiver{&queued});
+  TnExec::start(queuedOp);
+  queued.Stop.request_stop();
+  __atomic_store_n(&gate.Open, 1, __ATOMIC_SEQ_CST);
+
+  queued.Wait();
+  EXPECT_EQ(queued.NStopped, 1);
+  EXPECT_EQ(queued.NValue, 0);
+
+  CALL(ThreadPoolStop(&tp));
+  CALL(ThreadPoolDestroy(&tp));
+}
+
+TEST(Scheduler, Bulk) {
+  static constexpr int N = 10000;
+
+  ThreadPool tp;
+  CALL(ThreadPoolInit(&tp, 4));
+  CALL(ThreadPoolRun(&tp));
+
+  TnExec::Scheduler sched(&tp);
+  std::vector<int> hits(N, 0);
+
+  SchedulerState state;
+  auto op = TnExec::connect(
+      TnExec::bulk(sched.schedule(), N,
+                   [&](int i) {
+                     __atomic_add_fetch(&hits[i], 1, __ATOMIC_SEQ_CST);
+                   }),
+      TestReceiver{&state});
+  TnExec::start(op);
+  state.Wait();
+
+  EXPECT_EQ(state.NValue, 1);
+  EXPECT_EQ(std::count(hits.begin(), hits.end(), 1), N);
+
+  SchedulerState stopped;
+  stopped.Stop.request_stop();
+  auto stoppedOp = TnExec::connect(
+      TnExec::bulk(sched.schedule(), N, [&](int i) { hits[i]++; }),
+      TestReceiver{&stopped});
+  TnExec::start(stoppedOp);
+
+  EXPECT_EQ(stopped.NStopped, 1);
+  EXPECT_EQ(std::count(hits.begin(), hits.end(), 1), N);
+
+  CALL(ThreadPoolStop(&tp));
+  CALL(ThreadPoolDestroy(&tp));
+}
+
+TEST(Scheduler, BulkAfterAnySender) {
+  static constexpr int N = 10000;
+
+  ThreadPool tp;
+  CALL(ThreadPoolInit(&tp, 4));
+  CALL(ThreadPoolRun(&tp));
+
+  TnExec::Scheduler sched(&tp);
+  std::vector<int> hits(N, 0);
+
+  /* The predecessor's value reaches every index and is sent on */
+  SchedulerState state;
+  auto op = TnExec::connect(
+      TnExec::bulk(sched, ValueSender{7}, N,
+                   [&](int i, int value) {
+                     __atomic_add_fetch(&hits[i], value, __ATOMIC_SEQ_CST);
+                   }),
+      TestReceiver{&state});
+  TnExec::start(op);
+  state.Wait();
+
+  EXPECT_EQ(state.NValue, 1);
+  EXPECT_EQ(state.Value, 7);
+  EXPECT_EQ(std::count(hits.begin(), hits.end(), 7), N);
+
+  /* Bulk after bulk: the inner one completes on the pool */
+  SchedulerState chained;
+  auto chainedOp = TnExec::connect(
+      TnExec::bulk(sched, TnExec::bulk(sched.schedule(), N,
+                                       [&](int i) { hits[i] = 1; }),
+                   N, [&](int i) { hits[i]++; }),
+      TestReceiver{&chained});
+  TnExec::start(chainedOp);
+  chained.Wait();
+
+  EXPECT_EQ(chained.NValue, 1);
+  EXPECT_EQ(std::count(hits.begin(), hits.end(), 2), N);
+
+  CALL(ThreadPoolStop(&tp));
+  CALL(ThreadPoolDestroy(&tp));
+}
+
+#ifdef TN_STDEXEC
+static_assert(stdexec::scheduler<TnExec::Scheduler>);
+static_assert(stdexec::sender<TnExec::ScheduleSender>);
+static_assert(stdexec::sender_in<TnExec::ScheduleSender>);
+static_assert(stdexec::receiver<TestReceiver>);
+
+TEST(Scheduler, Stdexec) {
+  static constexpr int N = 1000;
+
+  ThreadPool tp;
+  CALL(ThreadPoolInit(&tp, 2));
+  CALL(ThreadPoolRun(&tp));
+
+  TnExec::Scheduler sched(&tp);
+  std::vector<int> hits(N, 0);
+
+  auto work = stdexec::schedule(sched) | stdexec::then([] { return 3; });
+  auto looped = TnExec::bulk(sched, std::move(work), N, [&](int i, int v) {
+    __atomic_add_fetch(&hits[i], v, __ATOMIC_SEQ_CST);
+  });
+  static_assert(stdexec::sender_in<decltype(looped)>);
+
+  auto [value] = stdexec::sync_wait(std::move(looped)).value();
+  EXPECT_EQ(value, 3);
+  EXPECT_EQ(std::count(hits.begin(), hits.end(), 3), N);
+
+  /* Cancellation reaches the pool through the receiver's environment */
+  SchedulerState stopped;
+  stopped.Stop.request_stop();
+  auto op = stdexec::connect(stdexec::schedule(sched),
+                             TestReceiver{&stopped});
+  stdexec::start(op);
+  EXPECT_EQ(stopped.NStopped, 1);
+
+  CALL(ThreadPoolStop(&tp));
+  CALL(ThreadPoolDestroy(&tp));
+}
+#endif
+
+TEST(Channel, ParksTasksNotWorkers) {
+  static constexpr size_t NWorkers = 2;
+  static constexpr size_t NProducers = 8;
+  static constexpr size_t NConsumers = 8;
+  static constexpr size_t NValues = 1000;
+
+  ThreadPoolConfig config;
+  CALL(ThreadPoolConfigInit(&config, NWorkers));
+  config.FiberStackSize = FIBER_DEFAULT_STACK_SIZE;
+
+  ThreadPool tp;
+  CALL(ThreadPoolInitConfig(&tp, &config));
+  CALL(ThreadPoolRun(&tp));
+
+  Channel ch;
+  CALL(ChannelInit(&ch, sizeof(size_t), 4));
+
+  size_t nProducers = NProducers, sum = 0;
+  ChannelData data = {&ch, NValues, &nProducers, &sum};
+
+  TaskGroup group;
+  CALL(TaskGroupInit(&group));
+
+  /* Consumers first: they fill both workers and must park */
+  WorkerTask consumer = {ConsumeValues, &data, &data};
+  for (size_t i = 0; i < NConsumers; ++i)
+    CALL(ThreadPoolAddGroupTask(&tp, &group, consumer));
+
+  WorkerTask producer = {ProduceValues, &data, &data};
+  for (size_t i = 0; i < NProducers; ++i)
+    CALL(ThreadPoolAddGroupTask(&tp, &group, producer));
+
+  CALL(ThreadPoolWaitGroup(&tp, &group));
+  EXPECT_EQ(sum, NProducers * NValues * (NValues + 1) / 2);
+
+  size_t value = 0;
+  EXPECT_EQ(ChannelTrySend(&ch, &value).Code, TN_FSM_WRONG_STATE);
+
+  CALL(TaskGroupDestroy(&group));
+  CALL(ChannelDestroy(&ch));
+  CALL(ThreadPoolWaitAll(&tp));
+  CALL(ThreadPoolStop(&tp));
+  CALL(ThreadPoolDestroy(&tp));
+}
+
+TEST(Parallel, SortMatchesStdSort) {
+  static constexpr size_t NWorkers = 4;
+  static constexpr size_t NValues = 200000;
+
+  ThreadPool tp;
+  CALL(ThreadPoolInit(&tp, NWorkers));
+  CALL(ThreadPoolRun(&tp));
+
+  std::mt19937 gen(42);
+  std::vector<int> values(NValues);
+  for (int& value : values) value = gen() % 1000;
+
+  std::vector<int> expected = values;
+  std::sort(expected.begin(), expected.end(), std::greater<int>());
+
+  CALL(TnParallel::Sort(&tp, values.begin(), values.end(),
+                        std::greater<int>()));
+  EXPECT_EQ(values, expected);
+
+  CALL(ThreadPoolStop(&tp));
+  CALL(ThreadPoolDestroy(&tp));
+}
+
+TEST(Parallel, ScanPartitionTransform) {
+  static constexpr size_t NWorkers = 4;
+  static constexpr size_t NValues = 100003;
+
+  ThreadPool tp;
+  CALL(ThreadPoolInit(&tp, NWorkers));
+  CALL(ThreadPoolRun(&tp));
+
+  std::vector<long> values(NValues);
+  std::iota(values.begin(), values.end(), 1);
+
+  std::vector<long> out(NValues), expected(NValues);
+
+  CALL(TnParallel::InclusiveScan(&tp, values.begin(), values.end(),
+                                 out.begin()));
+  std::partial_sum(values.begin(), values.end(), expected.begin());
+  EXPECT_EQ(out, expected);
+
+  CALL(TnParallel::ExclusiveScan(&tp, values.begin(), values.end(),
+                                 out.begin(), 10L));
+  for (size_t i = 0; i < NValues; ++i) 
+    ASSERT_EQ(out[i], 10 + (long)(i * (i + 1) / 2));
+
+  auto byThree = [](long value) { return value % 3 == 0; };
+
+  size_t nTrue;
+  CALL(TnParallel::StablePartition(&tp, values.begin(), values.end(),
+                                   out.begin(), byThree, &nTrue));
+  expected = values;
+  auto mid = std::stable_partition(expected.begin(), expected.end(), byThree);
+  EXPECT_EQ(nTrue, (size_t)(mid - expected.begin()));
+  EXPECT_EQ(out, expected);
+
+  size_t nOut;
+  CALL(TnParallel::CopyIf(&tp, values.begin(), values.end(), out.begin(),
+                          byThree, &nOut));
+  EXPECT_EQ(nOut, nTrue);
+  EXPECT_TRUE(std::equal(out.begin(), out.begin() + nOut, expected.begin()));
+
+  std::vector<double> halves(NValues);
+  CALL(TnParallel::Transform(&tp, values.begin(), values.end(),
+                             halves.begin(),
+                             [](long value) { return value / 2.0; }));
+  for (size_t i = 0; i < NValues; ++i) ASSERT_EQ(halves[i], values[i] / 2.0);
+
+  CALL(ThreadPoolStop(&tp));
+  CALL(ThreadPoolDestroy(&tp));
+}